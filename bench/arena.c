@@ -0,0 +1,185 @@
+/**
+ *
+ * Rhonabwy arena microbenchmark
+ *
+ * Counts the calls to the allocation functions when a JWT is parsed and
+ * verified with r_jwt_parse and r_jwt_verify_signature, with a
+ * jwt_verifier_t, and with a jwt_verifier_t using a rhn_arena_t
+ *
+ * Copyright 2020-2022 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU GENERAL PUBLIC LICENSE
+ * License as published by the Free Software Foundation;
+ * version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <orcania.h>
+#include <rhonabwy.h>
+
+#define BENCH_ITERATIONS 20000
+
+static size_t nb_calls = 0;
+
+static void * count_malloc(size_t size) {
+  nb_calls++;
+  return malloc(size);
+}
+
+static void * count_realloc(void * ptr, size_t size) {
+  nb_calls++;
+  return realloc(ptr, size);
+}
+
+static void count_free(void * ptr) {
+  nb_calls++;
+  free(ptr);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+static void print_result(const char * name, size_t calls, double elapsed) {
+  printf("  %-28s %8.1f allocator calls/token %8.2f us/token\n", name, (double)calls/BENCH_ITERATIONS, elapsed*1e6/BENCH_ITERATIONS);
+}
+
+static int bench_alg(const char * name, jwa_alg alg, jwk_t * jwk_privkey, jwk_t * jwk_pubkey) {
+  jwt_t * jwt = NULL;
+  jwt_verifier_t * verifier = NULL;
+  rhn_arena_t * arena = NULL;
+  rhn_jwt_verify_result_t result;
+  char * token;
+  size_t i, token_len, start_calls;
+  double start;
+  int ret = 1;
+
+  r_jwt_init(&jwt);
+  r_jwt_set_sign_alg(jwt, alg);
+  r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, "https://rhonabwy.example.com/",
+                        R_JWT_CLAIM_SUB, "248289761001",
+                        R_JWT_CLAIM_AUD, "client1",
+                        R_JWT_CLAIM_EXP, time(NULL)+3600,
+                        R_JWT_CLAIM_IAT, R_JWT_CLAIM_NOW,
+                        R_JWT_CLAIM_JTI, "6d8d0a29-4a4f-4bba-9a8b-1a8e1e5f2d4f",
+                        R_JWT_CLAIM_NOP);
+  if ((token = r_jwt_serialize_signed(jwt, jwk_privkey, 0)) == NULL) {
+    fprintf(stderr, "%s: error r_jwt_serialize_signed\n", name);
+    r_jwt_free(jwt);
+    return 1;
+  }
+  r_jwt_free(jwt);
+  token_len = o_strlen(token);
+
+  r_jwt_verifier_init(&verifier);
+  r_jwt_verifier_add_alg(verifier, alg);
+  r_jwt_verifier_add_key(verifier, jwk_pubkey, 0);
+  r_jwt_verifier_add_issuer(verifier, "https://rhonabwy.example.com/");
+  r_jwt_verifier_add_audience(verifier, "client1");
+  r_arena_init(&arena, 0);
+
+  printf("%s\n", name);
+  do {
+    start_calls = nb_calls;
+    start = now();
+    for (i=0; i<BENCH_ITERATIONS; i++) {
+      jwt = NULL;
+      if (r_jwt_init(&jwt) != RHN_OK ||
+          r_jwt_parsen(jwt, token, token_len, 0) != RHN_OK ||
+          r_jwt_verify_signature(jwt, jwk_pubkey, 0) != RHN_OK) {
+        fprintf(stderr, "%s: error r_jwt_verify_signature\n", name);
+        r_jwt_free(jwt);
+        break;
+      }
+      r_jwt_free(jwt);
+    }
+    if (i < BENCH_ITERATIONS) {
+      break;
+    }
+    print_result("r_jwt_verify_signature", nb_calls-start_calls, now()-start);
+
+    start_calls = nb_calls;
+    start = now();
+    for (i=0; i<BENCH_ITERATIONS; i++) {
+      if (r_jwt_verifier_verify(verifier, token, token_len, &result) != RHN_OK) {
+        fprintf(stderr, "%s: error r_jwt_verifier_verify\n", name);
+        break;
+      }
+      json_decref(result.j_claims);
+    }
+    if (i < BENCH_ITERATIONS) {
+      break;
+    }
+    print_result("r_jwt_verifier_verify", nb_calls-start_calls, now()-start);
+
+    r_jwt_verifier_set_arena(verifier, arena);
+    start_calls = nb_calls;
+    start = now();
+    for (i=0; i<BENCH_ITERATIONS; i++) {
+      if (r_jwt_verifier_verify(verifier, token, token_len, &result) != RHN_OK) {
+        fprintf(stderr, "%s: error r_jwt_verifier_verify with arena\n", name);
+        break;
+      }
+      json_decref(result.j_claims);
+    }
+    if (i < BENCH_ITERATIONS) {
+      break;
+    }
+    print_result("r_jwt_verifier_verify arena", nb_calls-start_calls, now()-start);
+
+    // The claims are needed by the caller most of the time, without them no allocation is left
+    start_calls = nb_calls;
+    start = now();
+    for (i=0; i<BENCH_ITERATIONS; i++) {
+      r_jwt_verifier_verify(verifier, token, token_len, NULL);
+    }
+    print_result("arena, no claims returned", nb_calls-start_calls, now()-start);
+    ret = 0;
+  } while (0);
+
+  r_jwt_verifier_free(verifier);
+  r_arena_free(arena);
+  o_free(token);
+  return ret;
+}
+
+int main(void) {
+  jwk_t * jwk_hmac = NULL, * jwk_privkey = NULL, * jwk_pubkey = NULL;
+  int ret = 0;
+
+  // The counters are installed first, the arena allocation functions are chained to them
+  o_set_alloc_funcs(count_malloc, count_realloc, count_free);
+  r_global_init();
+  r_global_enable_arena();
+
+  r_jwk_init(&jwk_hmac);
+  r_jwk_import_from_symmetric_key(jwk_hmac, (const unsigned char *)"0123456789abcdef0123456789abcdef", 32);
+  r_jwk_init(&jwk_privkey);
+  r_jwk_init(&jwk_pubkey);
+  r_jwk_generate_key_pair(jwk_privkey, jwk_pubkey, R_KEY_TYPE_EC, 256, NULL);
+
+  printf("JWT verification, %d tokens\n", BENCH_ITERATIONS);
+  ret |= bench_alg("HS256", R_JWA_ALG_HS256, jwk_hmac, jwk_hmac);
+  ret |= bench_alg("ES256", R_JWA_ALG_ES256, jwk_privkey, jwk_pubkey);
+
+  r_jwk_free(jwk_hmac);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_global_close();
+  return ret;
+}
@@ -0,0 +1,121 @@
+/**
+ *
+ * Rhonabwy base64url microbenchmark
+ *
+ * Compares orcania's base64url functions with the internal codec
+ * on 1 KB, 64 KB and 1 MB inputs
+ *
+ * Copyright 2020-2022 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU GENERAL PUBLIC LICENSE
+ * License as published by the Free Software Foundation;
+ * version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <orcania.h>
+#include <rhonabwy.h>
+
+#define BENCH_BYTES_PER_SIZE (256*1024*1024)
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+static void print_result(const char * name, size_t size, size_t iterations, double elapsed, double reference) {
+  double mbps = ((double)size*(double)iterations)/(1024.0*1024.0)/elapsed;
+  if (reference > 0) {
+    printf("  %-28s %8zu %10.1f MB/s  x%.2f\n", name, size, mbps, reference/elapsed);
+  } else {
+    printf("  %-28s %8zu %10.1f MB/s\n", name, size, mbps);
+  }
+}
+
+int main(void) {
+  size_t sizes[] = {1024, 64*1024, 1024*1024}, s, i, iterations, size;
+  unsigned char * data, * encoded, * decoded;
+  size_t encoded_len = 0, decoded_len = 0;
+  struct _o_datum dat = {0, NULL};
+  double start, t_orcania, t_rhonabwy;
+
+  r_global_init();
+  printf("base64url codec, orcania vs rhonabwy\n");
+  for (s=0; s<sizeof(sizes)/sizeof(size_t); s++) {
+    size = sizes[s];
+    iterations = BENCH_BYTES_PER_SIZE/size/8;
+    data = o_malloc(size);
+    encoded = o_malloc(size*2);
+    decoded = o_malloc(size);
+    for (i=0; i<size; i++) {
+      data[i] = (unsigned char)(i*31+7);
+    }
+    _r_base64url_encode(data, size, encoded, &encoded_len);
+
+    start = now();
+    for (i=0; i<iterations; i++) {
+      o_base64url_encode_alloc(data, size, &dat);
+      o_free(dat.data);
+    }
+    t_orcania = now()-start;
+    print_result("o_base64url_encode_alloc", size, iterations, t_orcania, 0);
+    start = now();
+    for (i=0; i<iterations; i++) {
+      _r_base64url_encode_alloc(data, size, &dat);
+      o_free(dat.data);
+    }
+    t_rhonabwy = now()-start;
+    print_result("_r_base64url_encode_alloc", size, iterations, t_rhonabwy, t_orcania);
+
+    start = now();
+    for (i=0; i<iterations; i++) {
+      o_base64url_decode_alloc(encoded, encoded_len, &dat);
+      o_free(dat.data);
+    }
+    t_orcania = now()-start;
+    print_result("o_base64url_decode_alloc", size, iterations, t_orcania, 0);
+    start = now();
+    for (i=0; i<iterations; i++) {
+      _r_base64url_decode_alloc(encoded, encoded_len, &dat);
+      o_free(dat.data);
+    }
+    t_rhonabwy = now()-start;
+    print_result("_r_base64url_decode_alloc", size, iterations, t_rhonabwy, t_orcania);
+
+    start = now();
+    for (i=0; i<iterations; i++) {
+      o_base64url_decode(encoded, encoded_len, decoded, &decoded_len);
+    }
+    t_orcania = now()-start;
+    print_result("o_base64url_decode", size, iterations, t_orcania, 0);
+    start = now();
+    for (i=0; i<iterations; i++) {
+      _r_base64url_decode(encoded, encoded_len, decoded, &decoded_len);
+    }
+    t_rhonabwy = now()-start;
+    print_result("_r_base64url_decode", size, iterations, t_rhonabwy, t_orcania);
+
+    if (decoded_len != size || memcmp(decoded, data, size)) {
+      fprintf(stderr, "base64url round trip error on %zu bytes\n", size);
+      return 1;
+    }
+    o_free(data);
+    o_free(encoded);
+    o_free(decoded);
+  }
+  r_global_close();
+  return 0;
+}
@@ -0,0 +1,735 @@
+/**
+ *
+ * Rhonabwy benchmark suite
+ *
+ * Measures ops/sec and p50/p99 latency for:
+ * - JWS sign and verify for every supported signature algorithm
+ * - JWE encrypt and decrypt for every key management algorithm and encryption algorithm
+ * - JWS and JWE parse in compact, general and flattened JSON mode, with and without zip=DEF
+ * - JWKS import at several sizes
+ * - JWS and JWE vectors of RFC 7520 (cookbook)
+ *
+ * The results are printed in JSON format
+ *
+ * Copyright 2020-2022 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU GENERAL PUBLIC LICENSE
+ * License as published by the Free Software Foundation;
+ * version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <gnutls/crypto.h>
+#include <orcania.h>
+#include <rhonabwy.h>
+
+#define BENCH_DEFAULT_ITERATIONS 200
+#define BENCH_DEFAULT_COOKBOOK   "test/cookbook-master"
+
+#define BENCH_PAYLOAD "{\"iss\":\"https://rhonabwy.example.com/\",\"sub\":\"248289761001\",\"aud\":[\"client1\",\"client2\"]," \
+"\"scope\":\"openid profile email address phone offline_access\",\"nonce\":\"n-0S6_WzA2Mj\",\"exp\":4102444800,\"iat\":1600000000," \
+"\"name\":\"Jane Doe\",\"given_name\":\"Jane\",\"family_name\":\"Doe\",\"email\":\"janedoe@example.com\",\"email_verified\":true," \
+"\"address\":{\"street_address\":\"1234 Hollywood Blvd.\",\"locality\":\"Los Angeles\",\"region\":\"CA\",\"postal_code\":\"90210\",\"country\":\"US\"}," \
+"\"groups\":[\"admin\",\"user\",\"operator\",\"auditor\",\"developer\",\"reviewer\",\"guest\",\"support\"]," \
+"\"lorem\":\"Lorem ipsum dolor sit amet, consectetur adipiscing elit. Duis efficitur lectus sit amet libero gravida eleifend. " \
+"Nulla aliquam accumsan erat, quis tincidunt purus ultricies eu. Aenean eu dui ac diam placerat mollis. Duis eget tempor ipsum, " \
+"vel ullamcorper purus. Ut eget quam vehicula, congue urna vel, dictum risus. Duis tristique est sed diam lobortis commodo.\"}"
+
+typedef struct _bench_ctx {
+  const char * group;
+  const char * name;
+  jwa_alg      alg;
+  jwa_enc      enc;
+  int          mode;
+  int          zip;
+  jwk_t      * jwk_privkey;
+  jwk_t      * jwk_pubkey;
+  jwks_t     * jwks_privkey;
+  jwks_t     * jwks_pubkey;
+  jwk_prepared_t * prepared_privkey;
+  jwk_prepared_t * prepared_pubkey;
+  char       * token;
+  const char * input;
+  size_t       size;
+} bench_ctx;
+
+typedef int (* bench_op)(bench_ctx * ctx);
+
+static size_t iterations = BENCH_DEFAULT_ITERATIONS;
+static const char * filter = NULL;
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec*1e6 + (double)ts.tv_nsec/1e3;
+}
+
+static int compare_double(const void * a, const void * b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static const char * mode_str(int mode) {
+  switch (mode) {
+    case R_JSON_MODE_GENERAL:
+      return "general";
+    case R_JSON_MODE_FLATTENED:
+      return "flattened";
+    default:
+      return "compact";
+  }
+}
+
+static const char * enc_str(jwa_enc enc) {
+  switch (enc) {
+    case R_JWA_ENC_A128CBC:
+      return "A128CBC-HS256";
+    case R_JWA_ENC_A192CBC:
+      return "A192CBC-HS384";
+    case R_JWA_ENC_A256CBC:
+      return "A256CBC-HS512";
+    case R_JWA_ENC_A128GCM:
+      return "A128GCM";
+    case R_JWA_ENC_A192GCM:
+      return "A192GCM";
+    case R_JWA_ENC_A256GCM:
+      return "A256GCM";
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * Runs op iterations times and appends the result to j_results
+ * The first call is a warm-up and isn't measured, if it fails the case is reported with an error status
+ */
+static void run_case(json_t * j_results, const char * op_name, bench_op op, bench_ctx * ctx) {
+  json_t * j_result;
+  double * latencies, start, total = 0;
+  size_t i;
+  int ret;
+
+  if (filter != NULL && o_strstr(ctx->name, filter) == NULL && o_strstr(ctx->group, filter) == NULL && o_strstr(op_name, filter) == NULL) {
+    return;
+  }
+  j_result = json_pack("{ssssssss?sssbsI}",
+                       "group", ctx->group,
+                       "name", ctx->name,
+                       "op", op_name,
+                       "enc", enc_str(ctx->enc),
+                       "mode", mode_str(ctx->mode),
+                       "zip", ctx->zip,
+                       "size", (json_int_t)ctx->size);
+  if ((ret = op(ctx)) != RHN_OK) {
+    json_object_set_new(j_result, "status", json_string("error"));
+    json_object_set_new(j_result, "error", json_integer(ret));
+  } else if ((latencies = o_malloc(iterations*sizeof(double))) != NULL) {
+    for (i=0; i<iterations; i++) {
+      start = now_us();
+      ret = op(ctx);
+      latencies[i] = now_us()-start;
+      total += latencies[i];
+      if (ret != RHN_OK) {
+        break;
+      }
+    }
+    if (ret == RHN_OK) {
+      qsort(latencies, iterations, sizeof(double), compare_double);
+      json_object_set_new(j_result, "status", json_string("ok"));
+      json_object_set_new(j_result, "iterations", json_integer((json_int_t)iterations));
+      json_object_set_new(j_result, "ops_per_sec", json_real(total>0?(double)iterations*1e6/total:0));
+      json_object_set_new(j_result, "p50_us", json_real(latencies[iterations/2]));
+      json_object_set_new(j_result, "p99_us", json_real(latencies[(iterations*99)/100<iterations?(iterations*99)/100:iterations-1]));
+    } else {
+      json_object_set_new(j_result, "status", json_string("error"));
+      json_object_set_new(j_result, "error", json_integer(ret));
+    }
+    o_free(latencies);
+  }
+  json_array_append_new(j_results, j_result);
+  fprintf(stderr, "%s %s %s %s%s: %s\n", ctx->group, ctx->name, op_name, mode_str(ctx->mode), ctx->zip?" zip":"", json_string_value(json_object_get(j_result, "status")));
+}
+
+/**
+ * JWS operations
+ */
+static char * jws_serialize(bench_ctx * ctx) {
+  jws_t * jws = NULL;
+  char * token = NULL;
+
+  if (r_jws_init(&jws) == RHN_OK &&
+      r_jws_set_alg(jws, ctx->alg) == RHN_OK &&
+      r_jws_set_payload(jws, (const unsigned char *)BENCH_PAYLOAD, o_strlen(BENCH_PAYLOAD)) == RHN_OK &&
+      (!ctx->zip || r_jws_set_header_str_value(jws, "zip", "DEF") == RHN_OK)) {
+    if (ctx->mode == R_JSON_MODE_COMPACT) {
+      token = r_jws_serialize(jws, ctx->jwk_privkey, 0);
+    } else {
+      token = r_jws_serialize_json_str(jws, ctx->jwks_privkey, 0, ctx->mode);
+    }
+  }
+  r_jws_free(jws);
+  return token;
+}
+
+static int op_jws_sign(bench_ctx * ctx) {
+  char * token = jws_serialize(ctx);
+  int ret = token!=NULL?RHN_OK:RHN_ERROR;
+
+  r_free(token);
+  return ret;
+}
+
+static int op_jws_parse(bench_ctx * ctx) {
+  jws_t * jws = r_jws_quick_parse(ctx->token, R_PARSE_NONE, 0);
+  int ret = jws!=NULL?RHN_OK:RHN_ERROR;
+
+  r_jws_free(jws);
+  return ret;
+}
+
+static int op_jws_verify(bench_ctx * ctx) {
+  jws_t * jws = r_jws_quick_parse(ctx->token, R_PARSE_NONE, 0);
+  int ret = jws!=NULL?r_jws_verify_signature(jws, ctx->jwk_pubkey, 0):RHN_ERROR;
+
+  r_jws_free(jws);
+  return ret;
+}
+
+/**
+ * JWE operations
+ */
+static char * jwe_serialize(bench_ctx * ctx) {
+  jwe_t * jwe = NULL;
+  char * token = NULL;
+
+  if (r_jwe_init(&jwe) == RHN_OK &&
+      r_jwe_set_alg(jwe, ctx->alg) == RHN_OK &&
+      r_jwe_set_enc(jwe, ctx->enc) == RHN_OK &&
+      r_jwe_set_payload(jwe, (const unsigned char *)BENCH_PAYLOAD, o_strlen(BENCH_PAYLOAD)) == RHN_OK &&
+      (!ctx->zip || r_jwe_set_header_str_value(jwe, "zip", "DEF") == RHN_OK)) {
+    if (ctx->mode == R_JSON_MODE_COMPACT) {
+      token = r_jwe_serialize(jwe, ctx->jwk_pubkey, 0);
+    } else {
+      token = r_jwe_serialize_json_str(jwe, ctx->jwks_pubkey, 0, ctx->mode);
+    }
+  }
+  r_jwe_free(jwe);
+  return token;
+}
+
+static int op_jwe_encrypt_prepared(bench_ctx * ctx) {
+  jwe_t * jwe = NULL;
+  char * token = NULL;
+
+  if (r_jwe_init(&jwe) == RHN_OK &&
+      r_jwe_set_alg(jwe, ctx->alg) == RHN_OK &&
+      r_jwe_set_enc(jwe, ctx->enc) == RHN_OK &&
+      r_jwe_set_payload(jwe, (const unsigned char *)BENCH_PAYLOAD, o_strlen(BENCH_PAYLOAD)) == RHN_OK) {
+    token = r_jwe_serialize_prepared(jwe, ctx->prepared_pubkey);
+  }
+  r_jwe_free(jwe);
+  r_free(token);
+  return token!=NULL?RHN_OK:RHN_ERROR;
+}
+
+static int op_jwe_encrypt(bench_ctx * ctx) {
+  char * token = jwe_serialize(ctx);
+  int ret = token!=NULL?RHN_OK:RHN_ERROR;
+
+  r_free(token);
+  return ret;
+}
+
+static int op_jwe_parse(bench_ctx * ctx) {
+  jwe_t * jwe = r_jwe_quick_parse(ctx->token, R_PARSE_NONE, 0);
+  int ret = jwe!=NULL?RHN_OK:RHN_ERROR;
+
+  r_jwe_free(jwe);
+  return ret;
+}
+
+static int op_jwe_decrypt(bench_ctx * ctx) {
+  jwe_t * jwe = r_jwe_quick_parse(ctx->token, R_PARSE_NONE, 0);
+  int ret = jwe!=NULL?r_jwe_decrypt(jwe, ctx->jwk_privkey, 0):RHN_ERROR;
+
+  r_jwe_free(jwe);
+  return ret;
+}
+
+static int op_jwe_decrypt_prepared(bench_ctx * ctx) {
+  jwe_t * jwe = r_jwe_quick_parse(ctx->token, R_PARSE_NONE, 0);
+  int ret = jwe!=NULL?r_jwe_decrypt_prepared(jwe, ctx->prepared_privkey):RHN_ERROR;
+
+  r_jwe_free(jwe);
+  return ret;
+}
+
+/**
+ * JWKS operations
+ */
+static int op_jwks_import(bench_ctx * ctx) {
+  jwks_t * jwks = NULL;
+  int ret;
+
+  if ((ret = r_jwks_init(&jwks)) == RHN_OK) {
+    ret = r_jwks_import_from_json_str(jwks, ctx->input);
+  }
+  r_jwks_free(jwks);
+  return ret;
+}
+
+/**
+ * Sets the keys of the context, the JWKS used in JSON mode contain a copy of the single key
+ * with the property alg set, because JSON serialization requires it
+ */
+static void ctx_set_keys(bench_ctx * ctx, jwk_t * jwk_privkey, jwk_t * jwk_pubkey) {
+  jwk_t * jwk;
+
+  r_jwks_free(ctx->jwks_privkey);
+  r_jwks_free(ctx->jwks_pubkey);
+  ctx->jwk_privkey = jwk_privkey;
+  ctx->jwk_pubkey = jwk_pubkey;
+  ctx->jwks_privkey = NULL;
+  ctx->jwks_pubkey = NULL;
+  r_jwks_init(&ctx->jwks_privkey);
+  r_jwks_init(&ctx->jwks_pubkey);
+  jwk = r_jwk_copy(jwk_privkey);
+  r_jwk_set_property_str(jwk, "alg", r_jwa_alg_to_str(ctx->alg));
+  r_jwks_append_jwk(ctx->jwks_privkey, jwk);
+  r_jwk_free(jwk);
+  jwk = r_jwk_copy(jwk_pubkey);
+  r_jwk_set_property_str(jwk, "alg", r_jwa_alg_to_str(ctx->alg));
+  r_jwks_append_jwk(ctx->jwks_pubkey, jwk);
+  r_jwk_free(jwk);
+}
+
+static void ctx_clean(bench_ctx * ctx) {
+  r_jwks_free(ctx->jwks_privkey);
+  r_jwks_free(ctx->jwks_pubkey);
+  r_jwk_prepared_free(ctx->prepared_privkey);
+  r_jwk_prepared_free(ctx->prepared_pubkey);
+  r_free(ctx->token);
+  memset(ctx, 0, sizeof(bench_ctx));
+}
+
+static jwk_t * generate_symmetric_key(size_t len) {
+  unsigned char key[64];
+  jwk_t * jwk = NULL;
+
+  if (len <= sizeof(key) && gnutls_rnd(GNUTLS_RND_KEY, key, len) == 0 && r_jwk_init(&jwk) == RHN_OK) {
+    if (r_jwk_import_from_symmetric_key(jwk, key, len) != RHN_OK) {
+      r_jwk_free(jwk);
+      jwk = NULL;
+    }
+  }
+  return jwk;
+}
+
+static int generate_key_pair(jwk_t ** jwk_privkey, jwk_t ** jwk_pubkey, int type, unsigned int bits) {
+  int ret;
+
+  *jwk_privkey = NULL;
+  *jwk_pubkey = NULL;
+  if ((ret = r_jwk_init(jwk_privkey)) == RHN_OK && (ret = r_jwk_init(jwk_pubkey)) == RHN_OK) {
+    ret = r_jwk_generate_key_pair(*jwk_privkey, *jwk_pubkey, type, bits, NULL);
+  }
+  if (ret != RHN_OK) {
+    fprintf(stderr, "Error generating key pair type %d, bits %u\n", type, bits);
+  }
+  return ret;
+}
+
+static void bench_jws(json_t * j_results) {
+  struct {
+    jwa_alg alg;
+    const char * name;
+    jwk_t ** privkey;
+    jwk_t ** pubkey;
+  } * item, algs[14];
+  jwk_t * jwk_hmac = generate_symmetric_key(64), * jwk_rsa_priv, * jwk_rsa_pub, * jwk_ec256_priv, * jwk_ec256_pub,
+        * jwk_ec384_priv, * jwk_ec384_pub, * jwk_ec521_priv, * jwk_ec521_pub, * jwk_eddsa_priv, * jwk_eddsa_pub;
+  bench_ctx ctx;
+  size_t i, n = 0;
+
+  memset(&ctx, 0, sizeof(bench_ctx));
+  generate_key_pair(&jwk_rsa_priv, &jwk_rsa_pub, R_KEY_TYPE_RSA, 2048);
+  generate_key_pair(&jwk_ec256_priv, &jwk_ec256_pub, R_KEY_TYPE_EC, 256);
+  generate_key_pair(&jwk_ec384_priv, &jwk_ec384_pub, R_KEY_TYPE_EC, 384);
+  generate_key_pair(&jwk_ec521_priv, &jwk_ec521_pub, R_KEY_TYPE_EC, 521);
+  generate_key_pair(&jwk_eddsa_priv, &jwk_eddsa_pub, R_KEY_TYPE_EDDSA, 256);
+
+#define BENCH_JWS_ALG(a, n_, priv, pub) algs[n].alg = a; algs[n].name = n_; algs[n].privkey = priv; algs[n].pubkey = pub; n++;
+  BENCH_JWS_ALG(R_JWA_ALG_HS256, "HS256", &jwk_hmac, &jwk_hmac)
+  BENCH_JWS_ALG(R_JWA_ALG_HS384, "HS384", &jwk_hmac, &jwk_hmac)
+  BENCH_JWS_ALG(R_JWA_ALG_HS512, "HS512", &jwk_hmac, &jwk_hmac)
+  BENCH_JWS_ALG(R_JWA_ALG_RS256, "RS256", &jwk_rsa_priv, &jwk_rsa_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_RS384, "RS384", &jwk_rsa_priv, &jwk_rsa_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_RS512, "RS512", &jwk_rsa_priv, &jwk_rsa_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_PS256, "PS256", &jwk_rsa_priv, &jwk_rsa_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_PS384, "PS384", &jwk_rsa_priv, &jwk_rsa_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_PS512, "PS512", &jwk_rsa_priv, &jwk_rsa_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_ES256, "ES256", &jwk_ec256_priv, &jwk_ec256_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_ES384, "ES384", &jwk_ec384_priv, &jwk_ec384_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_ES512, "ES512", &jwk_ec521_priv, &jwk_ec521_pub)
+  BENCH_JWS_ALG(R_JWA_ALG_EDDSA, "EdDSA", &jwk_eddsa_priv, &jwk_eddsa_pub)
+#undef BENCH_JWS_ALG
+
+  for (i=0; i<n; i++) {
+    item = &algs[i];
+    ctx.group = "jws";
+    ctx.name = item->name;
+    ctx.alg = item->alg;
+    ctx.size = o_strlen(BENCH_PAYLOAD);
+    ctx_set_keys(&ctx, *item->privkey, *item->pubkey);
+    run_case(j_results, "sign", op_jws_sign, &ctx);
+    if ((ctx.token = jws_serialize(&ctx)) != NULL) {
+      run_case(j_results, "verify", op_jws_verify, &ctx);
+    }
+    ctx_clean(&ctx);
+  }
+
+  // Parse modes
+  for (ctx.mode=R_JSON_MODE_COMPACT; ctx.mode<=R_JSON_MODE_FLATTENED; ctx.mode++) {
+    for (ctx.zip=0; ctx.zip<=1; ctx.zip++) {
+      ctx.group = "jws_parse";
+      ctx.name = "HS256";
+      ctx.alg = R_JWA_ALG_HS256;
+      ctx_set_keys(&ctx, jwk_hmac, jwk_hmac);
+      if ((ctx.token = jws_serialize(&ctx)) != NULL) {
+        ctx.size = o_strlen(ctx.token);
+        run_case(j_results, "parse", op_jws_parse, &ctx);
+        run_case(j_results, "verify", op_jws_verify, &ctx);
+      }
+      r_free(ctx.token);
+      ctx.token = NULL;
+    }
+  }
+  ctx_clean(&ctx);
+
+  r_jwk_free(jwk_hmac);
+  r_jwk_free(jwk_rsa_priv);
+  r_jwk_free(jwk_rsa_pub);
+  r_jwk_free(jwk_ec256_priv);
+  r_jwk_free(jwk_ec256_pub);
+  r_jwk_free(jwk_ec384_priv);
+  r_jwk_free(jwk_ec384_pub);
+  r_jwk_free(jwk_ec521_priv);
+  r_jwk_free(jwk_ec521_pub);
+  r_jwk_free(jwk_eddsa_priv);
+  r_jwk_free(jwk_eddsa_pub);
+}
+
+static void bench_jwe(json_t * j_results) {
+  jwa_alg algs[] = {R_JWA_ALG_RSA1_5, R_JWA_ALG_RSA_OAEP, R_JWA_ALG_RSA_OAEP_256,
+                    R_JWA_ALG_A128KW, R_JWA_ALG_A192KW, R_JWA_ALG_A256KW,
+                    R_JWA_ALG_DIR,
+                    R_JWA_ALG_ECDH_ES, R_JWA_ALG_ECDH_ES_A128KW, R_JWA_ALG_ECDH_ES_A192KW, R_JWA_ALG_ECDH_ES_A256KW,
+                    R_JWA_ALG_A128GCMKW, R_JWA_ALG_A192GCMKW, R_JWA_ALG_A256GCMKW,
+                    R_JWA_ALG_PBES2_H256, R_JWA_ALG_PBES2_H384, R_JWA_ALG_PBES2_H512};
+  jwa_enc encs[] = {R_JWA_ENC_A128CBC, R_JWA_ENC_A192CBC, R_JWA_ENC_A256CBC, R_JWA_ENC_A128GCM, R_JWA_ENC_A192GCM, R_JWA_ENC_A256GCM};
+  size_t enc_key_len[] = {32, 48, 64, 16, 24, 32};
+  jwk_t * jwk_rsa_priv, * jwk_rsa_pub, * jwk_ec_priv, * jwk_ec_pub, * jwk_kw[3], * jwk_dir, * jwk_password = NULL, * priv, * pub;
+  bench_ctx ctx;
+  size_t a, e;
+
+  memset(&ctx, 0, sizeof(bench_ctx));
+  generate_key_pair(&jwk_rsa_priv, &jwk_rsa_pub, R_KEY_TYPE_RSA, 2048);
+  generate_key_pair(&jwk_ec_priv, &jwk_ec_pub, R_KEY_TYPE_EC, 256);
+  jwk_kw[0] = generate_symmetric_key(16);
+  jwk_kw[1] = generate_symmetric_key(24);
+  jwk_kw[2] = generate_symmetric_key(32);
+  if (r_jwk_init(&jwk_password) == RHN_OK) {
+    r_jwk_import_from_password(jwk_password, "Thus from my lips, by yours, my sin is purged.");
+  }
+
+  for (a=0; a<sizeof(algs)/sizeof(jwa_alg); a++) {
+    for (e=0; e<sizeof(encs)/sizeof(jwa_enc); e++) {
+      jwk_dir = NULL;
+      switch (algs[a]) {
+        case R_JWA_ALG_RSA1_5:
+        case R_JWA_ALG_RSA_OAEP:
+        case R_JWA_ALG_RSA_OAEP_256:
+          priv = jwk_rsa_priv;
+          pub = jwk_rsa_pub;
+          break;
+        case R_JWA_ALG_ECDH_ES:
+        case R_JWA_ALG_ECDH_ES_A128KW:
+        case R_JWA_ALG_ECDH_ES_A192KW:
+        case R_JWA_ALG_ECDH_ES_A256KW:
+          priv = jwk_ec_priv;
+          pub = jwk_ec_pub;
+          break;
+        case R_JWA_ALG_A128KW:
+        case R_JWA_ALG_A128GCMKW:
+          priv = pub = jwk_kw[0];
+          break;
+        case R_JWA_ALG_A192KW:
+        case R_JWA_ALG_A192GCMKW:
+          priv = pub = jwk_kw[1];
+          break;
+        case R_JWA_ALG_A256KW:
+        case R_JWA_ALG_A256GCMKW:
+          priv = pub = jwk_kw[2];
+          break;
+        case R_JWA_ALG_DIR:
+          priv = pub = jwk_dir = generate_symmetric_key(enc_key_len[e]);
+          break;
+        default:
+          priv = pub = jwk_password;
+          break;
+      }
+      ctx.group = "jwe";
+      ctx.name = r_jwa_alg_to_str(algs[a]);
+      ctx.alg = algs[a];
+      ctx.enc = encs[e];
+      ctx.size = o_strlen(BENCH_PAYLOAD);
+      ctx_set_keys(&ctx, priv, pub);
+      run_case(j_results, "encrypt", op_jwe_encrypt, &ctx);
+      if ((ctx.token = jwe_serialize(&ctx)) != NULL) {
+        run_case(j_results, "decrypt", op_jwe_decrypt, &ctx);
+      }
+      if (priv == jwk_rsa_priv) {
+        ctx.prepared_privkey = r_jwk_prepare(priv, 0);
+        ctx.prepared_pubkey = r_jwk_prepare(pub, 0);
+        run_case(j_results, "encrypt_prepared", op_jwe_encrypt_prepared, &ctx);
+        if (ctx.token != NULL) {
+          run_case(j_results, "decrypt_prepared", op_jwe_decrypt_prepared, &ctx);
+        }
+      }
+      ctx_clean(&ctx);
+      r_jwk_free(jwk_dir);
+    }
+  }
+
+  // Parse modes
+  for (ctx.mode=R_JSON_MODE_COMPACT; ctx.mode<=R_JSON_MODE_FLATTENED; ctx.mode++) {
+    for (ctx.zip=0; ctx.zip<=1; ctx.zip++) {
+      ctx.group = "jwe_parse";
+      ctx.name = "A128KW";
+      ctx.alg = R_JWA_ALG_A128KW;
+      ctx.enc = R_JWA_ENC_A128GCM;
+      ctx_set_keys(&ctx, jwk_kw[0], jwk_kw[0]);
+      if ((ctx.token = jwe_serialize(&ctx)) != NULL) {
+        ctx.size = o_strlen(ctx.token);
+        run_case(j_results, "parse", op_jwe_parse, &ctx);
+        run_case(j_results, "decrypt", op_jwe_decrypt, &ctx);
+      }
+      r_free(ctx.token);
+      ctx.token = NULL;
+    }
+  }
+  ctx_clean(&ctx);
+
+  r_jwk_free(jwk_rsa_priv);
+  r_jwk_free(jwk_rsa_pub);
+  r_jwk_free(jwk_ec_priv);
+  r_jwk_free(jwk_ec_pub);
+  r_jwk_free(jwk_kw[0]);
+  r_jwk_free(jwk_kw[1]);
+  r_jwk_free(jwk_kw[2]);
+  r_jwk_free(jwk_password);
+}
+
+static void bench_jwks(json_t * j_results) {
+  size_t sizes[] = {1, 16, 128, 1024}, s, i;
+  jwk_t * jwk_templates[3] = {NULL, NULL, NULL}, * jwk_priv = NULL, * jwk;
+  json_t * j_jwks, * j_keys;
+  char kid[32], name[32];
+  bench_ctx ctx;
+
+  memset(&ctx, 0, sizeof(bench_ctx));
+  generate_key_pair(&jwk_priv, &jwk_templates[0], R_KEY_TYPE_RSA, 2048);
+  r_jwk_free(jwk_priv);
+  generate_key_pair(&jwk_priv, &jwk_templates[1], R_KEY_TYPE_EC, 256);
+  r_jwk_free(jwk_priv);
+  jwk_templates[2] = generate_symmetric_key(32);
+
+  for (s=0; s<sizeof(sizes)/sizeof(size_t); s++) {
+    j_keys = json_array();
+    for (i=0; i<sizes[s]; i++) {
+      jwk = r_jwk_copy(jwk_templates[i%3]);
+      snprintf(kid, sizeof(kid), "key-%zu", i);
+      r_jwk_set_property_str(jwk, "kid", kid);
+      json_array_append_new(j_keys, jwk);
+    }
+    j_jwks = json_pack("{so}", "keys", j_keys);
+    snprintf(name, sizeof(name), "%zu keys", sizes[s]);
+    ctx.group = "jwks";
+    ctx.name = name;
+    ctx.size = sizes[s];
+    ctx.token = json_dumps(j_jwks, JSON_COMPACT);
+    ctx.input = ctx.token;
+    run_case(j_results, "import", op_jwks_import, &ctx);
+    ctx_clean(&ctx);
+    json_decref(j_jwks);
+  }
+
+  r_jwk_free(jwk_templates[0]);
+  r_jwk_free(jwk_templates[1]);
+  r_jwk_free(jwk_templates[2]);
+}
+
+/**
+ * Vectors skipped in test/cookbook.c too: detached content and unprotected-only headers
+ */
+static int is_unsupported_vector(const char * name) {
+  return 0 == o_strncmp(name, "4_5.", 4) || 0 == o_strncmp(name, "4_7.", 4) || 0 == o_strncmp(name, "5_12.", 5);
+}
+
+/**
+ * Runs verify or decrypt on every serialization of every RFC 7520 vector using a single key
+ */
+static void bench_cookbook_dir(json_t * j_results, const char * cookbook_path, const char * type) {
+  const char * formats[] = {"compact", "json", "json_flat"};
+  char * dir_path = msprintf("%s/%s", cookbook_path, type), * file_path;
+  json_t * j_vector, * j_input, * j_output;
+  jwk_t * jwk;
+  struct dirent * entry;
+  DIR * dir;
+  bench_ctx ctx;
+  size_t i;
+
+  memset(&ctx, 0, sizeof(bench_ctx));
+  if ((dir = opendir(dir_path)) == NULL) {
+    fprintf(stderr, "Error opening %s, cookbook vectors skipped\n", dir_path);
+  } else {
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] == '.' || o_strstr(entry->d_name, ".json") == NULL || is_unsupported_vector(entry->d_name)) {
+        continue;
+      }
+      file_path = msprintf("%s/%s", dir_path, entry->d_name);
+      j_vector = json_load_file(file_path, 0, NULL);
+      j_input = json_object_get(j_vector, "input");
+      jwk = NULL;
+      if (json_is_object(json_object_get(j_input, "key"))) {
+        jwk = r_jwk_quick_import(R_IMPORT_JSON_T, json_object_get(j_input, "key"));
+      } else if (json_is_string(json_object_get(j_input, "pwd"))) {
+        jwk = r_jwk_quick_import(R_IMPORT_PASSWORD, json_string_value(json_object_get(j_input, "pwd")));
+      }
+      if (jwk != NULL) {
+        for (i=0; i<sizeof(formats)/sizeof(char *); i++) {
+          if ((j_output = json_object_get(json_object_get(j_vector, "output"), formats[i])) != NULL) {
+            ctx.group = "cookbook";
+            ctx.name = entry->d_name;
+            ctx.mode = i==0?R_JSON_MODE_COMPACT:(i==1?R_JSON_MODE_GENERAL:R_JSON_MODE_FLATTENED);
+            ctx.zip = json_object_get(j_input, "zip")!=NULL;
+            ctx.jwk_privkey = ctx.jwk_pubkey = jwk;
+            ctx.token = json_is_string(j_output)?o_strdup(json_string_value(j_output)):json_dumps(j_output, JSON_COMPACT);
+            ctx.size = o_strlen(ctx.token);
+            if (0 == o_strcmp("jws", type)) {
+              run_case(j_results, "verify", op_jws_verify, &ctx);
+            } else {
+              run_case(j_results, "decrypt", op_jwe_decrypt, &ctx);
+            }
+            ctx_clean(&ctx);
+          }
+        }
+      }
+      r_jwk_free(jwk);
+      json_decref(j_vector);
+      o_free(file_path);
+    }
+    closedir(dir);
+  }
+  o_free(dir_path);
+}
+
+static void print_help(FILE * output) {
+  fprintf(output, "rhonabwy_bench - Rhonabwy benchmark suite\n\n");
+  fprintf(output, "Options:\n");
+  fprintf(output, "-n --iterations <n>      Number of measured iterations per case, default %d\n", BENCH_DEFAULT_ITERATIONS);
+  fprintf(output, "-f --filter <str>        Run only cases whose group, name or operation contains str\n");
+  fprintf(output, "-c --cookbook <path>     Path to the RFC 7520 vectors, default %s\n", BENCH_DEFAULT_COOKBOOK);
+  fprintf(output, "-o --output <file>       Write the JSON results to file instead of stdout\n");
+  fprintf(output, "-h --help                Print this help message\n");
+}
+
+int main(int argc, char ** argv) {
+  const char * short_options = "n:f:c:o:h";
+  static const struct option long_options[]= {
+    {"iterations", required_argument, NULL, 'n'},
+    {"filter", required_argument, NULL, 'f'},
+    {"cookbook", required_argument, NULL, 'c'},
+    {"output", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  const char * cookbook_path = BENCH_DEFAULT_COOKBOOK, * output_path = NULL;
+  json_t * j_report, * j_results;
+  int next_option, ret = 0;
+  long n;
+
+  do {
+    next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+    switch (next_option) {
+      case 'n':
+        if ((n = strtol(optarg, NULL, 10)) <= 0) {
+          fprintf(stderr, "Invalid iterations value\n");
+          return 1;
+        }
+        iterations = (size_t)n;
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'c':
+        cookbook_path = optarg;
+        break;
+      case 'o':
+        output_path = optarg;
+        break;
+      case 'h':
+        print_help(stdout);
+        return 0;
+      case -1:
+        break;
+      default:
+        print_help(stderr);
+        return 1;
+    }
+  } while (next_option != -1);
+
+  if (r_global_init() != RHN_OK) {
+    fprintf(stderr, "Error r_global_init\n");
+    return 1;
+  }
+  j_results = json_array();
+  bench_jws(j_results);
+  bench_jwe(j_results);
+  bench_jwks(j_results);
+  bench_cookbook_dir(j_results, cookbook_path, "jws");
+  bench_cookbook_dir(j_results, cookbook_path, "jwe");
+
+  j_report = json_pack("{sssssIso}",
+                       "rhonabwy_version", RHONABWY_VERSION_STR,
+                       "gnutls_version", gnutls_check_version(NULL),
+                       "iterations", (json_int_t)iterations,
+                       "results", j_results);
+  if (output_path != NULL) {
+    if (json_dump_file(j_report, output_path, JSON_INDENT(2)|JSON_PRESERVE_ORDER)) {
+      fprintf(stderr, "Error writing %s\n", output_path);
+      ret = 1;
+    }
+  } else {
+    json_dumpf(j_report, stdout, JSON_INDENT(2)|JSON_PRESERVE_ORDER);
+    fputc('\n', stdout);
+  }
+  json_decref(j_report);
+  r_global_close();
+  return ret;
+}
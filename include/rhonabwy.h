@@ -49,6 +49,7 @@ extern "C"
 #define RHN_ERROR_PARAM        3
 #define RHN_ERROR_UNSUPPORTED  4
 #define RHN_ERROR_INVALID      5
+#define RHN_NEED_KEY           6
 
 #define R_X509_TYPE_UNSPECIFIED 0
 #define R_X509_TYPE_PUBKEY      1
@@ -72,6 +73,11 @@ extern "C"
 #define R_FLAG_FOLLOW_REDIRECT           0x00000010
 #define R_FLAG_IGNORE_REMOTE             0x00000100
 
+#define R_HTTP_DEFAULT_CONNECT_TIMEOUT    10000
+#define R_HTTP_DEFAULT_TIMEOUT            30000
+#define R_HTTP_DEFAULT_MAX_RESPONSE_SIZE  1048576
+#define R_HTTP_DEFAULT_MAX_IDLE_HANDLES   8
+
 #define R_JWT_TYPE_NONE                     0
 #define R_JWT_TYPE_SIGN                     1
 #define R_JWT_TYPE_ENCRYPT                  2
@@ -98,6 +104,12 @@ extern "C"
 #define R_PARSE_UNSIGNED       16
 #define R_PARSE_ALL           (R_PARSE_HEADER_ALL|R_PARSE_UNSIGNED)
 
+#define R_ECDH_POOL_P256   0x01
+#define R_ECDH_POOL_P384   0x02
+#define R_ECDH_POOL_X25519 0x04
+#define R_ECDH_POOL_X448   0x08
+#define R_ECDH_POOL_ALL    (R_ECDH_POOL_P256|R_ECDH_POOL_P384|R_ECDH_POOL_X25519|R_ECDH_POOL_X448)
+
 /**
  * @}
  */
@@ -150,6 +162,11 @@ typedef enum {
   R_JWA_ALG_ES256K         = 32
 } jwa_alg;
 
+/**
+ * Bit of alg in a mask of allowed algorithms, see r_jws_prescreen
+ */
+#define R_JWA_ALG_MASK(alg) (((uint64_t)1)<<(alg))
+
 typedef enum {
   R_JWT_CLAIM_NOP = 0,
   R_JWT_CLAIM_ISS = 1,
@@ -164,6 +181,7 @@ typedef enum {
   R_JWT_CLAIM_JSN = 10,
   R_JWT_CLAIM_TYP = 11,
   R_JWT_CLAIM_CTY = 12,
+  R_JWT_CLAIM_JTI_STORE = 13
 } rhn_claim_opt;
 
 typedef enum {
@@ -252,8 +270,17 @@ typedef struct {
   size_t          payload_len;
   json_t        * j_json_serialization;
   int             token_mode;
+  size_t          payload_alloc_len;
+  unsigned char * spare_b64url[3];
+  unsigned char * spare_payload;
+  size_t          spare_payload_len;
 } jws_t;
 
+/**
+ * Pool of ephemeral keys for ECDH-ES encryption, see r_ecdh_pool_init
+ */
+typedef struct _rhn_ecdh_pool rhn_ecdh_pool_t;
+
 typedef struct {
   unsigned char * header_b64url;
   unsigned char * encrypted_key_b64url;
@@ -277,6 +304,8 @@ typedef struct {
   size_t          payload_len;
   json_t        * j_json_serialization;
   int             token_mode;
+  unsigned char * spare_b64url[6];
+  rhn_ecdh_pool_t * ecdh_pool;
 } jwe_t;
 
 typedef struct {
@@ -297,8 +326,99 @@ typedef struct {
   jwks_t        * jwks_pubkey_sign;
   jwks_t        * jwks_privkey_enc;
   jwks_t        * jwks_pubkey_enc;
+  rhn_ecdh_pool_t * ecdh_pool;
+  uint32_t        remote_pending;
+  int             claims_pending;
 } jwt_t;
 
+/**
+ * A jwk_t prepared for multiple operations, see r_jwk_prepare
+ * Its content is private, use r_jwk_prepared_key_type to get its type
+ */
+typedef struct _jwk_prepared jwk_prepared_t;
+
+/**
+ * Result of a token verified by r_jws_verify_batch or r_jwt_verify_batch
+ */
+typedef struct {
+  int             status;      ///< RHN_OK if the token is valid, an error value otherwise
+  json_t        * j_claims;    ///< JWT claims if the token is valid, set by r_jwt_verify_batch only
+  unsigned char * payload;     ///< JWS payload if the token is valid, set by r_jws_verify_batch only
+  size_t          payload_len; ///< JWS payload length
+} rhn_batch_result_t;
+
+/**
+ * Managed JWKS downloaded and refreshed in background, see r_jwks_source_init
+ */
+typedef struct _jwks_source jwks_source_t;
+
+/**
+ * Read-only version of the keys of a jwks_source_t, see r_jwks_source_acquire
+ */
+typedef struct _jwks_snapshot jwks_snapshot_t;
+
+/**
+ * Compiled JWT validation policy, see r_jwt_verifier_init
+ */
+typedef struct _jwt_verifier jwt_verifier_t;
+
+/**
+ * Cache of verified tokens used by a jwt_verifier_t, see r_jwt_cache_init
+ */
+typedef struct _jwt_cache jwt_cache_t;
+
+/**
+ * Store of the jti claims already used, see r_jti_store_init
+ */
+typedef struct _jti_store jti_store_t;
+
+/**
+ * Memory arena used by a jwt_verifier_t, see r_arena_init
+ */
+typedef struct _rhn_arena rhn_arena_t;
+
+/**
+ * Check of a jwt_verifier_t that rejected a token
+ */
+typedef enum {
+  R_JWT_CHECK_NONE      = 0,  ///< All checks passed
+  R_JWT_CHECK_PARSE     = 1,  ///< The token isn't a valid signed JWT
+  R_JWT_CHECK_ALG       = 2,  ///< The signature algorithm isn't allowed
+  R_JWT_CHECK_TYP       = 3,  ///< The header typ doesn't match
+  R_JWT_CHECK_CTY       = 4,  ///< The header cty doesn't match
+  R_JWT_CHECK_KEY       = 5,  ///< No key matches the token
+  R_JWT_CHECK_SIGNATURE = 6,  ///< The signature is invalid
+  R_JWT_CHECK_ISS       = 7,  ///< The claim iss is missing or not allowed
+  R_JWT_CHECK_AUD       = 8,  ///< The claim aud is missing or not allowed
+  R_JWT_CHECK_EXP       = 9,  ///< The token is expired
+  R_JWT_CHECK_NBF       = 10, ///< The token isn't valid yet
+  R_JWT_CHECK_IAT       = 11, ///< The token is issued in the future
+  R_JWT_CHECK_REQUIRED  = 12, ///< A required claim is missing
+  R_JWT_CHECK_JTI       = 13  ///< The claim jti is missing or the token is replayed
+} rhn_jwt_check;
+
+/**
+ * Result of a token verified by r_jwt_verifier_verify
+ */
+typedef struct {
+  int             status;   ///< RHN_OK if the token is valid, an error value otherwise
+  rhn_jwt_check   failed;   ///< the check that rejected the token, R_JWT_CHECK_NONE if the token is valid
+  const char    * claim;    ///< name of the claim that failed a claim check, owned by the verifier
+  json_t        * j_claims; ///< JWT claims if the token is valid, must be json_decref'd after use
+} rhn_jwt_verify_result_t;
+
+/**
+ * Function used to download the remote contents from jku and x5u urls,
+ * see r_global_set_fetcher
+ * @param url: the url to download
+ * @param x5u_flags: the flags of the download, R_FLAG_IGNORE_SERVER_CERTIFICATE
+ * or R_FLAG_FOLLOW_REDIRECT
+ * @param expected_content_type: if not NULL, the response Content-Type must contain it
+ * @param user_data: the user_data set with r_global_set_fetcher
+ * @return the content downloaded, allocated with o_malloc, or NULL on error
+ */
+typedef char * (* rhn_fetcher_t)(const char * url, int x5u_flags, const char * expected_content_type, void * user_data);
+
 /**
  * @}
  */
@@ -323,6 +443,75 @@ int r_global_init(void);
  */
 void r_global_close(void);
 
+/**
+ * Enable or disable the process-wide cache of remote contents
+ * downloaded from jku and x5u urls
+ * When enabled, a content is reused until it expires, according to the
+ * Cache-Control max-age and Expires response headers, then revalidated
+ * using its ETag or Last-Modified header if any
+ * Cache entries are keyed by url and x5u_flags, the cache is thread-safe
+ * The cache is disabled by default
+ * @param enabled: 0 to disable the cache and remove all its entries,
+ * any other value to enable it
+ * @param default_ttl: lifetime in seconds of a content when the response
+ * has neither Cache-Control max-age nor Expires header
+ * @param min_refresh_interval: minimum delay in seconds between two downloads
+ * of the same url, even if the response allows a shorter lifetime
+ * @return RHN_OK on success, an error value on error
+ * RHN_ERROR_UNSUPPORTED if the library is built without curl
+ */
+int r_global_set_remote_cache(int enabled, unsigned int default_ttl, unsigned int min_refresh_interval);
+
+/**
+ * Remove all entries from the remote contents cache
+ */
+void r_global_flush_remote_cache(void);
+
+/**
+ * Set the options of the HTTP requests used to download remote contents
+ * from jku and x5u urls
+ * The curl handles are kept after a download to be reused by the next one,
+ * so the connection to the same server is reused if it's still open,
+ * the DNS and TLS sessions cache are shared by all the handles
+ * The default values are R_HTTP_DEFAULT_CONNECT_TIMEOUT, R_HTTP_DEFAULT_TIMEOUT,
+ * R_HTTP_DEFAULT_MAX_RESPONSE_SIZE and R_HTTP_DEFAULT_MAX_IDLE_HANDLES
+ * @param connect_timeout: maximum time in milliseconds to connect to the server,
+ * 0 to use curl default value
+ * @param timeout: maximum time in milliseconds of the whole request, 0 for no limit
+ * @param max_response_size: maximum size in bytes of the response body,
+ * a larger response is rejected, 0 for no limit
+ * @param max_idle_handles: maximum number of curl handles kept between two downloads,
+ * the handles in excess are closed, 0 to close the handle after each download
+ * @return RHN_OK on success, an error value on error
+ * RHN_ERROR_UNSUPPORTED if the library is built without curl
+ */
+int r_global_set_http_options(unsigned int connect_timeout, unsigned int timeout, size_t max_response_size, unsigned int max_idle_handles);
+
+/**
+ * Get the statistics of the HTTP requests used to download remote contents
+ * @param nb_requests: set to the number of requests sent, may be NULL
+ * @param nb_connections: set to the number of new connections opened
+ * to send those requests, may be NULL
+ * @return RHN_OK on success, an error value on error
+ * RHN_ERROR_UNSUPPORTED if the library is built without curl
+ */
+int r_global_get_http_stats(size_t * nb_requests, size_t * nb_connections);
+
+/**
+ * Set the function used to download the remote contents from jku and x5u urls,
+ * instead of curl
+ * The function is used for all the downloads, r_jwks_import_from_uri,
+ * r_jwk_import_from_x5u, r_jwks_source_t refreshes and x5u validation,
+ * the remote contents cache and the HTTP options aren't used then
+ * The function may be called by several threads at the same time,
+ * it's available even if the library is built without curl
+ * r_global_close removes the function
+ * @param fetcher: the function to use, NULL to use curl again
+ * @param user_data: a pointer passed to each call of fetcher
+ * @return RHN_OK on success, an error value on error
+ */
+int r_global_set_fetcher(rhn_fetcher_t fetcher, void * user_data);
+
 /**
  * Get the library information as a json_t * object
  * - library version
@@ -348,6 +537,15 @@ char * r_library_info_json_str(void);
  */
 void r_free(void * data);
 
+/**
+ * Free the claims and payloads set in the results of
+ * r_jws_verify_batch or r_jwt_verify_batch
+ * The results array itself isn't freed
+ * @param results: the results to clean
+ * @param count: the number of elements in results
+ */
+void r_batch_results_clean(rhn_batch_result_t * results, size_t count);
+
 /**
  * Initialize a jwk_t
  * @param jwk: a reference to a jwk_t * to initialize
@@ -387,6 +585,18 @@ int r_jws_init(jws_t ** jws);
  */
 void r_jws_free(jws_t * jws);
 
+/**
+ * Reset a jws_t to its initial state, so it can be reused to parse
+ * or build another token
+ * The header, the keys and the payload are removed, but the
+ * allocated buffers are kept to be reused by the next compact parse
+ * The keys sets are emptied too, so keys imported from a previous
+ * token header can't be used to verify the next one
+ * @param jws: the jws_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_reset(jws_t * jws);
+
 /**
  * Initialize a jwe_t
  * @param jwe: a reference to a jwe_t * to initialize
@@ -400,6 +610,18 @@ int r_jwe_init(jwe_t ** jwe);
  */
 void r_jwe_free(jwe_t * jwe);
 
+/**
+ * Reset a jwe_t to its initial state, so it can be reused to parse
+ * or build another token
+ * The header, the keys, the payload, the key and the iv are removed,
+ * but the allocated buffers are kept to be reused by the next compact parse
+ * The keys sets are emptied too, so keys imported from a previous
+ * token header can't be used to decrypt the next one
+ * @param jwe: the jwe_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_reset(jwe_t * jwe);
+
 /**
  * Initialize a jwt_t
  * @param jwt: a reference to a jwt_t * to initialize
@@ -413,6 +635,16 @@ int r_jwt_init(jwt_t ** jwt);
  */
 void r_jwt_free(jwt_t * jwt);
 
+/**
+ * Reset a jwt_t to its initial state, so it can be reused to parse
+ * or build another token
+ * The header, the claims and the keys are removed, the inner jws_t
+ * or jwe_t are reset and kept to be reused by the next parse
+ * @param jwt: the jwt_t * to reset
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_reset(jwt_t * jwt);
+
 /**
  * Get the jwa_alg corresponding to the string algorithm specified
  * @param alg: the algorithm to convert
@@ -845,6 +1077,46 @@ int r_jwk_export_to_pem_der(jwk_t * jwk, int format, unsigned char * output, siz
  */
 int r_jwk_export_to_symmetric_key(jwk_t * jwk, unsigned char * key, size_t * key_len);
 
+/**
+ * Prepare a jwk_t to be used for multiple sign or verify operations
+ * The key is imported once into GnuTLS objects (or decoded once if
+ * the key is symmetric) and kept in the returned jwk_prepared_t,
+ * so the JSON key doesn't need to be parsed on every operation
+ * RSA keys are also imported into the structures used by RSA-OAEP
+ * Symmetric keys keep the keyed HMAC state of HS256, HS384 and HS512
+ * after their first use, the state is copied for each signature
+ * A jwk_prepared_t can be used by several threads at the same time
+ * to verify signatures: a verification only reads the imported public
+ * key, and the HMAC state is installed once then copied by each thread
+ * Signing, decrypting or deriving a key with a prepared private key
+ * must be done by one thread at a time
+ * The jwk_prepared_t holds its own copy of jwk, the jwk_t can be freed afterwards
+ * @param jwk: the jwk_t * to prepare
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return NULL
+ * @return a jwk_prepared_t * on success, NULL on error, must be r_jwk_prepared_free'd after use
+ */
+jwk_prepared_t * r_jwk_prepare(jwk_t * jwk, int x5u_flags);
+
+/**
+ * Free a jwk_prepared_t and all its inner objects
+ * @param prepared: the jwk_prepared_t * to free
+ */
+void r_jwk_prepared_free(jwk_prepared_t * prepared);
+
+/**
+ * Get the type and size of a prepared key
+ * @param prepared: the jwk_prepared_t * to analyze
+ * @param bits: set the key size in bits, may be NULL
+ * @return an integer containing the same values as r_jwk_key_type,
+ * R_KEY_TYPE_NONE if prepared is NULL
+ */
+int r_jwk_prepared_key_type(jwk_prepared_t * prepared, unsigned int * bits);
+
 /**
  * Genrates a thumbprint of a jwk_t based on the RFC 7638
  * @param jwk: the jwk_t * to translate into a thumbprint
@@ -999,6 +1271,17 @@ size_t r_jwks_size(jwks_t * jwks);
  */
 jwk_t * r_jwks_get_at(jwks_t * jwks, size_t index);
 
+/**
+ * Get the jwk_t at the specified index of the jwks_t *
+ * without copying it
+ * @param jwks: the jwks_t * to evaluate
+ * @param index: the index of the array to retrieve
+ * @return a jwk_t * on success, NULL on error
+ * The returned jwk is owned by the jwks_t, it must not be r_jwk_free
+ * and is valid until the jwks_t is modified or freed
+ */
+jwk_t * r_jwks_peek_at(jwks_t * jwks, size_t index);
+
 /**
  * Get the jwk_t at the specified index of the jwks_t *
  * @param jwks: the jwks_t * to evaluate
@@ -1008,6 +1291,65 @@ jwk_t * r_jwks_get_at(jwks_t * jwks, size_t index);
  */
 jwk_t * r_jwks_get_by_kid(jwks_t * jwks, const char * kid);
 
+/**
+ * Get the jwk_t with the specified kid in the jwks_t *
+ * without copying it
+ * The lookup uses the index of the jwks_t if any, or scans the keys,
+ * it never modifies the jwks_t
+ * @param jwks: the jwks_t * to evaluate
+ * @param kid: the key id of the jwk to retreive
+ * @return a jwk_t * on success, NULL on error
+ * The returned jwk is owned by the jwks_t, it must not be r_jwk_free
+ * and is valid until the jwks_t is modified or freed
+ */
+jwk_t * r_jwks_peek_by_kid(jwks_t * jwks, const char * kid);
+
+/**
+ * Get the jwk_t with the specified SHA-256 thumbprint (RFC 7638)
+ * in the jwks_t * without copying it
+ * The lookup uses the index of the jwks_t if any, or scans the keys,
+ * it never modifies the jwks_t
+ * x5u-only keys are not found because their thumbprint needs a download
+ * @param jwks: the jwks_t * to evaluate
+ * @param thumbprint: the base64url SHA-256 thumbprint of the jwk to retreive
+ * @return a jwk_t * on success, NULL on error
+ * The returned jwk is owned by the jwks_t, it must not be r_jwk_free
+ * and is valid until the jwks_t is modified or freed
+ */
+jwk_t * r_jwks_peek_by_thumbprint(jwks_t * jwks, const char * thumbprint);
+
+/**
+ * Get the index-th jwk_t matching the properties kty, alg and use
+ * in the jwks_t * without copying it
+ * A NULL value matches a key where the property is absent
+ * The lookup uses the index of the jwks_t if any, or scans the keys,
+ * it never modifies the jwks_t
+ * @param jwks: the jwks_t * to evaluate
+ * @param kty: the value of the property kty
+ * @param alg: the value of the property alg
+ * @param use: the value of the property use
+ * @param index: the position of the key among the matching keys
+ * @return a jwk_t * on success, NULL if there's no more matching keys
+ * The returned jwk is owned by the jwks_t, it must not be r_jwk_free
+ * and is valid until the jwks_t is modified or freed
+ */
+jwk_t * r_jwks_peek_by_alg(jwks_t * jwks, const char * kty, const char * alg, const char * use, size_t index);
+
+/**
+ * Build the kid, thumbprint and alg lookup index of the jwks_t *
+ * Without index, r_jwks_get_by_kid and the r_jwks_peek_by_* functions
+ * scan the keys of the set
+ * The index is stored outside of the jwks_t, it is kept up to date by
+ * r_jwks_append_jwk, r_jwks_set_at, r_jwks_remove_at and r_jwks_empty,
+ * and freed by r_jwks_free
+ * The keys of an indexed set must not be changed in place,
+ * e.g. with r_jwk_set_property_str, unless this function is called again
+ * The index must be built before the jwks_t is read by several threads
+ * @param jwks: the jwks_t * to index
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_build_index(jwks_t * jwks);
+
 /**
  * Append a jwk_t at the end of the array of jwk_t in the jwks_t
  * @param jwks: the jwks_t * to append the jwk_t
@@ -1132,6 +1474,79 @@ jwks_t * r_jwks_search_json_t(jwks_t * jwks, json_t * j_match);
  */
 jwks_t * r_jwks_search_json_str(jwks_t * jwks, const char * str_match);
 
+/**
+ * Initialize a managed JWKS source
+ * The JWKS at uri is downloaded once during this call, then every
+ * refresh_interval seconds by a background thread
+ * A downloaded JWKS replaces the previous one only if it's valid,
+ * the remote contents cache is not used by the source
+ * If the first download fails, the source has no key until the next
+ * successful refresh, but the function still returns RHN_OK
+ * @param source: a reference to a jwks_source_t * to initialize,
+ * must be r_jwks_source_free'd after use
+ * @param uri: the uri of the JWKS
+ * @param x5u_flags: Flags to retrieve the JWKS
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * @param refresh_interval: the delay in seconds between two downloads, must be greater than 0
+ * @param min_refresh_interval: the minimum delay in seconds between two downloads
+ * when an early refresh is requested by r_jwks_source_request_refresh
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwks_source_init(jwks_source_t ** source, const char * uri, int x5u_flags, unsigned int refresh_interval, unsigned int min_refresh_interval);
+
+/**
+ * Stop the background thread and free the jwks_source_t
+ * The snapshots acquired before remain valid until they are released
+ * @param source: the jwks_source_t * to free
+ */
+void r_jwks_source_free(jwks_source_t * source);
+
+/**
+ * Get the current snapshot of the source keys
+ * This function doesn't take any lock and can be called from any thread,
+ * the snapshot is never changed, a refresh publishes a new snapshot instead
+ * @param source: the jwks_source_t * to read
+ * @return the current snapshot, or NULL if the source has no key yet,
+ * must be released with r_jwks_snapshot_release after use
+ */
+jwks_snapshot_t * r_jwks_source_acquire(jwks_source_t * source);
+
+/**
+ * Release a snapshot acquired with r_jwks_source_acquire
+ * @param snapshot: the jwks_snapshot_t * to release
+ */
+void r_jwks_snapshot_release(jwks_snapshot_t * snapshot);
+
+/**
+ * Get the keys of a snapshot
+ * The jwks_t is indexed and must not be modified, it can be read by several
+ * threads at the same time, e.g. using r_jwks_peek_by_kid or r_jws_verify_batch
+ * @param snapshot: the jwks_snapshot_t * to read
+ * @return the jwks_t * of the snapshot, valid until the snapshot is released
+ */
+jwks_t * r_jwks_snapshot_get_jwks(jwks_snapshot_t * snapshot);
+
+/**
+ * Ask the background thread to download the JWKS now,
+ * e.g. when a token uses an unknown kid
+ * The request is ignored if the last download was less than
+ * min_refresh_interval seconds ago, so unknown kids can't trigger a download storm
+ * @param source: the jwks_source_t * to refresh
+ * @return RHN_OK if a refresh is pending, RHN_ERROR_INVALID if the request is ignored
+ */
+int r_jwks_source_request_refresh(jwks_source_t * source);
+
+/**
+ * Get a copy of the key with the given kid in the current snapshot
+ * If no key matches, an early refresh is requested with r_jwks_source_request_refresh
+ * @param source: the jwks_source_t * to read
+ * @param kid: the key id of the key to return
+ * @return a jwk_t * on success, NULL if not found, must be r_jwk_free'd after use
+ */
+jwk_t * r_jwks_source_get_by_kid(jwks_source_t * source, const char * kid);
+
 /**
  * @}
  */
@@ -1509,6 +1924,25 @@ int r_jws_compact_parse(jws_t * jws, const char * jws_str, int x5u_flags);
  */
 int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, int x5u_flags);
 
+/**
+ * Checks the header of a serialized JWS in compact mode before parsing it
+ * Only the header is decoded, the payload is neither decoded nor inflated,
+ * so a token with a disallowed alg or an unknown kid is rejected early
+ * @param jws_str: the serialized JWS to check
+ * @param jws_str_len: the length of jws_str
+ * @param algs: the allowed signature algorithms, a combination of R_JWA_ALG_MASK(alg),
+ * 0 to allow every signature algorithm, R_JWA_ALG_NONE is never allowed
+ * @param jwks: the known public keys, NULL to skip the check
+ * if set, the header kid must match a key of jwks, a token without kid
+ * is accepted if jwks isn't empty
+ * jwks is only read, so the same jwks can be used by several threads
+ * at the same time
+ * @param typ: the expected header typ value, NULL to skip the check
+ * @return RHN_OK if the token passes the checks,
+ * RHN_ERROR_PARAM if the header is invalid, RHN_ERROR_INVALID if the token is rejected
+ */
+int r_jws_prescreen(const char * jws_str, size_t jws_str_len, uint64_t algs, jwks_t * jwks, const char * typ);
+
 /**
  * Parses the serialized JWS in compact mode (xxx.yyy.zzz)
  * @param jws: the jws_t to update
@@ -1761,6 +2195,49 @@ jws_t * r_jws_quick_parsen(const char * jws_str, size_t jws_str_len, uint32_t pa
  */
 int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags);
 
+/**
+ * Verifies the signature of the JWS using a prepared key
+ * The JWS must contain a signature
+ * If the jws has multiple signatures, it will return RHN_OK if one signature matches
+ * the public key
+ * @param jws: the jws_t to update
+ * @param key: the prepared key to check the signature, built with r_jwk_prepare
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jws_verify_signature_prepared(jws_t * jws, jwk_prepared_t * key);
+
+/**
+ * Verifies the signatures of a batch of JWS in compact or flattened JSON format
+ * The tokens are dispatched to a pool of nb_threads threads, the calling thread included
+ * The verification key is the key in jwks_pubkey with the same kid as the token,
+ * or the single key of jwks_pubkey if the token has no kid
+ * Keys embedded in the tokens headers (jwk, jku, x5c, x5u) are ignored
+ * Each key of jwks_pubkey is prepared once before the threads start,
+ * then shared by all threads
+ * Thread safety: jwks_pubkey is only read, it must not be modified until the
+ * function returns, but it can be used by several batches at the same time
+ * @param tokens: the tokens to verify
+ * @param count: the number of tokens
+ * @param jwks_pubkey: the public keys to verify the signatures
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param nb_threads: the maximum number of threads to use, 0 to use one thread per processor
+ * @param results: an array of count elements, each element will contain the status
+ * of the token at the same index, and its payload if the signature is valid
+ * statuses available are
+ * - RHN_OK: the signature is valid
+ * - RHN_ERROR_INVALID: the signature is invalid or no key matches the token
+ * - RHN_ERROR_PARAM: the token is invalid
+ * - RHN_ERROR_UNSUPPORTED: the token is in general JSON format
+ * results must be cleaned with r_batch_results_clean after use
+ * @return RHN_OK if all the tokens were processed, an error value on error
+ */
+int r_jws_verify_batch(const char ** tokens, size_t count, jwks_t * jwks_pubkey, int x5u_flags, unsigned int nb_threads, rhn_batch_result_t * results);
+
 /**
  * Serialize a JWS in compact mode (xxx.yyy.zzz)
  * @param jws: the JWS to serialize
@@ -1792,6 +2269,14 @@ char * r_jws_serialize(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags);
  */
 char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags);
 
+/**
+ * Serialize a JWS in compact mode (xxx.yyy.zzz) using a prepared key
+ * @param jws: the JWS to serialize
+ * @param key: the prepared private key to use to sign the JWS, built with r_jwk_prepare
+ * @return the JWS in serialized format, returned value must be r_free'd after use
+ */
+char * r_jws_serialize_prepared(jws_t * jws, jwk_prepared_t * key);
+
 /**
  * Serialize a JWS into its JSON format (general or flattened)
  * Mode general: Multiple signatures are generated.
@@ -2164,6 +2649,53 @@ const unsigned char * r_jwe_get_iv(jwe_t * jwe, size_t * iv_len);
  */
 int r_jwe_generate_iv(jwe_t * jwe);
 
+/**
+ * Initialize a pool of ephemeral keys for ECDH-ES encryption
+ * A background thread generates the keys in advance and keeps up to
+ * size keys available for each curve, each key is used by one encryption only
+ * If the pool is empty when a key is needed, the key is generated
+ * during the encryption as without pool
+ * A pool can be used by several threads at the same time
+ * Curve P-521 isn't available because it isn't supported for ECDH-ES
+ * @param pool: a reference to a rhn_ecdh_pool_t * to initialize,
+ * must be r_ecdh_pool_free'd after use
+ * @param curves: the curves to generate, a combination of
+ * R_ECDH_POOL_P256, R_ECDH_POOL_P384, R_ECDH_POOL_X25519 and R_ECDH_POOL_X448,
+ * or R_ECDH_POOL_ALL
+ * @param size: the number of keys kept for each curve
+ * @return RHN_OK on success, an error value on error
+ * @return RHN_ERROR_UNSUPPORTED if ECDH-ES isn't available
+ */
+int r_ecdh_pool_init(rhn_ecdh_pool_t ** pool, unsigned int curves, size_t size);
+
+/**
+ * Stop the background thread and free the rhn_ecdh_pool_t
+ * The keys not used are wiped
+ * The pool must not be used by any jwe_t or jwt_t afterwards
+ * @param pool: the rhn_ecdh_pool_t * to free
+ */
+void r_ecdh_pool_free(rhn_ecdh_pool_t * pool);
+
+/**
+ * Get the statistics of a rhn_ecdh_pool_t
+ * @param pool: the rhn_ecdh_pool_t * to read
+ * @param nb_available: set to the number of keys available for all curves, may be NULL
+ * @param nb_hits: set to the number of keys taken from the pool, may be NULL
+ * @param nb_misses: set to the number of keys generated during an encryption
+ * because the pool was empty, may be NULL
+ * @return RHN_OK on success, an error value on error
+ */
+int r_ecdh_pool_get_stats(rhn_ecdh_pool_t * pool, size_t * nb_available, size_t * nb_hits, size_t * nb_misses);
+
+/**
+ * Sets the pool of ephemeral keys used for ECDH-ES encryption
+ * The pool isn't copied, it must not be freed before the jwe_t
+ * @param jwe: the jwe_t to update
+ * @param pool: the rhn_ecdh_pool_t * to use, NULL to remove the pool
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_set_ecdh_pool(jwe_t * jwe, rhn_ecdh_pool_t * pool);
+
 /**
  * Sets the Additional Authenticated Data (aad)
  * @param jwe: the jwe_t to update
@@ -2557,6 +3089,16 @@ jwe_t * r_jwe_quick_parsen(const char * jwe_str, size_t jwe_str_len, uint32_t pa
  */
 int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags);
 
+/**
+ * Decrypts the payload of the JWE using a prepared key
+ * For RSA-OAEP and RSA-OAEP-256, the RSA private key values
+ * computed by r_jwk_prepare are reused
+ * @param jwe: the jwe_t to update
+ * @param key: the prepared private key to decrypt cypher key, built with r_jwk_prepare
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwe_decrypt_prepared(jwe_t * jwe, jwk_prepared_t * key);
+
 /**
  * Serialize a JWE into its string format (aaa.bbb.ccc.xxx.yyy.zzz)
  * @param jwe: the JWE to serialize
@@ -2572,6 +3114,14 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags);
  */
 char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags);
 
+/**
+ * Serialize a JWE into its string format (aaa.bbb.ccc.xxx.yyy.zzz) using a prepared key
+ * @param jwe: the JWE to serialize
+ * @param key: the prepared public key to encrypt the cypher key, built with r_jwk_prepare
+ * @return the JWE in serialized format, returned value must be r_free'd after use
+ */
+char * r_jwe_serialize_prepared(jwe_t * jwe, jwk_prepared_t * key);
+
 /**
  * Serialize a JWE into its JSON format (general or flattened)
  * Mode general: Multiple encryptions are generated.
@@ -2790,6 +3340,18 @@ json_t * r_jwt_get_full_claims_json_t(jwt_t * jwt);
  */
 char * r_jwt_get_full_claims_str(jwt_t * jwt);
 
+/**
+ * Return a selection of the JWT claims in JSON format
+ * If the claims of a parsed JWT aren't decoded yet, only the values
+ * of the selected claims are decoded, the full claims aren't
+ * @param jwt: the jwt_t to get the values
+ * @param claims: the names of the top-level claims to return
+ * @param nb_claims: the number of names in claims
+ * @return a json_t * object containing the selected claims present in the JWT,
+ * NULL on error, must be json_decref'd after use
+ */
+json_t * r_jwt_get_claims_json_t(jwt_t * jwt, const char * const * claims, size_t nb_claims);
+
 /**
  * Set the full JWT claim in JSON format
  * delete all existing value
@@ -3087,6 +3649,15 @@ int r_jwt_set_enc_iv(jwt_t * jwt, const unsigned char * iv, size_t iv_len);
  */
 const unsigned char * r_jwt_get_enc_iv(jwt_t * jwt, size_t * iv_len);
 
+/**
+ * Sets the pool of ephemeral keys used for ECDH-ES encryption
+ * The pool isn't copied, it must not be freed before the jwt_t
+ * @param jwt: the jwt_t to update
+ * @param pool: the rhn_ecdh_pool_t * to use, NULL to remove the pool
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_set_ecdh_pool(jwt_t * jwt, rhn_ecdh_pool_t * pool);
+
 /**
  * Generates a random Initialization Vector (iv)
  * @param jwt: the jwt_t to update
@@ -3123,6 +3694,14 @@ char * r_jwt_serialize_signed(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
  */
 char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_flags);
 
+/**
+ * Return a signed JWT in serialized format (xxx.yyy.zzz) using a prepared key
+ * @param jwt: the jwt_t to sign
+ * @param key: the prepared private key to sign the JWT, built with r_jwk_prepare
+ * @return the JWT in serialized format, returned value must be r_free'd after use
+ */
+char * r_jwt_serialize_signed_prepared(jwt_t * jwt, jwk_prepared_t * key);
+
 /**
  * Return an encrypted JWT in serialized format (xxx.yyy.zzz.aaa.bbb)
  * @param jwt: the jwt_t to encrypt
@@ -3378,6 +3957,22 @@ int r_jwt_token_type(const char * token);
  */
 int r_jwt_token_typen(const char * token, size_t token_len);
 
+/**
+ * Checks the header of a signed JWT before parsing it
+ * Only the header is decoded, the claims are neither decoded nor inflated,
+ * see r_jws_prescreen
+ * @param token: the token to check
+ * @param token_len: token length
+ * @param algs: the allowed signature algorithms, a combination of R_JWA_ALG_MASK(alg),
+ * 0 to allow every signature algorithm, R_JWA_ALG_NONE is never allowed
+ * @param jwks: the known public keys, NULL to skip the check,
+ * jwks is only read
+ * @param typ: the expected header typ value, NULL to skip the check
+ * @return RHN_OK if the token passes the checks,
+ * RHN_ERROR_PARAM if the token isn't a signed JWT, RHN_ERROR_INVALID if the token is rejected
+ */
+int r_jwt_prescreen(const char * token, size_t token_len, uint64_t algs, jwks_t * jwks, const char * typ);
+
 /**
  * Verifies the signature of the JWT
  * The JWT must contain a signature
@@ -3395,6 +3990,93 @@ int r_jwt_token_typen(const char * token, size_t token_len);
  */
 int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags);
 
+/**
+ * Verifies the signature of the JWT using a prepared key
+ * The JWT must contain a signature
+ * @param jwt: the jwt_t to update
+ * @param key: the prepared key to check the signature, built with r_jwk_prepare
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verify_signature_prepared(jwt_t * jwt, jwk_prepared_t * key);
+
+/**
+ * Parses a signed JWT and verifies its signature without downloading
+ * the jku or x5u remote contents
+ * If the token header has a jku and parse_flags has R_PARSE_HEADER_JKU,
+ * or a x5u and parse_flags has R_PARSE_HEADER_X5U, the function returns
+ * RHN_NEED_KEY and sets url to the content to download,
+ * the verification continues with r_jwt_verify_resume when the content is available
+ * Otherwise the signature is verified as with r_jwt_verify_signature
+ * The other parse_flags are used as with r_jwt_advanced_parsen
+ * @param jwt: the jwt that will contain the parsed token
+ * @param token: the token to parse into a JWT
+ * @param token_len: token length
+ * @param parse_flags: Flags to set or unset options, see r_jwt_advanced_parsen
+ * @param pubkey: the public key to check the signature,
+ * can be NULL if the token header or the jwt already contains a public key
+ * @param x5u_flags: Flags used to verify the signature, see r_jwt_verify_signature,
+ * add R_FLAG_IGNORE_REMOTE to make sure the function never downloads anything
+ * @param url: set to the url to download if the function returns RHN_NEED_KEY,
+ * NULL otherwise, the url is available until the jwt is modified
+ * @return RHN_OK if the signature is valid, RHN_NEED_KEY if a remote content is needed,
+ * an error value on error
+ * RHN_ERROR_UNSUPPORTED if the token isn't a signed JWT
+ */
+int r_jwt_verify_start(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, jwk_t * pubkey, int x5u_flags, const char ** url);
+
+/**
+ * Continues the verification started with r_jwt_verify_start with the content
+ * downloaded from the url returned
+ * A jku content is imported as a JWKS, a x5u content as a PEM certificate,
+ * the keys are added to the public keys of the jwt
+ * As with r_jwt_advanced_parsen, a jku content that can't be downloaded or imported
+ * isn't an error by itself, a x5u content that can't be imported is an error
+ * @param jwt: the jwt_t returned by r_jwt_verify_start with RHN_NEED_KEY
+ * @param content: the content downloaded, NULL if the download failed
+ * @param content_len: the length of content
+ * @param pubkey: the public key to check the signature,
+ * can be NULL if the token header or the jwt already contains a public key
+ * @param x5u_flags: Flags used to verify the signature, see r_jwt_verify_signature
+ * @param url: set to the next url to download if the function returns RHN_NEED_KEY,
+ * NULL otherwise
+ * @return RHN_OK if the signature is valid, RHN_NEED_KEY if another remote content is needed,
+ * an error value on error
+ */
+int r_jwt_verify_resume(jwt_t * jwt, const unsigned char * content, size_t content_len, jwk_t * pubkey, int x5u_flags, const char ** url);
+
+/**
+ * Verifies the signatures of a batch of signed JWTs
+ * The tokens are dispatched to a pool of nb_threads threads, the calling thread included
+ * The verification key is the key in jwks_pubkey with the same kid as the token,
+ * or the single key of jwks_pubkey if the token has no kid
+ * Keys embedded in the tokens headers (jwk, jku, x5c, x5u) are ignored
+ * Each key of jwks_pubkey is prepared once before the threads start,
+ * then shared by all threads
+ * The claims aren't validated, use the claims returned to do so
+ * Thread safety: jwks_pubkey is only read, it must not be modified until the
+ * function returns, but it can be used by several batches at the same time
+ * @param tokens: the tokens to verify
+ * @param count: the number of tokens
+ * @param jwks_pubkey: the public keys to verify the signatures
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @param nb_threads: the maximum number of threads to use, 0 to use one thread per processor
+ * @param results: an array of count elements, each element will contain the status
+ * of the token at the same index, and its claims if the signature is valid
+ * statuses available are
+ * - RHN_OK: the signature is valid
+ * - RHN_ERROR_INVALID: the signature is invalid or no key matches the token
+ * - RHN_ERROR_PARAM: the token is invalid
+ * - RHN_ERROR_UNSUPPORTED: the token is encrypted or nested
+ * results must be cleaned with r_batch_results_clean after use
+ * @return RHN_OK if all the tokens were processed, an error value on error
+ */
+int r_jwt_verify_batch(const char ** tokens, size_t count, jwks_t * jwks_pubkey, int x5u_flags, unsigned int nb_threads, rhn_batch_result_t * results);
+
 /**
  * Decrypts the payload of the JWT
  * @param jwt: the jwt_t to decrypt
@@ -3479,6 +4161,8 @@ int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_ke
  * - R_JWT_CLAIM_STR: the claim name specified must have the string value expected or NULL to validate the presence of the claim
  * - R_JWT_CLAIM_INT: the claim name specified must have the integer value expected
  * - R_JWT_CLAIM_JSN: the claim name specified must have the json_t * value expected or NULL to validate the presence of the claim
+ * - R_JWT_CLAIM_JTI_STORE: the claim "jti" must be present and not in the jti_store_t * specified, it's added to the store
+ * R_JWT_CLAIM_JTI_STORE should be the last claim of the list, so the jti of a token that fails another check isn't added to the store
  * Example
  * The following code will check the jwt agains the iss value "https://example.com", the sub value "client_1", the presence of the claim aud and that the claim exp is after now and the claim `nbf` is before now:
  * if (r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, "https://example.com", 
@@ -3510,6 +4194,320 @@ int r_jwt_validate_claims(jwt_t * jwt, ...);
  */
 int r_jwt_set_claims(jwt_t * jwt, ...);
 
+/**
+ * Initialize a jwt_verifier_t
+ * A verifier holds a validation policy built once and used to verify
+ * many tokens: allowed algorithms, public keys, issuers, audiences,
+ * leeway, required claims and expected typ and cty
+ * The string sets are kept in hash tables and the keys are prepared
+ * when added, so r_jwt_verifier_verify has no setup to do
+ * The verifier must be set up before being used, and used by one thread at a time
+ * @param verifier: a reference to a jwt_verifier_t * to initialize
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_init(jwt_verifier_t ** verifier);
+
+/**
+ * Free a jwt_verifier_t and its prepared keys
+ * @param verifier: the jwt_verifier_t * to free
+ */
+void r_jwt_verifier_free(jwt_verifier_t * verifier);
+
+/**
+ * Add a signature algorithm to the verifier allowlist
+ * A token signed with an algorithm not in the allowlist is rejected,
+ * so at least one algorithm must be allowed
+ * @param verifier: the jwt_verifier_t * to update
+ * @param alg: the algorithm to allow, unsecured tokens (R_JWA_ALG_NONE) are never allowed
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_add_alg(jwt_verifier_t * verifier, jwa_alg alg);
+
+/**
+ * Add a public key to the verifier
+ * The key is prepared immediately, the jwk_t can be freed afterwards
+ * A token with a kid is verified with the key of the same kid,
+ * a token without kid is verified with each key until one matches
+ * @param verifier: the jwt_verifier_t * to update
+ * @param jwk: the public key to add
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * Flags available are 
+ * - R_FLAG_IGNORE_SERVER_CERTIFICATE: ignrore if web server certificate is invalid
+ * - R_FLAG_FOLLOW_REDIRECT: follow redirections if necessary
+ * - R_FLAG_IGNORE_REMOTE: do not download remote key, but the function may return an error
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_add_key(jwt_verifier_t * verifier, jwk_t * jwk, int x5u_flags);
+
+/**
+ * Add all the public keys of a jwks_t to the verifier
+ * @param verifier: the jwt_verifier_t * to update
+ * @param jwks: the public keys to add
+ * @param x5u_flags: Flags to retrieve x5u certificates
+ * pointed by x5u if necessary, could be 0 if not needed
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_add_jwks(jwt_verifier_t * verifier, jwks_t * jwks, int x5u_flags);
+
+/**
+ * Add an allowed issuer
+ * If at least one issuer is added, the claim iss is required
+ * and must be one of the allowed issuers
+ * @param verifier: the jwt_verifier_t * to update
+ * @param iss: the issuer to allow
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_add_issuer(jwt_verifier_t * verifier, const char * iss);
+
+/**
+ * Add an accepted audience
+ * If at least one audience is added, the claim aud is required
+ * and must be, or contain if it's an array, one of the accepted audiences
+ * @param verifier: the jwt_verifier_t * to update
+ * @param aud: the audience to accept
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_add_audience(jwt_verifier_t * verifier, const char * aud);
+
+/**
+ * Add a claim that must be present in the token
+ * @param verifier: the jwt_verifier_t * to update
+ * @param claim: the name of the required claim
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_add_required_claim(jwt_verifier_t * verifier, const char * claim);
+
+/**
+ * Set the clock skew tolerated when checking the claims exp, nbf and iat
+ * The claims exp, nbf and iat are checked only if present,
+ * use r_jwt_verifier_add_required_claim to require them
+ * @param verifier: the jwt_verifier_t * to update
+ * @param leeway: the tolerated clock skew in seconds, default 0
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_set_leeway(jwt_verifier_t * verifier, unsigned int leeway);
+
+/**
+ * Set the expected header value typ
+ * @param verifier: the jwt_verifier_t * to update
+ * @param typ: the expected typ, NULL to disable the check
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_set_typ(jwt_verifier_t * verifier, const char * typ);
+
+/**
+ * Set the expected header value cty
+ * @param verifier: the jwt_verifier_t * to update
+ * @param cty: the expected cty, NULL to disable the check
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_set_cty(jwt_verifier_t * verifier, const char * cty);
+
+/**
+ * Parses a signed JWT and verifies it against the verifier policy:
+ * algorithm allowlist, typ and cty, signature, iss, aud,
+ * exp, nbf and iat, required claims, then jti replay if a jti_store_t is set
+ * The checks stop at the first failure, which is set in result
+ * Remote keys from the token header (jku, x5u) are never used
+ * @param verifier: the jwt_verifier_t * to use
+ * @param token: the token to verify
+ * @param token_len: token length
+ * @param result: the verification result, may be NULL,
+ * result->j_claims must be json_decref'd after use
+ * @return RHN_OK if the token is valid
+ * RHN_ERROR_PARAM if the token can't be parsed or isn't a signed JWT
+ * RHN_ERROR_INVALID if the token is rejected by the policy
+ * another error value on error
+ */
+int r_jwt_verifier_verify(jwt_verifier_t * verifier, const char * token, size_t token_len, rhn_jwt_verify_result_t * result);
+
+/**
+ * Initialize a jwt_cache_t, a cache of tokens verified by r_jwt_verifier_verify
+ * A token is looked up by the SHA-256 digest of its serialized value,
+ * on a hit the stored result and a copy of the claims are returned
+ * without parsing the token or verifying its signature again
+ * A valid token is kept until its claim exp, plus the verifier leeway,
+ * is reached, an invalid token is kept during negative_ttl seconds
+ * The least recently used entries are removed when the cache is full
+ * The cache is divided in shards with their own lock and can be shared
+ * by several verifiers used by different threads, as long as all the
+ * verifiers have the same policy
+ * @param cache: a reference to a jwt_cache_t * to initialize
+ * @param max_entries: maximum number of tokens in the cache
+ * @param nb_shards: number of shards, 0 to use the number of CPU available
+ * @param negative_ttl: lifetime in seconds of an invalid token result,
+ * 0 to cache valid tokens only
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_cache_init(jwt_cache_t ** cache, size_t max_entries, unsigned int nb_shards, unsigned int negative_ttl);
+
+/**
+ * Free a jwt_cache_t and all its entries
+ * The cache must not be used by any verifier afterwards
+ * @param cache: the jwt_cache_t * to free
+ */
+void r_jwt_cache_free(jwt_cache_t * cache);
+
+/**
+ * Remove all entries from a jwt_cache_t
+ * The cache is flushed when a verifier using it is modified,
+ * it must also be flushed when the keys used to build the verifiers
+ * change, e.g. after a jwks_source_t refresh
+ * @param cache: the jwt_cache_t * to flush
+ */
+void r_jwt_cache_flush(jwt_cache_t * cache);
+
+/**
+ * Get the statistics of a jwt_cache_t
+ * @param cache: the jwt_cache_t * to read
+ * @param hits: set to the number of tokens found in the cache, may be NULL
+ * @param misses: set to the number of tokens not found in the cache, may be NULL
+ * @param nb_entries: set to the number of tokens in the cache, may be NULL
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_cache_get_stats(jwt_cache_t * cache, size_t * hits, size_t * misses, size_t * nb_entries);
+
+/**
+ * Attach a jwt_cache_t to a verifier, the cache is flushed
+ * The verifier doesn't own the cache
+ * @param verifier: the jwt_verifier_t * to update
+ * @param cache: the jwt_cache_t * to use, NULL to disable the cache
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_set_cache(jwt_verifier_t * verifier, jwt_cache_t * cache);
+
+/**
+ * Initialize a jti_store_t, an in-process replay protection store
+ * The store contains the jti claims of the tokens already used,
+ * a token is rejected if its jti is already in the store
+ * Each jti is kept until the token claim exp is reached, or default_ttl
+ * seconds if the token has no claim exp, expired jti are removed
+ * with a timing wheel, so the store size depends on the number of tokens
+ * not yet expired only
+ * The store is divided in stripes with their own lock and is thread-safe
+ * @param store: a reference to a jti_store_t * to initialize
+ * @param max_entries: maximum number of jti in the store, when the store
+ * is full new tokens are rejected with RHN_ERROR_MEMORY
+ * @param default_ttl: lifetime in seconds of the jti of a token without claim exp
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jti_store_init(jti_store_t ** store, size_t max_entries, unsigned int default_ttl);
+
+/**
+ * Free a jti_store_t and all its entries
+ * @param store: the jti_store_t * to free
+ */
+void r_jti_store_free(jti_store_t * store);
+
+/**
+ * Add a jti to the store if it's not already present
+ * The jti is unique per issuer, so the pair iss and jti is stored
+ * @param store: the jti_store_t * to update
+ * @param iss: the claim iss of the token, may be NULL
+ * @param jti: the claim jti of the token
+ * @param exp: the time until the jti must be kept, usually the claim exp,
+ * 0 to use the store default_ttl, if exp is in the past the jti isn't stored
+ * @return RHN_OK if the jti was added
+ * RHN_ERROR_INVALID if the jti is already in the store
+ * RHN_ERROR_MEMORY if the store is full
+ * another error value on error
+ */
+int r_jti_store_add(jti_store_t * store, const char * iss, const char * jti, time_t exp);
+
+/**
+ * Get the number of jti in the store
+ * @param store: the jti_store_t * to read
+ * @return the number of jti in the store
+ */
+size_t r_jti_store_size(jti_store_t * store);
+
+/**
+ * Save the jti of the store in a local file, e.g. on shutdown
+ * The file is written aside then renamed, expired jti aren't saved
+ * @param store: the jti_store_t * to save
+ * @param path: the path of the file
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jti_store_save(jti_store_t * store, const char * path);
+
+/**
+ * Load the jti saved by r_jti_store_save in a store, e.g. on startup
+ * Expired jti are ignored
+ * @param store: the jti_store_t * to update
+ * @param path: the path of the file
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jti_store_load(jti_store_t * store, const char * path);
+
+/**
+ * Attach a jti_store_t to a verifier
+ * The claim jti becomes required and a token whose jti is already
+ * in the store is rejected, the jti of a valid token is added to the store
+ * The verifier doesn't own the store, the store can be shared by several verifiers
+ * @param verifier: the jwt_verifier_t * to update
+ * @param jti_store: the jti_store_t * to use, NULL to disable replay protection
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_set_jti_store(jwt_verifier_t * verifier, jti_store_t * jti_store);
+
+/**
+ * Enable the memory arenas used by the verifiers, see r_arena_init
+ * The orcania and jansson allocation functions are replaced by functions
+ * that take the memory from the arena of the calling thread during a
+ * verification, and call the previous allocation functions otherwise
+ * This function must be called after r_global_init and after the
+ * application has set its own allocation functions if any,
+ * like r_global_init it isn't thread-safe and must be called before other
+ * threads allocate memory with orcania or jansson
+ * r_global_close restores the previous allocation functions
+ * @return RHN_OK on success, an error value on error
+ */
+int r_global_enable_arena(void);
+
+/**
+ * Initialize a rhn_arena_t, a memory arena for the verification of a token
+ * While a verifier using an arena checks a token, all the allocations made
+ * with orcania or jansson in the calling thread are taken from the arena
+ * blocks, then they're released at once at the end of the verification,
+ * the blocks are overwritten with zeros and kept for the next token
+ * Arenas must be enabled first with r_global_enable_arena
+ * An arena isn't thread-safe, it must be used by one verifier at a time
+ * @param arena: a reference to a rhn_arena_t * to initialize
+ * @param block_size: size in bytes of the arena blocks, 0 for the default value (64KiB),
+ * a larger allocation gets its own block
+ * @return RHN_OK on success, RHN_ERROR_UNSUPPORTED if arenas aren't enabled,
+ * an error value on error
+ */
+int r_arena_init(rhn_arena_t ** arena, size_t block_size);
+
+/**
+ * Free a rhn_arena_t and its blocks
+ * The arena must not be used by any verifier afterwards
+ * @param arena: the rhn_arena_t * to free
+ */
+void r_arena_free(rhn_arena_t * arena);
+
+/**
+ * Get the statistics of a rhn_arena_t
+ * @param arena: the rhn_arena_t * to read
+ * @param nb_allocs: set to the number of allocations taken from the arena, may be NULL
+ * @param nb_blocks: set to the number of blocks of the arena, may be NULL
+ * @return RHN_OK on success, an error value on error
+ */
+int r_arena_get_stats(rhn_arena_t * arena, size_t * nb_allocs, size_t * nb_blocks);
+
+/**
+ * Attach a rhn_arena_t to a verifier
+ * The verifier doesn't own the arena
+ * The claims returned in the verification result are copied
+ * out of the arena
+ * @param verifier: the jwt_verifier_t * to update
+ * @param arena: the rhn_arena_t * to use, NULL to use the regular allocation functions
+ * @return RHN_OK on success, an error value on error
+ */
+int r_jwt_verifier_set_arena(jwt_verifier_t * verifier, rhn_arena_t * arena);
+
 /**
  * @}
  */
@@ -3533,6 +4531,18 @@ json_t * _r_json_get_json_t_value(json_t * j_json, const char * key);
 
 json_t * _r_json_get_full_json_t(json_t * j_json);
 
+/**
+ * Check a JSON text without building its tree
+ * Return 1 if json is a valid JSON text for jansson's decoder, 0 otherwise
+ */
+int _r_json_validate(const char * json, size_t json_len);
+
+/**
+ * Decode only the selected top-level members of a JSON object
+ * Return a new object containing the selected members present, NULL if json is invalid
+ */
+json_t * _r_json_extract_members(const char * json, size_t json_len, const char * const * names, size_t nb_names);
+
 size_t _r_get_key_size(jwa_enc enc);
 
 gnutls_cipher_algorithm_t _r_get_alg_from_enc(jwa_enc enc);
@@ -3541,6 +4551,104 @@ int _r_deflate_payload(const unsigned char * uncompressed, size_t uncompressed_l
 
 int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len, unsigned char ** uncompressed, size_t * uncompressed_len);
 
+/**
+ * base64url codec used internally, same interface as orcania's o_base64url_*
+ * functions, without intermediate allocation
+ * If out is NULL, only out_len is set, for decode the input is still validated
+ */
+struct _o_datum;
+
+int _r_base64url_encode(const unsigned char * src, size_t len, unsigned char * out, size_t * out_len);
+
+int _r_base64url_decode(const unsigned char * src, size_t len, unsigned char * out, size_t * out_len);
+
+int _r_base64url_encode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat);
+
+int _r_base64url_decode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat);
+
+/**
+ * Split a compact token in its segments separated by '.'
+ * The token isn't copied, offsets and lengths refer to the token
+ * Return the number of segments, or 0 if there's more than max_segments
+ */
+size_t _r_split_compact_token(const char * token, size_t token_len, size_t * offsets, size_t * lengths, size_t max_segments);
+
+/**
+ * Decode the header of a compact JWS without decoding the payload
+ * alg is set to the header alg, R_JWA_ALG_UNKNOWN if it isn't a JWS alg
+ * Return the header, or NULL if it's invalid
+ */
+json_t * _r_jws_decode_header(const char * jws_str, size_t jws_str_len, jwa_alg * alg);
+
+/**
+ * Parse a compact JWS whose header was already decoded by _r_jws_decode_header
+ * j_header isn't decoded again, its reference count is incremented
+ */
+int _r_jws_advanced_compact_parsen_header(jws_t * jws, const char * jws_str, size_t jws_str_len, json_t * j_header, uint32_t parse_flags, int x5u_flags);
+
+/**
+ * Spare strings kept by r_jws_reset and r_jwe_reset
+ * _r_spare_keep moves *str to *spare if it's larger than the current spare, frees it otherwise
+ * _r_spare_strndup copies src in *spare if it's large enough, then *spare is set to NULL,
+ * otherwise a new string is allocated
+ */
+void _r_spare_keep(unsigned char ** spare, unsigned char ** str);
+
+unsigned char * _r_spare_strndup(unsigned char ** spare, const char * src, size_t len);
+
+/**
+ * Batch verification, the tokens are dispatched to nb_threads workers
+ * The kid index is built and the keys are prepared once per batch
+ * before the workers start, process is called for each token and must
+ * only get its key through _r_batch_get_key
+ */
+struct _r_batch;
+
+typedef void (* _r_batch_process)(struct _r_batch * batch, const char * token, rhn_batch_result_t * result);
+
+int _r_batch_run(jwks_t * jwks, int x5u_flags, const char ** tokens, size_t count, unsigned int nb_threads, rhn_batch_result_t * results, _r_batch_process process);
+
+jwk_prepared_t * _r_batch_get_key(struct _r_batch * batch, const char * kid);
+
+/**
+ * RSA keys imported for RSA-OAEP, the private key values are overwritten when freed
+ * g_priv may be NULL, returns NULL if nettle doesn't support RSA-OAEP
+ */
+void * _r_rsa_keys_new(gnutls_privkey_t g_priv, gnutls_pubkey_t g_pub);
+
+void _r_rsa_keys_free(void * rsa_keys);
+
+/**
+ * Internal accessors of a jwk_prepared_t, the returned values belong to prepared
+ */
+jwk_t * _r_jwk_prepared_get_jwk(jwk_prepared_t * prepared);
+
+gnutls_privkey_t _r_jwk_prepared_get_privkey(jwk_prepared_t * prepared);
+
+gnutls_pubkey_t _r_jwk_prepared_get_pubkey(jwk_prepared_t * prepared);
+
+const unsigned char * _r_jwk_prepared_get_key(jwk_prepared_t * prepared, size_t * key_len);
+
+void * _r_jwk_prepared_get_rsa(jwk_prepared_t * prepared);
+
+/**
+ * Arena scope in the current thread
+ * Between _r_arena_enter and _r_arena_suspend, orcania and jansson allocations
+ * are taken from the arena, after _r_arena_suspend the allocations go back
+ * to the regular functions but the arena memory is still readable,
+ * _r_arena_leave wipes and releases the arena memory
+ */
+void _r_arena_enter(rhn_arena_t * arena);
+
+void _r_arena_suspend(rhn_arena_t * arena);
+
+void _r_arena_leave(rhn_arena_t * arena);
+
+/**
+ * Restore the allocation functions replaced by r_global_enable_arena
+ */
+void _r_arena_global_close(void);
+
 #endif
 
 #ifdef __cplusplus
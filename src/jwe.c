@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -38,6 +39,7 @@
 #define _R_PBES_DEFAULT_ITERATION 4096
 #define _R_PBES_DEFAULT_SALT_LENGTH 8
 #define _R_CURVE_MAX_SIZE 66
+#define _R_ECDH_POOL_NB_CURVES 4
 
 // AES KeyWrap (includes)
 #if NETTLE_VERSION_NUMBER >= 0x030400
@@ -328,100 +330,204 @@ static void rnd_nonce_func(void *_ctx, size_t length, uint8_t * data)
 	gnutls_rnd(GNUTLS_RND_NONCE, data, length);
 }
 
-static int _r_rsa_oaep_encrypt(gnutls_pubkey_t g_pub, jwa_alg alg, uint8_t * cleartext, size_t cleartext_len, uint8_t * ciphertext, size_t * cyphertext_len) {
-  struct rsa_public_key pub;
+/**
+ * Clears a mpz_t and overwrites its limbs before, so private key material
+ * doesn't stay in freed memory
+ */
+static void _r_mpz_clear_secure(mpz_t z) {
+  size_t size = mpz_size(z);
+  mp_limb_t * limbs;
+
+  if (size) {
+    limbs = mpz_limbs_modify(z, (mp_size_t)size);
+    gnutls_memset(limbs, 0, size*sizeof(mp_limb_t));
+    mpz_limbs_finish(z, 0);
+  }
+  mpz_clear(z);
+}
+
+static void _r_rsa_private_key_clear_secure(struct rsa_private_key * priv) {
+  _r_mpz_clear_secure(priv->d);
+  _r_mpz_clear_secure(priv->p);
+  _r_mpz_clear_secure(priv->q);
+  _r_mpz_clear_secure(priv->a);
+  _r_mpz_clear_secure(priv->b);
+  _r_mpz_clear_secure(priv->c);
+  priv->size = 0;
+}
+
+static void _r_datum_free_secure(gnutls_datum_t * dat) {
+  if (dat->data != NULL) {
+    gnutls_memset(dat->data, 0, dat->size);
+    gnutls_free(dat->data);
+    dat->data = NULL;
+  }
+}
+
+/**
+ * Imports a GnuTLS RSA public key into an initialized nettle rsa_public_key
+ */
+static int _r_rsa_import_pubkey(gnutls_pubkey_t g_pub, struct rsa_public_key * pub) {
   gnutls_datum_t m = {NULL, 0}, e = {NULL, 0};
   int ret = RHN_OK;
-  mpz_t gibberish;
 
-  rsa_public_key_init(&pub);
-  mpz_init(gibberish);
   if (gnutls_pubkey_export_rsa_raw(g_pub, &m, &e) == GNUTLS_E_SUCCESS) {
-    mpz_import(pub.n, m.size, 1, 1, 0, 0, m.data);
-    mpz_import(pub.e, e.size, 1, 1, 0, 0, e.data);
-    rsa_public_key_prepare(&pub);
-    if (*cyphertext_len >= pub.size) {
-      if (alg == R_JWA_ALG_RSA_OAEP) {
-        if (!rsaes_oaep_sha1_encrypt(&pub, NULL, rnd_nonce_func, 0, NULL, cleartext_len, cleartext, gibberish)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error rsaes_oaep_sha1_encrypt");
-          ret = RHN_ERROR;
-        }
-      } else {
-        if (!rsaes_oaep_sha256_encrypt(&pub, NULL, rnd_nonce_func, 0, NULL, cleartext_len, cleartext, gibberish)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error rsaes_oaep_sha256_encrypt");
-          ret = RHN_ERROR;
-        }
-      }
-      if (ret == RHN_OK) {
-        nettle_mpz_get_str_256(pub.size, ciphertext, gibberish);
-        *cyphertext_len = pub.size;
-      }
-    } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error cyphertext to small");
-      ret = RHN_ERROR_PARAM;
+    mpz_import(pub->n, m.size, 1, 1, 0, 0, m.data);
+    mpz_import(pub->e, e.size, 1, 1, 0, 0, e.data);
+    if (!rsa_public_key_prepare(pub)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_import_pubkey - Error rsa_public_key_prepare");
+      ret = RHN_ERROR;
     }
     gnutls_free(m.data);
     gnutls_free(e.data);
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error gnutls_pubkey_export_rsa_raw");
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_import_pubkey - Error gnutls_pubkey_export_rsa_raw");
     ret = RHN_ERROR;
   }
-  rsa_public_key_clear(&pub);
-  mpz_clear(gibberish);
-
   return ret;
 }
 
-static int _r_rsa_oaep_decrypt(gnutls_privkey_t g_priv, jwa_alg alg, uint8_t * ciphertext, size_t cyphertext_len, uint8_t * cleartext, size_t * cleartext_len) {
-  struct rsa_private_key priv;
+/**
+ * Imports a GnuTLS RSA private key into an initialized nettle rsa_private_key
+ * The CRT values are computed once by rsa_private_key_prepare
+ */
+static int _r_rsa_import_privkey(gnutls_privkey_t g_priv, struct rsa_private_key * priv) {
   gnutls_datum_t m = {NULL, 0}, e = {NULL, 0}, d = {NULL, 0}, p = {NULL, 0}, q = {NULL, 0}, u = {NULL, 0}, e1 = {NULL, 0}, e2 = {NULL, 0};
   int ret = RHN_OK;
+
+  if (gnutls_privkey_export_rsa_raw(g_priv, &m, &e, &d, &p, &q, &u, &e1, &e2) == GNUTLS_E_SUCCESS) {
+    mpz_import(priv->d, d.size, 1, 1, 0, 0, d.data);
+    mpz_import(priv->p, p.size, 1, 1, 0, 0, p.data);
+    mpz_import(priv->q, q.size, 1, 1, 0, 0, q.data);
+    mpz_import(priv->a, e1.size, 1, 1, 0, 0, e1.data);
+    mpz_import(priv->b, e2.size, 1, 1, 0, 0, e2.data);
+    mpz_import(priv->c, u.size, 1, 1, 0, 0, u.data);
+    if (!rsa_private_key_prepare(priv)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_import_privkey - Error rsa_private_key_prepare");
+      ret = RHN_ERROR;
+    }
+    gnutls_free(m.data);
+    gnutls_free(e.data);
+    _r_datum_free_secure(&d);
+    _r_datum_free_secure(&p);
+    _r_datum_free_secure(&q);
+    _r_datum_free_secure(&u);
+    _r_datum_free_secure(&e1);
+    _r_datum_free_secure(&e2);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_import_privkey - Error gnutls_privkey_export_rsa_raw");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+static int _r_rsa_oaep_encrypt(const struct rsa_public_key * pub, jwa_alg alg, uint8_t * cleartext, size_t cleartext_len, uint8_t * ciphertext, size_t * cyphertext_len) {
+  int ret = RHN_OK;
+  mpz_t gibberish;
+
+  mpz_init(gibberish);
+  if (*cyphertext_len >= pub->size) {
+    if (alg == R_JWA_ALG_RSA_OAEP) {
+      if (!rsaes_oaep_sha1_encrypt(pub, NULL, rnd_nonce_func, 0, NULL, cleartext_len, cleartext, gibberish)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error rsaes_oaep_sha1_encrypt");
+        ret = RHN_ERROR;
+      }
+    } else {
+      if (!rsaes_oaep_sha256_encrypt(pub, NULL, rnd_nonce_func, 0, NULL, cleartext_len, cleartext, gibberish)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error rsaes_oaep_sha256_encrypt");
+        ret = RHN_ERROR;
+      }
+    }
+    if (ret == RHN_OK) {
+      nettle_mpz_get_str_256(pub->size, ciphertext, gibberish);
+      *cyphertext_len = pub->size;
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error cyphertext to small");
+    ret = RHN_ERROR_PARAM;
+  }
+  _r_mpz_clear_secure(gibberish);
+
+  return ret;
+}
+
+static int _r_rsa_oaep_decrypt(const struct rsa_private_key * priv, jwa_alg alg, uint8_t * ciphertext, size_t cyphertext_len, uint8_t * cleartext, size_t * cleartext_len) {
+  int ret = RHN_OK;
   mpz_t gibberish;
 
-  rsa_private_key_init(&priv);
   mpz_init(gibberish);
   nettle_mpz_set_str_256_u(gibberish, cyphertext_len, ciphertext);
-  if (gnutls_privkey_export_rsa_raw(g_priv, &m, &e, &d, &p, &q, &u, &e1, &e2) == GNUTLS_E_SUCCESS) {
-    mpz_import(priv.d, d.size, 1, 1, 0, 0, d.data);
-    mpz_import(priv.p, p.size, 1, 1, 0, 0, p.data);
-    mpz_import(priv.q, q.size, 1, 1, 0, 0, q.data);
-    mpz_import(priv.a, e1.size, 1, 1, 0, 0, e1.data);
-    mpz_import(priv.b, e2.size, 1, 1, 0, 0, e2.data);
-    mpz_import(priv.c, u.size, 1, 1, 0, 0, u.data);
-    rsa_private_key_prepare(&priv);
-    if (cyphertext_len >= priv.size) {
-      if (alg == R_JWA_ALG_RSA_OAEP) {
-        if (!rsaes_oaep_sha1_decrypt(&priv, 0, NULL, cleartext_len, cleartext, gibberish)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_decrypt - Error rsaes_oaep_sha1_decrypt");
-          ret = RHN_ERROR;
-        }
-      } else {
-        if (!rsaes_oaep_sha256_decrypt(&priv, 0, NULL, cleartext_len, cleartext, gibberish)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_decrypt - Error rsaes_oaep_sha256_decrypt");
-          ret = RHN_ERROR;
-        }
+  if (cyphertext_len >= priv->size) {
+    if (alg == R_JWA_ALG_RSA_OAEP) {
+      if (!rsaes_oaep_sha1_decrypt(priv, 0, NULL, cleartext_len, cleartext, gibberish)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_decrypt - Error rsaes_oaep_sha1_decrypt");
+        ret = RHN_ERROR;
       }
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_decrypt - Error cyphertext to small");
-      ret = RHN_ERROR_PARAM;
+      if (!rsaes_oaep_sha256_decrypt(priv, 0, NULL, cleartext_len, cleartext, gibberish)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_decrypt - Error rsaes_oaep_sha256_decrypt");
+        ret = RHN_ERROR;
+      }
     }
-    gnutls_free(m.data);
-    gnutls_free(e.data);
-    gnutls_free(d.data);
-    gnutls_free(p.data);
-    gnutls_free(q.data);
-    gnutls_free(u.data);
-    gnutls_free(e1.data);
-    gnutls_free(e2.data);
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_encrypt - Error gnutls_pubkey_export_rsa_raw");
-    ret = RHN_ERROR;
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_rsa_oaep_decrypt - Error cyphertext to small");
+    ret = RHN_ERROR_PARAM;
   }
-  rsa_private_key_clear(&priv);
   mpz_clear(gibberish);
 
   return ret;
 }
+
+struct _r_rsa_keys {
+  struct rsa_public_key  pub;
+  struct rsa_private_key priv;
+  int                    has_priv;
+};
+
+void * _r_rsa_keys_new(gnutls_privkey_t g_priv, gnutls_pubkey_t g_pub) {
+  struct _r_rsa_keys * keys = NULL;
+
+  if (g_pub != NULL && (keys = o_malloc(sizeof(struct _r_rsa_keys))) != NULL) {
+    rsa_public_key_init(&keys->pub);
+    rsa_private_key_init(&keys->priv);
+    keys->has_priv = 0;
+    if (_r_rsa_import_pubkey(g_pub, &keys->pub) == RHN_OK) {
+      if (g_priv != NULL) {
+        if (_r_rsa_import_privkey(g_priv, &keys->priv) == RHN_OK) {
+          keys->has_priv = 1;
+        } else {
+          _r_rsa_keys_free(keys);
+          keys = NULL;
+        }
+      }
+    } else {
+      _r_rsa_keys_free(keys);
+      keys = NULL;
+    }
+  }
+  return keys;
+}
+
+void _r_rsa_keys_free(void * rsa_keys) {
+  struct _r_rsa_keys * keys = (struct _r_rsa_keys *)rsa_keys;
+
+  if (keys != NULL) {
+    rsa_public_key_clear(&keys->pub);
+    _r_rsa_private_key_clear_secure(&keys->priv);
+    gnutls_memset(keys, 0, sizeof(struct _r_rsa_keys));
+    o_free(keys);
+  }
+}
+#else
+void * _r_rsa_keys_new(gnutls_privkey_t g_priv, gnutls_pubkey_t g_pub) {
+  (void)g_priv;
+  (void)g_pub;
+  return NULL;
+}
+
+void _r_rsa_keys_free(void * rsa_keys) {
+  (void)rsa_keys;
+}
 #endif
 
 // AES KeyWrap
@@ -607,8 +713,8 @@ static json_t * r_jwe_aes_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         break;
       }
       _r_aes_key_wrap(kek, kek_len, jwe->key, jwe->key_len, wrapped_key);
-      if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error o_base64url_encode wrapped_key");
+      if (!_r_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error _r_base64url_encode wrapped_key");
         *ret = RHN_ERROR;
         break;
       }
@@ -653,8 +759,8 @@ static int r_jwe_aes_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_f
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), NULL, &cipherkey_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), NULL, &cipherkey_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -663,8 +769,8 @@ static int r_jwe_aes_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_f
         ret = RHN_ERROR_INVALID;
         break;
       }
-      if (!o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -724,8 +830,8 @@ static int _r_concat_kdf(jwe_t * jwe, jwa_alg alg, const gnutls_datum_t * Z, gnu
     kdf->size += 4+(unsigned int)alg_id_len;
 
     if (!o_strnullempty(apu)) {
-      if (!o_base64url_decode_alloc((const unsigned char *)apu, o_strlen(apu), &dat_apu)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error o_base64url_decode_alloc apu");
+      if (!_r_base64url_decode_alloc((const unsigned char *)apu, o_strlen(apu), &dat_apu)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error _r_base64url_decode_alloc apu");
         ret = RHN_ERROR;
         break;
       }
@@ -747,8 +853,8 @@ static int _r_concat_kdf(jwe_t * jwe, jwa_alg alg, const gnutls_datum_t * Z, gnu
     kdf->size += (unsigned int)dat_apu.size+4;
 
     if (!o_strnullempty(apv)) {
-      if (!o_base64url_decode_alloc((const unsigned char *)apv, o_strlen(apv), &dat_apv)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error o_base64url_decode apv");
+      if (!_r_base64url_decode_alloc((const unsigned char *)apv, o_strlen(apv), &dat_apv)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_concat_kdf - Error _r_base64url_decode apv");
         ret = RHN_ERROR;
         break;
       }
@@ -909,6 +1015,177 @@ static int _r_dh_compute(uint8_t * priv_k, uint8_t * pub_x, size_t crv_size, gnu
   return ret;
 }
 
+/**
+ * Ephemeral key in raw form, big endian d, x and y for NIST curves,
+ * d and x as in the JWK for X25519 and X448
+ */
+struct _r_ecdh_key {
+  uint8_t d[_R_CURVE_MAX_SIZE];
+  uint8_t x[_R_CURVE_MAX_SIZE];
+  uint8_t y[_R_CURVE_MAX_SIZE];
+};
+
+struct _rhn_ecdh_pool {
+  unsigned int         curves;
+  size_t               size;
+  struct _r_ecdh_key * keys[_R_ECDH_POOL_NB_CURVES];
+  size_t               count[_R_ECDH_POOL_NB_CURVES];
+  size_t               nb_hits;
+  size_t               nb_misses;
+  int                  stop;
+  pthread_t            thread;
+  pthread_mutex_t      lock;
+  pthread_cond_t       cond;
+};
+
+/**
+ * Index of the curve in the pool: P-256, P-384, X25519, X448
+ */
+static int _r_ecdh_curve_index(int type, unsigned int bits) {
+  if (type & R_KEY_TYPE_EC) {
+    return bits==256?0:(bits==384?1:-1);
+  } else {
+    return bits==256?2:(bits==448?3:-1);
+  }
+}
+
+static size_t _r_ecdh_curve_size(int index) {
+  switch (index) {
+    case 0:
+      return 32;
+    case 1:
+      return 48;
+    case 2:
+      return CURVE25519_SIZE;
+    default:
+      return CURVE448_SIZE;
+  }
+}
+
+static void _r_ecdh_random(void * ctx, size_t length, uint8_t * dst) {
+  (void)ctx;
+  gnutls_rnd(GNUTLS_RND_KEY, dst, length);
+}
+
+/**
+ * Generate an ephemeral key with nettle, without JWK round trip
+ */
+static int _r_ecdh_generate_key(int index, struct _r_ecdh_key * key) {
+  struct ecc_scalar priv;
+  struct ecc_point pub;
+  mpz_t z_d, z_x, z_y;
+  size_t size = _r_ecdh_curve_size(index);
+  const struct ecc_curve * nettle_curve;
+
+  if (index < 2) {
+    nettle_curve = index?nettle_get_secp_384r1():nettle_get_secp_256r1();
+    mpz_init(z_d);
+    mpz_init(z_x);
+    mpz_init(z_y);
+    ecc_scalar_init(&priv, nettle_curve);
+    ecc_point_init(&pub, nettle_curve);
+    ecc_scalar_random(&priv, NULL, _r_ecdh_random);
+    ecc_point_mul_g(&pub, &priv);
+    ecc_scalar_get(&priv, z_d);
+    ecc_point_get(&pub, z_x, z_y);
+    nettle_mpz_get_str_256(size, key->d, z_d);
+    nettle_mpz_get_str_256(size, key->x, z_x);
+    nettle_mpz_get_str_256(size, key->y, z_y);
+    mpz_clear(z_d);
+    mpz_clear(z_x);
+    mpz_clear(z_y);
+    ecc_scalar_clear(&priv);
+    ecc_point_clear(&pub);
+  } else {
+    if (gnutls_rnd(GNUTLS_RND_KEY, key->d, size)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_generate_key - Error gnutls_rnd");
+      return RHN_ERROR;
+    }
+    if (index == 2) {
+      curve25519_mul_g(key->x, key->d);
+    } else {
+      curve448_mul_g(key->x, key->d);
+    }
+  }
+  return RHN_OK;
+}
+
+/**
+ * Build the epk header value of an ephemeral key
+ */
+static json_t * _r_ecdh_key_to_epk(int index, const struct _r_ecdh_key * key) {
+  unsigned char x_b64url[_R_CURVE_MAX_SIZE*2] = {0}, y_b64url[_R_CURVE_MAX_SIZE*2] = {0};
+  size_t size = _r_ecdh_curve_size(index), x_b64url_len = 0, y_b64url_len = 0;
+  json_t * j_epk = NULL;
+
+  if (_r_base64url_encode(key->x, size, x_b64url, &x_b64url_len)) {
+    if (index < 2) {
+      if (_r_base64url_encode(key->y, size, y_b64url, &y_b64url_len)) {
+        j_epk = json_pack("{ssssss%ss%}", "kty", "EC", "crv", index?"P-384":"P-256", "x", x_b64url, x_b64url_len, "y", y_b64url, y_b64url_len);
+      }
+    } else {
+      j_epk = json_pack("{ssssss%}", "kty", "OKP", "crv", index==2?"X25519":"X448", "x", x_b64url, x_b64url_len);
+    }
+  }
+  if (j_epk == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_ecdh_key_to_epk - Error building epk");
+  }
+  return j_epk;
+}
+
+/**
+ * Take a key from the pool, the key is removed from the pool so it's used once
+ * Returns 0 if the pool has no key left for the curve
+ */
+static int _r_ecdh_pool_take(rhn_ecdh_pool_t * pool, int index, struct _r_ecdh_key * key) {
+  int ret = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count[index]) {
+    pool->count[index]--;
+    memcpy(key, &pool->keys[index][pool->count[index]], sizeof(struct _r_ecdh_key));
+    gnutls_memset(&pool->keys[index][pool->count[index]], 0, sizeof(struct _r_ecdh_key));
+    pool->nb_hits++;
+    pthread_cond_signal(&pool->cond);
+    ret = 1;
+  } else {
+    pool->nb_misses++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return ret;
+}
+
+static void * _r_ecdh_pool_run(void * arg) {
+  rhn_ecdh_pool_t * pool = (rhn_ecdh_pool_t *)arg;
+  struct _r_ecdh_key key;
+  int index, i;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    // Refill the curve with the fewest keys first
+    index = -1;
+    for (i=0; i<_R_ECDH_POOL_NB_CURVES; i++) {
+      if (pool->curves & (1u<<i) && pool->count[i] < pool->size && (index < 0 || pool->count[i] < pool->count[index])) {
+        index = i;
+      }
+    }
+    if (index < 0) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    } else {
+      pthread_mutex_unlock(&pool->lock);
+      i = _r_ecdh_generate_key(index, &key);
+      pthread_mutex_lock(&pool->lock);
+      if (i == RHN_OK && pool->count[index] < pool->size) {
+        memcpy(&pool->keys[index][pool->count[index]], &key, sizeof(struct _r_ecdh_key));
+        pool->count[index]++;
+      }
+      gnutls_memset(&key, 0, sizeof(struct _r_ecdh_key));
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
 static int _r_compare_likely(size_t src, size_t around) {
   return ((around && src == around-1) || src == around || src == around+1);
 }
@@ -916,7 +1193,10 @@ static int _r_compare_likely(size_t src, size_t around) {
 static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, jwk_t * jwk_priv, int type, unsigned int bits, int x5u_flags, int * ret) {
   int type_priv = 0;
   unsigned int bits_priv = 0;
-  jwk_t * jwk_ephemeral = NULL, * jwk_ephemeral_pub = NULL;
+  jwk_t * jwk_ephemeral_pub = NULL;
+  struct _r_ecdh_key ephemeral;
+  json_t * j_epk = NULL;
+  int index = _r_ecdh_curve_index(type, bits);
   gnutls_datum_t Z = {NULL, 0}, kdf = {NULL, 0};
   unsigned char cipherkey_b64url[256] = {0};
   uint8_t derived_key[128] = {0}, wrapped_key[136] = {0}, priv_k[_R_CURVE_MAX_SIZE] = {0}, pub_x[_R_CURVE_MAX_SIZE] = {0}, pub_y[_R_CURVE_MAX_SIZE] = {0};
@@ -927,13 +1207,13 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
   gnutls_ecc_curve_t curve = GNUTLS_ECC_CURVE_INVALID;
 
   do {
-    if (r_jwk_init(&jwk_ephemeral_pub) != RHN_OK) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral_pub");
-      *ret = RHN_ERROR;
-      break;
-    }
-
     if (jwk_priv != NULL) {
+      if (r_jwk_init(&jwk_ephemeral_pub) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral_pub");
+        *ret = RHN_ERROR;
+        break;
+      }
+
       type_priv = r_jwk_key_type(jwk_priv, &bits_priv, x5u_flags);
 
       if (((unsigned int)type_priv & 0xffffff00) != ((unsigned int)type & 0xffffff00)) {
@@ -953,20 +1233,30 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         *ret = RHN_ERROR;
         break;
       }
+      j_epk = r_jwk_export_to_json_t(jwk_ephemeral_pub);
     } else {
-      if (r_jwk_init(&jwk_ephemeral) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_init jwk_ephemeral");
-        *ret = RHN_ERROR;
+      if (index < 0) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error invalid curve");
+        *ret = RHN_ERROR_PARAM;
         break;
       }
 
-      if (r_jwk_generate_key_pair(jwk_ephemeral, jwk_ephemeral_pub, type&R_KEY_TYPE_EC?R_KEY_TYPE_EC:R_KEY_TYPE_ECDH, bits, NULL) != RHN_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error r_jwk_generate_key_pair");
+      // The ephemeral key is taken from the pool if possible, it stays in raw form
+      if ((jwe->ecdh_pool == NULL || !_r_ecdh_pool_take(jwe->ecdh_pool, index, &ephemeral)) && _r_ecdh_generate_key(index, &ephemeral) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_ecdh_generate_key");
         *ret = RHN_ERROR;
         break;
       }
+      priv_k_size = _r_ecdh_curve_size(index);
+      memcpy(priv_k, ephemeral.d, priv_k_size);
+      j_epk = _r_ecdh_key_to_epk(index, &ephemeral);
+      gnutls_memset(&ephemeral, 0, sizeof(struct _r_ecdh_key));
+    }
 
-      r_jwk_delete_property_str(jwk_ephemeral_pub, "kid");
+    if (j_epk == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error exporting epk");
+      *ret = RHN_ERROR;
+      break;
     }
 
     if (type & R_KEY_TYPE_EC) {
@@ -983,30 +1273,28 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
 
       if (jwk_priv != NULL) {
         key = r_jwk_get_property_str(jwk_priv, "d");
-      } else {
-        key = r_jwk_get_property_str(jwk_ephemeral, "d");
-      }
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (ecdsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (ecdsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (ecdsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (ecdsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
+        if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (ecdsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
       }
 
       key = r_jwk_get_property_str(jwk_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1017,15 +1305,15 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_pub, "y");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode y (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1036,8 +1324,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode y (ecdsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1058,37 +1346,35 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
 
       if (jwk_priv != NULL) {
         key = r_jwk_get_property_str(jwk_priv, "d");
-      } else {
-        key = r_jwk_get_property_str(jwk_ephemeral, "d");
-      }
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!priv_k_size || priv_k_size > _R_CURVE_MAX_SIZE) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Invalid priv_k_size (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode d (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
-      }
+        if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode d (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
 
-      if (!_r_compare_likely(priv_k_size, (size_t)gnutls_ecc_curve_get_size(curve))) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error invalid priv_k_size (eddsa)");
-        *ret = RHN_ERROR_PARAM;
-        break;
+        if (!_r_compare_likely(priv_k_size, (size_t)gnutls_ecc_curve_get_size(curve))) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error invalid priv_k_size (eddsa)");
+          *ret = RHN_ERROR_PARAM;
+          break;
+        }
       }
 
       pub_x_size = CURVE448_SIZE;
       key = r_jwk_get_property_str(jwk_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (eddsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1099,8 +1385,8 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_decode x (eddsa)");
         *ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1138,27 +1424,28 @@ static json_t * _r_jwe_ecdh_encrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk_pub, j
       r_jwe_set_cypher_key(jwe, derived_key, derived_key_len);
       o_free(jwe->encrypted_key_b64url);
       jwe->encrypted_key_b64url = NULL;
-      j_return = json_pack("{s{ss so}}", "header",
+      j_return = json_pack("{s{ss sO}}", "header",
                                            "alg", r_jwa_alg_to_str(alg),
-                                           "epk", r_jwk_export_to_json_t(jwk_ephemeral_pub));
+                                           "epk", j_epk);
     } else {
       _r_aes_key_wrap(derived_key, derived_key_len, jwe->key, jwe->key_len, wrapped_key);
-      if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error o_base64url_encode wrapped_key");
+      if (!_r_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_encrypt - Error _r_base64url_encode wrapped_key");
         *ret = RHN_ERROR;
       }
       o_free(jwe->encrypted_key_b64url);
       jwe->encrypted_key_b64url = (unsigned char *)o_strndup((const char *)cipherkey_b64url, cipherkey_b64url_len);
-      j_return = json_pack("{ss%s{ss so}}", "encrypted_key", cipherkey_b64url, cipherkey_b64url_len,
+      j_return = json_pack("{ss%s{ss sO}}", "encrypted_key", cipherkey_b64url, cipherkey_b64url_len,
                                              "header",
                                                "alg", r_jwa_alg_to_str(alg),
-                                               "epk", r_jwk_export_to_json_t(jwk_ephemeral_pub));
+                                               "epk", j_epk);
     }
   } while (0);
 
   o_free(kdf.data);
   gnutls_free(Z.data);
-  r_jwk_free(jwk_ephemeral);
+  gnutls_memset(priv_k, 0, sizeof(priv_k));
+  json_decref(j_epk);
   r_jwk_free(jwk_ephemeral_pub);
 
   return j_return;
@@ -1214,8 +1501,8 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
       }
 
       key = r_jwk_get_property_str(jwk, "d");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode d (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1226,15 +1513,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode d (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_ephemeral_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1245,15 +1532,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_ephemeral_pub, "y");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode y (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1264,8 +1551,8 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode y (ecdsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_y, &pub_y_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode y (ecdsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1290,8 +1577,8 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
       }
 
       key = r_jwk_get_property_str(jwk, "d");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), priv_k, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode d (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1302,15 +1589,15 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode d (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &priv_k_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode d (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
 
       key = r_jwk_get_property_str(jwk_ephemeral_pub, "x");
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), pub_x, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1321,8 +1608,8 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
         break;
       }
 
-      if (!o_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode x (eddsa)");
+      if (!_r_base64url_decode((const unsigned char *)key, o_strlen(key), NULL, &pub_x_size)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode x (eddsa)");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1353,7 +1640,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
     if (alg == R_JWA_ALG_ECDH_ES) {
       r_jwe_set_cypher_key(jwe, derived_key, derived_key_len);
     } else {
-      if (o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
+      if (_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
         if (_r_aes_key_unwrap(derived_key, derived_key_len, key_data, cipherkey_len-8, cipherkey)) {
           r_jwe_set_cypher_key(jwe, key_data, cipherkey_len-8);
         } else {
@@ -1361,7 +1648,7 @@ static int _r_jwe_ecdh_decrypt(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int type,
           break;
         }
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error o_base64url_decode cipherkey");
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_ecdh_decrypt - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR;
         break;
       }
@@ -1402,8 +1689,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         }
       }
       if ((p2s = r_jwe_get_header_str_value(jwe, "p2s")) != NULL) {
-        if (!o_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error o_base64url_decode_alloc p2s");
+        if (!_r_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error _r_base64url_decode_alloc p2s");
           *ret = RHN_ERROR_PARAM;
           break;
         }
@@ -1433,8 +1720,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
           *ret = RHN_ERROR_MEMORY;
           break;
         }
-        if (!o_base64url_encode(salt_seed, _R_PBES_DEFAULT_SALT_LENGTH, salt_seed_b64, &salt_seed_b64_len)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error o_base64url_encode salt_seed");
+        if (!_r_base64url_encode(salt_seed, _R_PBES_DEFAULT_SALT_LENGTH, salt_seed_b64, &salt_seed_b64_len)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_wrap - Error _r_base64url_encode salt_seed");
           *ret = RHN_ERROR;
           break;
         }
@@ -1489,8 +1776,8 @@ static json_t * r_jwe_pbes2_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         break;
       }
       _r_aes_key_wrap(kek, kek_len, jwe->key, jwe->key_len, wrapped_key);
-      if (!o_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error o_base64url_encode wrapped_key");
+      if (!_r_base64url_encode(wrapped_key, jwe->key_len+8, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aes_key_wrap - Error _r_base64url_encode wrapped_key");
         *ret = RHN_ERROR;
         break;
       }
@@ -1537,8 +1824,8 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         break;
       }
       p2s = r_jwe_get_header_str_value(jwe, "p2s");
-      if (!o_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error o_base64url_decode_alloc p2s");
+      if (!_r_base64url_decode_alloc((const unsigned char *)p2s, o_strlen(p2s), &dat_dec)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error _r_base64url_decode_alloc p2s");
         ret = RHN_ERROR_PARAM;
         break;
       }
@@ -1587,8 +1874,8 @@ static int r_jwe_pbes2_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), cipherkey, &cipherkey_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_pbes2_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR;
         break;
       }
@@ -1704,14 +1991,14 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
           *ret = RHN_ERROR;
           break;
         }
-        if (!o_base64url_encode_alloc(iv, iv_size, &dat_iv_enc)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_encode_alloc iv");
+        if (!_r_base64url_encode_alloc(iv, iv_size, &dat_iv_enc)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_encode_alloc iv");
           *ret = RHN_ERROR;
           break;
         }
       } else {
-        if (!o_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv_dec)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_decode iv");
+        if (!_r_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv_dec)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_decode iv");
           *ret = RHN_ERROR_PARAM;
           break;
         }
@@ -1742,8 +2029,8 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         *ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_encode(cipherkey, jwe->key_len, cipherkey_b64url, &cipherkey_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_encode cipherkey");
+      if (!_r_base64url_encode(cipherkey, jwe->key_len, cipherkey_b64url, &cipherkey_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_encode cipherkey");
         *ret = RHN_ERROR;
         break;
       }
@@ -1752,8 +2039,8 @@ static json_t * r_jwe_aesgcm_key_wrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
         *ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error o_base64url_encode tag");
+      if (!_r_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_wrap - Error _r_base64url_encode tag");
         *ret = RHN_ERROR;
         break;
       }
@@ -1898,8 +2185,8 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error o_base64url_decode iv");
+      if (!_r_base64url_decode_alloc((const unsigned char *)r_jwe_get_header_str_value(jwe, "iv"), o_strlen(r_jwe_get_header_str_value(jwe, "iv")), &dat_iv)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error _r_base64url_decode iv");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -1908,8 +2195,8 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         ret = RHN_ERROR_INVALID;
         break;
       }
-      if (!o_base64url_decode_alloc((const unsigned char *)jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat_key)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error o_base64url_decode cipherkey");
+      if (!_r_base64url_decode_alloc((const unsigned char *)jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat_key)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error _r_base64url_decode cipherkey");
         ret = RHN_ERROR_INVALID;
         break;
       }
@@ -1932,8 +2219,8 @@ static int r_jwe_aesgcm_key_unwrap(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5
         ret = RHN_ERROR;
         break;
       }
-      if (!o_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error o_base64url_encode tag");
+      if (!_r_base64url_encode(tag, tag_len, tag_b64url, &tag_b64url_len)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_aesgcm_key_unwrap - Error _r_base64url_encode tag");
         ret = RHN_ERROR;
         break;
       }
@@ -2116,8 +2403,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
         } else {
           apu = json_string_value(json_object_get(j_header, "apu"));
           if (!o_strnullempty(apu)) {
-            if (!o_base64url_decode((const unsigned char *)apu, o_strlen(apu), NULL, &apu_size)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode_alloc apu");
+            if (!_r_base64url_decode((const unsigned char *)apu, o_strlen(apu), NULL, &apu_size)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode_alloc apu");
               ret = RHN_ERROR_PARAM;
             }
           } else {
@@ -2134,8 +2421,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
         } else {
           apv = json_string_value(json_object_get(j_header, "apv"));
           if (!o_strnullempty(apv)) {
-            if (!o_base64url_decode((const unsigned char *)apv, o_strlen(apv), NULL, &apv_size)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode apv");
+            if (!_r_base64url_decode((const unsigned char *)apv, o_strlen(apv), NULL, &apv_size)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode apv");
               ret = RHN_ERROR_PARAM;
             }
           } else {
@@ -2153,8 +2440,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       } else {
         iv = json_string_value(json_object_get(j_header, "iv"));
         if (!o_strnullempty(iv)) {
-          if (!o_base64url_decode((const unsigned char *)iv, o_strlen(iv), NULL, &iv_size) || iv_size != 12) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode iv");
+          if (!_r_base64url_decode((const unsigned char *)iv, o_strlen(iv), NULL, &iv_size) || iv_size != 12) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode iv");
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2169,8 +2456,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       } else {
         tag = json_string_value(json_object_get(j_header, "tag"));
         if (!o_strnullempty(tag)) {
-          if (!o_base64url_decode((const unsigned char *)tag, o_strlen(tag), NULL, &tag_size) || tag_size != 16) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode tag %zu", tag_size);
+          if (!_r_base64url_decode((const unsigned char *)tag, o_strlen(tag), NULL, &tag_size) || tag_size != 16) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode tag %zu", tag_size);
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2187,8 +2474,8 @@ static int r_jwe_extract_header(jwe_t * jwe, json_t * j_header, uint32_t parse_f
       } else {
         p2s = json_string_value(json_object_get(j_header, "p2s"));
         if (!o_strnullempty(p2s)) {
-          if (!o_base64url_decode((const unsigned char *)p2s, o_strlen(p2s), NULL, &p2s_size) || p2s_size < 8) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error o_base64url_decode p2s");
+          if (!_r_base64url_decode((const unsigned char *)p2s, o_strlen(p2s), NULL, &p2s_size) || p2s_size < 8) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_extract_header - Error _r_base64url_decode p2s");
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2233,45 +2520,39 @@ static void r_jwe_remove_padding(unsigned char * text, size_t * text_len, unsign
 
 static int r_jwe_compute_hmac_tag(jwe_t * jwe, unsigned char * ciphertext, size_t cyphertext_len, const unsigned char * aad, unsigned char * tag, size_t * tag_len) {
   int ret, res;
-  unsigned char al[8], * compute_hmac = NULL;
+  unsigned char al[8];
   uint64_t aad_len;
-  size_t hmac_size = 0, aad_size = o_strlen((const char *)aad), i;
+  size_t aad_size = o_strlen((const char *)aad), i;
   gnutls_mac_algorithm_t mac = r_jwe_get_digest_from_enc(jwe->enc);
+  gnutls_hmac_hd_t hmac;
 
-  aad_len = (uint64_t)(o_strlen((const char *)aad)*8);
-  memset(al, 0, 8);
+  aad_len = (uint64_t)(aad_size*8);
   for(i = 0; i < 8; i++) {
     al[i] = (uint8_t)((aad_len >> 8*(7 - i)) & 0xFF);
   }
 
-  if ((compute_hmac = o_malloc(aad_size+jwe->iv_len+cyphertext_len+8)) != NULL) {
-    if (aad_size) {
-      memcpy(compute_hmac, aad, aad_size);
-      hmac_size += aad_size;
-    }
-    memcpy(compute_hmac+hmac_size, jwe->iv, jwe->iv_len);
-    hmac_size += jwe->iv_len;
-    memcpy(compute_hmac+hmac_size, ciphertext, cyphertext_len);
-    hmac_size += cyphertext_len;
-    memcpy(compute_hmac+hmac_size, al, 8);
-    hmac_size += 8;
-
-    if (!(res = gnutls_hmac_fast(mac, jwe->key, jwe->key_len/2, compute_hmac, hmac_size, tag))) {
+  // The MAC key is the first half of the CEK, which is different for each token,
+  // the input AAD || IV || ciphertext || AL is fed to the MAC without being concatenated
+  if (!(res = gnutls_hmac_init(&hmac, mac, jwe->key, jwe->key_len/2))) {
+    if ((!aad_size || !(res = gnutls_hmac(hmac, aad, aad_size))) &&
+        !(res = gnutls_hmac(hmac, jwe->iv, jwe->iv_len)) &&
+        !(res = gnutls_hmac(hmac, ciphertext, cyphertext_len)) &&
+        !(res = gnutls_hmac(hmac, al, 8))) {
       *tag_len = (unsigned)gnutls_hmac_get_len(mac)/2;
       ret = RHN_OK;
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac_fast: '%s'", gnutls_strerror(res));
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac: '%s'", gnutls_strerror(res));
       ret = RHN_ERROR;
     }
-    o_free(compute_hmac);
+    gnutls_hmac_deinit(hmac, tag);
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error allocating resources for compute_hmac");
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compute_hmac_tag - Error gnutls_hmac_init: '%s'", gnutls_strerror(res));
     ret = RHN_ERROR;
   }
   return ret;
 }
 
-static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_flags, int * ret) {
+static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, jwk_prepared_t * prepared, int x5u_flags, int * ret) {
   json_t * j_return = NULL;
   int res;
   unsigned int bits = 0;
@@ -2285,6 +2566,9 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
 #if NETTLE_VERSION_NUMBER >= 0x030400
   uint8_t * cyphertext = NULL;
   size_t cyphertext_len = 0;
+  struct rsa_public_key rsa_pub;
+  const struct rsa_public_key * pub = NULL;
+  struct _r_rsa_keys * rsa_keys = NULL;
 #endif
 #if NETTLE_VERSION_NUMBER >= 0x030600
   json_t * jwk_priv = NULL;
@@ -2300,12 +2584,12 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
           plainkey.data = jwe->key;
           plainkey.size = (unsigned int)jwe->key_len;
           if (!(res = gnutls_pubkey_encrypt_data(g_pub, 0, &plainkey, &cypherkey))) {
-            if (o_base64url_encode_alloc(cypherkey.data, cypherkey.size, &dat)) {
+            if (_r_base64url_encode_alloc(cypherkey.data, cypherkey.size, &dat)) {
               j_return = json_pack("{ss%s{ss}}", "encrypted_key", dat.data, dat.size, "header", "alg", r_jwa_alg_to_str(alg));
               o_free(dat.data);
               dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error o_base64url_encode cypherkey_b64");
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error _r_base64url_encode cypherkey_b64");
               *ret = RHN_ERROR;
             }
             gnutls_free(cypherkey.data);
@@ -2326,21 +2610,30 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
 #if NETTLE_VERSION_NUMBER >= 0x030400
     case R_JWA_ALG_RSA_OAEP:
     case R_JWA_ALG_RSA_OAEP_256:
-      res = r_jwk_key_type(jwk, &bits, x5u_flags);
+      if (prepared != NULL) {
+        res = r_jwk_prepared_key_type(prepared, &bits);
+      } else {
+        res = r_jwk_key_type(jwk, &bits, x5u_flags);
+      }
       if (res & R_KEY_TYPE_RSA && bits >= 2048) {
-        if (jwk != NULL && (g_pub = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags)) != NULL) {
+        rsa_public_key_init(&rsa_pub);
+        if (prepared != NULL && (rsa_keys = _r_jwk_prepared_get_rsa(prepared)) != NULL) {
+          pub = &rsa_keys->pub;
+        } else if (jwk != NULL && (g_pub = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags)) != NULL && _r_rsa_import_pubkey(g_pub, &rsa_pub) == RHN_OK) {
+          pub = &rsa_pub;
+        }
+        if (pub != NULL) {
           if ((cyphertext = o_malloc(bits+1)) != NULL) {
             cyphertext_len = bits+1;
-            if (_r_rsa_oaep_encrypt(g_pub, alg, jwe->key, jwe->key_len, cyphertext, &cyphertext_len) == RHN_OK) {
-              if (o_base64url_encode_alloc(cyphertext, cyphertext_len, &dat)) {
+            if (_r_rsa_oaep_encrypt(pub, alg, jwe->key, jwe->key_len, cyphertext, &cyphertext_len) == RHN_OK) {
+              if (_r_base64url_encode_alloc(cyphertext, cyphertext_len, &dat)) {
                 j_return = json_pack("{ss%s{ss}}", "encrypted_key", dat.data, dat.size, "header", "alg", r_jwa_alg_to_str(alg));
                 o_free(dat.data);
                 dat.data = NULL;
               } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error o_base64url_encode cypherkey_b64");
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error _r_base64url_encode cypherkey_b64");
                 *ret = RHN_ERROR;
               }
-              gnutls_free(cypherkey.data);
             } else {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error _r_rsa_oaep_encrypt");
               *ret = RHN_ERROR;
@@ -2355,6 +2648,7 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
           *ret = RHN_ERROR;
         }
         gnutls_pubkey_deinit(g_pub);
+        rsa_public_key_clear(&rsa_pub);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_perform_key_encryption - Error invalid key type (rsa oaep)");
         *ret = RHN_ERROR_PARAM;
@@ -2479,7 +2773,7 @@ static json_t * r_jwe_perform_key_encryption(jwe_t * jwe, jwa_alg alg, jwk_t * j
   return j_return;
 }
 
-static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int x5u_flags) {
+static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, jwk_prepared_t * prepared, int x5u_flags) {
   int ret, res;
   gnutls_datum_t plainkey = {NULL, 0}, cypherkey;
   gnutls_privkey_t g_priv = NULL;
@@ -2490,6 +2784,9 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
 #if NETTLE_VERSION_NUMBER >= 0x030400
   uint8_t * clearkey = NULL;
   size_t clearkey_len = 0;
+  struct rsa_private_key rsa_priv;
+  const struct rsa_private_key * priv = NULL;
+  struct _r_rsa_keys * rsa_keys = NULL;
 #endif
 
   switch (alg) {
@@ -2497,7 +2794,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
       res = r_jwk_key_type(jwk, &bits, x5u_flags);
       if (res & R_KEY_TYPE_RSA && res & R_KEY_TYPE_PRIVATE && bits >= 2048) {
         if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = r_jwk_export_to_gnutls_privkey(jwk)) != NULL) {
-            if (o_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
+            if (_r_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
               cypherkey.size = (unsigned int)dat.size;
               cypherkey.data = dat.data;
               if (!(res = gnutls_privkey_decrypt_data(g_priv, 0, &cypherkey, &plainkey))) {
@@ -2517,7 +2814,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
               o_free(dat.data);
               dat.data = NULL;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error o_base64url_decode_alloc encrypted_key_b64url");
+              y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error _r_base64url_decode_alloc encrypted_key_b64url");
               ret = RHN_ERROR_PARAM;
             }
         } else {
@@ -2533,13 +2830,25 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
 #if NETTLE_VERSION_NUMBER >= 0x030400
     case R_JWA_ALG_RSA_OAEP:
     case R_JWA_ALG_RSA_OAEP_256:
-      res = r_jwk_key_type(jwk, &bits, x5u_flags);
+      if (prepared != NULL) {
+        res = r_jwk_prepared_key_type(prepared, &bits);
+      } else {
+        res = r_jwk_key_type(jwk, &bits, x5u_flags);
+      }
       if (res & R_KEY_TYPE_RSA && res & R_KEY_TYPE_PRIVATE && bits >= 2048) {
-        if (jwk != NULL && !o_strnullempty((const char *)jwe->encrypted_key_b64url) && (g_priv = r_jwk_export_to_gnutls_privkey(jwk)) != NULL) {
-          if (o_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
+        rsa_private_key_init(&rsa_priv);
+        if (o_strnullempty((const char *)jwe->encrypted_key_b64url)) {
+          priv = NULL;
+        } else if (prepared != NULL && (rsa_keys = _r_jwk_prepared_get_rsa(prepared)) != NULL && rsa_keys->has_priv) {
+          priv = &rsa_keys->priv;
+        } else if (jwk != NULL && (g_priv = r_jwk_export_to_gnutls_privkey(jwk)) != NULL && _r_rsa_import_privkey(g_priv, &rsa_priv) == RHN_OK) {
+          priv = &rsa_priv;
+        }
+        if (priv != NULL) {
+          if (_r_base64url_decode_alloc(jwe->encrypted_key_b64url, o_strlen((const char *)jwe->encrypted_key_b64url), &dat)) {
             if ((clearkey = o_malloc(bits+1)) != NULL) {
               clearkey_len = bits+1;
-              if (_r_rsa_oaep_decrypt(g_priv, alg, dat.data, dat.size, clearkey, &clearkey_len) == RHN_OK) {
+              if (_r_rsa_oaep_decrypt(priv, alg, dat.data, dat.size, clearkey, &clearkey_len) == RHN_OK) {
                 if (_r_get_key_size(jwe->enc) == clearkey_len) {
                   if (r_jwe_set_cypher_key(jwe, clearkey, clearkey_len) == RHN_OK) {
                     ret = RHN_OK;
@@ -2551,6 +2860,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
                   y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error invalid key length");
                   ret = RHN_ERROR_PARAM;
                 }
+                gnutls_memset(clearkey, 0, clearkey_len);
               } else {
                 y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error _r_rsa_oaep_decrypt");
                 ret = RHN_ERROR_INVALID;
@@ -2563,7 +2873,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
             o_free(dat.data);
             dat.data = NULL;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error o_base64url_decode_alloc encrypted_key_b64url");
+            y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error _r_base64url_decode_alloc encrypted_key_b64url");
             ret = RHN_ERROR_PARAM;
           }
         } else {
@@ -2571,6 +2881,7 @@ static int _r_preform_key_decryption(jwe_t * jwe, jwa_alg alg, jwk_t * jwk, int
           ret = RHN_ERROR_PARAM;
         }
         gnutls_privkey_deinit(g_priv);
+        _r_rsa_private_key_clear_secure(&rsa_priv);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "_r_preform_key_decryption - Error invalid key size RSA_OAEP");
         ret = RHN_ERROR_INVALID;
@@ -2715,6 +3026,8 @@ int r_jwe_init(jwe_t ** jwe) {
             (*jwe)->payload_len = 0;
             (*jwe)->j_json_serialization = NULL;
             (*jwe)->token_mode = R_JSON_MODE_COMPACT;
+            memset((*jwe)->spare_b64url, 0, sizeof((*jwe)->spare_b64url));
+            (*jwe)->ecdh_pool = NULL;
             ret = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_init - Error allocating resources for jwks_privkey");
@@ -2743,6 +3056,8 @@ int r_jwe_init(jwe_t ** jwe) {
 }
 
 void r_jwe_free(jwe_t * jwe) {
+  size_t i;
+
   if (jwe != NULL) {
     r_jwks_free(jwe->jwks_privkey);
     r_jwks_free(jwe->jwks_pubkey);
@@ -2759,10 +3074,53 @@ void r_jwe_free(jwe_t * jwe) {
     o_free(jwe->iv);
     o_free(jwe->aad);
     o_free(jwe->payload);
+    for (i=0; i<6; i++) {
+      o_free(jwe->spare_b64url[i]);
+    }
     o_free(jwe);
   }
 }
 
+int r_jwe_reset(jwe_t * jwe) {
+  int ret;
+
+  if (jwe != NULL) {
+    r_jwks_empty(jwe->jwks_privkey);
+    r_jwks_empty(jwe->jwks_pubkey);
+    json_object_clear(jwe->j_header);
+    json_decref(jwe->j_unprotected_header);
+    jwe->j_unprotected_header = NULL;
+    json_decref(jwe->j_json_serialization);
+    jwe->j_json_serialization = NULL;
+    _r_spare_keep(&jwe->spare_b64url[0], &jwe->header_b64url);
+    _r_spare_keep(&jwe->spare_b64url[1], &jwe->encrypted_key_b64url);
+    _r_spare_keep(&jwe->spare_b64url[2], &jwe->aad_b64url);
+    _r_spare_keep(&jwe->spare_b64url[3], &jwe->iv_b64url);
+    _r_spare_keep(&jwe->spare_b64url[4], &jwe->ciphertext_b64url);
+    _r_spare_keep(&jwe->spare_b64url[5], &jwe->auth_tag_b64url);
+    o_free(jwe->key);
+    jwe->key = NULL;
+    jwe->key_len = 0;
+    o_free(jwe->iv);
+    jwe->iv = NULL;
+    jwe->iv_len = 0;
+    o_free(jwe->aad);
+    jwe->aad = NULL;
+    jwe->aad_len = 0;
+    o_free(jwe->payload);
+    jwe->payload = NULL;
+    jwe->payload_len = 0;
+    jwe->alg = R_JWA_ALG_UNKNOWN;
+    jwe->enc = R_JWA_ENC_UNKNOWN;
+    jwe->token_mode = R_JSON_MODE_COMPACT;
+    jwe->ecdh_pool = NULL;
+    ret = RHN_OK;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 jwe_t * r_jwe_copy(jwe_t * jwe) {
   jwe_t * jwe_copy = NULL;
 
@@ -2771,6 +3129,7 @@ jwe_t * r_jwe_copy(jwe_t * jwe) {
       jwe_copy->alg = jwe->alg;
       jwe_copy->enc = jwe->enc;
       jwe_copy->token_mode = jwe->token_mode;
+      jwe_copy->ecdh_pool = jwe->ecdh_pool;
       if (r_jwe_set_payload(jwe_copy, jwe->payload, jwe->payload_len) == RHN_OK &&
           r_jwe_set_iv(jwe_copy, jwe->iv, jwe->iv_len) == RHN_OK &&
           r_jwe_set_aad(jwe_copy, jwe->aad, jwe->aad_len) == RHN_OK &&
@@ -2906,13 +3265,13 @@ int r_jwe_set_iv(jwe_t * jwe, const unsigned char * iv, size_t iv_len) {
       if ((jwe->iv = o_malloc(iv_len)) != NULL) {
         memcpy(jwe->iv, iv, iv_len);
         jwe->iv_len = iv_len;
-        if (o_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
+        if (_r_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
           o_free(jwe->iv_b64url);
           jwe->iv_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
           o_free(dat.data);
           ret = RHN_OK;
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_iv - Error o_base64url_encode_alloc iv");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_iv - Error _r_base64url_encode_alloc iv");
           ret = RHN_ERROR;
         }
         ret = RHN_OK;
@@ -2953,13 +3312,13 @@ int r_jwe_set_aad(jwe_t * jwe, const unsigned char * aad, size_t aad_len) {
       if ((jwe->aad = o_malloc(aad_len)) != NULL) {
         memcpy(jwe->aad, aad, aad_len);
         jwe->aad_len = aad_len;
-        if (o_base64url_encode_alloc(jwe->aad, jwe->aad_len, &dat)) {
+        if (_r_base64url_encode_alloc(jwe->aad, jwe->aad_len, &dat)) {
           o_free(jwe->aad_b64url);
           jwe->aad_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
           o_free(dat.data);
           ret = RHN_OK;
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_aad - Error o_base64url_encode_alloc aad");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_set_aad - Error _r_base64url_encode_alloc aad");
           ret = RHN_ERROR;
         }
         ret = RHN_OK;
@@ -3001,12 +3360,12 @@ int r_jwe_generate_iv(jwe_t * jwe) {
     if (jwe->iv_len) {
       if ((jwe->iv = o_malloc(jwe->iv_len)) != NULL) {
         if (!gnutls_rnd(GNUTLS_RND_NONCE, jwe->iv, jwe->iv_len)) {
-          if (o_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
+          if (_r_base64url_encode_alloc(jwe->iv, jwe->iv_len, &dat)) {
             jwe->iv_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
             o_free(dat.data);
             ret = RHN_OK;
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_generate_iv - Error o_base64url_encode iv_b64");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_generate_iv - Error _r_base64url_encode iv_b64");
             ret = RHN_ERROR;
           }
         } else {
@@ -3027,6 +3386,129 @@ int r_jwe_generate_iv(jwe_t * jwe) {
   return ret;
 }
 
+int r_ecdh_pool_init(rhn_ecdh_pool_t ** pool, unsigned int curves, size_t size) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  int ret = RHN_OK, i;
+
+  if (pool != NULL && curves && !(curves & ~(unsigned int)R_ECDH_POOL_ALL) && size) {
+    if ((*pool = o_malloc(sizeof(rhn_ecdh_pool_t))) != NULL) {
+      memset(*pool, 0, sizeof(rhn_ecdh_pool_t));
+      (*pool)->curves = curves;
+      (*pool)->size = size;
+      for (i=0; i<_R_ECDH_POOL_NB_CURVES && ret == RHN_OK; i++) {
+        if (curves & (1u<<i) && ((*pool)->keys[i] = o_malloc(size*sizeof(struct _r_ecdh_key))) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_ecdh_pool_init - Error allocating resources for keys");
+          ret = RHN_ERROR_MEMORY;
+        }
+      }
+      if (ret == RHN_OK) {
+        if (!pthread_mutex_init(&(*pool)->lock, NULL)) {
+          if (!pthread_cond_init(&(*pool)->cond, NULL)) {
+            if (pthread_create(&(*pool)->thread, NULL, _r_ecdh_pool_run, *pool)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_ecdh_pool_init - Error pthread_create");
+              pthread_cond_destroy(&(*pool)->cond);
+              pthread_mutex_destroy(&(*pool)->lock);
+              ret = RHN_ERROR;
+            }
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_ecdh_pool_init - Error pthread_cond_init");
+            pthread_mutex_destroy(&(*pool)->lock);
+            ret = RHN_ERROR;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_ecdh_pool_init - Error pthread_mutex_init");
+          ret = RHN_ERROR;
+        }
+      }
+      if (ret != RHN_OK) {
+        for (i=0; i<_R_ECDH_POOL_NB_CURVES; i++) {
+          o_free((*pool)->keys[i]);
+        }
+        o_free(*pool);
+        *pool = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_ecdh_pool_init - Error allocating resources for pool");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+#else
+  (void)(pool);
+  (void)(curves);
+  (void)(size);
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+void r_ecdh_pool_free(rhn_ecdh_pool_t * pool) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  int i;
+
+  if (pool != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    for (i=0; i<_R_ECDH_POOL_NB_CURVES; i++) {
+      if (pool->keys[i] != NULL) {
+        gnutls_memset(pool->keys[i], 0, pool->size*sizeof(struct _r_ecdh_key));
+        o_free(pool->keys[i]);
+      }
+    }
+    o_free(pool);
+  }
+#else
+  (void)(pool);
+#endif
+}
+
+int r_ecdh_pool_get_stats(rhn_ecdh_pool_t * pool, size_t * nb_available, size_t * nb_hits, size_t * nb_misses) {
+#if NETTLE_VERSION_NUMBER >= 0x030600
+  int i;
+
+  if (pool != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    if (nb_available != NULL) {
+      *nb_available = 0;
+      for (i=0; i<_R_ECDH_POOL_NB_CURVES; i++) {
+        *nb_available += pool->count[i];
+      }
+    }
+    if (nb_hits != NULL) {
+      *nb_hits = pool->nb_hits;
+    }
+    if (nb_misses != NULL) {
+      *nb_misses = pool->nb_misses;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+#else
+  (void)(pool);
+  (void)(nb_available);
+  (void)(nb_hits);
+  (void)(nb_misses);
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+int r_jwe_set_ecdh_pool(jwe_t * jwe, rhn_ecdh_pool_t * pool) {
+  if (jwe != NULL) {
+    jwe->ecdh_pool = pool;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwe_set_alg(jwe_t * jwe, jwa_alg alg) {
   int ret = RHN_OK;
 
@@ -3441,13 +3923,13 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
     cipher_cbc = (jwe->enc == R_JWA_ENC_A128CBC || jwe->enc == R_JWA_ENC_A192CBC || jwe->enc == R_JWA_ENC_A256CBC);
 
     if ((str_header = json_dumps(jwe->j_header, JSON_COMPACT)) != NULL) {
-      if (o_base64url_encode_alloc((const unsigned char *)str_header, o_strlen(str_header), &dat)) {
+      if (_r_base64url_encode_alloc((const unsigned char *)str_header, o_strlen(str_header), &dat)) {
         o_free(jwe->header_b64url);
         jwe->header_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
         o_free(dat.data);
         dat.data = NULL;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode str_header");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_base64url_encode str_header");
         ret = RHN_ERROR;
       }
       o_free(str_header);
@@ -3498,11 +3980,11 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
         if (ret == RHN_OK) {
           if (!(res = gnutls_cipher_encrypt(handle, ptext, ptext_len))) {
             if ((ciphertext_b64url = o_malloc(2*ptext_len)) != NULL) {
-              if (o_base64url_encode(ptext, ptext_len, ciphertext_b64url, &ciphertext_b64url_len)) {
+              if (_r_base64url_encode(ptext, ptext_len, ciphertext_b64url, &ciphertext_b64url_len)) {
                 o_free(jwe->ciphertext_b64url);
                 jwe->ciphertext_b64url = (unsigned char *)o_strndup((const char *)ciphertext_b64url, ciphertext_b64url_len);
               } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode ciphertext");
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_base64url_encode ciphertext");
                 ret = RHN_ERROR;
               }
             } else {
@@ -3534,13 +4016,13 @@ int r_jwe_encrypt_payload(jwe_t * jwe) {
           }
           if (ret == RHN_OK && tag_len) {
             if ((tag_b64url = o_malloc(tag_len*2)) != NULL) {
-              if (o_base64url_encode_alloc(tag, tag_len, &dat)) {
+              if (_r_base64url_encode_alloc(tag, tag_len, &dat)) {
                 o_free(jwe->auth_tag_b64url);
                 jwe->auth_tag_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
                 o_free(dat.data);
                 dat.data = NULL;
               } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error o_base64url_encode tag_b64url");
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_payload - Error _r_base64url_encode tag_b64url");
                 ret = RHN_ERROR;
               }
               o_free(tag_b64url);
@@ -3602,7 +4084,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
      * if the cipher is a block-mode cipher
      */
     if (_r_gnutls_is_block_cipher(_r_get_alg_from_enc(jwe->enc))) {
-      if (o_base64url_decode(jwe->ciphertext_b64url, ciphertext_b64_len, NULL, &ciphertext_decoded_len)) {
+      if (_r_base64url_decode(jwe->ciphertext_b64url, ciphertext_b64_len, NULL, &ciphertext_decoded_len)) {
         cipher_block_size = (unsigned)gnutls_cipher_get_block_size(_r_get_alg_from_enc(jwe->enc));
         if (!ciphertext_decoded_len || ciphertext_decoded_len % cipher_block_size) {
           /* The ciphertext length is not a multiple of block size.
@@ -3611,7 +4093,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
           ret = RHN_ERROR_INVALID;
         }
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode ciphertext_b64url");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_base64url_decode ciphertext_b64url");
         ret = RHN_ERROR;
       }
     }
@@ -3619,17 +4101,17 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
     if (ret == RHN_OK) {
       // Decode iv and payload_b64
       o_free(jwe->iv);
-      if (o_base64url_decode_alloc(jwe->iv_b64url, o_strlen((const char *)jwe->iv_b64url), &dat)) {
+      if (_r_base64url_decode_alloc(jwe->iv_b64url, o_strlen((const char *)jwe->iv_b64url), &dat)) {
         if ((jwe->iv = o_malloc(dat.size)) != NULL) {
           jwe->iv_len = dat.size;
           memcpy(jwe->iv, dat.data, dat.size);
-          if (o_base64url_decode_alloc(jwe->ciphertext_b64url, ciphertext_b64_len, &dat_ciph)) {
+          if (_r_base64url_decode_alloc(jwe->ciphertext_b64url, ciphertext_b64_len, &dat_ciph)) {
             if ((payload_enc = o_malloc(dat_ciph.size)) == NULL) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error allocating resources for payload_enc");
               ret = RHN_ERROR_MEMORY;
             }
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode_alloc ciphertext_b64url");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_base64url_decode_alloc ciphertext_b64url");
             ret = RHN_ERROR;
           }
         } else {
@@ -3638,7 +4120,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
         }
         o_free(dat.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_decode_alloc iv");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_base64url_decode_alloc iv");
         ret = RHN_ERROR;
       }
     }
@@ -3711,14 +4193,14 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
             }
           }
           if (ret == RHN_OK && tag_len) {
-            if (o_base64url_encode_alloc(tag, tag_len, &dat_tag)) {
+            if (_r_base64url_encode_alloc(tag, tag_len, &dat_tag)) {
               if (dat_tag.size != o_strlen((const char *)jwe->auth_tag_b64url) || 0 != memcmp(dat_tag.data, jwe->auth_tag_b64url, dat_tag.size)) {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Invalid tag");
                 ret = RHN_ERROR_INVALID;
               }
               o_free(dat_tag.data);
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error o_base64url_encode_alloc tag");
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_decrypt_payload - Error _r_base64url_encode_alloc tag");
               ret = RHN_ERROR;
             }
           }
@@ -3742,7 +4224,7 @@ int r_jwe_decrypt_payload(jwe_t * jwe) {
   return ret;
 }
 
-int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
+static int _r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, jwk_prepared_t * prepared, int x5u_flags) {
   int ret, res = RHN_OK;
   jwk_t * jwk = NULL;
   jwa_alg alg;
@@ -3768,7 +4250,7 @@ int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
     if ((kid = r_jwk_get_property_str(jwk, "kid")) != NULL && r_jwe_get_header_str_value(jwe, "kid") == NULL) {
       r_jwe_set_header_str_value(jwe, "kid", kid);
     }
-    if ((j_header = r_jwe_perform_key_encryption(jwe, jwe->alg, jwk, x5u_flags, &res)) != NULL) {
+    if ((j_header = r_jwe_perform_key_encryption(jwe, jwe->alg, jwk, prepared, x5u_flags, &res)) != NULL) {
       j_cur_header = r_jwe_get_full_header_json_t(jwe);
       json_object_update(j_cur_header, json_object_get(j_header, "header"));
       r_jwe_set_full_header_json_t(jwe, j_cur_header);
@@ -3778,11 +4260,11 @@ int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
       json_decref(j_header);
       ret = RHN_OK;
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_key - Error r_jwe_perform_key_encryption");
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_encrypt_key - Error r_jwe_perform_key_encryption");
       ret = res;
     }
   } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_encrypt_key - invalid input parameters");
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwe_encrypt_key - invalid input parameters");
     ret = RHN_ERROR_PARAM;
   }
 
@@ -3790,32 +4272,39 @@ int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
   return ret;
 }
 
-int r_jwe_decrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
+int r_jwe_encrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
+  return _r_jwe_encrypt_key(jwe, jwk_s, NULL, x5u_flags);
+}
+
+static int _r_jwe_decrypt_key(jwe_t * jwe, jwk_t * jwk_s, jwk_prepared_t * prepared, int x5u_flags) {
   int ret;
   jwk_t * jwk = NULL;
 
   if (jwe != NULL) {
     if (jwk_s != NULL) {
-      jwk = r_jwk_copy(jwk_s);
+      jwk = jwk_s;
     } else {
       if (r_jwe_get_header_str_value(jwe, "kid") != NULL) {
-        jwk = r_jwks_get_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
+        jwk = r_jwks_peek_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
       } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
-        jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
+        jwk = r_jwks_peek_at(jwe->jwks_privkey, 0);
       }
     }
   }
 
   if (jwe != NULL && jwe->alg != R_JWA_ALG_UNKNOWN && jwe->alg != R_JWA_ALG_NONE) {
-    ret = _r_preform_key_decryption(jwe, jwe->alg, jwk, x5u_flags);
+    ret = _r_preform_key_decryption(jwe, jwe->alg, jwk, prepared, x5u_flags);
   } else {
     ret = RHN_ERROR_PARAM;
   }
 
-  r_jwk_free(jwk);
   return ret;
 }
 
+int r_jwe_decrypt_key(jwe_t * jwe, jwk_t * jwk_s, int x5u_flags) {
+  return _r_jwe_decrypt_key(jwe, jwk_s, NULL, x5u_flags);
+}
+
 int r_jwe_parse(jwe_t * jwe, const char * jwe_str, int x5u_flags) {
   return r_jwe_parsen(jwe, jwe_str, o_strlen(jwe_str), x5u_flags);
 }
@@ -3884,26 +4373,37 @@ int r_jwe_advanced_compact_parse(jwe_t * jwe, const char * jwe_str, uint32_t par
 
 int r_jwe_advanced_compact_parsen(jwe_t * jwe, const char * jwe_str, size_t jwe_str_len, uint32_t parse_flags, int x5u_flags) {
   int ret;
-  char ** str_array = NULL;
-  char * token = NULL;
-  size_t cypher_key_len = 0, cypher_len = 0, tag_len = 0;
+  size_t offsets[5] = {0, 0, 0, 0, 0}, lengths[5] = {0, 0, 0, 0, 0}, header_len = 0, iv_len = 0, cypher_key_len = 0, cypher_len = 0, tag_len = 0;
+  const unsigned char * token = (const unsigned char *)jwe_str;
   json_t * j_header = NULL;
-  struct _o_datum dat_header = {0, NULL}, dat_iv = {0, NULL};
+  unsigned char * data = NULL;
 
   if (jwe != NULL && jwe_str != NULL && jwe_str_len) {
-    token = o_strndup(jwe_str, jwe_str_len);
-    if (split_string(token, ".", &str_array) == 5 && !o_strnullempty(str_array[0]) && !o_strnullempty(str_array[2]) && !o_strnullempty(str_array[3]) && !o_strnullempty(str_array[4])) {
+    if (_r_split_compact_token(jwe_str, jwe_str_len, offsets, lengths, 5) == 5 && lengths[0] && lengths[2] && lengths[3] && lengths[4]) {
       // Check if all elements 0, 2 and 3 are base64url encoded
-      if (o_base64url_decode_alloc((unsigned char *)str_array[0], o_strlen(str_array[0]), &dat_header) &&
-         (o_strnullempty(str_array[1]) || o_base64url_decode((unsigned char *)str_array[1], o_strlen(str_array[1]), NULL, &cypher_key_len)) &&
-          o_base64url_decode_alloc((unsigned char *)str_array[2], o_strlen(str_array[2]), &dat_iv) &&
-          o_base64url_decode((unsigned char *)str_array[3], o_strlen(str_array[3]), NULL, &cypher_len) &&
-          o_base64url_decode((unsigned char *)str_array[4], o_strlen(str_array[4]), NULL, &tag_len)) {
+      if (_r_base64url_decode(token+offsets[0], lengths[0], NULL, &header_len) &&
+         (!lengths[1] || _r_base64url_decode(token+offsets[1], lengths[1], NULL, &cypher_key_len)) &&
+          _r_base64url_decode(token+offsets[2], lengths[2], NULL, &iv_len) &&
+          _r_base64url_decode(token+offsets[3], lengths[3], NULL, &cypher_len) &&
+          _r_base64url_decode(token+offsets[4], lengths[4], NULL, &tag_len)) {
         ret = RHN_OK;
         jwe->token_mode = R_JSON_MODE_COMPACT;
         do {
+          // Decode header and iv in the same buffer
+          if ((data = o_malloc(header_len+iv_len+1)) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error allocating resources for data");
+            ret = RHN_ERROR_MEMORY;
+            break;
+          }
+          if (!_r_base64url_decode(token+offsets[0], lengths[0], data, &header_len) ||
+              !_r_base64url_decode(token+offsets[2], lengths[2], data+header_len, &iv_len)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error decoding header or iv");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+
           // Decode header
-          if ((j_header = json_loadb((const char *)dat_header.data, dat_header.size, JSON_DECODE_ANY, NULL)) == NULL) {
+          if ((j_header = json_loadb((const char *)data, header_len, JSON_DECODE_ANY, NULL)) == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error json_loadb dat_header");
             ret = RHN_ERROR_PARAM;
             break;
@@ -3919,37 +4419,35 @@ int r_jwe_advanced_compact_parsen(jwe_t * jwe, const char * jwe_str, size_t jwe_
           jwe->j_header = json_incref(j_header);
 
           // Decode iv
-          if (r_jwe_set_iv(jwe, dat_iv.data, dat_iv.size) != RHN_OK) {
+          if (r_jwe_set_iv(jwe, data+header_len, iv_len) != RHN_OK) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_compact_parsen - Error r_jwe_set_iv");
             ret = RHN_ERROR;
             break;
           }
 
+          // The strings kept by r_jwe_reset are used if they're large enough
           o_free(jwe->header_b64url);
-          jwe->header_b64url = (unsigned char *)o_strdup(str_array[0]);
+          jwe->header_b64url = _r_spare_strndup(&jwe->spare_b64url[0], jwe_str+offsets[0], lengths[0]);
           o_free(jwe->aad_b64url);
-          jwe->aad_b64url = (unsigned char *)o_strdup(str_array[0]);
+          jwe->aad_b64url = _r_spare_strndup(&jwe->spare_b64url[2], jwe_str+offsets[0], lengths[0]);
           o_free(jwe->encrypted_key_b64url);
-          jwe->encrypted_key_b64url = (unsigned char *)o_strdup(str_array[1]);
+          jwe->encrypted_key_b64url = _r_spare_strndup(&jwe->spare_b64url[1], jwe_str+offsets[1], lengths[1]);
           o_free(jwe->iv_b64url);
-          jwe->iv_b64url = (unsigned char *)o_strdup(str_array[2]);
+          jwe->iv_b64url = _r_spare_strndup(&jwe->spare_b64url[3], jwe_str+offsets[2], lengths[2]);
           o_free(jwe->ciphertext_b64url);
-          jwe->ciphertext_b64url = (unsigned char *)o_strdup(str_array[3]);
+          jwe->ciphertext_b64url = _r_spare_strndup(&jwe->spare_b64url[4], jwe_str+offsets[3], lengths[3]);
           o_free(jwe->auth_tag_b64url);
-          jwe->auth_tag_b64url = (unsigned char *)o_strdup(str_array[4]);
+          jwe->auth_tag_b64url = _r_spare_strndup(&jwe->spare_b64url[5], jwe_str+offsets[4], lengths[4]);
 
         } while (0);
         json_decref(j_header);
+        o_free(data);
       } else {
         ret = RHN_ERROR_PARAM;
       }
-      o_free(dat_header.data);
-      o_free(dat_iv.data);
     } else {
       ret = RHN_ERROR_PARAM;
     }
-    free_string_array(str_array);
-    o_free(token);
   } else {
     ret = RHN_ERROR_PARAM;
   }
@@ -4036,7 +4534,7 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
           break;
         }
 
-        if (!o_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "protected")), json_string_length(json_object_get(jwe_json, "protected")), &dat_header)) {
+        if (!_r_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "protected")), json_string_length(json_object_get(jwe_json, "protected")), &dat_header)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error invalid protected base64");
           ret = RHN_ERROR_PARAM;
           break;
@@ -4058,8 +4556,8 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
         jwe->j_header = json_incref(j_header);
 
         // Decode iv
-        if (!o_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "iv")), json_string_length(json_object_get(jwe_json, "iv")), &dat_iv)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error o_base64url_decode_alloc iv");
+        if (!_r_base64url_decode_alloc((unsigned char *)json_string_value(json_object_get(jwe_json, "iv")), json_string_length(json_object_get(jwe_json, "iv")), &dat_iv)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error _r_base64url_decode_alloc iv");
           ret = RHN_ERROR_PARAM;
           break;
         }
@@ -4087,7 +4585,7 @@ int r_jwe_advanced_parse_json_t(jwe_t * jwe, json_t * jwe_json, uint32_t parse_f
               ret = RHN_ERROR_PARAM;
               break;
             } else {
-              if (!o_base64url_decode((const unsigned char*)json_string_value(json_object_get(j_recipient, "encrypted_key")), json_string_length(json_object_get(j_recipient, "encrypted_key")), NULL, &cypher_key_len)) {
+              if (!_r_base64url_decode((const unsigned char*)json_string_value(json_object_get(j_recipient, "encrypted_key")), json_string_length(json_object_get(j_recipient, "encrypted_key")), NULL, &cypher_key_len)) {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwe_parse_json_t - Error at index %zu, invalid encrypted_key base64 %s", index);
                 ret = RHN_ERROR_PARAM;
                 break;
@@ -4142,7 +4640,7 @@ jwe_t * r_jwe_quick_parsen(const char * jwe_str, size_t jwe_str_len, uint32_t pa
   return jwe;
 }
 
-int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
+static int _r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, jwk_prepared_t * prepared, int x5u_flags) {
   int ret, res;
   json_t * j_recipient = NULL, * j_header, * j_cur_header;
   size_t index = 0, i;
@@ -4151,12 +4649,12 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
 
   if (jwe != NULL) {
     if (jwk_privkey != NULL) {
-      jwk = r_jwk_copy(jwk_privkey);
+      jwk = jwk_privkey;
     } else {
       if (r_jwe_get_header_str_value(jwe, "kid") != NULL) {
-        jwk = r_jwks_get_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
+        jwk = r_jwks_peek_by_kid(jwe->jwks_privkey, r_jwe_get_header_str_value(jwe, "kid"));
       } else if (r_jwks_size(jwe->jwks_privkey) == 1) {
-        jwk = r_jwks_get_at(jwe->jwks_privkey, 0);
+        jwk = r_jwks_peek_at(jwe->jwks_privkey, 0);
       }
     }
   }
@@ -4182,29 +4680,25 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
         if (alg != R_JWA_ALG_UNKNOWN && alg != R_JWA_ALG_ECDH_ES) {
           if (jwk_privkey != NULL) {
             if (r_jwk_get_property_str(jwk_privkey, "kid") == NULL || json_object_get(json_object_get(j_recipient, "header"), "kid") == NULL || 0 == o_strcmp(json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")), r_jwk_get_property_str(jwk_privkey, "kid"))) {
-              if ((res = _r_preform_key_decryption(jwe, alg, jwk_privkey, x5u_flags)) != RHN_ERROR_INVALID) {
+              if ((res = _r_preform_key_decryption(jwe, alg, jwk_privkey, prepared, x5u_flags)) != RHN_ERROR_INVALID) {
                 ret = res;
                 break;
               }
             }
           } else {
             if (json_object_get(json_object_get(j_recipient, "header"), "kid") != NULL) {
-              cur_jwk = r_jwks_get_by_kid(jwe->jwks_privkey, json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")));
-              if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags)) != RHN_ERROR_INVALID) {
+              cur_jwk = r_jwks_peek_by_kid(jwe->jwks_privkey, json_string_value(json_object_get(json_object_get(j_recipient, "header"), "kid")));
+              if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, NULL, x5u_flags)) != RHN_ERROR_INVALID) {
                 ret = res;
-                r_jwk_free(cur_jwk);
                 break;
               }
-              r_jwk_free(cur_jwk);
             } else {
               for (i=0; i<r_jwks_size(jwe->jwks_privkey); i++) {
-                cur_jwk = r_jwks_get_at(jwe->jwks_privkey, i);
-                if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, x5u_flags)) != RHN_ERROR_INVALID) {
+                cur_jwk = r_jwks_peek_at(jwe->jwks_privkey, i);
+                if ((res = _r_preform_key_decryption(jwe, alg, cur_jwk, NULL, x5u_flags)) != RHN_ERROR_INVALID) {
                   ret = res;
-                  r_jwk_free(cur_jwk);
                   break;
                 }
-                r_jwk_free(cur_jwk);
               }
               if (ret != RHN_ERROR_INVALID) {
                 break;
@@ -4234,7 +4728,7 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
       }
       r_jwe_set_full_header_json_t(jwe, j_cur_header);
       json_decref(j_cur_header);
-      if ((res = r_jwe_decrypt_key(jwe, jwk, x5u_flags)) == RHN_OK && (res = r_jwe_decrypt_payload(jwe)) == RHN_OK) {
+      if ((res = _r_jwe_decrypt_key(jwe, jwk, prepared, x5u_flags)) == RHN_OK && (res = r_jwe_decrypt_payload(jwe)) == RHN_OK) {
         ret = RHN_OK;
       } else {
         if (res != RHN_ERROR_INVALID) {
@@ -4248,11 +4742,22 @@ int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
   } else {
     ret = RHN_ERROR_PARAM;
   }
-  r_jwk_free(jwk);
   return ret;
 }
 
-char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
+int r_jwe_decrypt(jwe_t * jwe, jwk_t * jwk_privkey, int x5u_flags) {
+  return _r_jwe_decrypt(jwe, jwk_privkey, NULL, x5u_flags);
+}
+
+int r_jwe_decrypt_prepared(jwe_t * jwe, jwk_prepared_t * key) {
+  if (key != NULL) {
+    return _r_jwe_decrypt(jwe, _r_jwk_prepared_get_jwk(key), key, 0);
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+static char * _r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, jwk_prepared_t * prepared, int x5u_flags) {
   char * jwe_str = NULL;
   int res = RHN_OK;
   unsigned int bits = 0;
@@ -4296,7 +4801,7 @@ char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
       }
     }
   }
-  if (res == RHN_OK && r_jwe_set_alg_header(jwe, jwe->j_header) == RHN_OK && r_jwe_encrypt_key(jwe, jwk_pubkey, x5u_flags) == RHN_OK && r_jwe_encrypt_payload(jwe) == RHN_OK) {
+  if (res == RHN_OK && r_jwe_set_alg_header(jwe, jwe->j_header) == RHN_OK && _r_jwe_encrypt_key(jwe, jwk_pubkey, prepared, x5u_flags) == RHN_OK && r_jwe_encrypt_payload(jwe) == RHN_OK) {
     jwe_str = msprintf("%s.%s.%s.%s.%s",
                       jwe->header_b64url,
                       jwe->encrypted_key_b64url!=NULL?(const char *)jwe->encrypted_key_b64url:"",
@@ -4310,6 +4815,18 @@ char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
   return jwe_str;
 }
 
+char * r_jwe_serialize(jwe_t * jwe, jwk_t * jwk_pubkey, int x5u_flags) {
+  return _r_jwe_serialize(jwe, jwk_pubkey, NULL, x5u_flags);
+}
+
+char * r_jwe_serialize_prepared(jwe_t * jwe, jwk_prepared_t * key) {
+  if (jwe != NULL && key != NULL) {
+    return _r_jwe_serialize(jwe, _r_jwk_prepared_get_jwk(key), key, 0);
+  } else {
+    return NULL;
+  }
+}
+
 char * r_jwe_serialize_json_str(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags, int mode) {
   json_t * j_result = r_jwe_serialize_json_t(jwe, jwks_pubkey, x5u_flags, mode);
   char * str_result = json_dumps(j_result, JSON_COMPACT);
@@ -4354,7 +4871,7 @@ json_t * r_jwe_serialize_json_t(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags
         }
       }
       if (res == RHN_OK) {
-        if ((j_result = r_jwe_perform_key_encryption(jwe, alg, jwk, x5u_flags, &res)) != NULL) {
+        if ((j_result = r_jwe_perform_key_encryption(jwe, alg, jwk, NULL, x5u_flags, &res)) != NULL) {
           if (r_jwe_encrypt_payload(jwe) == RHN_OK) {
             if ((kid = r_jwe_get_header_str_value(jwe, "kid")) == NULL) {
               kid = r_jwk_get_property_str(jwk, "kid");
@@ -4419,7 +4936,7 @@ json_t * r_jwe_serialize_json_t(jwe_t * jwe, jwks_t * jwks_pubkey, int x5u_flags
           alg = r_str_to_jwa_alg(r_jwk_get_property_str(jwk, "alg"));
         }
         if (alg != R_JWA_ALG_UNKNOWN && alg != R_JWA_ALG_ECDH_ES) {
-          if ((j_result = r_jwe_perform_key_encryption(jwe, alg, jwk, x5u_flags, &res)) != NULL) {
+          if ((j_result = r_jwe_perform_key_encryption(jwe, alg, jwk, NULL, x5u_flags, &res)) != NULL) {
             if (json_object_get(jwe->j_header, "kid") == NULL && json_object_get(jwe->j_unprotected_header, "kid") == NULL) {
               json_object_set_new(json_object_get(j_result, "header"), "kid", json_string(r_jwk_get_property_str(jwk, "kid")));
             }
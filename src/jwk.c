@@ -43,6 +43,18 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
 #include <nettle/curve448.h>
 #endif
 
+struct _jwk_prepared {
+  jwk_t            * jwk;
+  int                type;
+  unsigned int       bits;
+  gnutls_privkey_t   privkey;
+  gnutls_pubkey_t    pubkey;
+  unsigned char    * key;
+  size_t             key_len;
+  void             * rsa;  // RSA-OAEP keys, see _r_rsa_keys_new
+  void            ** hmac; // Keyed HMAC states of HS256, HS384 and HS512
+};
+
 int r_jwk_init(jwk_t ** jwk) {
   int ret;
   if (jwk != NULL) {
@@ -231,7 +243,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid x");
           ret = RHN_ERROR_PARAM;
         } else if (json_string_length(json_object_get(jwk, "x"))) {
-          if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), NULL, &b64dec_len) || !b64dec_len) {
+          if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), NULL, &b64dec_len) || !b64dec_len) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid x format");
             ret = RHN_ERROR_PARAM;
           }
@@ -240,7 +252,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid y");
           ret = RHN_ERROR_PARAM;
         } else if (json_string_length(json_object_get(jwk, "y"))) {
-          if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "y")), json_string_length(json_object_get(jwk, "y")), NULL, &b64dec_len) || !b64dec_len) {
+          if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "y")), json_string_length(json_object_get(jwk, "y")), NULL, &b64dec_len) || !b64dec_len) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid y format");
             ret = RHN_ERROR_PARAM;
           }
@@ -250,7 +262,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d");
             ret = RHN_ERROR_PARAM;
           } else {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d format");
               ret = RHN_ERROR_PARAM;
             }
@@ -271,7 +283,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid x");
           ret = RHN_ERROR_PARAM;
         } else if (json_string_length(json_object_get(jwk, "x"))) {
-          if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), NULL, &b64dec_len) || !b64dec_len) {
+          if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), NULL, &b64dec_len) || !b64dec_len) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid x format");
             ret = RHN_ERROR_PARAM;
           }
@@ -281,7 +293,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d");
             ret = RHN_ERROR_PARAM;
           } else {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d format");
               ret = RHN_ERROR_PARAM;
             }
@@ -293,7 +305,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid n");
           ret = RHN_ERROR_PARAM;
         } else if (json_string_length(json_object_get(jwk, "n"))) {
-          if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), NULL, &b64dec_len) || !b64dec_len) {
+          if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), NULL, &b64dec_len) || !b64dec_len) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid n format");
             ret = RHN_ERROR_PARAM;
           }
@@ -302,7 +314,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid e");
           ret = RHN_ERROR_PARAM;
         } else if (json_string_length(json_object_get(jwk, "e"))) {
-          if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "e")), json_string_length(json_object_get(jwk, "e")), NULL, &b64dec_len) || !b64dec_len) {
+          if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "e")), json_string_length(json_object_get(jwk, "e")), NULL, &b64dec_len) || !b64dec_len) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid e format");
             ret = RHN_ERROR_PARAM;
           }
@@ -312,7 +324,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d");
             ret = RHN_ERROR_PARAM;
           } else {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d format");
               ret = RHN_ERROR_PARAM;
             }
@@ -324,7 +336,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid p");
             ret = RHN_ERROR_PARAM;
           } else if (has_privkey_parameters) {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "p")), json_string_length(json_object_get(jwk, "p")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "p")), json_string_length(json_object_get(jwk, "p")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid d format");
               ret = RHN_ERROR_PARAM;
             }
@@ -335,7 +347,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid q");
             ret = RHN_ERROR_PARAM;
           } else if (has_privkey_parameters) {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "q")), json_string_length(json_object_get(jwk, "q")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "q")), json_string_length(json_object_get(jwk, "q")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid q format");
               ret = RHN_ERROR_PARAM;
             }
@@ -346,7 +358,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid dp");
             ret = RHN_ERROR_PARAM;
           } else if (has_privkey_parameters) {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "dp")), json_string_length(json_object_get(jwk, "dp")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "dp")), json_string_length(json_object_get(jwk, "dp")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid dp format");
               ret = RHN_ERROR_PARAM;
             }
@@ -357,7 +369,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid dq");
             ret = RHN_ERROR_PARAM;
           } else if (has_privkey_parameters) {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "dq")), json_string_length(json_object_get(jwk, "dq")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "dq")), json_string_length(json_object_get(jwk, "dq")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid dq format");
               ret = RHN_ERROR_PARAM;
             }
@@ -368,7 +380,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid qi");
             ret = RHN_ERROR_PARAM;
           } else if (has_privkey_parameters) {
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "qi")), json_string_length(json_object_get(jwk, "qi")), NULL, &b64dec_len) || !b64dec_len) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "qi")), json_string_length(json_object_get(jwk, "qi")), NULL, &b64dec_len) || !b64dec_len) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid qi format");
               ret = RHN_ERROR_PARAM;
             }
@@ -382,7 +394,7 @@ int r_jwk_is_valid(jwk_t * jwk) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid k");
           ret = RHN_ERROR_PARAM;
         } else {
-          if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "k")), json_string_length(json_object_get(jwk, "k")), NULL, &b64dec_len) || !b64dec_len) {
+          if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "k")), json_string_length(json_object_get(jwk, "k")), NULL, &b64dec_len) || !b64dec_len) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_is_valid - Invalid k format");
             ret = RHN_ERROR_PARAM;
           }
@@ -405,7 +417,8 @@ int r_jwk_is_valid_x5u(jwk_t * jwk, int x5u_flags) {
   jwk_t * jwk_x5u = NULL;
 
   if (r_jwk_is_valid(jwk) == RHN_OK && r_jwk_get_property_str(jwk, "x5u") != NULL) {
-    type = r_jwk_key_type(jwk, NULL, x5u_flags);
+    // The x5u certificate is downloaded once by r_jwk_import_from_x5u
+    type = r_jwk_key_type(jwk, NULL, x5u_flags|R_FLAG_IGNORE_REMOTE);
     if (type & R_KEY_TYPE_RSA) {
       if (r_jwk_init(&jwk_x5u) == RHN_OK) {
         if (r_jwk_import_from_x5u(jwk_x5u, x5u_flags, r_jwk_get_property_str(jwk, "x5u")) == RHN_OK) {
@@ -565,7 +578,7 @@ int r_jwk_generate_key_pair(jwk_t * jwk_privkey, jwk_t * jwk_pubkey, int type, u
 #if NETTLE_VERSION_NUMBER >= 0x030600
                   if (type == R_KEY_TYPE_ECDH) {
                     d_b64 = (const unsigned char *)r_jwk_get_property_str(jwk_privkey, "d");
-                    if (o_base64url_decode(d_b64, o_strlen((const char *)d_b64), d_ecdh, &d_ecdh_size)) {
+                    if (_r_base64url_decode(d_b64, o_strlen((const char *)d_b64), d_ecdh, &d_ecdh_size)) {
                       ret = RHN_OK;
                       if (bits == 256) {
                         r_jwk_set_property_str(jwk_privkey, "crv", "X25519");
@@ -582,16 +595,16 @@ int r_jwk_generate_key_pair(jwk_t * jwk_privkey, jwk_t * jwk_pubkey, int type, u
                         ret = RHN_ERROR;
                       }
                       if (ret == RHN_OK) {
-                        if (o_base64url_encode(x_ecdh, bits==256?CURVE25519_SIZE:CURVE448_SIZE, x_ecdh_b64, &x_ecdh_b64_size)) {
+                        if (_r_base64url_encode(x_ecdh, bits==256?CURVE25519_SIZE:CURVE448_SIZE, x_ecdh_b64, &x_ecdh_b64_size)) {
                           x_ecdh_b64[x_ecdh_b64_size] = '\0';
                           r_jwk_set_property_str(jwk_pubkey, "x", (const char *)x_ecdh_b64);
                         } else {
-                          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_generate_key_pair - Error o_base64url_encode ECDH");
+                          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_generate_key_pair - Error _r_base64url_encode ECDH");
                           ret = RHN_ERROR;
                         }
                       }
                     } else {
-                      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_generate_key_pair - Error o_base64url_decode ECDH");
+                      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_generate_key_pair - Error _r_base64url_decode ECDH");
                       ret = RHN_ERROR;
                     }
                   } else {
@@ -637,13 +650,94 @@ int r_jwk_generate_key_pair(jwk_t * jwk_privkey, jwk_t * jwk_pubkey, int type, u
   return ret;
 }
 
+/**
+ * Returns 1 if the public key is available only from its x5u url
+ */
+static int _r_jwk_is_x5u_only(jwk_t * jwk) {
+  return json_object_get(jwk, "x5u") != NULL &&
+         json_object_get(jwk, "n") == NULL &&
+         json_object_get(jwk, "x") == NULL &&
+         json_array_get(json_object_get(jwk, "x5c"), 0) == NULL &&
+         0 != o_strcmp(json_string_value(json_object_get(jwk, "kty")), "oct");
+}
+
+/**
+ * Downloads the x5u certificate and imports it in crt
+ * Return RHN_ERROR_INVALID if the certificate can't be imported
+ */
+static int _r_jwk_get_x5u_crt(jwk_t * jwk, int x5u_flags, gnutls_x509_crt_t * crt) {
+  int ret;
+  char * x5u_content = NULL;
+  gnutls_datum_t data;
+
+  *crt = NULL;
+  if ((x5u_content = _r_get_http_content(json_string_value(json_object_get(jwk, "x5u")), x5u_flags, NULL)) != NULL) {
+    if (!gnutls_x509_crt_init(crt)) {
+      data.data = (unsigned char *)x5u_content;
+      data.size = (unsigned int)o_strlen(x5u_content);
+      if (!gnutls_x509_crt_import(*crt, &data, GNUTLS_X509_FMT_PEM)) {
+        ret = RHN_OK;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwk_get_x5u_crt - Error gnutls_x509_crt_import");
+        gnutls_x509_crt_deinit(*crt);
+        *crt = NULL;
+        ret = RHN_ERROR_INVALID;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwk_get_x5u_crt - Error gnutls_x509_crt_init");
+      *crt = NULL;
+      ret = RHN_ERROR;
+    }
+    o_free(x5u_content);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwk_get_x5u_crt - Error getting x5u content");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Checks that the certificate public key algorithm matches the key type
+ * Returns type if it matches, R_KEY_TYPE_NONE otherwise
+ */
+static int _r_jwk_check_crt_type(gnutls_x509_crt_t crt, int type, unsigned int * bits, const char * source) {
+  int pk_alg = gnutls_x509_crt_get_pk_algorithm(crt, bits);
+
+  if ((type&R_KEY_TYPE_RSA)) {
+    if (pk_alg != GNUTLS_PK_RSA) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type %s - Invalid %s type, expected RSA", source, source);
+      type = R_KEY_TYPE_NONE;
+    }
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+  } else if ((type&R_KEY_TYPE_EC)) {
+    if (pk_alg != GNUTLS_PK_ECDSA) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type %s - Invalid %s type, expected EC", source, source);
+      type = R_KEY_TYPE_NONE;
+    }
+  } else if ((type&R_KEY_TYPE_EDDSA)) {
+#if GNUTLS_VERSION_NUMBER >= 0x03060e
+    if (pk_alg != GNUTLS_PK_EDDSA_ED25519 && pk_alg != GNUTLS_PK_EDDSA_ED448)
+#else
+    if (pk_alg != GNUTLS_PK_EDDSA_ED25519)
+#endif
+    {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type %s - Invalid %s type, expected OKP", source, source);
+      type = R_KEY_TYPE_NONE;
+    }
+#endif
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type %s - Error unsupported algorithm %s", source, gnutls_pk_algorithm_get_name((gnutls_pk_algorithm_t)pk_alg));
+    type = R_KEY_TYPE_NONE;
+  }
+  return type;
+}
+
 int r_jwk_key_type(jwk_t * jwk, unsigned int * bits, int x5u_flags) {
   gnutls_x509_crt_t     crt = NULL;
   gnutls_datum_t        data;
-  int ret = R_KEY_TYPE_NONE, pk_alg;
+  int ret = R_KEY_TYPE_NONE, res;
   size_t k_len = 0;
   int bits_set = 0, has_values = 0;
-  char * x5u_content = NULL;
   struct _o_datum dat = {0, NULL};
 
   if (r_jwk_is_valid(jwk) == RHN_OK) {
@@ -692,34 +786,8 @@ int r_jwk_key_type(jwk_t * jwk, unsigned int * bits, int x5u_flags) {
             data.size = (unsigned int)dat.size;
             if (!gnutls_x509_crt_init(&crt)) {
               if (!gnutls_x509_crt_import(crt, &data, GNUTLS_X509_FMT_DER)) {
-                pk_alg = gnutls_x509_crt_get_pk_algorithm(crt, bits);
+                ret = _r_jwk_check_crt_type(crt, ret, bits, "x5c");
                 bits_set = 1;
-                if ((ret&R_KEY_TYPE_RSA)) {
-                  if (pk_alg != GNUTLS_PK_RSA) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5c - Invalid x5c type, expected RSA");
-                    ret = R_KEY_TYPE_NONE;
-                  }
-#if GNUTLS_VERSION_NUMBER >= 0x030600
-                } else if ((ret&R_KEY_TYPE_EC)) {
-                  if (pk_alg != GNUTLS_PK_ECDSA) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5c - Invalid x5c type, expected EC");
-                    ret = R_KEY_TYPE_NONE;
-                  }
-                } else if ((ret&R_KEY_TYPE_EDDSA)) {
-#if GNUTLS_VERSION_NUMBER >= 0x03060e
-                  if (pk_alg != GNUTLS_PK_EDDSA_ED25519 && pk_alg != GNUTLS_PK_EDDSA_ED448)
-#else
-                  if (pk_alg != GNUTLS_PK_EDDSA_ED25519)
-#endif
-                  {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5c - Invalid x5c type, expected OKP");
-                    ret = R_KEY_TYPE_NONE;
-                  }
-#endif
-                } else {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5c - Error unsupported algorithm %s", gnutls_pk_algorithm_get_name((gnutls_pk_algorithm_t)pk_alg));
-                  ret = R_KEY_TYPE_NONE;
-                }
                 ret |= R_KEY_TYPE_PUBLIC;
               } else {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5c - Error gnutls import");
@@ -739,51 +807,13 @@ int r_jwk_key_type(jwk_t * jwk, unsigned int * bits, int x5u_flags) {
       if (json_object_get(jwk, "x5u") != NULL) {
         if (!(x5u_flags & R_FLAG_IGNORE_REMOTE)) {
           // Get first x5u
-          if ((x5u_content = _r_get_http_content(json_string_value(json_object_get(jwk, "x5u")), x5u_flags, NULL)) != NULL) {
-            data.data = (unsigned char *)x5u_content;
-            data.size = (unsigned int)o_strlen(x5u_content);
-            if (!gnutls_x509_crt_init(&crt)) {
-              if (!gnutls_x509_crt_import(crt, &data, GNUTLS_X509_FMT_PEM)) {
-                pk_alg = gnutls_x509_crt_get_pk_algorithm(crt, bits);
-                bits_set = 1;
-                if ((ret&R_KEY_TYPE_RSA)) {
-                  if (pk_alg != GNUTLS_PK_RSA) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5u - Invalid x5u type, expected RSA");
-                    ret = R_KEY_TYPE_NONE;
-                  }
-#if GNUTLS_VERSION_NUMBER >= 0x030600
-                } else if ((ret&R_KEY_TYPE_EC)) {
-                  if (pk_alg != GNUTLS_PK_ECDSA) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5u - Invalid x5u type, expected EC");
-                    ret = R_KEY_TYPE_NONE;
-                  }
-                } else if ((ret&R_KEY_TYPE_EDDSA)) {
-#if GNUTLS_VERSION_NUMBER >= 0x03060e
-                  if (pk_alg != GNUTLS_PK_EDDSA_ED25519 && pk_alg != GNUTLS_PK_EDDSA_ED448)
-#else
-                  if (pk_alg != GNUTLS_PK_EDDSA_ED25519)
-#endif
-                  {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5u - Invalid x5u type, expected OKP");
-                    ret = R_KEY_TYPE_NONE;
-                  }
-#endif
-                } else {
-                  ret = R_KEY_TYPE_NONE;
-                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5u - Error unsupported algorithm %s", gnutls_pk_algorithm_get_name((gnutls_pk_algorithm_t)pk_alg));
-                }
-                ret |= R_KEY_TYPE_PUBLIC;
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type x5u - Error gnutls_x509_crt_import");
-                ret = R_KEY_TYPE_NONE;
-              }
-              gnutls_x509_crt_deinit(crt);
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type - Error gnutls_x509_crt_init");
-            }
-            o_free(x5u_content);
-          } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type - Error getting x5u content");
+          if ((res = _r_jwk_get_x5u_crt(jwk, x5u_flags, &crt)) == RHN_OK) {
+            ret = _r_jwk_check_crt_type(crt, ret, bits, "x5u");
+            bits_set = 1;
+            ret |= R_KEY_TYPE_PUBLIC;
+            gnutls_x509_crt_deinit(crt);
+          } else if (res == RHN_ERROR_INVALID) {
+            ret = R_KEY_TYPE_NONE;
           }
         }
       }
@@ -791,7 +821,7 @@ int r_jwk_key_type(jwk_t * jwk, unsigned int * bits, int x5u_flags) {
   }
   if (bits != NULL && !bits_set) {
     if (ret & R_KEY_TYPE_RSA) {
-      if (o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), NULL, &k_len)) {
+      if (_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), NULL, &k_len)) {
         *bits = (unsigned int)k_len*8;
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type - Error invalid base64url n value");
@@ -820,7 +850,7 @@ int r_jwk_key_type(jwk_t * jwk, unsigned int * bits, int x5u_flags) {
         *bits = 448;
       }
     } else if (ret & R_KEY_TYPE_HMAC) {
-      if (o_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "k")), json_string_length(json_object_get(jwk, "k")), NULL, &k_len)) {
+      if (_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(jwk, "k")), json_string_length(json_object_get(jwk, "k")), NULL, &k_len)) {
         *bits = (unsigned int)k_len*8;
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_key_type - Error invalid base64url k value");
@@ -1064,8 +1094,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
           json_object_set_new(jwk, "kty", json_string("RSA"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(m.data, m.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (2)");
+            if (!_r_base64url_encode_alloc(m.data, m.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (2)");
               ret = RHN_ERROR;
               break;
             }
@@ -1073,8 +1103,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(e.data, e.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (4)");
+            if (!_r_base64url_encode_alloc(e.data, e.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (4)");
               ret = RHN_ERROR;
               break;
             }
@@ -1082,8 +1112,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(d.data, d.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (6)");
+            if (!_r_base64url_encode_alloc(d.data, d.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (6)");
               ret = RHN_ERROR;
               break;
             }
@@ -1091,8 +1121,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(p.data, p.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (8)");
+            if (!_r_base64url_encode_alloc(p.data, p.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (8)");
               ret = RHN_ERROR;
               break;
             }
@@ -1100,8 +1130,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(q.data, q.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (10)");
+            if (!_r_base64url_encode_alloc(q.data, q.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (10)");
               ret = RHN_ERROR;
               break;
             }
@@ -1109,8 +1139,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(u.data, u.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (12)");
+            if (!_r_base64url_encode_alloc(u.data, u.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (12)");
               ret = RHN_ERROR;
               break;
             }
@@ -1118,8 +1148,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(e1.data, e1.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (14)");
+            if (!_r_base64url_encode_alloc(e1.data, e1.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (14)");
               ret = RHN_ERROR;
               break;
             }
@@ -1127,8 +1157,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(e2.data, e2.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode_alloc (16)");
+            if (!_r_base64url_encode_alloc(e2.data, e2.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode_alloc (16)");
               ret = RHN_ERROR;
               break;
             }
@@ -1145,8 +1175,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error gnutls_x509_crt_get_key_id");
               ret = RHN_ERROR;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error o_base64url_encode (5)");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey rsa - Error _r_base64url_encode (5)");
               ret = RHN_ERROR;
             }
             json_object_set_new(jwk, "kid", json_stringn((const char *)kid_b64, kid_b64_len));
@@ -1171,8 +1201,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
           json_object_set_new(jwk, "kty", json_string("EC"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(x.data, x.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error o_base64url_encode_alloc (1)");
+            if (!_r_base64url_encode_alloc(x.data, x.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error _r_base64url_encode_alloc (1)");
               ret = RHN_ERROR;
               break;
             }
@@ -1180,8 +1210,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(y.data, y.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error o_base64url_encode_alloc (2)");
+            if (!_r_base64url_encode_alloc(y.data, y.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error _r_base64url_encode_alloc (2)");
               ret = RHN_ERROR;
               break;
             }
@@ -1189,8 +1219,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(k.data, k.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error o_base64url_encode_alloc (3)");
+            if (!_r_base64url_encode_alloc(k.data, k.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error _r_base64url_encode_alloc (3)");
               ret = RHN_ERROR;
               break;
             }
@@ -1223,8 +1253,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error gnutls_x509_crt_get_key_id");
               ret = RHN_ERROR;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey ecdsa - Error _r_base64url_encode");
               ret = RHN_ERROR;
             }
             json_object_set_new(jwk, "kid", json_stringn((const char *)kid_b64, kid_b64_len));
@@ -1246,8 +1276,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
           json_object_set_new(jwk, "kty", json_string("OKP"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(x.data, x.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error o_base64url_encode_alloc (1)");
+            if (!_r_base64url_encode_alloc(x.data, x.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error _r_base64url_encode_alloc (1)");
               ret = RHN_ERROR;
               break;
             }
@@ -1255,8 +1285,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(k.data, k.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error o_base64url_encode_alloc (2)");
+            if (!_r_base64url_encode_alloc(k.data, k.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error _r_base64url_encode_alloc (2)");
               ret = RHN_ERROR;
               break;
             }
@@ -1278,8 +1308,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error gnutls_x509_crt_get_key_id");
               ret = RHN_ERROR;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error _r_base64url_encode");
               ret = RHN_ERROR;
             }
             json_object_set_new(jwk, "kid", json_stringn((const char *)kid_b64, kid_b64_len));
@@ -1300,8 +1330,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
           json_object_set_new(jwk, "kty", json_string("OKP"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(x.data, x.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error o_base64url_encode_alloc (1)");
+            if (!_r_base64url_encode_alloc(x.data, x.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error _r_base64url_encode_alloc (1)");
               ret = RHN_ERROR;
               break;
             }
@@ -1309,8 +1339,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(k.data, k.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error o_base64url_encode_alloc (2)");
+            if (!_r_base64url_encode_alloc(k.data, k.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error _r_base64url_encode_alloc (2)");
               ret = RHN_ERROR;
               break;
             }
@@ -1332,8 +1362,8 @@ int r_jwk_import_from_gnutls_privkey(jwk_t * jwk, gnutls_privkey_t key) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error gnutls_x509_crt_get_key_id");
               ret = RHN_ERROR;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_privkey eddsa - Error _r_base64url_encode");
               ret = RHN_ERROR;
             }
             json_object_set_new(jwk, "kid", json_stringn((const char *)kid_b64, kid_b64_len));
@@ -1376,8 +1406,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
           json_object_set_new(jwk, "kty", json_string("RSA"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(m.data, m.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey rsa - Error o_base64url_encode_alloc (1)");
+            if (!_r_base64url_encode_alloc(m.data, m.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey rsa - Error _r_base64url_encode_alloc (1)");
               ret = RHN_ERROR;
               break;
             }
@@ -1385,8 +1415,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(e.data, e.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey rsa - Error o_base64url_encode_alloc (42)");
+            if (!_r_base64url_encode_alloc(e.data, e.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey rsa - Error _r_base64url_encode_alloc (42)");
               ret = RHN_ERROR;
               break;
             }
@@ -1399,8 +1429,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
               break;
             }
 
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey rsa - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey rsa - Error _r_base64url_encode");
               ret = RHN_ERROR;
               break;
             }
@@ -1419,8 +1449,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
           json_object_set_new(jwk, "kty", json_string("EC"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(x.data, x.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdsa - Error o_base64url_encode_alloc (1)");
+            if (!_r_base64url_encode_alloc(x.data, x.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdsa - Error _r_base64url_encode_alloc (1)");
               ret = RHN_ERROR;
               break;
             }
@@ -1428,8 +1458,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
             o_free(dat.data);
             dat.data = NULL;
 
-            if (!o_base64url_encode_alloc(y.data, y.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdsa - Error o_base64url_encode_alloc (2)");
+            if (!_r_base64url_encode_alloc(y.data, y.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdsa - Error _r_base64url_encode_alloc (2)");
               ret = RHN_ERROR;
               break;
             }
@@ -1459,8 +1489,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
               ret = RHN_ERROR;
               break;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdsa - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdsa - Error _r_base64url_encode");
               ret = RHN_ERROR;
               break;
             }
@@ -1481,8 +1511,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
           json_object_set_new(jwk, "kty", json_string("OKP"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(x.data, x.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey eddsa - Error o_base64url_encode_alloc");
+            if (!_r_base64url_encode_alloc(x.data, x.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey eddsa - Error _r_base64url_encode_alloc");
               ret = RHN_ERROR;
               break;
             }
@@ -1503,8 +1533,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
               ret = RHN_ERROR;
               break;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey eddsa - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey eddsa - Error _r_base64url_encode");
               ret = RHN_ERROR;
               break;
             }
@@ -1524,8 +1554,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
           json_object_set_new(jwk, "kty", json_string("OKP"));
           ret = RHN_OK;
           do {
-            if (!o_base64url_encode_alloc(x.data, x.size, &dat)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdh - Error o_base64url_encode_alloc");
+            if (!_r_base64url_encode_alloc(x.data, x.size, &dat)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdh - Error _r_base64url_encode_alloc");
               ret = RHN_ERROR;
               break;
             }
@@ -1546,8 +1576,8 @@ int r_jwk_import_from_gnutls_pubkey(jwk_t * jwk, gnutls_pubkey_t pub) {
               ret = RHN_ERROR;
               break;
             }
-            if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdh - Error o_base64url_encode");
+            if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_pubkey ecdh - Error _r_base64url_encode");
               ret = RHN_ERROR;
               break;
             }
@@ -1584,8 +1614,8 @@ int r_jwk_import_from_gnutls_x509_crt(jwk_t * jwk, gnutls_x509_crt_t crt) {
           if (gnutls_x509_crt_get_key_id(crt, GNUTLS_KEYID_USE_SHA256, kid, &kid_len)) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_x509_crt x509 - Error gnutls_x509_crt_get_key_id");
             ret = RHN_ERROR;
-          } else if (!o_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_x509_crt x509 - Error o_base64url_encode");
+          } else if (!_r_base64url_encode(kid, kid_len, kid_b64, &kid_b64_len)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_import_from_gnutls_x509_crt x509 - Error _r_base64url_encode");
             ret = RHN_ERROR;
           } else {
             json_object_set_new(jwk, "kid", json_stringn((const char *)kid_b64, kid_b64_len));
@@ -1656,7 +1686,7 @@ int r_jwk_import_from_symmetric_key(jwk_t * jwk, const unsigned char * key, size
   struct _o_datum dat = {0, NULL};
 
   if (jwk != NULL && key != NULL && key_len) {
-    if (o_base64url_encode_alloc(key, key_len, &dat)) {
+    if (_r_base64url_encode_alloc(key, key_len, &dat)) {
       key_b64 = o_strndup((const char *)dat.data, dat.size);
       if (r_jwk_set_property_str(jwk, "kty", "oct") == RHN_OK && r_jwk_set_property_str(jwk, "k", (const char *)key_b64) == RHN_OK) {
         ret = RHN_OK;
@@ -1836,8 +1866,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
     } else if (type & R_KEY_TYPE_RSA) {
       res = RHN_OK;
       do {
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (n)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (n)");
           res = RHN_ERROR;
           break;
         }
@@ -1846,8 +1876,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "e")), json_string_length(json_object_get(jwk, "e")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (e)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "e")), json_string_length(json_object_get(jwk, "e")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (e)");
           res = RHN_ERROR;
           break;
         }
@@ -1856,8 +1886,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (d)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (d)");
           res = RHN_ERROR;
           break;
         }
@@ -1866,8 +1896,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "p")), json_string_length(json_object_get(jwk, "p")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (p)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "p")), json_string_length(json_object_get(jwk, "p")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (p)");
           res = RHN_ERROR;
           break;
         }
@@ -1876,8 +1906,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "q")), json_string_length(json_object_get(jwk, "q")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (q)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "q")), json_string_length(json_object_get(jwk, "q")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (q)");
           res = RHN_ERROR;
           break;
         }
@@ -1886,8 +1916,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "qi")), json_string_length(json_object_get(jwk, "qi")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (qi)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "qi")), json_string_length(json_object_get(jwk, "qi")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (qi)");
           res = RHN_ERROR;
           break;
         }
@@ -1896,8 +1926,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "dp")), json_string_length(json_object_get(jwk, "dp")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (dp)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "dp")), json_string_length(json_object_get(jwk, "dp")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (dp)");
           res = RHN_ERROR;
           break;
         }
@@ -1906,8 +1936,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "dq")), json_string_length(json_object_get(jwk, "dq")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (dq)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "dq")), json_string_length(json_object_get(jwk, "dq")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (dq)");
           res = RHN_ERROR;
           break;
         }
@@ -1944,8 +1974,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
     } else if (type & R_KEY_TYPE_EC) {
       res = RHN_OK;
       do {
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (x)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (x)");
           res = RHN_ERROR;
           break;
         }
@@ -1954,8 +1984,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "y")), json_string_length(json_object_get(jwk, "y")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (y)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "y")), json_string_length(json_object_get(jwk, "y")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (y)");
           res = RHN_ERROR;
           break;
         }
@@ -1964,8 +1994,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (d)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (d)");
           res = RHN_ERROR;
           break;
         }
@@ -2012,8 +2042,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
     } else if (type & R_KEY_TYPE_EDDSA || type & R_KEY_TYPE_ECDH) {
       res = RHN_OK;
       do {
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (x)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (x)");
           res = RHN_ERROR;
           break;
         }
@@ -2022,8 +2052,8 @@ gnutls_privkey_t r_jwk_export_to_gnutls_privkey(jwk_t * jwk) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error o_base64url_decode_alloc (d)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "d")), json_string_length(json_object_get(jwk, "d")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_privkey - Error _r_base64url_decode_alloc (d)");
           res = RHN_ERROR;
           break;
         }
@@ -2087,8 +2117,8 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
   gnutls_privkey_t privkey = NULL;
   gnutls_x509_crt_t crt;
   gnutls_datum_t m = {NULL, 0}, e = {NULL, 0}, data = {NULL, 0};
-  int res, type = r_jwk_key_type(jwk, NULL, x5u_flags);
-  char * x5u_content = NULL;
+  // The x5u certificate is downloaded once below, not during the key type detection
+  int res, type = r_jwk_key_type(jwk, NULL, _r_jwk_is_x5u_only(jwk)?(x5u_flags|R_FLAG_IGNORE_REMOTE):x5u_flags);
   struct _o_datum dat = {0, NULL};
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   gnutls_ecc_curve_t curve;
@@ -2139,36 +2169,24 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
       } else {
         if (!(x5u_flags & R_FLAG_IGNORE_REMOTE)) {
           // Get x5u
-          if ((x5u_content = _r_get_http_content(json_string_value(json_object_get(jwk, "x5u")), x5u_flags, NULL)) != NULL) {
-            if (!gnutls_pubkey_init(&pubkey)) {
-              if (!gnutls_x509_crt_init(&crt)) {
-                data.data = (unsigned char *)x5u_content;
-                data.size = (unsigned int)o_strlen(x5u_content);
-                if (!gnutls_x509_crt_import(crt, &data, GNUTLS_X509_FMT_PEM)) {
-                  if (!gnutls_pubkey_import_x509(pubkey, crt, 0)) {
-                    res = RHN_OK;
-                  } else {
-                    gnutls_pubkey_deinit(pubkey);
-                    pubkey = NULL;
-                    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error gnutls_pubkey_import_x509");
-                    res = RHN_ERROR;
-                  }
+          if (_r_jwk_get_x5u_crt(jwk, x5u_flags, &crt) == RHN_OK) {
+            if (_r_jwk_check_crt_type(crt, type, NULL, "x5u") != R_KEY_TYPE_NONE) {
+              if (!gnutls_pubkey_init(&pubkey)) {
+                if (!gnutls_pubkey_import_x509(pubkey, crt, 0)) {
+                  res = RHN_OK;
                 } else {
                   gnutls_pubkey_deinit(pubkey);
                   pubkey = NULL;
-                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error gnutls_pubkey_import");
+                  y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error gnutls_pubkey_import_x509");
                   res = RHN_ERROR;
                 }
-                gnutls_x509_crt_deinit(crt);
               } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error gnutls_x509_crt_init");
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error gnutls_pubkey_init");
               }
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error gnutls_pubkey_init");
             }
-            o_free(x5u_content);
+            gnutls_x509_crt_deinit(crt);
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error getting x5u content");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey x5u - Error getting x5u certificate");
           }
         } else {
           res = RHN_ERROR_UNSUPPORTED;
@@ -2178,8 +2196,8 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
       res = RHN_OK;
       if (!(type & R_KEY_TYPE_PRIVATE)) {
         do {
-          if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), &dat)) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error o_base64url_decode_alloc (n)");
+          if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "n")), json_string_length(json_object_get(jwk, "n")), &dat)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error _r_base64url_decode_alloc (n)");
             res = RHN_ERROR;
             break;
           }
@@ -2188,8 +2206,8 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
           dat.data = NULL;
           dat.size = 0;
 
-          if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "e")), json_string_length(json_object_get(jwk, "e")), &dat)) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error o_base64url_decode_alloc (e)");
+          if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "e")), json_string_length(json_object_get(jwk, "e")), &dat)) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error _r_base64url_decode_alloc (e)");
             res = RHN_ERROR;
             break;
           }
@@ -2241,8 +2259,8 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
     } else if (type & R_KEY_TYPE_EC) {
       res = RHN_OK;
       do {
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error o_base64url_decode_alloc (x)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error _r_base64url_decode_alloc (x)");
           res = RHN_ERROR;
           break;
         }
@@ -2251,8 +2269,8 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
         dat.data = NULL;
         dat.size = 0;
 
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "y")), json_string_length(json_object_get(jwk, "y")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error o_base64url_decode_alloc (y)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "y")), json_string_length(json_object_get(jwk, "y")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error _r_base64url_decode_alloc (y)");
           res = RHN_ERROR;
           break;
         }
@@ -2297,8 +2315,8 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
     } else if (type & R_KEY_TYPE_EDDSA || type & R_KEY_TYPE_ECDH) {
       res = RHN_OK;
       do {
-        if (!o_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error o_base64url_decode_alloc (x)");
+        if (!_r_base64url_decode_alloc((const unsigned char *)json_string_value(json_object_get(jwk, "x")), json_string_length(json_object_get(jwk, "x")), &dat)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_pubkey - Error _r_base64url_decode_alloc (x)");
           res = RHN_ERROR;
           break;
         }
@@ -2356,8 +2374,7 @@ gnutls_pubkey_t r_jwk_export_to_gnutls_pubkey(jwk_t * jwk, int x5u_flags) {
 gnutls_x509_crt_t r_jwk_export_to_gnutls_crt(jwk_t * jwk, int x5u_flags) {
   gnutls_x509_crt_t crt = NULL;
   gnutls_datum_t data = {NULL, 0};
-  int type = r_jwk_key_type(jwk, NULL, x5u_flags);
-  char * x5u_content = NULL;
+  int type = r_jwk_key_type(jwk, NULL, _r_jwk_is_x5u_only(jwk)?(x5u_flags|R_FLAG_IGNORE_REMOTE):x5u_flags);
   struct _o_datum dat = {0, NULL};
 
   if (type & (R_KEY_TYPE_PUBLIC)) {
@@ -2381,21 +2398,13 @@ gnutls_x509_crt_t r_jwk_export_to_gnutls_crt(jwk_t * jwk, int x5u_flags) {
       } else {
         if (!(x5u_flags & R_FLAG_IGNORE_REMOTE)) {
           // Get x5u
-          if ((x5u_content = _r_get_http_content(json_string_value(json_object_get(jwk, "x5u")), x5u_flags, NULL)) != NULL) {
-            if (!gnutls_x509_crt_init(&crt)) {
-              data.data = (unsigned char *)x5u_content;
-              data.size = (unsigned int)o_strlen(x5u_content);
-              if (gnutls_x509_crt_import(crt, &data, GNUTLS_X509_FMT_PEM)) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_crt x5u - Error gnutls_pubkey_import");
-                gnutls_x509_crt_deinit(crt);
-                crt = NULL;
-              }
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_crt x5u - Error gnutls_x509_crt_init");
+          if (_r_jwk_get_x5u_crt(jwk, x5u_flags, &crt) == RHN_OK) {
+            if (_r_jwk_check_crt_type(crt, type, NULL, "x5u") == R_KEY_TYPE_NONE) {
+              gnutls_x509_crt_deinit(crt);
+              crt = NULL;
             }
-            o_free(x5u_content);
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_crt x5u - Error getting x5u content");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_gnutls_crt x5u - Error getting x5u certificate");
           }
         }
       }
@@ -2473,12 +2482,12 @@ int r_jwk_export_to_symmetric_key(jwk_t * jwk, unsigned char * key, size_t * key
     if (r_jwk_key_type(jwk, NULL, 0) & R_KEY_TYPE_SYMMETRIC) {
       k = r_jwk_get_property_str(jwk, "k");
       if ((k_len = o_strlen(k))) {
-        if (o_base64url_decode((const unsigned char *)k, k_len, NULL, &k_expected)) {
+        if (_r_base64url_decode((const unsigned char *)k, k_len, NULL, &k_expected)) {
           if (k_expected <= *key_len) {
-            if (o_base64url_decode((const unsigned char *)k, k_len, key, key_len)) {
+            if (_r_base64url_decode((const unsigned char *)k, k_len, key, key_len)) {
               ret = RHN_OK;
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_symmetric_key - Error o_base64url_decode");
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_export_to_symmetric_key - Error _r_base64url_decode");
               ret = RHN_ERROR;
             }
           } else {
@@ -2501,6 +2510,212 @@ int r_jwk_export_to_symmetric_key(jwk_t * jwk, unsigned char * key, size_t * key
   return ret;
 }
 
+/**
+ * Return a new HMAC handle keyed with the prepared symmetric key
+ * The keyed state of each algorithm is computed once and cloned with gnutls_hmac_copy,
+ * it is installed atomically so a prepared key can be used by several threads
+ */
+gnutls_hmac_hd_t _r_jwk_prepared_hmac(jwk_prepared_t * prepared, gnutls_mac_algorithm_t alg) {
+  gnutls_hmac_hd_t hmac = NULL;
+#if GNUTLS_VERSION_NUMBER >= 0x030609
+  gnutls_hmac_hd_t state = NULL;
+  void * expected = NULL;
+  int index = -1;
+
+  if (prepared->hmac != NULL) {
+    if (alg == GNUTLS_MAC_SHA256) {
+      index = 0;
+    } else if (alg == GNUTLS_MAC_SHA384) {
+      index = 1;
+    } else if (alg == GNUTLS_MAC_SHA512) {
+      index = 2;
+    }
+  }
+  if (index >= 0) {
+    if ((state = __atomic_load_n(&prepared->hmac[index], __ATOMIC_ACQUIRE)) == NULL) {
+      if (!gnutls_hmac_init(&state, alg, prepared->key, prepared->key_len)) {
+        if (!__atomic_compare_exchange_n(&prepared->hmac[index], &expected, (void *)state, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          // Another thread installed its state first
+          gnutls_hmac_deinit(state, NULL);
+          state = expected;
+        }
+      } else {
+        state = NULL;
+      }
+    }
+    if (state != NULL) {
+      hmac = gnutls_hmac_copy(state);
+    }
+  }
+#endif
+  if (hmac == NULL && gnutls_hmac_init(&hmac, alg, prepared->key, prepared->key_len)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwk_prepared_hmac - Error gnutls_hmac_init");
+    hmac = NULL;
+  }
+  return hmac;
+}
+
+/**
+ * If borrow is set, the prepared key keeps a reference to jwk instead of a copy,
+ * this is used internally when the prepared key doesn't outlive the call
+ */
+jwk_prepared_t * _r_jwk_prepare(jwk_t * jwk, int x5u_flags, int borrow) {
+  jwk_prepared_t * prepared = NULL;
+  gnutls_x509_crt_t crt = NULL;
+  int type = R_KEY_TYPE_NONE, ret = RHN_OK, res;
+  unsigned int bits = 0;
+
+  if (jwk != NULL && _r_jwk_is_x5u_only(jwk) && !(x5u_flags & R_FLAG_IGNORE_REMOTE)) {
+    // Download the x5u certificate once and use it for both the key type and the public key
+    if (_r_jwk_get_x5u_crt(jwk, x5u_flags, &crt) == RHN_OK) {
+      if ((type = r_jwk_key_type(jwk, NULL, x5u_flags|R_FLAG_IGNORE_REMOTE)) != R_KEY_TYPE_NONE) {
+        type = _r_jwk_check_crt_type(crt, type, &bits, "x5u");
+      }
+    }
+  } else if (jwk != NULL) {
+    type = r_jwk_key_type(jwk, &bits, x5u_flags);
+  }
+
+  if (type != R_KEY_TYPE_NONE) {
+    if ((prepared = o_malloc(sizeof(jwk_prepared_t))) != NULL) {
+      prepared->type = type;
+      prepared->bits = bits;
+      prepared->privkey = NULL;
+      prepared->pubkey = NULL;
+      prepared->key = NULL;
+      prepared->key_len = 0;
+      prepared->rsa = NULL;
+      prepared->hmac = NULL;
+      if ((prepared->jwk = (borrow?json_incref(jwk):r_jwk_copy(jwk))) != NULL) {
+        if (type & R_KEY_TYPE_SYMMETRIC) {
+          prepared->key_len = o_strlen(r_jwk_get_property_str(jwk, "k"));
+          if ((prepared->key = o_malloc(prepared->key_len)) != NULL) {
+            if (r_jwk_export_to_symmetric_key(jwk, prepared->key, &prepared->key_len) != RHN_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error r_jwk_export_to_symmetric_key");
+              ret = RHN_ERROR;
+            } else if (!borrow && (prepared->hmac = o_malloc(3*sizeof(void *))) != NULL) {
+              // Keyed HMAC states for HS256, HS384 and HS512, created on first use
+              memset(prepared->hmac, 0, 3*sizeof(void *));
+            }
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error allocating resources for key");
+            ret = RHN_ERROR_MEMORY;
+          }
+        } else {
+          if (type & R_KEY_TYPE_PRIVATE) {
+            prepared->privkey = r_jwk_export_to_gnutls_privkey(jwk);
+          }
+          if (prepared->privkey != NULL) {
+            if (!(res = gnutls_pubkey_init(&prepared->pubkey))) {
+              if ((res = gnutls_pubkey_import_privkey(prepared->pubkey, prepared->privkey, 0, 0))) {
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error gnutls_pubkey_import_privkey: %s", gnutls_strerror(res));
+                gnutls_pubkey_deinit(prepared->pubkey);
+                prepared->pubkey = NULL;
+              }
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error gnutls_pubkey_init: %s", gnutls_strerror(res));
+              prepared->pubkey = NULL;
+            }
+          } else if (crt != NULL) {
+            if (!(res = gnutls_pubkey_init(&prepared->pubkey))) {
+              if ((res = gnutls_pubkey_import_x509(prepared->pubkey, crt, 0))) {
+                y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error gnutls_pubkey_import_x509: %s", gnutls_strerror(res));
+                gnutls_pubkey_deinit(prepared->pubkey);
+                prepared->pubkey = NULL;
+              }
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error gnutls_pubkey_init: %s", gnutls_strerror(res));
+              prepared->pubkey = NULL;
+            }
+          } else {
+            prepared->pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+          }
+          if (prepared->privkey == NULL && prepared->pubkey == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error importing key");
+            ret = RHN_ERROR;
+          } else if (type & R_KEY_TYPE_RSA && !borrow) {
+            // Borrowed keys are used for a single operation, the RSA-OAEP values aren't worth it
+            prepared->rsa = _r_rsa_keys_new(prepared->privkey, prepared->pubkey);
+          }
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error r_jwk_copy");
+        ret = RHN_ERROR_MEMORY;
+      }
+      if (ret != RHN_OK) {
+        r_jwk_prepared_free(prepared);
+        prepared = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_prepare - Error allocating resources for prepared");
+    }
+  }
+  if (crt != NULL) {
+    gnutls_x509_crt_deinit(crt);
+  }
+  return prepared;
+}
+
+jwk_prepared_t * r_jwk_prepare(jwk_t * jwk, int x5u_flags) {
+  return _r_jwk_prepare(jwk, x5u_flags, 0);
+}
+
+void r_jwk_prepared_free(jwk_prepared_t * prepared) {
+  size_t i;
+
+  if (prepared != NULL) {
+    r_jwk_free(prepared->jwk);
+    gnutls_privkey_deinit(prepared->privkey);
+    gnutls_pubkey_deinit(prepared->pubkey);
+    _r_rsa_keys_free(prepared->rsa);
+    if (prepared->hmac != NULL) {
+      for (i=0; i<3; i++) {
+        if (prepared->hmac[i] != NULL) {
+          gnutls_hmac_deinit((gnutls_hmac_hd_t)prepared->hmac[i], NULL);
+        }
+      }
+      o_free(prepared->hmac);
+    }
+    if (prepared->key != NULL) {
+      gnutls_memset(prepared->key, 0, prepared->key_len);
+      o_free(prepared->key);
+    }
+    o_free(prepared);
+  }
+}
+
+int r_jwk_prepared_key_type(jwk_prepared_t * prepared, unsigned int * bits) {
+  if (prepared != NULL) {
+    if (bits != NULL) {
+      *bits = prepared->bits;
+    }
+    return prepared->type;
+  } else {
+    return R_KEY_TYPE_NONE;
+  }
+}
+
+jwk_t * _r_jwk_prepared_get_jwk(jwk_prepared_t * prepared) {
+  return prepared->jwk;
+}
+
+gnutls_privkey_t _r_jwk_prepared_get_privkey(jwk_prepared_t * prepared) {
+  return prepared->privkey;
+}
+
+gnutls_pubkey_t _r_jwk_prepared_get_pubkey(jwk_prepared_t * prepared) {
+  return prepared->pubkey;
+}
+
+const unsigned char * _r_jwk_prepared_get_key(jwk_prepared_t * prepared, size_t * key_len) {
+  *key_len = prepared->key_len;
+  return prepared->key;
+}
+
+void * _r_jwk_prepared_get_rsa(jwk_prepared_t * prepared) {
+  return prepared->rsa;
+}
+
 const char * r_jwk_get_property_str(jwk_t * jwk, const char * key) {
   if (jwk != NULL && !o_strnullempty(key)) {
     if (json_is_string(json_object_get(jwk, key))) {
@@ -2708,10 +2923,10 @@ char * r_jwk_thumbprint(jwk_t * jwk, int hash, int x5u_flags) {
         key_dump = json_dumps(key_members, JSON_COMPACT|JSON_SORT_KEYS);
         if (key_dump != NULL) {
           if (!gnutls_hash_fast(alg, key_dump, o_strlen(key_dump), jwk_hash)) {
-            if (o_base64url_encode(jwk_hash, (unsigned)gnutls_hash_get_len(alg), jwk_hash_b64, &jwk_hash_b64_len)) {
+            if (_r_base64url_encode(jwk_hash, (unsigned)gnutls_hash_get_len(alg), jwk_hash_b64, &jwk_hash_b64_len)) {
               thumb = o_strndup((const char *)jwk_hash_b64, jwk_hash_b64_len);
             } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_thumbprint, error o_base64url_encode");
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_thumbprint, error _r_base64url_encode");
             }
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jwk_thumbprint, error gnutls_hash_fast");
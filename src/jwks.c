@@ -21,11 +21,270 @@
  *
  */
 
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <orcania.h>
 #include <yder.h>
 #include <rhonabwy.h>
 
 char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type);
+char * _r_get_http_content_uncached(const char * url, int x5u_flags, const char * expected_content_type);
+
+#define R_JWKS_INDEX_KID         "kid"
+#define R_JWKS_INDEX_THUMBPRINT  "jkt"
+#define R_JWKS_INDEX_ALG         "alg"
+#define R_JWKS_INDEX_BUCKETS     64
+
+/**
+ * The lookup indexes are stored outside of the jwks objects so a lookup
+ * never modifies the jwks and a jwks can be read by several threads at the
+ * same time
+ * A jwks is indexed only after r_jwks_build_index, its index is kept in a
+ * bucket chosen by the address of the jwks, each bucket has its own lock,
+ * and a bucket without index is never locked, so the jwks that aren't
+ * indexed, e.g. the key sets of a jws_t or a jwe_t, don't pay for the index
+ * An index has 3 tables mapping a value to the position of the key in
+ * the "keys" array:
+ * - "kid": kid -> position of the first key with this kid
+ * - "jkt": SHA-256 thumbprint -> position
+ * - "alg": "kty alg use" -> [positions]
+ * and records the address and size of the "keys" array it was built for,
+ * a lookup falls back to a linear scan if the index is stale
+ */
+typedef struct _r_jwks_index {
+  jwks_t               * jwks;
+  json_t               * keys;
+  size_t                 size;
+  json_t               * j_tables;
+  struct _r_jwks_index * next;
+} _r_jwks_index;
+
+typedef struct {
+  pthread_rwlock_t   lock;
+  _r_jwks_index    * first;
+  size_t             nb_index;
+} _r_jwks_index_bucket;
+
+static _r_jwks_index_bucket _r_jwks_index_buckets[R_JWKS_INDEX_BUCKETS];
+static pthread_once_t _r_jwks_index_once = PTHREAD_ONCE_INIT;
+
+static void _r_jwks_index_init(void) {
+  size_t i;
+
+  for (i=0; i<R_JWKS_INDEX_BUCKETS; i++) {
+    pthread_rwlock_init(&_r_jwks_index_buckets[i].lock, NULL);
+  }
+}
+
+static _r_jwks_index_bucket * _r_jwks_index_get_bucket(jwks_t * jwks) {
+  uintptr_t address = (uintptr_t)jwks;
+
+  return &_r_jwks_index_buckets[((address>>4)^(address>>12))%R_JWKS_INDEX_BUCKETS];
+}
+
+/**
+ * Return 0 if the bucket of the jwks has no index,
+ * so the jwks isn't indexed and the bucket doesn't need to be locked
+ */
+static int _r_jwks_index_may_exist(_r_jwks_index_bucket * bucket) {
+  return __atomic_load_n(&bucket->nb_index, __ATOMIC_ACQUIRE) != 0;
+}
+
+static _r_jwks_index * _r_jwks_index_find(_r_jwks_index_bucket * bucket, jwks_t * jwks) {
+  _r_jwks_index * index;
+
+  for (index = bucket->first; index != NULL && index->jwks != jwks; index = index->next);
+  return index;
+}
+
+static char * _r_jwks_index_alg_key(const char * kty, const char * alg, const char * use) {
+  return msprintf("%s %s %s", kty!=NULL?kty:"", alg!=NULL?alg:"", use!=NULL?use:"");
+}
+
+static int _r_jwks_index_has_thumbprint(jwk_t * jwk) {
+  // x5u-only keys have no thumbprint until downloaded, don't fetch them here
+  return json_object_get(jwk, "n") != NULL || json_object_get(jwk, "x") != NULL || json_object_get(jwk, "k") != NULL;
+}
+
+static void _r_jwks_index_add(json_t * j_tables, jwk_t * jwk, size_t position) {
+  const char * kid = r_jwk_get_property_str(jwk, "kid");
+  json_t * j_table, * j_list;
+  char * key = NULL;
+
+  j_table = json_object_get(j_tables, R_JWKS_INDEX_KID);
+  if (!o_strnullempty(kid) && json_object_get(j_table, kid) == NULL) {
+    json_object_set_new(j_table, kid, json_integer((json_int_t)position));
+  }
+  j_table = json_object_get(j_tables, R_JWKS_INDEX_THUMBPRINT);
+  if (_r_jwks_index_has_thumbprint(jwk)) {
+    if ((key = r_jwk_thumbprint(jwk, R_JWK_THUMB_SHA256, R_FLAG_IGNORE_REMOTE)) != NULL && json_object_get(j_table, key) == NULL) {
+      json_object_set_new(j_table, key, json_integer((json_int_t)position));
+    }
+    o_free(key);
+  }
+  j_table = json_object_get(j_tables, R_JWKS_INDEX_ALG);
+  if ((key = _r_jwks_index_alg_key(r_jwk_get_property_str(jwk, "kty"), r_jwk_get_property_str(jwk, "alg"), r_jwk_get_property_str(jwk, "use"))) != NULL) {
+    if ((j_list = json_object_get(j_table, key)) == NULL) {
+      json_object_set_new(j_table, key, json_array());
+      j_list = json_object_get(j_table, key);
+    }
+    json_array_append_new(j_list, json_integer((json_int_t)position));
+  }
+  o_free(key);
+}
+
+static json_t * _r_jwks_index_tables_new(jwks_t * jwks) {
+  json_t * j_tables, * jwk = NULL;
+  size_t index = 0;
+
+  if ((j_tables = json_pack("{s{}s{}s{}}", R_JWKS_INDEX_KID, R_JWKS_INDEX_THUMBPRINT, R_JWKS_INDEX_ALG)) != NULL) {
+    json_array_foreach(json_object_get(jwks, "keys"), index, jwk) {
+      _r_jwks_index_add(j_tables, jwk, index);
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks index - Error allocating resources for j_tables");
+  }
+  return j_tables;
+}
+
+/**
+ * An index is valid if it was built for the current "keys" array
+ * and has the same number of keys
+ */
+static int _r_jwks_index_is_valid(jwks_t * jwks, _r_jwks_index * index, size_t size) {
+  return index != NULL && index->j_tables != NULL && index->keys == json_object_get(jwks, "keys") && index->size == size;
+}
+
+/**
+ * Replace the tables of the jwks index by j_tables, or remove the index if j_tables is NULL
+ * j_tables is stolen
+ */
+static int _r_jwks_index_set(jwks_t * jwks, json_t * j_tables) {
+  _r_jwks_index_bucket * bucket = _r_jwks_index_get_bucket(jwks);
+  _r_jwks_index * index, ** previous;
+  int ret = RHN_OK;
+
+  pthread_once(&_r_jwks_index_once, _r_jwks_index_init);
+  if (!pthread_rwlock_wrlock(&bucket->lock)) {
+    if ((index = _r_jwks_index_find(bucket, jwks)) == NULL && j_tables != NULL) {
+      if ((index = o_malloc(sizeof(_r_jwks_index))) != NULL) {
+        index->jwks = jwks;
+        index->j_tables = NULL;
+        index->next = bucket->first;
+        bucket->first = index;
+        __atomic_store_n(&bucket->nb_index, bucket->nb_index+1, __ATOMIC_RELEASE);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "jwks index - Error allocating resources for index");
+        json_decref(j_tables);
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+    if (index != NULL) {
+      if (j_tables != NULL) {
+        json_decref(index->j_tables);
+        index->j_tables = j_tables;
+        index->keys = json_object_get(jwks, "keys");
+        index->size = r_jwks_size(jwks);
+      } else {
+        for (previous = &bucket->first; *previous != index; previous = &(*previous)->next);
+        *previous = index->next;
+        __atomic_store_n(&bucket->nb_index, bucket->nb_index-1, __ATOMIC_RELEASE);
+        json_decref(index->j_tables);
+        o_free(index);
+      }
+    }
+    pthread_rwlock_unlock(&bucket->lock);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks index - Error pthread_rwlock_wrlock");
+    json_decref(j_tables);
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Update the index after a change in an indexed jwks
+ * If jwk is not NULL, it was appended at the end of the jwks and is added
+ * to the index, otherwise the index is rebuilt
+ */
+static void _r_jwks_index_update(jwks_t * jwks, jwk_t * jwk) {
+  _r_jwks_index_bucket * bucket = _r_jwks_index_get_bucket(jwks);
+  _r_jwks_index * index;
+  json_t * j_tables;
+  size_t size = r_jwks_size(jwks);
+
+  if (_r_jwks_index_may_exist(bucket)) {
+    pthread_once(&_r_jwks_index_once, _r_jwks_index_init);
+    if (!pthread_rwlock_wrlock(&bucket->lock)) {
+      if ((index = _r_jwks_index_find(bucket, jwks)) != NULL) {
+        if (jwk != NULL && size && _r_jwks_index_is_valid(jwks, index, size-1)) {
+          _r_jwks_index_add(index->j_tables, jwk, size-1);
+          index->size = size;
+        } else if ((j_tables = _r_jwks_index_tables_new(jwks)) != NULL) {
+          json_decref(index->j_tables);
+          index->j_tables = j_tables;
+          index->keys = json_object_get(jwks, "keys");
+          index->size = size;
+        }
+      }
+      pthread_rwlock_unlock(&bucket->lock);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "jwks index - Error pthread_rwlock_wrlock");
+    }
+  }
+}
+
+/**
+ * Get the valid index tables of the jwks with the read lock of its bucket held,
+ * return NULL without the lock if the jwks has no valid index
+ * The tables must be released with _r_jwks_index_release
+ */
+static json_t * _r_jwks_index_acquire(jwks_t * jwks) {
+  _r_jwks_index_bucket * bucket = _r_jwks_index_get_bucket(jwks);
+
+  if (_r_jwks_index_may_exist(bucket)) {
+    pthread_once(&_r_jwks_index_once, _r_jwks_index_init);
+    if (!pthread_rwlock_rdlock(&bucket->lock)) {
+      _r_jwks_index * index = _r_jwks_index_find(bucket, jwks);
+      if (_r_jwks_index_is_valid(jwks, index, r_jwks_size(jwks))) {
+        return index->j_tables;
+      }
+      pthread_rwlock_unlock(&bucket->lock);
+    }
+  }
+  return NULL;
+}
+
+static void _r_jwks_index_release(jwks_t * jwks) {
+  pthread_rwlock_unlock(&_r_jwks_index_get_bucket(jwks)->lock);
+}
+
+static jwk_t * _r_jwks_index_get(jwks_t * jwks, json_t * j_position) {
+  if (json_is_integer(j_position)) {
+    return json_array_get(json_object_get(jwks, "keys"), (size_t)json_integer_value(j_position));
+  } else {
+    return NULL;
+  }
+}
+
+static int _r_jwks_match_thumbprint(jwk_t * jwk, const char * thumbprint) {
+  char * jkt;
+  int ret = 0;
+
+  if (_r_jwks_index_has_thumbprint(jwk) && (jkt = r_jwk_thumbprint(jwk, R_JWK_THUMB_SHA256, R_FLAG_IGNORE_REMOTE)) != NULL) {
+    ret = (0 == o_strcmp(jkt, thumbprint));
+    o_free(jkt);
+  }
+  return ret;
+}
+
+static int _r_jwks_match_alg(jwk_t * jwk, const char * kty, const char * alg, const char * use) {
+  return 0 == o_strcmp(kty, r_jwk_get_property_str(jwk, "kty")) &&
+         0 == o_strcmp(alg, r_jwk_get_property_str(jwk, "alg")) &&
+         0 == o_strcmp(use, r_jwk_get_property_str(jwk, "use"));
+}
 
 int r_jwks_init(jwks_t ** jwks) {
   int ret;
@@ -40,6 +299,9 @@ int r_jwks_init(jwks_t ** jwks) {
 
 void r_jwks_free(jwks_t * jwks) {
   if (jwks != NULL) {
+    if (_r_jwks_index_may_exist(_r_jwks_index_get_bucket(jwks))) {
+      _r_jwks_index_set(jwks, NULL);
+    }
     json_decref(jwks);
   }
 }
@@ -81,19 +343,102 @@ jwk_t * r_jwks_get_at(jwks_t * jwks, size_t index) {
   }
 }
 
+jwk_t * r_jwks_peek_at(jwks_t * jwks, size_t index) {
+  if (jwks != NULL) {
+    return json_array_get(json_object_get(jwks, "keys"), index);
+  } else {
+    return NULL;
+  }
+}
+
 jwk_t * r_jwks_get_by_kid(jwks_t * jwks, const char * kid) {
-  json_t * jwk = NULL;
+  return json_deep_copy(r_jwks_peek_by_kid(jwks, kid));
+}
+
+jwk_t * r_jwks_peek_by_kid(jwks_t * jwks, const char * kid) {
+  json_t * jwk = NULL, * j_index;
   size_t index = 0;
+
   if (jwks != NULL && !o_strnullempty(kid)) {
+    if ((j_index = _r_jwks_index_acquire(jwks)) != NULL) {
+      jwk = _r_jwks_index_get(jwks, json_object_get(json_object_get(j_index, R_JWKS_INDEX_KID), kid));
+      _r_jwks_index_release(jwks);
+      if (jwk == NULL || 0 == o_strcmp(kid, r_jwk_get_property_str(jwk, "kid"))) {
+        return jwk;
+      }
+      // A key was changed in place, the index is stale
+    }
     json_array_foreach(json_object_get(jwks, "keys"), index, jwk) {
       if (0 == o_strcmp(kid, r_jwk_get_property_str(jwk, "kid"))) {
-        return json_deep_copy(jwk);
+        return jwk;
       }
     }
   }
   return NULL;
 }
 
+jwk_t * r_jwks_peek_by_thumbprint(jwks_t * jwks, const char * thumbprint) {
+  json_t * jwk = NULL, * j_index;
+  size_t index = 0;
+
+  if (jwks != NULL && !o_strnullempty(thumbprint)) {
+    if ((j_index = _r_jwks_index_acquire(jwks)) != NULL) {
+      jwk = _r_jwks_index_get(jwks, json_object_get(json_object_get(j_index, R_JWKS_INDEX_THUMBPRINT), thumbprint));
+      _r_jwks_index_release(jwks);
+      return jwk;
+    }
+    json_array_foreach(json_object_get(jwks, "keys"), index, jwk) {
+      if (_r_jwks_match_thumbprint(jwk, thumbprint)) {
+        return jwk;
+      }
+    }
+  }
+  return NULL;
+}
+
+jwk_t * r_jwks_peek_by_alg(jwks_t * jwks, const char * kty, const char * alg, const char * use, size_t index) {
+  json_t * jwk = NULL, * j_index;
+  size_t i = 0, matches = 0;
+  char * key;
+
+  if (jwks != NULL) {
+    if ((j_index = _r_jwks_index_acquire(jwks)) != NULL) {
+      if ((key = _r_jwks_index_alg_key(kty, alg, use)) != NULL) {
+        jwk = _r_jwks_index_get(jwks, json_array_get(json_object_get(json_object_get(j_index, R_JWKS_INDEX_ALG), key), index));
+        o_free(key);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_peek_by_alg - Error allocating resources for key");
+      }
+      _r_jwks_index_release(jwks);
+      if (jwk == NULL || _r_jwks_match_alg(jwk, kty, alg, use)) {
+        return jwk;
+      }
+      // A key was changed in place, the index is stale
+    }
+    json_array_foreach(json_object_get(jwks, "keys"), i, jwk) {
+      if (_r_jwks_match_alg(jwk, kty, alg, use) && matches++ == index) {
+        return jwk;
+      }
+    }
+  }
+  return NULL;
+}
+
+int r_jwks_build_index(jwks_t * jwks) {
+  json_t * j_tables;
+
+  if (jwks != NULL) {
+    if ((j_tables = _r_jwks_index_tables_new(jwks)) != NULL) {
+      return _r_jwks_index_set(jwks, j_tables);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_build_index - Error building index");
+      return RHN_ERROR_MEMORY;
+    }
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 jwks_t * r_jwks_copy(jwks_t * jwks) {
   if (jwks != NULL) {
     return json_deep_copy(jwks);
@@ -105,6 +450,7 @@ jwks_t * r_jwks_copy(jwks_t * jwks) {
 int r_jwks_append_jwk(jwks_t * jwks, jwk_t * jwk) {
   if (jwks != NULL) {
     if (!json_array_append(json_object_get(jwks, "keys"), jwk)) {
+      _r_jwks_index_update(jwks, jwk);
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks append - error json_array_append");
@@ -118,6 +464,7 @@ int r_jwks_append_jwk(jwks_t * jwks, jwk_t * jwk) {
 int r_jwks_set_at(jwks_t * jwks, size_t index, jwk_t * jwk) {
   if (jwks != NULL) {
     if (!json_array_set(json_object_get(jwks, "keys"), index, jwk)) {
+      _r_jwks_index_update(jwks, NULL);
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks append - error json_array_set");
@@ -131,6 +478,7 @@ int r_jwks_set_at(jwks_t * jwks, size_t index, jwk_t * jwk) {
 int r_jwks_remove_at(jwks_t * jwks, size_t index) {
   if (jwks != NULL) {
     if (!json_array_remove(json_object_get(jwks, "keys"), index)) {
+      _r_jwks_index_update(jwks, NULL);
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks append - error json_array_remove");
@@ -144,6 +492,7 @@ int r_jwks_remove_at(jwks_t * jwks, size_t index) {
 int r_jwks_empty(jwks_t * jwks) {
   if (jwks != NULL) {
     if (!json_array_clear(json_object_get(jwks, "keys"))) {
+      _r_jwks_index_update(jwks, NULL);
       return RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "rhonabwy jwks empty - error json_array_clear");
@@ -475,12 +824,10 @@ jwks_t * r_jwks_search_json_t(jwks_t * jwks, json_t * j_match) {
 
   if (r_jwks_init(&jwks_ret) == RHN_OK) {
     if (r_jwks_size(jwks) && json_object_size(j_match)) {
-      for (i=0; i<r_jwks_size(jwks); i++) {
-        jwk = r_jwks_get_at(jwks, i);
+      json_array_foreach(json_object_get(jwks, "keys"), i, jwk) {
         if (r_jwk_match_json_t(jwk, j_match) == RHN_OK) {
-          r_jwks_append_jwk(jwks_ret, jwk);
+          json_array_append_new(json_object_get(jwks_ret, "keys"), json_deep_copy(jwk));
         }
-        r_jwk_free(jwk);
       }
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_search_json_t - Error invalid input parameters");
@@ -497,3 +844,248 @@ jwks_t * r_jwks_search_json_str(jwks_t * jwks, const char * str_match) {
   json_decref(j_match);
   return jwks_ret;
 }
+
+/**
+ * Managed key source
+ * The current snapshot is published with an atomic pointer swap,
+ * readers never take a lock: a reader registers itself in readers[epoch]
+ * only while it loads the pointer and increments the snapshot refcount
+ * After a swap, the writer flips the epoch twice and waits for each
+ * readers counter to drain, then no reader can still be about to
+ * increment the refcount of the previous snapshot
+ */
+struct _jwks_snapshot {
+  jwks_t       * jwks;
+  unsigned int   refs;
+};
+
+struct _jwks_source {
+  char            * uri;
+  int               x5u_flags;
+  unsigned int      refresh_interval;
+  unsigned int      min_refresh_interval;
+  jwks_snapshot_t * current;
+  unsigned int      epoch;
+  unsigned int      readers[2];
+  time_t            last_fetch;
+  int               refresh_requested;
+  int               stop;
+  pthread_t         thread;
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;
+};
+
+static void _r_jwks_source_synchronize(jwks_source_t * source) {
+  unsigned int i, epoch;
+
+  for (i=0; i<2; i++) {
+    epoch = __atomic_fetch_add(&source->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&source->readers[epoch], __ATOMIC_SEQ_CST)) {
+      sched_yield();
+    }
+  }
+}
+
+static void _r_jwks_source_publish(jwks_source_t * source, jwks_snapshot_t * snapshot) {
+  jwks_snapshot_t * previous = __atomic_exchange_n(&source->current, snapshot, __ATOMIC_SEQ_CST);
+
+  if (previous != NULL) {
+    _r_jwks_source_synchronize(source);
+    r_jwks_snapshot_release(previous);
+  }
+}
+
+/**
+ * Downloads and validates the jwks, then publishes it if it's valid
+ * The previous snapshot is kept on any error
+ */
+static int _r_jwks_source_fetch(jwks_source_t * source) {
+  int ret;
+  char * content;
+  json_t * j_content;
+  jwks_snapshot_t * snapshot;
+
+  if ((content = _r_get_http_content_uncached(source->uri, source->x5u_flags, "application/json")) != NULL) {
+    if ((j_content = json_loads(content, JSON_DECODE_ANY, NULL)) != NULL) {
+      if ((snapshot = o_malloc(sizeof(jwks_snapshot_t))) != NULL) {
+        snapshot->refs = 1;
+        if ((ret = r_jwks_init(&snapshot->jwks)) == RHN_OK &&
+            (ret = r_jwks_import_from_json_t(snapshot->jwks, j_content)) == RHN_OK &&
+            (ret = r_jwks_is_valid(snapshot->jwks)) == RHN_OK &&
+            (ret = r_jwks_build_index(snapshot->jwks)) == RHN_OK) {
+          _r_jwks_source_publish(source, snapshot);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "jwks source - Invalid jwks at %s", source->uri);
+          r_jwks_snapshot_release(snapshot);
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "jwks source - Error allocating resources for snapshot");
+        ret = RHN_ERROR_MEMORY;
+      }
+      json_decref(j_content);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "jwks source - Error parsing content of %s", source->uri);
+      ret = RHN_ERROR_PARAM;
+    }
+    o_free(content);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "jwks source - Error getting content of %s", source->uri);
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+static void * _r_jwks_source_run(void * arg) {
+  jwks_source_t * source = (jwks_source_t *)arg;
+  struct timespec deadline = {0, 0};
+
+  pthread_mutex_lock(&source->lock);
+  while (!source->stop) {
+    deadline.tv_sec = source->last_fetch + (time_t)source->refresh_interval;
+    while (!source->stop && !source->refresh_requested && time(NULL) < deadline.tv_sec) {
+      pthread_cond_timedwait(&source->cond, &source->lock, &deadline);
+    }
+    if (!source->stop) {
+      source->refresh_requested = 0;
+      source->last_fetch = time(NULL);
+      pthread_mutex_unlock(&source->lock);
+      _r_jwks_source_fetch(source);
+      pthread_mutex_lock(&source->lock);
+    }
+  }
+  pthread_mutex_unlock(&source->lock);
+  return NULL;
+}
+
+int r_jwks_source_init(jwks_source_t ** source, const char * uri, int x5u_flags, unsigned int refresh_interval, unsigned int min_refresh_interval) {
+  int ret = RHN_OK;
+
+  if (source != NULL && !o_strnullempty(uri) && refresh_interval) {
+    if ((*source = o_malloc(sizeof(jwks_source_t))) != NULL) {
+      memset(*source, 0, sizeof(jwks_source_t));
+      (*source)->x5u_flags = x5u_flags;
+      (*source)->refresh_interval = refresh_interval;
+      (*source)->min_refresh_interval = min_refresh_interval;
+      if (((*source)->uri = o_strdup(uri)) != NULL) {
+        if (!pthread_mutex_init(&(*source)->lock, NULL)) {
+          if (!pthread_cond_init(&(*source)->cond, NULL)) {
+            (*source)->last_fetch = time(NULL);
+            if (_r_jwks_source_fetch(*source) != RHN_OK) {
+              y_log_message(Y_LOG_LEVEL_WARNING, "r_jwks_source_init - First download of %s failed, the source has no key until the next refresh", uri);
+            }
+            if (pthread_create(&(*source)->thread, NULL, _r_jwks_source_run, *source)) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_source_init - Error pthread_create");
+              pthread_cond_destroy(&(*source)->cond);
+              pthread_mutex_destroy(&(*source)->lock);
+              ret = RHN_ERROR;
+            }
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_source_init - Error pthread_cond_init");
+            pthread_mutex_destroy(&(*source)->lock);
+            ret = RHN_ERROR;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_source_init - Error pthread_mutex_init");
+          ret = RHN_ERROR;
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_source_init - Error allocating resources for uri");
+        ret = RHN_ERROR_MEMORY;
+      }
+      if (ret != RHN_OK) {
+        r_jwks_snapshot_release((*source)->current);
+        o_free((*source)->uri);
+        o_free(*source);
+        *source = NULL;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwks_source_init - Error allocating resources for source");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_jwks_source_free(jwks_source_t * source) {
+  if (source != NULL) {
+    pthread_mutex_lock(&source->lock);
+    source->stop = 1;
+    pthread_cond_signal(&source->cond);
+    pthread_mutex_unlock(&source->lock);
+    pthread_join(source->thread, NULL);
+    pthread_cond_destroy(&source->cond);
+    pthread_mutex_destroy(&source->lock);
+    r_jwks_snapshot_release(source->current);
+    o_free(source->uri);
+    o_free(source);
+  }
+}
+
+jwks_snapshot_t * r_jwks_source_acquire(jwks_source_t * source) {
+  jwks_snapshot_t * snapshot = NULL;
+  unsigned int epoch;
+
+  if (source != NULL) {
+    epoch = __atomic_load_n(&source->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&source->readers[epoch], 1, __ATOMIC_SEQ_CST);
+    if ((snapshot = __atomic_load_n(&source->current, __ATOMIC_SEQ_CST)) != NULL) {
+      __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_sub_fetch(&source->readers[epoch], 1, __ATOMIC_SEQ_CST);
+  }
+  return snapshot;
+}
+
+void r_jwks_snapshot_release(jwks_snapshot_t * snapshot) {
+  if (snapshot != NULL && !__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_SEQ_CST)) {
+    r_jwks_free(snapshot->jwks);
+    o_free(snapshot);
+  }
+}
+
+jwks_t * r_jwks_snapshot_get_jwks(jwks_snapshot_t * snapshot) {
+  if (snapshot != NULL) {
+    return snapshot->jwks;
+  } else {
+    return NULL;
+  }
+}
+
+int r_jwks_source_request_refresh(jwks_source_t * source) {
+  int ret;
+
+  if (source != NULL) {
+    pthread_mutex_lock(&source->lock);
+    if (source->refresh_requested) {
+      ret = RHN_OK;
+    } else if (time(NULL) >= source->last_fetch + (time_t)source->min_refresh_interval) {
+      source->refresh_requested = 1;
+      pthread_cond_signal(&source->cond);
+      ret = RHN_OK;
+    } else {
+      ret = RHN_ERROR_INVALID;
+    }
+    pthread_mutex_unlock(&source->lock);
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+jwk_t * r_jwks_source_get_by_kid(jwks_source_t * source, const char * kid) {
+  jwks_snapshot_t * snapshot;
+  jwk_t * jwk = NULL;
+
+  if (source != NULL && !o_strnullempty(kid)) {
+    snapshot = r_jwks_source_acquire(source);
+    if ((jwk = r_jwk_copy(r_jwks_peek_by_kid(r_jwks_snapshot_get_jwks(snapshot), kid))) == NULL) {
+      if (r_jwks_source_request_refresh(source) == RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_DEBUG, "r_jwks_source_get_by_kid - kid %s not found, refresh requested", kid);
+      }
+    }
+    r_jwks_snapshot_release(snapshot);
+  }
+  return jwk;
+}
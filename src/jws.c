@@ -31,12 +31,102 @@
 #include <yder.h>
 #include <rhonabwy.h>
 
+#if NETTLE_VERSION_NUMBER >= 0x030400
+#include <nettle/memops.h>
+#endif
+
+#define R_JWS_DIGEST_MAX_LEN 64
+#define R_JWS_HMAC_B64URL_MAX_LEN 88
+#define R_JWS_HEADER_STACK_LEN 512
+
+jwk_prepared_t * _r_jwk_prepare(jwk_t * jwk, int x5u_flags, int borrow);
+gnutls_hmac_hd_t _r_jwk_prepared_hmac(jwk_prepared_t * prepared, gnutls_mac_algorithm_t alg);
+
+/**
+ * Converts a JWS alg name without a chain of string comparisons
+ * Returns R_JWA_ALG_UNKNOWN if alg isn't a JWS alg
+ */
+static jwa_alg _r_jws_str_to_alg(const char * alg, size_t alg_len) {
+  static const jwa_alg hs[3] = {R_JWA_ALG_HS256, R_JWA_ALG_HS384, R_JWA_ALG_HS512},
+                       rs[3] = {R_JWA_ALG_RS256, R_JWA_ALG_RS384, R_JWA_ALG_RS512},
+                       ps[3] = {R_JWA_ALG_PS256, R_JWA_ALG_PS384, R_JWA_ALG_PS512},
+                       es[3] = {R_JWA_ALG_ES256, R_JWA_ALG_ES384, R_JWA_ALG_ES512};
+  int size;
+
+  if (alg == NULL) {
+    return R_JWA_ALG_UNKNOWN;
+  }
+  switch (alg_len) {
+    case 4:
+      return 0 == memcmp("none", alg, 4)?R_JWA_ALG_NONE:R_JWA_ALG_UNKNOWN;
+    case 5:
+      if (0 == memcmp("EdDSA", alg, 5)) {
+        return R_JWA_ALG_EDDSA;
+      }
+      if (alg[1] != 'S') {
+        return R_JWA_ALG_UNKNOWN;
+      }
+      if (0 == memcmp("256", alg+2, 3)) {
+        size = 0;
+      } else if (0 == memcmp("384", alg+2, 3)) {
+        size = 1;
+      } else if (0 == memcmp("512", alg+2, 3)) {
+        size = 2;
+      } else {
+        return R_JWA_ALG_UNKNOWN;
+      }
+      switch (alg[0]) {
+        case 'H':
+          return hs[size];
+        case 'R':
+          return rs[size];
+        case 'P':
+          return ps[size];
+        case 'E':
+          return es[size];
+        default:
+          return R_JWA_ALG_UNKNOWN;
+      }
+    case 6:
+      return 0 == memcmp("ES256K", alg, 6)?R_JWA_ALG_ES256K:R_JWA_ALG_UNKNOWN;
+    default:
+      return R_JWA_ALG_UNKNOWN;
+  }
+}
+
+json_t * _r_jws_decode_header(const char * jws_str, size_t jws_str_len, jwa_alg * alg) {
+  unsigned char stack_buf[R_JWS_HEADER_STACK_LEN], * buf = stack_buf;
+  size_t header_len = 0, buf_len = 0;
+  json_t * j_header = NULL, * j_alg;
+
+  if (jws_str != NULL && alg != NULL) {
+    while (header_len < jws_str_len && jws_str[header_len] != '.') {
+      header_len++;
+    }
+    if (header_len < jws_str_len && _r_base64url_decode((const unsigned char *)jws_str, header_len, NULL, &buf_len)) {
+      if (buf_len > R_JWS_HEADER_STACK_LEN) {
+        buf = o_malloc(buf_len);
+      }
+      if (buf != NULL && _r_base64url_decode((const unsigned char *)jws_str, header_len, buf, &buf_len)) {
+        if ((j_header = json_loadb((const char *)buf, buf_len, 0, NULL)) != NULL) {
+          j_alg = json_object_get(j_header, "alg");
+          *alg = _r_jws_str_to_alg(json_string_value(j_alg), json_string_length(j_alg));
+        }
+      }
+      if (buf != stack_buf) {
+        o_free(buf);
+      }
+    }
+  }
+  return j_header;
+}
+
 static json_t * r_jws_parse_protected(const unsigned char * header_b64url) {
   json_t * j_return = NULL;
   struct _o_datum dat = {0, NULL};
 
   do {
-    if (!o_base64url_decode_alloc(header_b64url, o_strlen((const char *)header_b64url), &dat)) {
+    if (!_r_base64url_decode_alloc(header_b64url, o_strlen((const char *)header_b64url), &dat)) {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_protected - Invalid base64");
       break;
     }
@@ -49,20 +139,18 @@ static json_t * r_jws_parse_protected(const unsigned char * header_b64url) {
 static int r_jws_extract_header(jws_t * jws, json_t * j_header, uint32_t parse_flags, int x5u_flags) {
   int ret;
   jwk_t * jwk;
+  json_t * j_alg;
+  jwa_alg alg;
 
   if (json_is_object(j_header)) {
     ret = RHN_OK;
 
-    if (json_object_get(j_header, "alg") != NULL) {
-      if (0 != o_strcmp("HS256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("HS384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("HS512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("RS256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("RS384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("RS512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("PS256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("PS384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("PS512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("ES256", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("ES384", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("ES512", json_string_value(json_object_get(j_header, "alg"))) &&
-      0 != o_strcmp("EdDSA", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("ES256K", json_string_value(json_object_get(j_header, "alg"))) && 0 != o_strcmp("none", json_string_value(json_object_get(j_header, "alg")))) {
+    if ((j_alg = json_object_get(j_header, "alg")) != NULL) {
+      if ((alg = _r_jws_str_to_alg(json_string_value(j_alg), json_string_length(j_alg))) == R_JWA_ALG_UNKNOWN) {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_extract_header - Invalid alg");
         ret = RHN_ERROR_PARAM;
       } else {
-        jws->alg = r_str_to_jwa_alg(json_string_value(json_object_get(j_header, "alg")));
+        jws->alg = alg;
       }
     }
 
@@ -125,12 +213,12 @@ static int r_jws_set_header_value(jws_t * jws, int force) {
   if (jws != NULL) {
     if (jws->header_b64url == NULL || force) {
       if ((header_str = json_dumps(jws->j_header, JSON_COMPACT)) != NULL) {
-        if (o_base64url_encode_alloc((const unsigned char *)header_str, o_strlen(header_str), &dat)) {
+        if (_r_base64url_encode_alloc((const unsigned char *)header_str, o_strlen(header_str), &dat)) {
           o_free(jws->header_b64url);
           jws->header_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
           o_free(dat.data);
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_header_value - Error o_base64url_encode header_str");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_header_value - Error _r_base64url_encode header_str");
           ret = RHN_ERROR;
         }
         o_free(header_str);
@@ -164,12 +252,12 @@ static int r_jws_set_payload_value(jws_t * jws, int force) {
           payload_to_set_len = jws->payload_len;
         }
         if (ret == RHN_OK) {
-          if (o_base64url_encode_alloc(payload_to_set, payload_to_set_len, &dat)) {
+          if (_r_base64url_encode_alloc(payload_to_set, payload_to_set_len, &dat)) {
             o_free(jws->payload_b64url);
             jws->payload_b64url = (unsigned char *)o_strndup((const char *)dat.data, dat.size);
             o_free(dat.data);
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_payload_value - Error o_base64url_encode payload");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_payload_value - Error _r_base64url_encode payload");
             ret = RHN_ERROR;
           }
         }
@@ -196,36 +284,93 @@ static int r_jws_set_token_values(jws_t * jws, int force) {
   return ret;
 }
 
-static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
-  int alg = GNUTLS_DIG_NULL;
-  unsigned char * data = NULL, * key = NULL, * sig = NULL, * to_return = NULL;
-  size_t key_len = 0, sig_len = 0;
+/**
+ * Hash the signing input header_b64url.payload_b64url without concatenating it
+ */
+static int r_jws_hash_signing_input(jws_t * jws, gnutls_digest_algorithm_t alg, unsigned char * digest, unsigned int * digest_len) {
+  gnutls_hash_hd_t hash;
+  int ret;
+
+  if (!gnutls_hash_init(&hash, alg)) {
+    if (!gnutls_hash(hash, jws->header_b64url, o_strlen((const char *)jws->header_b64url)) &&
+        !gnutls_hash(hash, ".", 1) &&
+        !gnutls_hash(hash, jws->payload_b64url, o_strlen((const char *)jws->payload_b64url))) {
+      *digest_len = gnutls_hash_get_len(alg);
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_hash_signing_input - Error gnutls_hash");
+      ret = RHN_ERROR;
+    }
+    gnutls_hash_deinit(hash, digest);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_hash_signing_input - Error gnutls_hash_init");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Compute the HMAC of the signing input header_b64url.payload_b64url without concatenating it
+ */
+static int r_jws_hmac_signing_input(jws_t * jws, gnutls_mac_algorithm_t alg, jwk_prepared_t * key, unsigned char * sig) {
+  gnutls_hmac_hd_t hmac;
+  int ret;
+
+  if ((hmac = _r_jwk_prepared_hmac(key, alg)) != NULL) {
+    if (!gnutls_hmac(hmac, jws->header_b64url, o_strlen((const char *)jws->header_b64url)) &&
+        !gnutls_hmac(hmac, ".", 1) &&
+        !gnutls_hmac(hmac, jws->payload_b64url, o_strlen((const char *)jws->payload_b64url))) {
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_hmac_signing_input - Error gnutls_hmac");
+      ret = RHN_ERROR;
+    }
+    gnutls_hmac_deinit(hmac, sig);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_hmac_signing_input - Error _r_jwk_prepared_hmac");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Build the signing input header_b64url.payload_b64url in one buffer
+ * Used by EdDSA only, which signs the whole message and can't use a digest
+ */
+static int r_jws_build_signing_input(jws_t * jws, gnutls_datum_t * data) {
+  size_t header_len = o_strlen((const char *)jws->header_b64url), payload_len = o_strlen((const char *)jws->payload_b64url);
+
+  if ((data->data = o_malloc(header_len+payload_len+1)) != NULL) {
+    memcpy(data->data, jws->header_b64url, header_len);
+    data->data[header_len] = '.';
+    memcpy(data->data+header_len+1, jws->payload_b64url, payload_len);
+    data->size = (unsigned int)(header_len+payload_len+1);
+    return RHN_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_build_signing_input - Error allocating resources for data");
+    return RHN_ERROR_MEMORY;
+  }
+}
+
+static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_prepared_t * key) {
+  int alg = GNUTLS_MAC_UNKNOWN;
+  unsigned char * sig = NULL, * to_return = NULL;
+  size_t sig_len = 0, key_len = 0;
   struct _o_datum dat_sig = {0, NULL};
 
   if (jws->alg == R_JWA_ALG_HS256) {
-    alg = GNUTLS_DIG_SHA256;
+    alg = GNUTLS_MAC_SHA256;
   } else if (jws->alg == R_JWA_ALG_HS384) {
-    alg = GNUTLS_DIG_SHA384;
+    alg = GNUTLS_MAC_SHA384;
   } else if (jws->alg == R_JWA_ALG_HS512) {
-    alg = GNUTLS_DIG_SHA512;
+    alg = GNUTLS_MAC_SHA512;
   }
 
-  if (alg != GNUTLS_DIG_NULL) {
-    sig_len = (unsigned)gnutls_hmac_get_len((gnutls_mac_algorithm_t)alg);
-    sig = o_malloc(sig_len);
-
-    key_len = o_strlen(r_jwk_get_property_str(jwk, "k"));
-    if (key_len) {
-      key = o_malloc(key_len);
-
-      if (key != NULL) {
-        if (r_jwk_export_to_symmetric_key(jwk, key, &key_len) != RHN_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error r_jwk_export_to_symmetric_key");
-          o_free(key);
-          key = NULL;
-        }
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error allocating resources for key");
+  if (alg != GNUTLS_MAC_UNKNOWN) {
+    if (_r_jwk_prepared_get_key(key, &key_len) != NULL && key_len) {
+      sig_len = (unsigned)gnutls_hmac_get_len((gnutls_mac_algorithm_t)alg);
+      if ((sig = o_malloc(sig_len)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error allocating resources for sig");
       }
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error key invalid, 'k' empty");
@@ -234,56 +379,68 @@ static unsigned char * r_jws_sign_hmac(jws_t * jws, jwk_t * jwk) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error key invalid, 'alg' invalid");
   }
 
-  if (key != NULL && sig != NULL) {
-    data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    if (!gnutls_hmac_fast((gnutls_mac_algorithm_t)alg, key, key_len, data, o_strlen((const char *)data), sig)) {
-      if (o_base64url_encode_alloc(sig, sig_len, &dat_sig)) {
+  if (sig != NULL) {
+    if (r_jws_hmac_signing_input(jws, (gnutls_mac_algorithm_t)alg, key, sig) == RHN_OK) {
+      if (_r_base64url_encode_alloc(sig, sig_len, &dat_sig)) {
         to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error o_base64url_encode sig_b64");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error _r_base64url_encode sig_b64");
       }
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error gnutls_hmac_fast");
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_hmac - Error r_jws_hmac_signing_input");
     }
   }
 
-  o_free(data);
   o_free(sig);
-  o_free(key);
 
   return to_return;
 }
 
-static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
-  gnutls_datum_t body_dat, sig_dat;
-  unsigned char * to_return = NULL;
-  int alg = GNUTLS_DIG_NULL, res;
+static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_prepared_t * key) {
+  gnutls_privkey_t privkey = _r_jwk_prepared_get_privkey(key);
+  gnutls_datum_t hash_dat, sig_dat;
+  unsigned char * to_return = NULL, digest[R_JWS_DIGEST_MAX_LEN];
+  int dig = GNUTLS_DIG_NULL, res;
   unsigned int flag = 0;
   struct _o_datum dat_sig = {0, NULL};
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+  int alg = GNUTLS_SIGN_UNKNOWN;
+#endif
 
   switch (jws->alg) {
     case R_JWA_ALG_RS256:
-      alg = GNUTLS_DIG_SHA256;
+      dig = GNUTLS_DIG_SHA256;
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+      alg = GNUTLS_SIGN_RSA_SHA256;
+#endif
       break;
     case R_JWA_ALG_RS384:
-      alg = GNUTLS_DIG_SHA384;
+      dig = GNUTLS_DIG_SHA384;
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+      alg = GNUTLS_SIGN_RSA_SHA384;
+#endif
       break;
     case R_JWA_ALG_RS512:
-      alg = GNUTLS_DIG_SHA512;
+      dig = GNUTLS_DIG_SHA512;
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+      alg = GNUTLS_SIGN_RSA_SHA512;
+#endif
       break;
 /* RSA-PSS signature is available with GnuTLS >= 3.6 */
 #if GNUTLS_VERSION_NUMBER >= 0x030600
     case R_JWA_ALG_PS256:
+      dig = GNUTLS_DIG_SHA256;
       alg = GNUTLS_SIGN_RSA_PSS_SHA256;
       flag = GNUTLS_PRIVKEY_SIGN_FLAG_RSA_PSS;
       break;
     case R_JWA_ALG_PS384:
+      dig = GNUTLS_DIG_SHA384;
       alg = GNUTLS_SIGN_RSA_PSS_SHA384;
       flag = GNUTLS_PRIVKEY_SIGN_FLAG_RSA_PSS;
       break;
     case R_JWA_ALG_PS512:
+      dig = GNUTLS_DIG_SHA512;
       alg = GNUTLS_SIGN_RSA_PSS_SHA512;
       flag = GNUTLS_PRIVKEY_SIGN_FLAG_RSA_PSS;
       break;
@@ -293,41 +450,38 @@ static unsigned char * r_jws_sign_rsa(jws_t * jws, jwk_t * jwk) {
   }
 
   if (privkey != NULL && GNUTLS_PK_RSA == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = (unsigned int)o_strlen((const char *)body_dat.data);
-
-    if (!(res =
+    if (dig != GNUTLS_DIG_NULL && r_jws_hash_signing_input(jws, (gnutls_digest_algorithm_t)dig, digest, &hash_dat.size) == RHN_OK) {
+      hash_dat.data = digest;
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-                 gnutls_privkey_sign_data2
+      res = gnutls_privkey_sign_hash2(privkey, (gnutls_sign_algorithm_t)alg, flag, &hash_dat, &sig_dat);
 #else
-                 gnutls_privkey_sign_data
+      res = gnutls_privkey_sign_hash(privkey, (gnutls_digest_algorithm_t)dig, flag, &hash_dat, &sig_dat);
 #endif
-                                           (privkey, (gnutls_sign_algorithm_t)alg, flag, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
-        to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-        o_free(dat_sig.data);
+      if (!res) {
+        if (_r_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
+          to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
+          o_free(dat_sig.data);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error _r_base64url_encode for to_return");
+        }
+        gnutls_free(sig_dat.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error o_base64url_encode for to_return");
-        o_free(to_return);
-        to_return = NULL;
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error gnutls_privkey_sign_hash2, res %d", res);
       }
-      gnutls_free(sig_dat.data);
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error gnutls_privkey_sign_data2, res %d", res);
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error r_jws_hash_signing_input");
     }
-    o_free(body_dat.data);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_rsa - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
   return to_return;
 }
 
-static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
+static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_prepared_t * key) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
-  gnutls_datum_t body_dat, sig_dat, r, s;
-  unsigned char * binary_sig = NULL, * to_return = NULL;
+  gnutls_privkey_t privkey = _r_jwk_prepared_get_privkey(key);
+  gnutls_datum_t hash_dat, sig_dat, r, s;
+  unsigned char * binary_sig = NULL, * to_return = NULL, digest[R_JWS_DIGEST_MAX_LEN];
   int alg = GNUTLS_DIG_NULL, res;
   unsigned int adj = 0;
   unsigned int r_padding = 0, s_padding = 0, r_out_padding = 0, s_out_padding = 0;
@@ -346,79 +500,76 @@ static unsigned char * r_jws_sign_ecdsa(jws_t * jws, jwk_t * jwk) {
   }
 
   if (privkey != NULL && GNUTLS_PK_EC == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = (unsigned int)o_strlen((const char *)body_dat.data);
-
-    if (!(res = gnutls_privkey_sign_data(privkey, (gnutls_digest_algorithm_t)alg, 0, &body_dat, &sig_dat))) {
-      if (!gnutls_decode_rs_value(&sig_dat, &r, &s)) {
-        if (r.size > adj) {
-          r_padding = r.size - adj;
-        } else if (r.size < adj) {
-          r_out_padding = adj - r.size;
-        }
+    if (alg != GNUTLS_DIG_NULL && r_jws_hash_signing_input(jws, (gnutls_digest_algorithm_t)alg, digest, &hash_dat.size) == RHN_OK) {
+      hash_dat.data = digest;
+      if (!(res = gnutls_privkey_sign_hash(privkey, (gnutls_digest_algorithm_t)alg, 0, &hash_dat, &sig_dat))) {
+        if (!gnutls_decode_rs_value(&sig_dat, &r, &s)) {
+          if (r.size > adj) {
+            r_padding = r.size - adj;
+          } else if (r.size < adj) {
+            r_out_padding = adj - r.size;
+          }
 
-        if (s.size > adj) {
-          s_padding = s.size - adj;
-        } else if (s.size < adj) {
-          s_out_padding = adj - s.size;
-        }
+          if (s.size > adj) {
+            s_padding = s.size - adj;
+          } else if (s.size < adj) {
+            s_out_padding = adj - s.size;
+          }
 
-        sig_size = adj << 1;
+          sig_size = adj << 1;
 
-        if ((binary_sig = o_malloc(sig_size)) != NULL) {
-          memset(binary_sig, 0, sig_size);
-          memcpy(binary_sig + r_out_padding, r.data + r_padding, r.size - r_padding);
-          memcpy(binary_sig + (r.size - r_padding + r_out_padding) + s_out_padding, s.data + s_padding, (s.size - s_padding));
-          if (o_base64url_encode_alloc(binary_sig, sig_size, &dat_sig)) {
-            to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
-            o_free(dat_sig.data);
+          if ((binary_sig = o_malloc(sig_size)) != NULL) {
+            memset(binary_sig, 0, sig_size);
+            memcpy(binary_sig + r_out_padding, r.data + r_padding, r.size - r_padding);
+            memcpy(binary_sig + (r.size - r_padding + r_out_padding) + s_out_padding, s.data + s_padding, (s.size - s_padding));
+            if (_r_base64url_encode_alloc(binary_sig, sig_size, &dat_sig)) {
+              to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
+              o_free(dat_sig.data);
+            } else {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error _r_base64url_encode_alloc for dat_sig");
+            }
+            o_free(binary_sig);
           } else {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error o_base64url_encode_alloc for dat_sig");
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error allocating resources for binary_sig");
           }
-          o_free(binary_sig);
+          gnutls_free(r.data);
+          gnutls_free(s.data);
         } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error allocating resources for binary_sig");
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error gnutls_decode_rs_value");
         }
-        gnutls_free(r.data);
-        gnutls_free(s.data);
+        gnutls_free(sig_dat.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error gnutls_decode_rs_value");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error gnutls_privkey_sign_hash: %d", res);
       }
-      gnutls_free(sig_dat.data);
     } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error gnutls_privkey_sign_data: %d", res);
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error r_jws_hash_signing_input");
     }
-    o_free(body_dat.data);
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_ecdsa - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
   return to_return;
 #else
   (void)(jws);
-  (void)(jwk);
+  (void)(key);
   return NULL;
 #endif
 }
 
-static unsigned char * r_jws_sign_eddsa(jws_t * jws, jwk_t * jwk) {
+static unsigned char * r_jws_sign_eddsa(jws_t * jws, jwk_prepared_t * key) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
+  gnutls_privkey_t privkey = _r_jwk_prepared_get_privkey(key);
   gnutls_datum_t body_dat, sig_dat;
   unsigned char * to_return = NULL;
   int res;
   struct _o_datum dat_sig = {0, NULL};
 
-  if (privkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_privkey_get_pk_algorithm(privkey, NULL)) {
-    body_dat.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-    body_dat.size = (unsigned int)o_strlen((const char *)body_dat.data);
-
+  if (privkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_privkey_get_pk_algorithm(privkey, NULL) && r_jws_build_signing_input(jws, &body_dat) == RHN_OK) {
     if (!(res = gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA512, 0, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
+      if (_r_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
         to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error o_base64url_encode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error _r_base64url_encode_alloc for dat_sig");
       }
       gnutls_free(sig_dat.data);
     } else {
@@ -428,19 +579,18 @@ static unsigned char * r_jws_sign_eddsa(jws_t * jws, jwk_t * jwk) {
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_eddsa - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
   return to_return;
 #else
   (void)(jws);
-  (void)(jwk);
+  (void)(key);
   return NULL;
 #endif
 }
 
 #if 0
-static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
+static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_prepared_t * key) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  gnutls_privkey_t privkey = r_jwk_export_to_gnutls_privkey(jwk);
+  gnutls_privkey_t privkey = _r_jwk_prepared_get_privkey(key);
   gnutls_datum_t body_dat, sig_dat;
   unsigned char * to_return = NULL;
   int res;
@@ -451,11 +601,11 @@ static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
     body_dat.size = o_strlen((const char *)body_dat.data);
 
     if (!(res = gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA256, 0, &body_dat, &sig_dat))) {
-      if (o_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
+      if (_r_base64url_encode_alloc(sig_dat.data, sig_dat.size, &dat_sig)) {
         to_return = (unsigned char*)o_strndup((const char *)dat_sig.data, dat_sig.size);
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error o_base64url_encode for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error _r_base64url_encode for dat_sig");
       }
       gnutls_free(sig_dat.data);
     } else {
@@ -465,61 +615,89 @@ static unsigned char * r_jws_sign_es256k(jws_t * jws, jwk_t * jwk) {
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_sign_es256k - Error extracting privkey");
   }
-  gnutls_privkey_deinit(privkey);
   return to_return;
 #else
   (void)(jws);
-  (void)(jwk);
+  (void)(key);
   return NULL;
 #endif
 }
 #endif
 
-static int r_jws_verify_sig_hmac(jws_t * jws, jwk_t * jwk) {
-  unsigned char * sig = r_jws_sign_hmac(jws, jwk);
-  int ret;
+/**
+ * Compare two buffers in constant time
+ */
+static int _r_jws_memeql(const unsigned char * a, const unsigned char * b, size_t len) {
+#if NETTLE_VERSION_NUMBER >= 0x030400
+  return memeql_sec(a, b, len);
+#else
+  unsigned char diff = 0;
+  size_t i;
+
+  for (i=0; i<len; i++) {
+    diff |= (unsigned char)(a[i] ^ b[i]);
+  }
+  return !diff;
+#endif
+}
+
+static int r_jws_verify_sig_hmac(jws_t * jws, jwk_prepared_t * key) {
+  unsigned char mac[R_JWS_DIGEST_MAX_LEN], mac_b64url[R_JWS_HMAC_B64URL_MAX_LEN];
+  size_t mac_b64url_len = 0, key_len = 0;
+  int alg = GNUTLS_MAC_UNKNOWN, ret = RHN_ERROR_INVALID;
 
-  if (sig != NULL && 0 == o_strcmp((const char *)jws->signature_b64url, (const char *)sig)) {
+  if (jws->alg == R_JWA_ALG_HS256) {
+    alg = GNUTLS_MAC_SHA256;
+  } else if (jws->alg == R_JWA_ALG_HS384) {
+    alg = GNUTLS_MAC_SHA384;
+  } else if (jws->alg == R_JWA_ALG_HS512) {
+    alg = GNUTLS_MAC_SHA512;
+  }
+
+  // The expected MAC is encoded in base64url instead of decoding the signature,
+  // so a non canonical encoding of the same bytes is still rejected
+  if (alg != GNUTLS_MAC_UNKNOWN && _r_jwk_prepared_get_key(key, &key_len) != NULL && key_len &&
+      r_jws_hmac_signing_input(jws, (gnutls_mac_algorithm_t)alg, key, mac) == RHN_OK &&
+      _r_base64url_encode(mac, gnutls_hmac_get_len((gnutls_mac_algorithm_t)alg), mac_b64url, &mac_b64url_len) &&
+      mac_b64url_len == o_strlen((const char *)jws->signature_b64url) &&
+      _r_jws_memeql(mac_b64url, jws->signature_b64url, mac_b64url_len)) {
     ret = RHN_OK;
-  } else {
-    ret = RHN_ERROR_INVALID;
   }
-  o_free(sig);
   return ret;
 }
 
-static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
-  int alg = GNUTLS_DIG_NULL, ret = RHN_OK;
-  unsigned int flag = 0;
-  gnutls_datum_t sig_dat = {NULL, 0}, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+static int r_jws_verify_sig_rsa(jws_t * jws, jwk_prepared_t * key) {
+  int alg = GNUTLS_SIGN_UNKNOWN, dig = GNUTLS_DIG_NULL, ret = RHN_OK;
+  unsigned char digest[R_JWS_DIGEST_MAX_LEN];
+  gnutls_datum_t sig_dat = {NULL, 0}, data = {digest, 0};
+  gnutls_pubkey_t pubkey = _r_jwk_prepared_get_pubkey(key);
   struct _o_datum dat_sig = {0, NULL};
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = (unsigned int)o_strlen((const char *)data.data);
-
   switch (jws->alg) {
     case R_JWA_ALG_RS256:
-      alg = GNUTLS_DIG_SHA256;
+      alg = GNUTLS_SIGN_RSA_SHA256;
+      dig = GNUTLS_DIG_SHA256;
       break;
     case R_JWA_ALG_RS384:
-      alg = GNUTLS_DIG_SHA384;
+      alg = GNUTLS_SIGN_RSA_SHA384;
+      dig = GNUTLS_DIG_SHA384;
       break;
     case R_JWA_ALG_RS512:
-      alg = GNUTLS_DIG_SHA512;
+      alg = GNUTLS_SIGN_RSA_SHA512;
+      dig = GNUTLS_DIG_SHA512;
       break;
 #if GNUTLS_VERSION_NUMBER >= 0x030600
     case R_JWA_ALG_PS256:
       alg = GNUTLS_SIGN_RSA_PSS_SHA256;
-      flag = GNUTLS_PRIVKEY_SIGN_FLAG_RSA_PSS;
+      dig = GNUTLS_DIG_SHA256;
       break;
     case R_JWA_ALG_PS384:
       alg = GNUTLS_SIGN_RSA_PSS_SHA384;
-      flag = GNUTLS_PRIVKEY_SIGN_FLAG_RSA_PSS;
+      dig = GNUTLS_DIG_SHA384;
       break;
     case R_JWA_ALG_PS512:
       alg = GNUTLS_SIGN_RSA_PSS_SHA512;
-      flag = GNUTLS_PRIVKEY_SIGN_FLAG_RSA_PSS;
+      dig = GNUTLS_DIG_SHA512;
       break;
 #endif
     default:
@@ -528,16 +706,19 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 
   if (pubkey != NULL && GNUTLS_PK_RSA == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (dig == GNUTLS_DIG_NULL || r_jws_hash_signing_input(jws, (gnutls_digest_algorithm_t)dig, digest, &data.size) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error r_jws_hash_signing_input");
+        ret = RHN_ERROR;
+      } else if (_r_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = (unsigned int)dat_sig.size;
-        if (gnutls_pubkey_verify_data2(pubkey, (gnutls_sign_algorithm_t)alg, flag, &data, &sig_dat)) {
+        if (gnutls_pubkey_verify_hash2(pubkey, (gnutls_sign_algorithm_t)alg, 0, &data, &sig_dat)) {
           y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error invalid signature");
           ret = RHN_ERROR_INVALID;
         }
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Error _r_base64url_decode_alloc for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -548,30 +729,29 @@ static int r_jws_verify_sig_rsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_rsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
   return ret;
 }
 
-static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
+static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_prepared_t * key) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
-  int alg = 0, ret = RHN_OK;
-  gnutls_datum_t sig_dat = {NULL, 0}, r, s, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  int alg = 0, dig = GNUTLS_DIG_NULL, ret = RHN_OK;
+  unsigned char digest[R_JWS_DIGEST_MAX_LEN];
+  gnutls_datum_t sig_dat = {NULL, 0}, r, s, data = {digest, 0};
+  gnutls_pubkey_t pubkey = _r_jwk_prepared_get_pubkey(key);
   struct _o_datum dat_sig = {0, NULL};
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = (unsigned int)o_strlen((const char *)data.data);
-
   switch (jws->alg) {
     case R_JWA_ALG_ES256:
       alg = GNUTLS_SIGN_ECDSA_SHA256;
+      dig = GNUTLS_DIG_SHA256;
       break;
     case R_JWA_ALG_ES384:
       alg = GNUTLS_SIGN_ECDSA_SHA384;
+      dig = GNUTLS_DIG_SHA384;
       break;
     case R_JWA_ALG_ES512:
       alg = GNUTLS_SIGN_ECDSA_SHA512;
+      dig = GNUTLS_DIG_SHA512;
       break;
     default:
       break;
@@ -579,7 +759,7 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 
   if (pubkey != NULL && GNUTLS_PK_EC == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (_r_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
         if (dat_sig.size == 64) {
           r.size = 32;
           r.data = dat_sig.data;
@@ -600,9 +780,14 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
           ret = RHN_ERROR_INVALID;
         }
 
+        if (ret == RHN_OK && (dig == GNUTLS_DIG_NULL || r_jws_hash_signing_input(jws, (gnutls_digest_algorithm_t)dig, digest, &data.size) != RHN_OK)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error r_jws_hash_signing_input");
+          ret = RHN_ERROR;
+        }
+
         if (ret == RHN_OK) {
           if (!gnutls_encode_rs_value(&sig_dat, &r, &s)) {
-            if (gnutls_pubkey_verify_data2(pubkey, (gnutls_sign_algorithm_t)alg, 0, &data, &sig_dat)) {
+            if (gnutls_pubkey_verify_hash2(pubkey, (gnutls_sign_algorithm_t)alg, 0, &data, &sig_dat)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error invalid signature");
               ret = RHN_ERROR_INVALID;
             }
@@ -616,7 +801,7 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
         }
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Error _r_base64url_decode_alloc for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -627,30 +812,26 @@ static int r_jws_verify_sig_ecdsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_ecdsa - Invalid public key");
     ret = RHN_ERROR_PARAM;
   }
-  o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
   return ret;
 #else
   (void)(jws);
-  (void)(jwk);
-  (void)(x5u_flags);
+  (void)(key);
   return RHN_ERROR_INVALID;
 #endif
 }
 
-static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
+static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_prepared_t * key) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   int ret = RHN_OK;
-  gnutls_datum_t sig_dat = {NULL, 0}, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  gnutls_datum_t sig_dat = {NULL, 0}, data = {NULL, 0};
+  gnutls_pubkey_t pubkey = _r_jwk_prepared_get_pubkey(key);
   struct _o_datum dat_sig = {0, NULL};
 
-  data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
-  data.size = (unsigned int)o_strlen((const char *)data.data);
-
   if (pubkey != NULL && GNUTLS_PK_EDDSA_ED25519 == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (r_jws_build_signing_input(jws, &data) != RHN_OK) {
+        ret = RHN_ERROR_MEMORY;
+      } else if (_r_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = (unsigned int)dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, GNUTLS_SIGN_EDDSA_ED25519, 0, &data, &sig_dat)) {
@@ -659,7 +840,7 @@ static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
         }
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error o_base64url_decode for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_eddsa - Error _r_base64url_decode for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -671,22 +852,20 @@ static int r_jws_verify_sig_eddsa(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     ret = RHN_ERROR_PARAM;
   }
   o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
   return ret;
 #else
   (void)(jws);
-  (void)(jwk);
-  (void)(x5u_flags);
+  (void)(key);
   return RHN_ERROR_INVALID;
 #endif
 }
 
 #if 0
-static int r_jws_verify_sig_es256k(jws_t * jws, jwk_t * jwk, int x5u_flags) {
+static int r_jws_verify_sig_es256k(jws_t * jws, jwk_prepared_t * key) {
 #if GNUTLS_VERSION_NUMBER >= 0x030600
   int ret = RHN_OK;
   gnutls_datum_t sig_dat = {NULL, 0}, data;
-  gnutls_pubkey_t pubkey = r_jwk_export_to_gnutls_pubkey(jwk, x5u_flags);
+  gnutls_pubkey_t pubkey = _r_jwk_prepared_get_pubkey(key);
   struct _o_datum dat_sig = {0, NULL};
 
   data.data = (unsigned char *)msprintf("%s.%s", jws->header_b64url, jws->payload_b64url);
@@ -694,7 +873,7 @@ static int r_jws_verify_sig_es256k(jws_t * jws, jwk_t * jwk, int x5u_flags) {
 
   if (pubkey != NULL && GNUTLS_PK_EC == gnutls_pubkey_get_pk_algorithm(pubkey, NULL)) {
     if (!o_strnullempty((const char *)jws->signature_b64url)) {
-      if (o_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
+      if (_r_base64url_decode_alloc(jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), &dat_sig)) {
         sig_dat.data = dat_sig.data;
         sig_dat.size = dat_sig.size;
         if (gnutls_pubkey_verify_data2(pubkey, GNUTLS_SIGN_ECDSA_SHA256, 0, &data, &sig_dat)) {
@@ -703,7 +882,7 @@ static int r_jws_verify_sig_es256k(jws_t * jws, jwk_t * jwk, int x5u_flags) {
         }
         o_free(dat_sig.data);
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_es256k - Error o_base64url_decode_alloc for dat_sig");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_verify_sig_es256k - Error _r_base64url_decode_alloc for dat_sig");
         ret = RHN_ERROR;
       }
     } else {
@@ -715,26 +894,24 @@ static int r_jws_verify_sig_es256k(jws_t * jws, jwk_t * jwk, int x5u_flags) {
     ret = RHN_ERROR_PARAM;
   }
   o_free(data.data);
-  gnutls_pubkey_deinit(pubkey);
   return ret;
 #else
   (void)(jws);
-  (void)(jwk);
-  (void)(x5u_flags);
+  (void)(key);
   return RHN_ERROR_INVALID;
 #endif
 }
 #endif
 
-static int _r_verify_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_flags) {
-  int ret;
+static int _r_verify_signature_prepared(jws_t * jws, jwk_prepared_t * key, jwa_alg alg) {
+  int ret, type = r_jwk_prepared_key_type(key, NULL);
 
   switch (alg) {
     case R_JWA_ALG_HS256:
     case R_JWA_ALG_HS384:
     case R_JWA_ALG_HS512:
-      if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_HMAC) {
-        ret = r_jws_verify_sig_hmac(jws, jwk);
+      if (type & R_KEY_TYPE_HMAC) {
+        ret = r_jws_verify_sig_hmac(jws, key);
       } else {
         ret = RHN_ERROR_INVALID;
       }
@@ -745,8 +922,8 @@ static int _r_verify_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_fl
     case R_JWA_ALG_PS256:
     case R_JWA_ALG_PS384:
     case R_JWA_ALG_PS512:
-      if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_RSA) {
-        ret = r_jws_verify_sig_rsa(jws, jwk, x5u_flags);
+      if (type & R_KEY_TYPE_RSA) {
+        ret = r_jws_verify_sig_rsa(jws, key);
       } else {
         ret = RHN_ERROR_INVALID;
       }
@@ -754,23 +931,23 @@ static int _r_verify_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_fl
     case R_JWA_ALG_ES256:
     case R_JWA_ALG_ES384:
     case R_JWA_ALG_ES512:
-      if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_EC) {
-        ret = r_jws_verify_sig_ecdsa(jws, jwk, x5u_flags);
+      if (type & R_KEY_TYPE_EC) {
+        ret = r_jws_verify_sig_ecdsa(jws, key);
       } else {
         ret = RHN_ERROR_INVALID;
       }
       break;
     case R_JWA_ALG_EDDSA:
-      if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_EDDSA) {
-        ret = r_jws_verify_sig_eddsa(jws, jwk, x5u_flags);
+      if (type & R_KEY_TYPE_EDDSA) {
+        ret = r_jws_verify_sig_eddsa(jws, key);
       } else {
         ret = RHN_ERROR_INVALID;
       }
       break;
 #if 0
     case R_JWA_ALG_ES256K:
-      if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_EC) {
-        ret = r_jws_verify_sig_es256k(jws, jwk, x5u_flags);
+      if (type & R_KEY_TYPE_EC) {
+        ret = r_jws_verify_sig_es256k(jws, key);
       } else {
         ret = RHN_ERROR_INVALID;
       }
@@ -783,17 +960,30 @@ static int _r_verify_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_fl
   return ret;
 }
 
-static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_flags) {
+static int _r_verify_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_flags) {
+  int ret;
+  jwk_prepared_t * key;
+
+  if ((key = _r_jwk_prepare(jwk, x5u_flags, 1)) != NULL) {
+    ret = _r_verify_signature_prepared(jws, key, alg);
+  } else {
+    ret = RHN_ERROR_INVALID;
+  }
+  r_jwk_prepared_free(key);
+  return ret;
+}
+
+static unsigned char * _r_generate_signature_prepared(jws_t * jws, jwk_prepared_t * key, jwa_alg alg) {
   unsigned char * str_ret = NULL;
-  int res;
+  int type = r_jwk_prepared_key_type(key, NULL);
 
-  if (jws != NULL && (jwk != NULL || alg == R_JWA_ALG_NONE)) {
+  if (jws != NULL && (key != NULL || alg == R_JWA_ALG_NONE)) {
     switch (alg) {
       case R_JWA_ALG_HS256:
       case R_JWA_ALG_HS384:
       case R_JWA_ALG_HS512:
-        if (r_jwk_key_type(jwk, NULL, x5u_flags) & R_KEY_TYPE_HMAC) {
-          str_ret = r_jws_sign_hmac(jws, jwk);
+        if (type & R_KEY_TYPE_HMAC) {
+          str_ret = r_jws_sign_hmac(jws, key);
         }
         break;
       case R_JWA_ALG_RS256:
@@ -802,23 +992,20 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
       case R_JWA_ALG_PS256:
       case R_JWA_ALG_PS384:
       case R_JWA_ALG_PS512:
-        res = r_jwk_key_type(jwk, NULL, x5u_flags);
-        if (res & R_KEY_TYPE_RSA && res &R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_rsa(jws, jwk);
+        if (type & R_KEY_TYPE_RSA && type & R_KEY_TYPE_PRIVATE) {
+          str_ret = r_jws_sign_rsa(jws, key);
         }
         break;
       case R_JWA_ALG_ES256:
       case R_JWA_ALG_ES384:
       case R_JWA_ALG_ES512:
-        res = r_jwk_key_type(jwk, NULL, x5u_flags);
-        if (res & R_KEY_TYPE_EC && res & R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_ecdsa(jws, jwk);
+        if (type & R_KEY_TYPE_EC && type & R_KEY_TYPE_PRIVATE) {
+          str_ret = r_jws_sign_ecdsa(jws, key);
         }
         break;
       case R_JWA_ALG_EDDSA:
-        res = r_jwk_key_type(jwk, NULL, x5u_flags);
-        if (res & R_KEY_TYPE_EDDSA && res & R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_eddsa(jws, jwk);
+        if (type & R_KEY_TYPE_EDDSA && type & R_KEY_TYPE_PRIVATE) {
+          str_ret = r_jws_sign_eddsa(jws, key);
         }
         break;
       case R_JWA_ALG_NONE:
@@ -826,9 +1013,8 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
         break;
 #if 0
       case R_JWA_ALG_ES256K:
-        res = r_jwk_key_type(jwk, NULL, x5u_flags);
-        if (res & R_KEY_TYPE_EC && res & R_KEY_TYPE_PRIVATE) {
-          str_ret = r_jws_sign_es256k(jws, jwk);
+        if (type & R_KEY_TYPE_EC && type & R_KEY_TYPE_PRIVATE) {
+          str_ret = r_jws_sign_es256k(jws, key);
         }
         break;
 #endif
@@ -842,6 +1028,21 @@ static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg a
   return str_ret;
 }
 
+static unsigned char * _r_generate_signature(jws_t * jws, jwk_t * jwk, jwa_alg alg, int x5u_flags) {
+  unsigned char * str_ret = NULL;
+  jwk_prepared_t * key = NULL;
+
+  if (alg != R_JWA_ALG_NONE && jwk != NULL) {
+    if ((key = _r_jwk_prepare(jwk, x5u_flags, 1)) != NULL) {
+      str_ret = _r_generate_signature_prepared(jws, key, alg);
+    }
+  } else {
+    str_ret = _r_generate_signature_prepared(jws, NULL, alg);
+  }
+  r_jwk_prepared_free(key);
+  return str_ret;
+}
+
 int r_jws_init(jws_t ** jws) {
   int ret;
 
@@ -858,6 +1059,12 @@ int r_jws_init(jws_t ** jws) {
             (*jws)->payload_len = 0;
             (*jws)->j_json_serialization = NULL;
             (*jws)->token_mode = R_JSON_MODE_COMPACT;
+            (*jws)->payload_alloc_len = 0;
+            (*jws)->spare_b64url[0] = NULL;
+            (*jws)->spare_b64url[1] = NULL;
+            (*jws)->spare_b64url[2] = NULL;
+            (*jws)->spare_payload = NULL;
+            (*jws)->spare_payload_len = 0;
             ret = RHN_OK;
           } else {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_init - Error allocating resources for jwks_privkey");
@@ -895,10 +1102,47 @@ void r_jws_free(jws_t * jws) {
     json_decref(jws->j_header);
     o_free(jws->payload);
     json_decref(jws->j_json_serialization);
+    o_free(jws->spare_b64url[0]);
+    o_free(jws->spare_b64url[1]);
+    o_free(jws->spare_b64url[2]);
+    o_free(jws->spare_payload);
     o_free(jws);
   }
 }
 
+int r_jws_reset(jws_t * jws) {
+  int ret;
+
+  if (jws != NULL) {
+    r_jwks_empty(jws->jwks_privkey);
+    r_jwks_empty(jws->jwks_pubkey);
+    json_object_clear(jws->j_header);
+    json_decref(jws->j_json_serialization);
+    jws->j_json_serialization = NULL;
+    _r_spare_keep(&jws->spare_b64url[0], &jws->header_b64url);
+    _r_spare_keep(&jws->spare_b64url[1], &jws->payload_b64url);
+    _r_spare_keep(&jws->spare_b64url[2], &jws->signature_b64url);
+    if (jws->payload != NULL) {
+      if (jws->payload_alloc_len > jws->spare_payload_len) {
+        o_free(jws->spare_payload);
+        jws->spare_payload = jws->payload;
+        jws->spare_payload_len = jws->payload_alloc_len;
+      } else {
+        o_free(jws->payload);
+      }
+    }
+    jws->payload = NULL;
+    jws->payload_len = 0;
+    jws->payload_alloc_len = 0;
+    jws->alg = R_JWA_ALG_UNKNOWN;
+    jws->token_mode = R_JSON_MODE_COMPACT;
+    ret = RHN_OK;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
 jws_t * r_jws_copy(jws_t * jws) {
   jws_t * jws_copy = NULL;
   if (jws != NULL) {
@@ -927,7 +1171,11 @@ jws_t * r_jws_copy(jws_t * jws) {
   return jws_copy;
 }
 
-int r_jws_set_payload(jws_t * jws, const unsigned char * payload, size_t payload_len) {
+/**
+ * Set the decoded payload, payload_b64url is left unchanged so the parse
+ * functions can keep the payload as received
+ */
+static int r_jws_set_payload_data(jws_t * jws, const unsigned char * payload, size_t payload_len) {
   int ret;
 
   if (jws != NULL) {
@@ -936,14 +1184,16 @@ int r_jws_set_payload(jws_t * jws, const unsigned char * payload, size_t payload
       if ((jws->payload = o_malloc(payload_len)) != NULL) {
         memcpy(jws->payload, payload, payload_len);
         jws->payload_len = payload_len;
+        jws->payload_alloc_len = payload_len;
         ret = RHN_OK;
       } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_payload - Error allocating resources for payload");
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_set_payload_data - Error allocating resources for payload");
         ret = RHN_ERROR_MEMORY;
       }
     } else {
       jws->payload = NULL;
       jws->payload_len = 0;
+      jws->payload_alloc_len = 0;
       ret = RHN_OK;
     }
   } else {
@@ -952,6 +1202,14 @@ int r_jws_set_payload(jws_t * jws, const unsigned char * payload, size_t payload
   return ret;
 }
 
+int r_jws_set_payload(jws_t * jws, const unsigned char * payload, size_t payload_len) {
+  if (jws != NULL) {
+    // The received payload must not be signed or verified in place of the new one
+    _r_spare_keep(&jws->spare_b64url[1], &jws->payload_b64url);
+  }
+  return r_jws_set_payload_data(jws, payload, payload_len);
+}
+
 const unsigned char * r_jws_get_payload(jws_t * jws, size_t * payload_len) {
   if (jws != NULL) {
     if (payload_len != NULL) {
@@ -1450,25 +1708,79 @@ int r_jws_advanced_compact_parse(jws_t * jws, const char * jws_str, uint32_t par
   return r_jws_advanced_compact_parsen(jws, jws_str, o_strlen(jws_str), parse_flags, x5u_flags);
 }
 
-int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, int x5u_flags) {
+int r_jws_prescreen(const char * jws_str, size_t jws_str_len, uint64_t algs, jwks_t * jwks, const char * typ) {
+  json_t * j_header;
+  jwa_alg alg = R_JWA_ALG_UNKNOWN;
+  const char * kid;
   int ret;
-  char ** str_array = NULL;
-  char * token = NULL;
-  size_t split_size = 0, unzip_len = 0;
+
+  if (jws_str == NULL || !jws_str_len) {
+    return RHN_ERROR_PARAM;
+  }
+  if ((j_header = _r_jws_decode_header(jws_str, jws_str_len, &alg)) == NULL || alg == R_JWA_ALG_UNKNOWN) {
+    ret = RHN_ERROR_PARAM;
+  } else if (alg == R_JWA_ALG_NONE || (algs && !(algs & R_JWA_ALG_MASK(alg)))) {
+    ret = RHN_ERROR_INVALID;
+  } else if (typ != NULL && 0 != o_strcmp(typ, json_string_value(json_object_get(j_header, "typ")))) {
+    ret = RHN_ERROR_INVALID;
+  } else if (jwks != NULL) {
+    if ((kid = json_string_value(json_object_get(j_header, "kid"))) != NULL) {
+      ret = r_jwks_peek_by_kid(jwks, kid) != NULL?RHN_OK:RHN_ERROR_INVALID;
+    } else {
+      ret = r_jwks_size(jwks)?RHN_OK:RHN_ERROR_INVALID;
+    }
+  } else {
+    ret = RHN_OK;
+  }
+  json_decref(j_header);
+  return ret;
+}
+
+/**
+ * If j_header_decoded isn't NULL, it's the header already decoded from jws_str,
+ * e.g. by _r_jws_decode_header, so it isn't decoded again
+ */
+int _r_jws_advanced_compact_parsen_header(jws_t * jws, const char * jws_str, size_t jws_str_len, json_t * j_header_decoded, uint32_t parse_flags, int x5u_flags) {
+  int ret;
+  size_t offsets[3] = {0, 0, 0}, lengths[3] = {0, 0, 0}, nb_segments, header_len = 0, payload_len = 0, unzip_len = 0, data_len = 0;
+  const unsigned char * token = (const unsigned char *)jws_str;
   json_t * j_header = NULL;
-  struct _o_datum dat_header = {0, NULL}, dat_payload = {0, NULL};
-  unsigned char * unzip = NULL;
+  unsigned char * data = NULL, * unzip = NULL;
 
   if (jws != NULL && jws_str != NULL && jws_str_len) {
-    token = o_strndup(jws_str, jws_str_len);
-    if ((split_size = split_string(token, ".", &str_array)) == 2 || split_size == 3) {
+    if ((nb_segments = _r_split_compact_token(jws_str, jws_str_len, offsets, lengths, 3)) == 2 || nb_segments == 3) {
       // Check if all first 2 elements are base64url
-      if (o_base64url_decode_alloc((unsigned char *)str_array[0], o_strlen(str_array[0]), &dat_header) &&
-          o_base64url_decode_alloc((unsigned char *)str_array[1], o_strlen(str_array[1]), &dat_payload)) {
+      if ((j_header_decoded != NULL || _r_base64url_decode(token+offsets[0], lengths[0], NULL, &header_len)) &&
+          _r_base64url_decode(token+offsets[1], lengths[1], NULL, &payload_len)) {
         ret = RHN_OK;
         do {
+          // Decode payload and header in the same buffer, the payload first so the buffer can be kept as the jws payload
+          // The payload buffer kept by r_jws_reset is used if it's large enough
+          if (jws->spare_payload != NULL && jws->spare_payload_len >= payload_len+header_len+1) {
+            data = jws->spare_payload;
+            data_len = jws->spare_payload_len;
+            jws->spare_payload = NULL;
+            jws->spare_payload_len = 0;
+          } else if ((data = o_malloc(payload_len+header_len+1)) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error allocating resources for data");
+            ret = RHN_ERROR_MEMORY;
+            break;
+          } else {
+            data_len = payload_len+header_len+1;
+          }
+          if (!_r_base64url_decode(token+offsets[1], lengths[1], data, &payload_len) ||
+              (j_header_decoded == NULL && !_r_base64url_decode(token+offsets[0], lengths[0], data+payload_len, &header_len))) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error decoding jws from base64url format");
+            ret = RHN_ERROR_PARAM;
+            break;
+          }
+
           // Decode header
-          j_header = json_loadb((const char*)dat_header.data, dat_header.size, JSON_DECODE_ANY, NULL);
+          if (j_header_decoded != NULL) {
+            j_header = json_incref(j_header_decoded);
+          } else {
+            j_header = json_loadb((const char*)data+payload_len, header_len, JSON_DECODE_ANY, NULL);
+          }
           if (r_jws_extract_header(jws, j_header, parse_flags, x5u_flags) != RHN_OK) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error extracting header params");
             ret = RHN_ERROR_PARAM;
@@ -1488,33 +1800,39 @@ int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_
 
           // Decode payload
           if (0 == o_strcmp("DEF", r_jws_get_header_str_value(jws, "zip"))) {
-            if (_r_inflate_payload(dat_payload.data, dat_payload.size, &unzip, &unzip_len) != RHN_OK) {
+            if (_r_inflate_payload(data, payload_len, &unzip, &unzip_len) != RHN_OK) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error _r_inflate_payload");
               ret = RHN_ERROR_PARAM;
               break;
             }
-            if (r_jws_set_payload(jws, unzip, unzip_len) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error r_jws_set_payload");
+            if (r_jws_set_payload_data(jws, unzip, unzip_len) != RHN_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error r_jws_set_payload_data");
               ret = RHN_ERROR_PARAM;
               break;
             }
+          } else if (payload_len) {
+            o_free(jws->payload);
+            jws->payload = data;
+            jws->payload_len = payload_len;
+            jws->payload_alloc_len = data_len;
+            data = NULL;
           } else {
-            if (r_jws_set_payload(jws, dat_payload.data, dat_payload.size) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - Error r_jws_set_payload");
-              ret = RHN_ERROR;
-              break;
-            }
+            r_jws_set_payload_data(jws, NULL, 0);
           }
 
           o_free(jws->header_b64url);
-          jws->header_b64url = (unsigned char *)o_strdup(str_array[0]);
+          jws->header_b64url = _r_spare_strndup(&jws->spare_b64url[0], jws_str+offsets[0], lengths[0]);
+
+          // Keep the payload as received, so the signature is verified without encoding it again
+          o_free(jws->payload_b64url);
+          jws->payload_b64url = _r_spare_strndup(&jws->spare_b64url[1], jws_str+offsets[1], lengths[1]);
 
           o_free(jws->signature_b64url);
           jws->signature_b64url = NULL;
-          if (str_array[2] != NULL) {
-            jws->signature_b64url = (unsigned char *)o_strdup(str_array[2]);
+          if (nb_segments == 3) {
+            jws->signature_b64url = _r_spare_strndup(&jws->spare_b64url[2], jws_str+offsets[2], lengths[2]);
           }
-          if (r_jws_get_alg(jws) != R_JWA_ALG_NONE && o_strnullempty(str_array[2])) {
+          if (r_jws_get_alg(jws) != R_JWA_ALG_NONE && (nb_segments < 3 || !lengths[2])) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error invalid signature length");
             ret = RHN_ERROR_PARAM;
             break;
@@ -1522,24 +1840,25 @@ int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_
         } while (0);
         json_decref(j_header);
         o_free(unzip);
+        o_free(data);
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - error decoding jws from base64url format");
         ret = RHN_ERROR_PARAM;
       }
-      o_free(dat_header.data);
-      o_free(dat_payload.data);
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_advanced_compact_parsen - jws_str invalid format");
       ret = RHN_ERROR_PARAM;
     }
-    free_string_array(str_array);
-    o_free(token);
   } else {
     ret = RHN_ERROR_PARAM;
   }
   return ret;
 }
 
+int r_jws_advanced_compact_parsen(jws_t * jws, const char * jws_str, size_t jws_str_len, uint32_t parse_flags, int x5u_flags) {
+  return _r_jws_advanced_compact_parsen_header(jws, jws_str, jws_str_len, NULL, parse_flags, x5u_flags);
+}
+
 int r_jws_parse_json_t(jws_t * jws, json_t * jws_json, int x5u_flags) {
   return r_jws_advanced_parse_json_t(jws, jws_json, R_PARSE_HEADER_ALL, x5u_flags);
 }
@@ -1617,7 +1936,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
               ret = RHN_ERROR;
               break;
             }
-            if (!o_base64url_decode((unsigned char *)jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), NULL, &signature_len)) {
+            if (!_r_base64url_decode((unsigned char *)jws->signature_b64url, o_strlen((const char *)jws->signature_b64url), NULL, &signature_len)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Invalid JWS, signature not valid base64url format");
               ret = RHN_ERROR_PARAM;
               break;
@@ -1627,7 +1946,7 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
           }
 
           // Decode header
-          if (!o_base64url_decode_alloc((unsigned char *)jws->header_b64url, o_strlen((const char *)jws->header_b64url), &dat_header)) {
+          if (!_r_base64url_decode_alloc((unsigned char *)jws->header_b64url, o_strlen((const char *)jws->header_b64url), &dat_header)) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error decoding str_header");
             ret = RHN_ERROR_PARAM;
             break;
@@ -1644,19 +1963,19 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
           jws->j_header = json_incref(j_header);
 
           // Decode payload
-          if (!o_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
+          if (!_r_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error decoding payload");
             ret = RHN_ERROR_PARAM;
             break;
           }
 
-          if (r_jws_set_payload(jws, dat_payload.data, dat_payload.size) != RHN_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error r_jws_set_payload");
+          if (r_jws_set_payload_data(jws, dat_payload.data, dat_payload.size) != RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error r_jws_set_payload_data");
             ret = RHN_ERROR;
             break;
           }
 
-          if (r_jws_extract_header(jws, json_object_get(jws_json, "header"), parse_flags, x5u_flags) != RHN_OK) {
+          if (json_object_get(jws_json, "header") != NULL && r_jws_extract_header(jws, json_object_get(jws_json, "header"), parse_flags, x5u_flags) != RHN_OK) {
             y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error extracting header params");
             ret = RHN_ERROR_PARAM;
             break;
@@ -1682,13 +2001,13 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
               break;
             }
 
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "protected")), json_string_length(json_object_get(j_element, "protected")), NULL, &header_len)) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "protected")), json_string_length(json_object_get(j_element, "protected")), NULL, &header_len)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error header base64url format");
               ret = RHN_ERROR_PARAM;
               break;
             }
 
-            if (!o_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "signature")), json_string_length(json_object_get(j_element, "signature")), NULL, &signature_len)) {
+            if (!_r_base64url_decode((const unsigned char *)json_string_value(json_object_get(j_element, "signature")), json_string_length(json_object_get(j_element, "signature")), NULL, &signature_len)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error signature base64url format");
               ret = RHN_ERROR_PARAM;
               break;
@@ -1725,14 +2044,14 @@ int r_jws_advanced_parse_json_t(jws_t * jws, json_t * jws_json, uint32_t parse_f
             }
 
             // Decode payload
-            if (!o_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
+            if (!_r_base64url_decode_alloc((unsigned char *)jws->payload_b64url, o_strlen((const char *)jws->payload_b64url), &dat_payload)) {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - error decoding jws->payload");
               ret = RHN_ERROR_PARAM;
               break;
             }
 
-            if (r_jws_set_payload(jws, dat_payload.data, dat_payload.size) != RHN_OK) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error r_jws_set_payload");
+            if (r_jws_set_payload_data(jws, dat_payload.data, dat_payload.size) != RHN_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_parse_json_t - Error r_jws_set_payload_data");
               ret = RHN_ERROR;
               break;
             }
@@ -1784,12 +2103,12 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
 
   if (jws != NULL) {
     if (jwk_pubkey != NULL) {
-      jwk = r_jwk_copy(jwk_pubkey);
+      jwk = jwk_pubkey;
     } else {
       if ((kid = r_jws_get_header_str_value(jws, "kid")) != NULL || (jws->token_mode == R_JSON_MODE_FLATTENED && (kid = json_string_value(json_object_get(json_object_get(jws->j_json_serialization, "header"), "kid"))) != NULL)) {
-        jwk = r_jwks_get_by_kid(jws->jwks_pubkey, kid);
+        jwk = r_jwks_peek_by_kid(jws->jwks_pubkey, kid);
       } else if (r_jwks_size(jws->jwks_pubkey) == 1) {
-        jwk = r_jwks_get_at(jws->jwks_pubkey, 0);
+        jwk = r_jwks_peek_at(jws->jwks_pubkey, 0);
       }
     }
   }
@@ -1811,9 +2130,8 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
               if (jwk_pubkey != NULL) {
                 ret = _r_verify_signature(jws, jwk, jws->alg, x5u_flags);
               } else {
-                if ((cur_jwk = r_jwks_get_by_kid(jws->jwks_pubkey, kid)) != NULL) {
+                if ((cur_jwk = r_jwks_peek_by_kid(jws->jwks_pubkey, kid)) != NULL) {
                   ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
-                  r_jwk_free(cur_jwk);
                 }
               }
               if (ret != RHN_ERROR_INVALID) {
@@ -1826,9 +2144,8 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
                 }
               } else if (r_jwks_size(jws->jwks_pubkey)) {
                 for (i=0; i<r_jwks_size(jws->jwks_pubkey); i++) {
-                  cur_jwk = r_jwks_get_at(jws->jwks_pubkey, i);
+                  cur_jwk = r_jwks_peek_at(jws->jwks_pubkey, i);
                   ret = _r_verify_signature(jws, cur_jwk, jws->alg, x5u_flags);
-                  r_jwk_free(cur_jwk);
                   if (ret != RHN_ERROR_INVALID) {
                     break;
                   }
@@ -1863,10 +2180,82 @@ int r_jws_verify_signature(jws_t * jws, jwk_t * jwk_pubkey, int x5u_flags) {
   } else {
     ret = RHN_ERROR_PARAM;
   }
-  r_jwk_free(jwk);
   return ret;
 }
 
+int r_jws_verify_signature_prepared(jws_t * jws, jwk_prepared_t * key) {
+  int ret, res;
+  json_t * j_signature = NULL, * j_header;
+  size_t index = 0;
+
+  if (jws != NULL && key != NULL) {
+    if (jws->token_mode == R_JSON_MODE_GENERAL) {
+      ret = RHN_ERROR_INVALID;
+      o_free(jws->header_b64url);
+      o_free(jws->signature_b64url);
+      json_array_foreach(json_object_get(jws->j_json_serialization, "signatures"), index, j_signature) {
+        jws->header_b64url = (unsigned char *)json_string_value(json_object_get(j_signature, "protected"));
+        jws->signature_b64url = (unsigned char *)json_string_value(json_object_get(j_signature, "signature"));
+        if ((j_header = r_jws_parse_protected((const unsigned char *)json_string_value(json_object_get(j_signature, "protected")))) != NULL) {
+          res = r_jws_extract_header(jws, j_header, R_PARSE_NONE, R_FLAG_IGNORE_REMOTE);
+          json_decref(j_header);
+          if (res == RHN_OK) {
+            if ((ret = _r_verify_signature_prepared(jws, key, jws->alg)) != RHN_ERROR_INVALID) {
+              break;
+            }
+          } else {
+            ret = RHN_ERROR;
+            break;
+          }
+        } else {
+          ret = RHN_ERROR;
+          break;
+        }
+      }
+      jws->header_b64url = NULL;
+      jws->signature_b64url = NULL;
+    } else {
+      if (r_jws_set_token_values(jws, 0) == RHN_OK && jws->signature_b64url != NULL) {
+        ret = _r_verify_signature_prepared(jws, key, jws->alg);
+      } else {
+        ret = RHN_ERROR_PARAM;
+      }
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+static void _r_jws_verify_batch_token(struct _r_batch * batch, const char * token, rhn_batch_result_t * result) {
+  jws_t * jws = NULL;
+  jwk_prepared_t * key;
+
+  if (r_jws_init(&jws) == RHN_OK) {
+    if ((result->status = r_jws_advanced_parsen(jws, token, o_strlen(token), R_PARSE_NONE, 0)) == RHN_OK) {
+      if (jws->token_mode == R_JSON_MODE_GENERAL) {
+        result->status = RHN_ERROR_UNSUPPORTED;
+      } else if ((key = _r_batch_get_key(batch, r_jws_get_kid(jws))) == NULL) {
+        result->status = RHN_ERROR_INVALID;
+      } else if ((result->status = r_jws_verify_signature_prepared(jws, key)) == RHN_OK) {
+        // The payload is handed over to the result
+        result->payload = jws->payload;
+        result->payload_len = jws->payload_len;
+        jws->payload = NULL;
+        jws->payload_len = 0;
+        jws->payload_alloc_len = 0;
+      }
+    }
+  } else {
+    result->status = RHN_ERROR_MEMORY;
+  }
+  r_jws_free(jws);
+}
+
+int r_jws_verify_batch(const char ** tokens, size_t count, jwks_t * jwks_pubkey, int x5u_flags, unsigned int nb_threads, rhn_batch_result_t * results) {
+  return _r_batch_run(jwks_pubkey, x5u_flags, tokens, count, nb_threads, results, _r_jws_verify_batch_token);
+}
+
 char * r_jws_serialize(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags) {
   if (r_jws_get_alg(jws) != R_JWA_ALG_NONE) {
     return r_jws_serialize_unsecure(jws, jwk_privkey, x5u_flags);
@@ -1920,6 +2309,41 @@ char * r_jws_serialize_unsecure(jws_t * jws, jwk_t * jwk_privkey, int x5u_flags)
   return jws_str;
 }
 
+char * r_jws_serialize_prepared(jws_t * jws, jwk_prepared_t * key) {
+  char * jws_str = NULL;
+  jwa_alg alg;
+
+  if (jws != NULL && key != NULL) {
+    if (jws->alg == R_JWA_ALG_UNKNOWN && (alg = r_str_to_jwa_alg(r_jwk_get_property_str(_r_jwk_prepared_get_jwk(key), "alg"))) != R_JWA_ALG_NONE && alg != R_JWA_ALG_UNKNOWN) {
+      r_jws_set_alg(jws, alg);
+    }
+
+    if (jws->alg != R_JWA_ALG_NONE && jws->alg != R_JWA_ALG_UNKNOWN) {
+      if (r_jwk_get_property_str(_r_jwk_prepared_get_jwk(key), "kid") != NULL && r_jws_get_header_str_value(jws, "kid") == NULL) {
+        r_jws_set_header_str_value(jws, "kid", r_jwk_get_property_str(_r_jwk_prepared_get_jwk(key), "kid"));
+      }
+
+      o_free(jws->signature_b64url);
+      if (r_jws_set_token_values(jws, 1) == RHN_OK) {
+        jws->signature_b64url = _r_generate_signature_prepared(jws, key, jws->alg);
+        if (jws->signature_b64url != NULL) {
+          jws_str = msprintf("%s.%s.%s", jws->header_b64url, jws->payload_b64url, jws->signature_b64url);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_prepared - No signature");
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_prepared - Error r_jws_set_token_values");
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_prepared - Invalid alg");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jws_serialize_prepared - Error input parameters");
+  }
+
+  return jws_str;
+}
+
 char * r_jws_serialize_json_str(jws_t * jws, jwks_t * jwks_privkey, int x5u_flags, int mode) {
   json_t * j_result = r_jws_serialize_json_t(jws, jwks_privkey, x5u_flags, mode);
   char * str_result = json_dumps(j_result, JSON_COMPACT);
@@ -21,8 +21,12 @@
  *
  */
 
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
@@ -53,6 +57,9 @@ int r_jwt_init(jwt_t ** jwt) {
                   (*jwt)->key_len = 0;
                   (*jwt)->iv = NULL;
                   (*jwt)->iv_len = 0;
+                  (*jwt)->ecdh_pool = NULL;
+                  (*jwt)->remote_pending = 0;
+                  (*jwt)->claims_pending = 0;
                   ret = RHN_OK;
                 } else {
                   y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_init - Error allocating resources for jwks_pubkey_enc");
@@ -108,6 +115,84 @@ void r_jwt_free(jwt_t * jwt) {
   }
 }
 
+int r_jwt_reset(jwt_t * jwt) {
+  int ret = RHN_OK;
+
+  if (jwt != NULL) {
+    r_jwks_empty(jwt->jwks_privkey_sign);
+    r_jwks_empty(jwt->jwks_pubkey_sign);
+    r_jwks_empty(jwt->jwks_privkey_enc);
+    r_jwks_empty(jwt->jwks_pubkey_enc);
+    json_object_clear(jwt->j_header);
+    if (jwt->j_claims != NULL) {
+      json_object_clear(jwt->j_claims);
+    } else if ((jwt->j_claims = json_object()) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_reset - Error allocating resources for j_claims");
+      ret = RHN_ERROR_MEMORY;
+    }
+    if (jwt->jws != NULL) {
+      r_jws_reset(jwt->jws);
+    }
+    if (jwt->jwe != NULL) {
+      r_jwe_reset(jwt->jwe);
+    }
+    o_free(jwt->key);
+    jwt->key = NULL;
+    jwt->key_len = 0;
+    o_free(jwt->iv);
+    jwt->iv = NULL;
+    jwt->iv_len = 0;
+    jwt->sign_alg = R_JWA_ALG_UNKNOWN;
+    jwt->enc_alg = R_JWA_ALG_UNKNOWN;
+    jwt->enc = R_JWA_ENC_UNKNOWN;
+    jwt->type = R_JWT_TYPE_NONE;
+    jwt->parse_flags = R_PARSE_HEADER_ALL;
+    jwt->ecdh_pool = NULL;
+    jwt->remote_pending = 0;
+    jwt->claims_pending = 0;
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+/**
+ * The claims of a parsed signed JWT are kept in the jws payload
+ * and decoded on first access
+ */
+static json_t * _r_jwt_get_claims(jwt_t * jwt) {
+  const unsigned char * payload;
+  size_t payload_len = 0;
+
+  if (jwt->claims_pending) {
+    jwt->claims_pending = 0;
+    if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) == NULL ||
+        (jwt->j_claims = json_loadb((const char *)payload, payload_len, JSON_DECODE_ANY, NULL)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwt_get_claims - Error parsing payload as JSON");
+    }
+  }
+  return jwt->j_claims;
+}
+
+// The jws_t and jwe_t of a previous parse are reset instead of allocated again
+static int _r_jwt_renew_jws(jwt_t * jwt) {
+  // The pending claims are decoded before the payload is dropped
+  _r_jwt_get_claims(jwt);
+  if (jwt->jws != NULL) {
+    return r_jws_reset(jwt->jws);
+  } else {
+    return r_jws_init(&jwt->jws);
+  }
+}
+
+static int _r_jwt_renew_jwe(jwt_t * jwt) {
+  if (jwt->jwe != NULL) {
+    return r_jwe_reset(jwt->jwe);
+  } else {
+    return r_jwe_init(&jwt->jwe);
+  }
+}
+
 jwt_t * r_jwt_copy(jwt_t * jwt) {
   jwt_t * jwt_copy = NULL;
 
@@ -116,8 +201,9 @@ jwt_t * r_jwt_copy(jwt_t * jwt) {
       jwt_copy->sign_alg = jwt->sign_alg;
       jwt_copy->enc_alg = jwt->enc_alg;
       jwt_copy->enc = jwt->enc;
+      jwt_copy->ecdh_pool = jwt->ecdh_pool;
       json_decref(jwt_copy->j_header);
-      if (r_jwt_set_full_claims_json_t(jwt_copy, jwt->j_claims) != RHN_OK ||
+      if (r_jwt_set_full_claims_json_t(jwt_copy, _r_jwt_get_claims(jwt)) != RHN_OK ||
         r_jwt_add_enc_jwks(jwt_copy, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) != RHN_OK ||
         r_jwt_add_sign_jwks(jwt_copy, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) != RHN_OK ||
         (jwt_copy->j_header = json_deep_copy(jwt->j_header)) == NULL) {
@@ -195,7 +281,7 @@ char * r_jwt_get_full_header_str(jwt_t * jwt) {
 
 int r_jwt_set_claim_str_value(jwt_t * jwt, const char * key, const char * str_value) {
   if (jwt != NULL) {
-    return _r_json_set_str_value(jwt->j_claims, key, str_value);
+    return _r_json_set_str_value(_r_jwt_get_claims(jwt), key, str_value);
   } else {
     return RHN_ERROR_PARAM;
   }
@@ -203,7 +289,7 @@ int r_jwt_set_claim_str_value(jwt_t * jwt, const char * key, const char * str_va
 
 int r_jwt_set_claim_int_value(jwt_t * jwt, const char * key, rhn_int_t i_value) {
   if (jwt != NULL) {
-    return _r_json_set_int_value(jwt->j_claims, key, i_value);
+    return _r_json_set_int_value(_r_jwt_get_claims(jwt), key, i_value);
   } else {
     return RHN_ERROR_PARAM;
   }
@@ -211,7 +297,7 @@ int r_jwt_set_claim_int_value(jwt_t * jwt, const char * key, rhn_int_t i_value)
 
 int r_jwt_set_claim_json_t_value(jwt_t * jwt, const char * key, json_t * j_value) {
   if (jwt != NULL) {
-    return _r_json_set_json_t_value(jwt->j_claims, key, j_value);
+    return _r_json_set_json_t_value(_r_jwt_get_claims(jwt), key, j_value);
   } else {
     return RHN_ERROR_PARAM;
   }
@@ -219,42 +305,66 @@ int r_jwt_set_claim_json_t_value(jwt_t * jwt, const char * key, json_t * j_value
 
 const char * r_jwt_get_claim_str_value(jwt_t * jwt, const char * key) {
   if (jwt != NULL) {
-    return _r_json_get_str_value(jwt->j_claims, key);
+    return _r_json_get_str_value(_r_jwt_get_claims(jwt), key);
   }
   return NULL;
 }
 
 rhn_int_t r_jwt_get_claim_int_value(jwt_t * jwt, const char * key) {
   if (jwt != NULL) {
-    return _r_json_get_int_value(jwt->j_claims, key);
+    return _r_json_get_int_value(_r_jwt_get_claims(jwt), key);
   }
   return 0;
 }
 
 json_t * r_jwt_get_claim_json_t_value(jwt_t * jwt, const char * key) {
   if (jwt != NULL) {
-    return _r_json_get_json_t_value(jwt->j_claims, key);
+    return _r_json_get_json_t_value(_r_jwt_get_claims(jwt), key);
   }
   return NULL;
 }
 
 json_t * r_jwt_get_full_claims_json_t(jwt_t * jwt) {
   if (jwt != NULL) {
-    return _r_json_get_full_json_t(jwt->j_claims);
+    return _r_json_get_full_json_t(_r_jwt_get_claims(jwt));
   }
   return NULL;
 }
 
+json_t * r_jwt_get_claims_json_t(jwt_t * jwt, const char * const * claims, size_t nb_claims) {
+  const unsigned char * payload;
+  size_t payload_len = 0, i;
+  json_t * j_return = NULL, * j_value;
+
+  if (jwt != NULL && claims != NULL) {
+    if (jwt->claims_pending) {
+      if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL) {
+        j_return = _r_json_extract_members((const char *)payload, payload_len, claims, nb_claims);
+      }
+    } else if (json_is_object(jwt->j_claims) && (j_return = json_object()) != NULL) {
+      for (i=0; i<nb_claims; i++) {
+        if ((j_value = json_object_get(jwt->j_claims, claims[i])) != NULL && json_object_set_new(j_return, claims[i], json_deep_copy(j_value))) {
+          json_decref(j_return);
+          j_return = NULL;
+          break;
+        }
+      }
+    }
+  }
+  return j_return;
+}
+
 char * r_jwt_get_full_claims_str(jwt_t * jwt) {
   char * to_return = NULL;
   if (jwt != NULL) {
-    to_return = json_dumps(jwt->j_claims, JSON_COMPACT);
+    to_return = json_dumps(_r_jwt_get_claims(jwt), JSON_COMPACT);
   }
   return to_return;
 }
 
 int r_jwt_set_full_claims_json_t(jwt_t * jwt, json_t * j_claim) {
   if (jwt != NULL && json_is_object(j_claim)) {
+    jwt->claims_pending = 0;
     json_decref(jwt->j_claims);
     jwt->j_claims = json_deep_copy(j_claim);
     return RHN_OK;
@@ -286,7 +396,7 @@ int r_jwt_append_claims_json_t(jwt_t * jwt, json_t * j_claim) {
   int ret;
 
   if (jwt != NULL && j_claim_copy != NULL) {
-    if (!json_object_update(jwt->j_claims, j_claim_copy)) {
+    if (!json_object_update(_r_jwt_get_claims(jwt), j_claim_copy)) {
       ret = RHN_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_append_claims_json_t - Error json_object_update");
@@ -959,6 +1069,15 @@ const unsigned char * r_jwt_get_enc_iv(jwt_t * jwt, size_t * iv_len) {
   return NULL;
 }
 
+int r_jwt_set_ecdh_pool(jwt_t * jwt, rhn_ecdh_pool_t * pool) {
+  if (jwt != NULL) {
+    jwt->ecdh_pool = pool;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwt_generate_enc_iv(jwt_t * jwt) {
   int ret;
 
@@ -1029,7 +1148,7 @@ char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_fla
       }
       json_decref(j_header);
       if (r_jws_add_jwks(jws, jwt->jwks_privkey_sign, jwt->jwks_pubkey_sign) == RHN_OK) {
-        if ((payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
+        if ((payload = json_dumps(_r_jwt_get_claims(jwt), JSON_COMPACT)) != NULL) {
           if (r_jws_set_alg(jws, alg) == RHN_OK && r_jws_set_payload(jws, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
             token = r_jws_serialize_unsecure(jws, privkey, x5u_flags);
           } else {
@@ -1052,6 +1171,43 @@ char * r_jwt_serialize_signed_unsecure(jwt_t * jwt, jwk_t * privkey, int x5u_fla
   return token;
 }
 
+char * r_jwt_serialize_signed_prepared(jwt_t * jwt, jwk_prepared_t * key) {
+  jws_t * jws = NULL;
+  char * token = NULL, * payload = NULL;
+  jwa_alg alg = R_JWA_ALG_UNKNOWN;
+  json_t * j_header, * j_value = NULL;
+  const char * h_key = NULL;
+
+  if (jwt != NULL && key != NULL && ((alg = r_jwt_get_sign_alg(jwt)) != R_JWA_ALG_UNKNOWN || (alg = r_str_to_jwa_alg(r_jwk_get_property_str(_r_jwk_prepared_get_jwk(key), "alg"))) != R_JWA_ALG_UNKNOWN) && alg != R_JWA_ALG_NONE) {
+    if (r_jws_init(&jws) == RHN_OK) {
+      if (r_jwt_get_header_str_value(jwt, "typ") == NULL) {
+        r_jwt_set_header_str_value(jwt, "typ", "JWT");
+      }
+      j_header = r_jwt_get_full_header_json_t(jwt);
+      json_object_foreach(j_header, h_key, j_value) {
+        r_jws_set_header_json_t_value(jws, h_key, j_value);
+      }
+      json_decref(j_header);
+      if ((payload = json_dumps(_r_jwt_get_claims(jwt), JSON_COMPACT)) != NULL) {
+        if (r_jws_set_alg(jws, alg) == RHN_OK && r_jws_set_payload(jws, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
+          token = r_jws_serialize_prepared(jws, key);
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed_prepared - Error setting jws");
+        }
+        o_free(payload);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed_prepared - Error json_dumps claims");
+      }
+      r_jws_free(jws);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed_prepared - Error r_jws_init");
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_serialize_signed_prepared - Error invalid input parameters");
+  }
+  return token;
+}
+
 char * r_jwt_serialize_encrypted(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
   jwe_t * jwe = NULL;
   char * token = NULL, * payload = NULL;
@@ -1078,8 +1234,9 @@ char * r_jwt_serialize_encrypted(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
         r_jwe_set_iv(jwe, key_iv, key_iv_len);
       }
       json_decref(j_header);
+      r_jwe_set_ecdh_pool(jwe, jwt->ecdh_pool);
       if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK) {
-        if ((payload = json_dumps(jwt->j_claims, JSON_COMPACT)) != NULL) {
+        if ((payload = json_dumps(_r_jwt_get_claims(jwt), JSON_COMPACT)) != NULL) {
           if (r_jwe_set_alg(jwe, alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
             token = r_jwe_serialize(jwe, pubkey, x5u_flags);
           } else {
@@ -1130,6 +1287,7 @@ char * r_jwt_serialize_nested(jwt_t * jwt, unsigned int type, jwk_t * sign_key,
           }
           json_decref(j_header);
           r_jwe_set_header_str_value(jwe, "cty", "JWT");
+          r_jwe_set_ecdh_pool(jwe, jwt->ecdh_pool);
           if (r_jwe_add_jwks(jwe, jwt->jwks_privkey_enc, jwt->jwks_pubkey_enc) == RHN_OK) {
             if (r_jwe_set_alg(jwe, enc_alg) == RHN_OK && r_jwe_set_enc(jwe, enc) == RHN_OK && r_jwe_set_payload(jwe, (const unsigned char *)token_intermediate, o_strlen(token_intermediate)) == RHN_OK) {
               token = r_jwe_serialize(jwe, encrypt_key, encrypt_key_x5u_flags);
@@ -1203,21 +1361,23 @@ int r_jwt_advanced_parse(jwt_t * jwt, const char * token, uint32_t parse_flags,
   return r_jwt_advanced_parsen(jwt, token, o_strlen(token), parse_flags, x5u_flags);
 }
 
-int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags) {
+/**
+ * j_header is the header of a signed token already decoded by _r_jws_decode_header, or NULL
+ */
+static int _r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, json_t * j_header, uint32_t parse_flags, int x5u_flags) {
   size_t payload_len = 0;
   int ret, res, token_type = R_JWT_TYPE_NONE;
   const unsigned char * payload = NULL;
-  char * payload_str = NULL;
 
   if (jwt != NULL && token != NULL && token_len) {
     jwt->parse_flags = parse_flags;
     token_type = r_jwt_token_typen(token, token_len);
     if (R_JWT_TYPE_SIGN == token_type) { // JWS
-      r_jws_free(jwt->jws);
-      if ((r_jws_init(&jwt->jws)) == RHN_OK) {
-        if ((res = r_jws_advanced_compact_parsen(jwt->jws, token, token_len, parse_flags, x5u_flags)) == RHN_OK) {
+      if (_r_jwt_renew_jws(jwt) == RHN_OK) {
+        if ((res = _r_jws_advanced_compact_parsen_header(jwt->jws, token, token_len, j_header, parse_flags, x5u_flags)) == RHN_OK) {
           json_decref(jwt->j_header);
-          jwt->j_header = json_deep_copy(jwt->jws->j_header);
+          // The header values aren't modified in place, they are shared with the jws header
+          jwt->j_header = json_copy(jwt->jws->j_header);
           json_decref(jwt->j_claims);
           jwt->j_claims = NULL;
           jwt->sign_alg = jwt->jws->alg;
@@ -1225,14 +1385,14 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
           if (0 != o_strcmp("JWT", r_jwt_get_header_str_value(jwt, "cty"))) {
             jwt->type = R_JWT_TYPE_SIGN;
             if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-              payload_str = o_strndup((const char *)payload, payload_len);
-              if ((jwt->j_claims = json_loads(payload_str, JSON_DECODE_ANY, NULL)) != NULL) {
+              // The claims are only checked here, they are decoded on first access
+              if (_r_json_validate((const char *)payload, payload_len)) {
+                jwt->claims_pending = 1;
                 ret = RHN_OK;
               } else {
                 y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error parsing payload as JSON");
                 ret = RHN_ERROR;
               }
-              o_free(payload_str);
             } else {
               y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_parsen - Error getting payload");
               ret = RHN_ERROR;
@@ -1242,8 +1402,7 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
             jwt->type = R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN;
             if (r_jws_get_alg(jwt->jws) != R_JWA_ALG_NONE) {
               if ((payload = r_jws_get_payload(jwt->jws, &payload_len)) != NULL && payload_len > 0) {
-                r_jwe_free(jwt->jwe);
-                if (r_jwe_init(&jwt->jwe) == RHN_OK) {
+                if (_r_jwt_renew_jwe(jwt) == RHN_OK) {
                   if (r_jwe_advanced_compact_parsen(jwt->jwe, (const char *)payload, payload_len, parse_flags, x5u_flags) == RHN_OK) {
                     ret = RHN_OK;
                   } else {
@@ -1273,8 +1432,7 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
         ret = RHN_ERROR;
       }
     } else if (R_JWT_TYPE_ENCRYPT == token_type) { // JWE
-      r_jwe_free(jwt->jwe);
-      if ((r_jwe_init(&jwt->jwe)) == RHN_OK) {
+      if (_r_jwt_renew_jwe(jwt) == RHN_OK) {
         if ((res = r_jwe_advanced_compact_parsen(jwt->jwe, token, token_len, parse_flags, x5u_flags)) == RHN_OK) {
           json_decref(jwt->j_header);
           jwt->j_header = json_deep_copy(jwt->jwe->j_header);
@@ -1309,6 +1467,10 @@ int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uin
   return ret;
 }
 
+int r_jwt_advanced_parsen(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, int x5u_flags) {
+  return _r_jwt_advanced_parsen(jwt, token, token_len, NULL, parse_flags, x5u_flags);
+}
+
 jwt_t * r_jwt_quick_parse(const char * token, uint32_t parse_flags, int x5u_flags) {
   return r_jwt_quick_parsen(token, o_strlen(token), parse_flags, x5u_flags);
 }
@@ -1347,15 +1509,13 @@ int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
     r_jwks_empty(jwt->jws->jwks_pubkey);
     jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
+      jwk = r_jwks_peek_at(jwt->jwks_privkey_sign, i);
       r_jws_add_keys(jwt->jws, jwk, NULL);
-      r_jwk_free(jwk);
     }
     jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
+      jwk = r_jwks_peek_at(jwt->jwks_pubkey_sign, i);
       r_jws_add_keys(jwt->jws, NULL, jwk);
-      r_jwk_free(jwk);
     }
     return r_jws_verify_signature(jwt->jws, pubkey, x5u_flags);
   } else {
@@ -1363,6 +1523,1211 @@ int r_jwt_verify_signature(jwt_t * jwt, jwk_t * pubkey, int x5u_flags) {
   }
 }
 
+int r_jwt_verify_signature_prepared(jwt_t * jwt, jwk_prepared_t * key) {
+  if (jwt != NULL && jwt->jws != NULL) {
+    return r_jws_verify_signature_prepared(jwt->jws, key);
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+/**
+ * Returns RHN_NEED_KEY with the next remote content to download if any,
+ * verifies the signature otherwise
+ */
+static int _r_jwt_verify_next(jwt_t * jwt, jwk_t * pubkey, int x5u_flags, const char ** url) {
+  if (jwt->remote_pending & R_PARSE_HEADER_JKU) {
+    *url = json_string_value(json_object_get(jwt->j_header, "jku"));
+    return RHN_NEED_KEY;
+  } else if (jwt->remote_pending & R_PARSE_HEADER_X5U) {
+    *url = json_string_value(json_object_get(jwt->j_header, "x5u"));
+    return RHN_NEED_KEY;
+  } else {
+    return r_jwt_verify_signature(jwt, pubkey, x5u_flags);
+  }
+}
+
+int r_jwt_verify_start(jwt_t * jwt, const char * token, size_t token_len, uint32_t parse_flags, jwk_t * pubkey, int x5u_flags, const char ** url) {
+  int ret;
+
+  if (jwt != NULL && url != NULL) {
+    *url = NULL;
+    jwt->remote_pending = 0;
+    // The remote contents are fetched by the caller
+    if ((ret = r_jwt_advanced_parsen(jwt, token, token_len, parse_flags&~(uint32_t)(R_PARSE_HEADER_JKU|R_PARSE_HEADER_X5U), x5u_flags)) == RHN_OK) {
+      jwt->parse_flags = parse_flags;
+      if (jwt->type != R_JWT_TYPE_SIGN) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_start - Token isn't a signed JWT");
+        ret = RHN_ERROR_UNSUPPORTED;
+      } else {
+        if (json_string_length(json_object_get(jwt->j_header, "jku")) && (parse_flags&R_PARSE_HEADER_JKU)) {
+          jwt->remote_pending |= R_PARSE_HEADER_JKU;
+        }
+        if (json_object_get(jwt->j_header, "x5u") != NULL && (parse_flags&R_PARSE_HEADER_X5U)) {
+          if (json_string_length(json_object_get(jwt->j_header, "x5u"))) {
+            jwt->remote_pending |= R_PARSE_HEADER_X5U;
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_start - Invalid x5u");
+            ret = RHN_ERROR_PARAM;
+          }
+        }
+        if (ret == RHN_OK) {
+          ret = _r_jwt_verify_next(jwt, pubkey, x5u_flags, url);
+        } else {
+          jwt->remote_pending = 0;
+        }
+      }
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwt_verify_resume(jwt_t * jwt, const unsigned char * content, size_t content_len, jwk_t * pubkey, int x5u_flags, const char ** url) {
+  int ret = RHN_OK;
+  json_t * j_jwks = NULL;
+  jwk_t * jwk = NULL;
+
+  if (jwt != NULL && url != NULL && jwt->remote_pending) {
+    *url = NULL;
+    if (jwt->remote_pending & R_PARSE_HEADER_JKU) {
+      jwt->remote_pending &= ~(uint32_t)R_PARSE_HEADER_JKU;
+      if (content == NULL || (j_jwks = json_loadb((const char *)content, content_len, JSON_DECODE_ANY, NULL)) == NULL || r_jwks_import_from_json_t(jwt->jwks_pubkey_sign, j_jwks) != RHN_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_resume - Error loading jwks from uri %s", r_jwt_get_header_str_value(jwt, "jku"));
+      }
+      json_decref(j_jwks);
+    } else {
+      jwt->remote_pending &= ~(uint32_t)R_PARSE_HEADER_X5U;
+      if (r_jwk_init(&jwk) == RHN_OK) {
+        if (content != NULL && r_jwk_import_from_pem_der(jwk, R_X509_TYPE_CERTIFICATE, R_FORMAT_PEM, content, content_len) == RHN_OK) {
+          if (r_jwt_add_sign_keys(jwt, NULL, jwk) != RHN_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_resume - Error r_jwt_add_sign_keys");
+            ret = RHN_ERROR;
+          }
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_resume - Error importing x5u");
+          ret = RHN_ERROR_PARAM;
+        }
+        r_jwk_free(jwk);
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verify_resume - Error r_jwk_init");
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+    if (ret == RHN_OK) {
+      ret = _r_jwt_verify_next(jwt, pubkey, x5u_flags, url);
+    } else {
+      jwt->remote_pending = 0;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+static void _r_jwt_verify_batch_token(struct _r_batch * batch, const char * token, rhn_batch_result_t * result) {
+  jwt_t * jwt = NULL;
+  jwk_prepared_t * key;
+  size_t token_len = o_strlen(token);
+  int type = r_jwt_token_typen(token, token_len);
+
+  if (type == R_JWT_TYPE_NONE) {
+    result->status = RHN_ERROR_PARAM;
+  } else if (type != R_JWT_TYPE_SIGN) {
+    result->status = RHN_ERROR_UNSUPPORTED;
+  } else if (r_jwt_init(&jwt) == RHN_OK) {
+    if ((result->status = r_jwt_advanced_parsen(jwt, token, token_len, R_PARSE_NONE, 0)) == RHN_OK) {
+      if (jwt->type != R_JWT_TYPE_SIGN) {
+        result->status = RHN_ERROR_UNSUPPORTED;
+      } else if ((key = _r_batch_get_key(batch, r_jwt_get_header_str_value(jwt, "kid"))) == NULL) {
+        result->status = RHN_ERROR_INVALID;
+      } else if ((result->status = r_jwt_verify_signature_prepared(jwt, key)) == RHN_OK) {
+        // The claims are handed over to the result
+        result->j_claims = _r_jwt_get_claims(jwt);
+        jwt->j_claims = NULL;
+      }
+    }
+  } else {
+    result->status = RHN_ERROR_MEMORY;
+  }
+  r_jwt_free(jwt);
+}
+
+int r_jwt_verify_batch(const char ** tokens, size_t count, jwks_t * jwks_pubkey, int x5u_flags, unsigned int nb_threads, rhn_batch_result_t * results) {
+  return _r_batch_run(jwks_pubkey, x5u_flags, tokens, count, nb_threads, results, _r_jwt_verify_batch_token);
+}
+
+struct _jwt_verifier {
+  uint64_t          algs;
+  jwk_prepared_t ** keys;
+  size_t            nb_keys;
+  json_t          * j_kid_index;
+  json_t          * j_issuers;
+  json_t          * j_audiences;
+  json_t          * j_required;
+  char            * typ;
+  char            * cty;
+  unsigned int      leeway;
+  jwt_cache_t     * cache;
+  jti_store_t     * jti_store;
+  jwt_t           * jwt;
+  rhn_arena_t     * arena;
+};
+
+/**
+ * Coarse wall clock, second resolution is enough for exp, nbf and iat
+ */
+static time_t _r_jwt_verifier_now(void) {
+#ifdef CLOCK_REALTIME_COARSE
+  struct timespec ts;
+
+  if (!clock_gettime(CLOCK_REALTIME_COARSE, &ts)) {
+    return ts.tv_sec;
+  }
+#endif
+  return time(NULL);
+}
+
+#define _R_JWT_CACHE_DIGEST_LEN 32
+
+struct _r_jwt_cache_entry {
+  unsigned char               digest[_R_JWT_CACHE_DIGEST_LEN];
+  int                         status;
+  rhn_jwt_check               failed;
+  size_t                      claim_index;
+  json_t                    * j_claims;
+  time_t                      expires_at;
+  struct _r_jwt_cache_entry * prev;
+  struct _r_jwt_cache_entry * next;
+  struct _r_jwt_cache_entry * chain;
+};
+
+struct _r_jwt_cache_shard {
+  pthread_mutex_t              lock;
+  struct _r_jwt_cache_entry ** buckets;
+  size_t                       nb_buckets;
+  struct _r_jwt_cache_entry  * head;
+  struct _r_jwt_cache_entry  * tail;
+  size_t                       nb_entries;
+  size_t                       hits;
+  size_t                       misses;
+};
+
+struct _jwt_cache {
+  struct _r_jwt_cache_shard * shards;
+  unsigned int                nb_shards;
+  size_t                      shard_capacity;
+  unsigned int                negative_ttl;
+};
+
+static struct _r_jwt_cache_entry ** _r_jwt_cache_bucket(struct _r_jwt_cache_shard * shard, const unsigned char * digest) {
+  size_t index;
+
+  // The digest is a SHA-256, its bytes are already evenly distributed
+  memcpy(&index, digest+sizeof(uint32_t), sizeof(size_t));
+  return &shard->buckets[index & (shard->nb_buckets-1)];
+}
+
+static void _r_jwt_cache_remove(struct _r_jwt_cache_shard * shard, struct _r_jwt_cache_entry * entry) {
+  struct _r_jwt_cache_entry ** bucket = _r_jwt_cache_bucket(shard, entry->digest);
+
+  while (*bucket != entry) {
+    bucket = &(*bucket)->chain;
+  }
+  *bucket = entry->chain;
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    shard->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    shard->tail = entry->prev;
+  }
+  shard->nb_entries--;
+  json_decref(entry->j_claims);
+  o_free(entry);
+}
+
+static void _r_jwt_cache_push_front(struct _r_jwt_cache_shard * shard, struct _r_jwt_cache_entry * entry) {
+  entry->prev = NULL;
+  entry->next = shard->head;
+  if (shard->head != NULL) {
+    shard->head->prev = entry;
+  } else {
+    shard->tail = entry;
+  }
+  shard->head = entry;
+}
+
+static struct _r_jwt_cache_shard * _r_jwt_cache_get_shard(jwt_cache_t * cache, const unsigned char * digest) {
+  uint32_t index;
+
+  memcpy(&index, digest, sizeof(uint32_t));
+  return &cache->shards[index % cache->nb_shards];
+}
+
+/**
+ * Looks up a token digest, on hit the cached result is copied in result
+ * and the entry becomes the most recently used
+ */
+static int _r_jwt_cache_get(jwt_cache_t * cache, const unsigned char * digest, time_t now, rhn_jwt_verify_result_t * result, size_t * claim_index, int copy_claims) {
+  struct _r_jwt_cache_shard * shard = _r_jwt_cache_get_shard(cache, digest);
+  struct _r_jwt_cache_entry * entry;
+  int found = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  for (entry = *_r_jwt_cache_bucket(shard, digest); entry != NULL; entry = entry->chain) {
+    if (!memcmp(entry->digest, digest, _R_JWT_CACHE_DIGEST_LEN)) {
+      break;
+    }
+  }
+  if (entry != NULL && entry->expires_at && entry->expires_at < now) {
+    _r_jwt_cache_remove(shard, entry);
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    result->status = entry->status;
+    result->failed = entry->failed;
+    result->j_claims = (copy_claims && entry->j_claims!=NULL)?json_deep_copy(entry->j_claims):NULL;
+    *claim_index = entry->claim_index;
+    if (!copy_claims || entry->j_claims == NULL || result->j_claims != NULL) {
+      // Move the entry at the head of the LRU list
+      if (entry != shard->head) {
+        entry->prev->next = entry->next;
+        if (entry->next != NULL) {
+          entry->next->prev = entry->prev;
+        } else {
+          shard->tail = entry->prev;
+        }
+        _r_jwt_cache_push_front(shard, entry);
+      }
+      shard->hits++;
+      found = 1;
+    }
+  }
+  if (!found) {
+    shard->misses++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return found;
+}
+
+/**
+ * Stores a verification result, j_claims is handed over to the cache
+ */
+static void _r_jwt_cache_put(jwt_cache_t * cache, const unsigned char * digest, rhn_jwt_verify_result_t * result, size_t claim_index, json_t * j_claims, time_t expires_at) {
+  struct _r_jwt_cache_shard * shard = _r_jwt_cache_get_shard(cache, digest);
+  struct _r_jwt_cache_entry * entry, ** bucket;
+
+  if ((entry = o_malloc(sizeof(struct _r_jwt_cache_entry))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_jwt_cache_put - Error allocating resources for entry");
+    json_decref(j_claims);
+    return;
+  }
+  memcpy(entry->digest, digest, _R_JWT_CACHE_DIGEST_LEN);
+  entry->status = result->status;
+  entry->failed = result->failed;
+  entry->claim_index = claim_index;
+  entry->j_claims = j_claims;
+  entry->expires_at = expires_at;
+  pthread_mutex_lock(&shard->lock);
+  bucket = _r_jwt_cache_bucket(shard, digest);
+  while (*bucket != NULL && memcmp((*bucket)->digest, digest, _R_JWT_CACHE_DIGEST_LEN)) {
+    bucket = &(*bucket)->chain;
+  }
+  // Another thread may have stored the same token in the meantime
+  if (*bucket != NULL) {
+    _r_jwt_cache_remove(shard, *bucket);
+  }
+  while (shard->nb_entries >= cache->shard_capacity && shard->tail != NULL) {
+    _r_jwt_cache_remove(shard, shard->tail);
+  }
+  bucket = _r_jwt_cache_bucket(shard, digest);
+  entry->chain = *bucket;
+  *bucket = entry;
+  _r_jwt_cache_push_front(shard, entry);
+  shard->nb_entries++;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+int r_jwt_cache_init(jwt_cache_t ** cache, size_t max_entries, unsigned int nb_shards, unsigned int negative_ttl) {
+  unsigned int i;
+  size_t nb_buckets = 16;
+  long nb_cpus;
+
+  if (cache == NULL || !max_entries) {
+    return RHN_ERROR_PARAM;
+  }
+  if (!nb_shards) {
+    nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nb_shards = nb_cpus>0?(unsigned int)nb_cpus:1;
+  }
+  if (nb_shards > max_entries) {
+    nb_shards = (unsigned int)max_entries;
+  }
+  if ((*cache = o_malloc(sizeof(jwt_cache_t))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_cache_init - Error allocating resources for cache");
+    return RHN_ERROR_MEMORY;
+  }
+  if (((*cache)->shards = o_malloc(nb_shards*sizeof(struct _r_jwt_cache_shard))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_cache_init - Error allocating resources for shards");
+    o_free(*cache);
+    *cache = NULL;
+    return RHN_ERROR_MEMORY;
+  }
+  memset((*cache)->shards, 0, nb_shards*sizeof(struct _r_jwt_cache_shard));
+  (*cache)->nb_shards = 0;
+  (*cache)->shard_capacity = (max_entries+nb_shards-1)/nb_shards;
+  (*cache)->negative_ttl = negative_ttl;
+  while (nb_buckets < (*cache)->shard_capacity) {
+    nb_buckets <<= 1;
+  }
+  for (i=0; i<nb_shards; i++) {
+    if (((*cache)->shards[i].buckets = o_malloc(nb_buckets*sizeof(struct _r_jwt_cache_entry *))) == NULL || pthread_mutex_init(&(*cache)->shards[i].lock, NULL)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_cache_init - Error initializing shard");
+      o_free((*cache)->shards[i].buckets);
+      r_jwt_cache_free(*cache);
+      *cache = NULL;
+      return RHN_ERROR_MEMORY;
+    }
+    memset((*cache)->shards[i].buckets, 0, nb_buckets*sizeof(struct _r_jwt_cache_entry *));
+    (*cache)->shards[i].nb_buckets = nb_buckets;
+    (*cache)->nb_shards++;
+  }
+  return RHN_OK;
+}
+
+void r_jwt_cache_flush(jwt_cache_t * cache) {
+  unsigned int i;
+
+  if (cache != NULL) {
+    for (i=0; i<cache->nb_shards; i++) {
+      pthread_mutex_lock(&cache->shards[i].lock);
+      while (cache->shards[i].head != NULL) {
+        _r_jwt_cache_remove(&cache->shards[i], cache->shards[i].head);
+      }
+      pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+  }
+}
+
+void r_jwt_cache_free(jwt_cache_t * cache) {
+  unsigned int i;
+
+  if (cache != NULL) {
+    r_jwt_cache_flush(cache);
+    for (i=0; i<cache->nb_shards; i++) {
+      pthread_mutex_destroy(&cache->shards[i].lock);
+      o_free(cache->shards[i].buckets);
+    }
+    o_free(cache->shards);
+    o_free(cache);
+  }
+}
+
+int r_jwt_cache_get_stats(jwt_cache_t * cache, size_t * hits, size_t * misses, size_t * nb_entries) {
+  unsigned int i;
+
+  if (cache == NULL) {
+    return RHN_ERROR_PARAM;
+  }
+  if (hits != NULL) {
+    *hits = 0;
+  }
+  if (misses != NULL) {
+    *misses = 0;
+  }
+  if (nb_entries != NULL) {
+    *nb_entries = 0;
+  }
+  for (i=0; i<cache->nb_shards; i++) {
+    pthread_mutex_lock(&cache->shards[i].lock);
+    if (hits != NULL) {
+      *hits += cache->shards[i].hits;
+    }
+    if (misses != NULL) {
+      *misses += cache->shards[i].misses;
+    }
+    if (nb_entries != NULL) {
+      *nb_entries += cache->shards[i].nb_entries;
+    }
+    pthread_mutex_unlock(&cache->shards[i].lock);
+  }
+  return RHN_OK;
+}
+
+#define _R_JTI_STORE_STRIPES     16
+#define _R_JTI_STORE_SLOTS       256
+#define _R_JTI_STORE_GRANULARITY 16
+#define _R_JTI_STORE_MAGIC       "RHNJTI1\n"
+
+struct _r_jti_entry {
+  unsigned char         digest[_R_JWT_CACHE_DIGEST_LEN];
+  int64_t               expires_at;
+  struct _r_jti_entry * chain;
+  struct _r_jti_entry * slot_next;
+};
+
+/**
+ * A stripe is a hash set of jti digests with its own lock,
+ * and a hashed timing wheel: each entry is also linked in the slot
+ * of its expiration time, so expired entries are removed by sweeping
+ * the slots elapsed since the last sweep, without scanning the hash set
+ */
+struct _r_jti_stripe {
+  pthread_mutex_t        lock;
+  struct _r_jti_entry ** buckets;
+  size_t                 nb_buckets;
+  struct _r_jti_entry  * slots[_R_JTI_STORE_SLOTS];
+  int64_t                last_tick;
+  size_t                 nb_entries;
+};
+
+struct _jti_store {
+  struct _r_jti_stripe stripes[_R_JTI_STORE_STRIPES];
+  size_t               stripe_capacity;
+  unsigned int         default_ttl;
+};
+
+static void _r_jti_digest(const char * iss, const char * jti, unsigned char * digest) {
+  gnutls_hash_hd_t dig;
+
+  // The jti is unique per issuer, so the same jti from another issuer isn't a replay
+  if (!gnutls_hash_init(&dig, GNUTLS_DIG_SHA256)) {
+    gnutls_hash(dig, iss!=NULL?iss:"", o_strlen(iss)+1);
+    gnutls_hash(dig, jti, o_strlen(jti));
+    gnutls_hash_deinit(dig, digest);
+  } else {
+    memset(digest, 0, _R_JWT_CACHE_DIGEST_LEN);
+  }
+}
+
+static struct _r_jti_entry ** _r_jti_bucket(struct _r_jti_stripe * stripe, const unsigned char * digest) {
+  size_t index;
+
+  memcpy(&index, digest+sizeof(uint32_t), sizeof(size_t));
+  return &stripe->buckets[index & (stripe->nb_buckets-1)];
+}
+
+static void _r_jti_unlink(struct _r_jti_stripe * stripe, struct _r_jti_entry * entry) {
+  struct _r_jti_entry ** bucket = _r_jti_bucket(stripe, entry->digest);
+
+  while (*bucket != entry) {
+    bucket = &(*bucket)->chain;
+  }
+  *bucket = entry->chain;
+  stripe->nb_entries--;
+}
+
+static void _r_jti_slot_insert(struct _r_jti_stripe * stripe, struct _r_jti_entry * entry) {
+  size_t slot = (size_t)(entry->expires_at/_R_JTI_STORE_GRANULARITY)%_R_JTI_STORE_SLOTS;
+
+  entry->slot_next = stripe->slots[slot];
+  stripe->slots[slot] = entry;
+}
+
+/**
+ * Removes the entries expired at now from the slots elapsed since the last sweep
+ */
+static void _r_jti_sweep(struct _r_jti_stripe * stripe, int64_t now) {
+  int64_t tick = now/_R_JTI_STORE_GRANULARITY, t;
+  struct _r_jti_entry ** cur, * entry;
+
+  if (stripe->last_tick && tick-stripe->last_tick > _R_JTI_STORE_SLOTS) {
+    stripe->last_tick = tick-_R_JTI_STORE_SLOTS;
+  }
+  for (t=stripe->last_tick?stripe->last_tick:tick; t<=tick; t++) {
+    cur = &stripe->slots[t%_R_JTI_STORE_SLOTS];
+    while (*cur != NULL) {
+      entry = *cur;
+      if (entry->expires_at < now) {
+        *cur = entry->slot_next;
+        _r_jti_unlink(stripe, entry);
+        o_free(entry);
+      } else {
+        cur = &entry->slot_next;
+      }
+    }
+  }
+  stripe->last_tick = tick;
+}
+
+static int _r_jti_store_add_digest(jti_store_t * store, const unsigned char * digest, int64_t expires_at, int64_t now) {
+  struct _r_jti_stripe * stripe = &store->stripes[digest[0]%_R_JTI_STORE_STRIPES];
+  struct _r_jti_entry * entry, ** bucket;
+  int ret = RHN_OK;
+
+  pthread_mutex_lock(&stripe->lock);
+  _r_jti_sweep(stripe, now);
+  bucket = _r_jti_bucket(stripe, digest);
+  for (entry = *bucket; entry != NULL; entry = entry->chain) {
+    if (!memcmp(entry->digest, digest, _R_JWT_CACHE_DIGEST_LEN)) {
+      break;
+    }
+  }
+  // After the sweep, all the entries left are still valid
+  if (entry != NULL) {
+    ret = RHN_ERROR_INVALID;
+  } else if (stripe->nb_entries >= store->stripe_capacity) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_add - Store full");
+    ret = RHN_ERROR_MEMORY;
+  } else if ((entry = o_malloc(sizeof(struct _r_jti_entry))) != NULL) {
+    memcpy(entry->digest, digest, _R_JWT_CACHE_DIGEST_LEN);
+    entry->expires_at = expires_at;
+    entry->chain = *bucket;
+    *bucket = entry;
+    _r_jti_slot_insert(stripe, entry);
+    stripe->nb_entries++;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_add - Error allocating resources for entry");
+    ret = RHN_ERROR_MEMORY;
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return ret;
+}
+
+int r_jti_store_init(jti_store_t ** store, size_t max_entries, unsigned int default_ttl) {
+  size_t nb_buckets = 16;
+  unsigned int i;
+
+  if (store == NULL || !max_entries || !default_ttl) {
+    return RHN_ERROR_PARAM;
+  }
+  if ((*store = o_malloc(sizeof(jti_store_t))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_init - Error allocating resources for store");
+    return RHN_ERROR_MEMORY;
+  }
+  memset(*store, 0, sizeof(jti_store_t));
+  (*store)->stripe_capacity = (max_entries+_R_JTI_STORE_STRIPES-1)/_R_JTI_STORE_STRIPES;
+  (*store)->default_ttl = default_ttl;
+  while (nb_buckets < (*store)->stripe_capacity) {
+    nb_buckets <<= 1;
+  }
+  for (i=0; i<_R_JTI_STORE_STRIPES; i++) {
+    if (((*store)->stripes[i].buckets = o_malloc(nb_buckets*sizeof(struct _r_jti_entry *))) == NULL || pthread_mutex_init(&(*store)->stripes[i].lock, NULL)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_init - Error initializing stripe");
+      o_free((*store)->stripes[i].buckets);
+      (*store)->stripes[i].buckets = NULL;
+      r_jti_store_free(*store);
+      *store = NULL;
+      return RHN_ERROR_MEMORY;
+    }
+    memset((*store)->stripes[i].buckets, 0, nb_buckets*sizeof(struct _r_jti_entry *));
+    (*store)->stripes[i].nb_buckets = nb_buckets;
+  }
+  return RHN_OK;
+}
+
+void r_jti_store_free(jti_store_t * store) {
+  struct _r_jti_entry * entry;
+  unsigned int i, j;
+
+  if (store != NULL) {
+    for (i=0; i<_R_JTI_STORE_STRIPES && store->stripes[i].buckets != NULL; i++) {
+      for (j=0; j<_R_JTI_STORE_SLOTS; j++) {
+        while ((entry = store->stripes[i].slots[j]) != NULL) {
+          store->stripes[i].slots[j] = entry->slot_next;
+          o_free(entry);
+        }
+      }
+      o_free(store->stripes[i].buckets);
+      pthread_mutex_destroy(&store->stripes[i].lock);
+    }
+    o_free(store);
+  }
+}
+
+int r_jti_store_add(jti_store_t * store, const char * iss, const char * jti, time_t exp) {
+  unsigned char digest[_R_JWT_CACHE_DIGEST_LEN];
+  int64_t now = (int64_t)_r_jwt_verifier_now();
+
+  if (store == NULL || o_strnullempty(jti)) {
+    return RHN_ERROR_PARAM;
+  } else if (exp > 0 && (int64_t)exp < now) {
+    // The token is expired, there's nothing to protect anymore
+    return RHN_OK;
+  }
+  _r_jti_digest(iss, jti, digest);
+  return _r_jti_store_add_digest(store, digest, exp>0?(int64_t)exp:now+store->default_ttl, now);
+}
+
+size_t r_jti_store_size(jti_store_t * store) {
+  size_t size = 0;
+  unsigned int i;
+
+  if (store != NULL) {
+    for (i=0; i<_R_JTI_STORE_STRIPES; i++) {
+      pthread_mutex_lock(&store->stripes[i].lock);
+      size += store->stripes[i].nb_entries;
+      pthread_mutex_unlock(&store->stripes[i].lock);
+    }
+  }
+  return size;
+}
+
+int r_jti_store_save(jti_store_t * store, const char * path) {
+  struct _r_jti_entry * entry;
+  char * tmp_path;
+  FILE * file;
+  unsigned int i, j;
+  int ret = RHN_OK;
+  int64_t now = (int64_t)_r_jwt_verifier_now();
+
+  if (store == NULL || o_strnullempty(path)) {
+    return RHN_ERROR_PARAM;
+  }
+  // The file is written aside then renamed, so a crash never leaves a truncated store
+  if ((tmp_path = msprintf("%s.tmp", path)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_save - Error allocating resources for tmp_path");
+    return RHN_ERROR_MEMORY;
+  }
+  if ((file = fopen(tmp_path, "wb")) != NULL) {
+    if (fwrite(_R_JTI_STORE_MAGIC, 1, o_strlen(_R_JTI_STORE_MAGIC), file) != o_strlen(_R_JTI_STORE_MAGIC)) {
+      ret = RHN_ERROR;
+    }
+    for (i=0; i<_R_JTI_STORE_STRIPES && ret == RHN_OK; i++) {
+      pthread_mutex_lock(&store->stripes[i].lock);
+      for (j=0; j<_R_JTI_STORE_SLOTS && ret == RHN_OK; j++) {
+        for (entry = store->stripes[i].slots[j]; entry != NULL && ret == RHN_OK; entry = entry->slot_next) {
+          if (entry->expires_at >= now &&
+             (fwrite(entry->digest, 1, _R_JWT_CACHE_DIGEST_LEN, file) != _R_JWT_CACHE_DIGEST_LEN ||
+              fwrite(&entry->expires_at, sizeof(int64_t), 1, file) != 1)) {
+            ret = RHN_ERROR;
+          }
+        }
+      }
+      pthread_mutex_unlock(&store->stripes[i].lock);
+    }
+    if (fclose(file)) {
+      ret = RHN_ERROR;
+    }
+    if (ret == RHN_OK && rename(tmp_path, path)) {
+      ret = RHN_ERROR;
+    }
+    if (ret != RHN_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_save - Error writing file %s", path);
+      remove(tmp_path);
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_save - Error opening file %s", tmp_path);
+    ret = RHN_ERROR;
+  }
+  o_free(tmp_path);
+  return ret;
+}
+
+int r_jti_store_load(jti_store_t * store, const char * path) {
+  unsigned char digest[_R_JWT_CACHE_DIGEST_LEN];
+  char magic[sizeof(_R_JTI_STORE_MAGIC)-1];
+  int64_t expires_at, now = (int64_t)_r_jwt_verifier_now();
+  FILE * file;
+  int ret = RHN_OK, res;
+
+  if (store == NULL || o_strnullempty(path)) {
+    return RHN_ERROR_PARAM;
+  }
+  if ((file = fopen(path, "rb")) != NULL) {
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, _R_JTI_STORE_MAGIC, sizeof(magic))) {
+      while (ret == RHN_OK && fread(digest, 1, _R_JWT_CACHE_DIGEST_LEN, file) == _R_JWT_CACHE_DIGEST_LEN) {
+        if (fread(&expires_at, sizeof(int64_t), 1, file) != 1) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_load - Truncated file %s", path);
+          ret = RHN_ERROR_PARAM;
+        } else if (expires_at >= now) {
+          res = _r_jti_store_add_digest(store, digest, expires_at, now);
+          if (res == RHN_ERROR_MEMORY) {
+            ret = res;
+          }
+        }
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_load - Invalid file %s", path);
+      ret = RHN_ERROR_PARAM;
+    }
+    fclose(file);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jti_store_load - Error opening file %s", path);
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+static int _r_jwt_verifier_check_time(json_t * j_claims, const char * claim, time_t now, unsigned int leeway) {
+  json_t * j_value = json_object_get(j_claims, claim);
+  time_t t_value;
+
+  if (j_value == NULL) {
+    return 1;
+  } else if (!json_is_integer(j_value) || json_integer_value(j_value) <= 0) {
+    return 0;
+  }
+  t_value = (time_t)json_integer_value(j_value);
+  if (0 == o_strcmp("exp", claim)) {
+    return t_value+(time_t)leeway >= now;
+  } else {
+    return t_value-(time_t)leeway <= now;
+  }
+}
+
+static int _r_jwt_verifier_check_aud(jwt_verifier_t * verifier, json_t * j_aud) {
+  json_t * j_element = NULL;
+  size_t index = 0;
+
+  if (json_is_string(j_aud)) {
+    return json_object_get(verifier->j_audiences, json_string_value(j_aud)) != NULL;
+  } else if (json_is_array(j_aud)) {
+    json_array_foreach(j_aud, index, j_element) {
+      if (json_is_string(j_element) && json_object_get(verifier->j_audiences, json_string_value(j_element)) != NULL) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int _r_jwt_verifier_fail(rhn_jwt_verify_result_t * result, int status, rhn_jwt_check failed, const char * claim) {
+  result->status = status;
+  result->failed = failed;
+  result->claim = claim;
+  return status;
+}
+
+int r_jwt_verifier_init(jwt_verifier_t ** verifier) {
+  int ret;
+
+  if (verifier != NULL) {
+    if ((*verifier = o_malloc(sizeof(jwt_verifier_t))) != NULL) {
+      memset(*verifier, 0, sizeof(jwt_verifier_t));
+      if (((*verifier)->j_kid_index = json_object()) != NULL &&
+          ((*verifier)->j_issuers = json_object()) != NULL &&
+          ((*verifier)->j_audiences = json_object()) != NULL &&
+          ((*verifier)->j_required = json_array()) != NULL) {
+        ret = RHN_OK;
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error allocating resources for verifier");
+        r_jwt_verifier_free(*verifier);
+        *verifier = NULL;
+        ret = RHN_ERROR_MEMORY;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_init - Error allocating resources for verifier");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_jwt_verifier_free(jwt_verifier_t * verifier) {
+  size_t i;
+
+  if (verifier != NULL) {
+    for (i=0; i<verifier->nb_keys; i++) {
+      r_jwk_prepared_free(verifier->keys[i]);
+    }
+    o_free(verifier->keys);
+    json_decref(verifier->j_kid_index);
+    json_decref(verifier->j_issuers);
+    json_decref(verifier->j_audiences);
+    json_decref(verifier->j_required);
+    o_free(verifier->typ);
+    o_free(verifier->cty);
+    r_jwt_free(verifier->jwt);
+    o_free(verifier);
+  }
+}
+
+int r_jwt_verifier_add_alg(jwt_verifier_t * verifier, jwa_alg alg) {
+  if (verifier != NULL && alg > R_JWA_ALG_NONE && alg < 64) {
+    r_jwt_cache_flush(verifier->cache);
+    verifier->algs |= R_JWA_ALG_MASK(alg);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_add_key(jwt_verifier_t * verifier, jwk_t * jwk, int x5u_flags) {
+  jwk_prepared_t * prepared, ** keys;
+  const char * kid;
+
+  if (verifier == NULL || jwk == NULL) {
+    return RHN_ERROR_PARAM;
+  }
+  // A token rejected for an unknown kid may become valid with the new key
+  r_jwt_cache_flush(verifier->cache);
+  if ((prepared = r_jwk_prepare(jwk, x5u_flags)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_add_key - Error r_jwk_prepare");
+    return RHN_ERROR_PARAM;
+  }
+  if ((keys = o_realloc(verifier->keys, (verifier->nb_keys+1)*sizeof(jwk_prepared_t *))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_add_key - Error allocating resources for keys");
+    r_jwk_prepared_free(prepared);
+    return RHN_ERROR_MEMORY;
+  }
+  verifier->keys = keys;
+  // The first key wins if a kid is duplicated, like in r_jwks_peek_by_kid
+  kid = r_jwk_get_property_str(_r_jwk_prepared_get_jwk(prepared), "kid");
+  if (kid != NULL && json_object_get(verifier->j_kid_index, kid) == NULL) {
+    if (json_object_set_new(verifier->j_kid_index, kid, json_integer((json_int_t)verifier->nb_keys))) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_add_key - Error setting kid index");
+      r_jwk_prepared_free(prepared);
+      return RHN_ERROR_MEMORY;
+    }
+  }
+  verifier->keys[verifier->nb_keys++] = prepared;
+  return RHN_OK;
+}
+
+int r_jwt_verifier_add_jwks(jwt_verifier_t * verifier, jwks_t * jwks, int x5u_flags) {
+  size_t i;
+  int ret = RHN_OK;
+
+  if (verifier != NULL && r_jwks_size(jwks)) {
+    for (i=0; i<r_jwks_size(jwks) && ret == RHN_OK; i++) {
+      ret = r_jwt_verifier_add_key(verifier, r_jwks_peek_at(jwks, i), x5u_flags);
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+int r_jwt_verifier_add_issuer(jwt_verifier_t * verifier, const char * iss) {
+  if (verifier != NULL && !o_strnullempty(iss)) {
+    r_jwt_cache_flush(verifier->cache);
+    return json_object_set(verifier->j_issuers, iss, json_true())?RHN_ERROR_MEMORY:RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_add_audience(jwt_verifier_t * verifier, const char * aud) {
+  if (verifier != NULL && !o_strnullempty(aud)) {
+    r_jwt_cache_flush(verifier->cache);
+    return json_object_set(verifier->j_audiences, aud, json_true())?RHN_ERROR_MEMORY:RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_add_required_claim(jwt_verifier_t * verifier, const char * claim) {
+  if (verifier != NULL && !o_strnullempty(claim)) {
+    r_jwt_cache_flush(verifier->cache);
+    return json_array_append_new(verifier->j_required, json_string(claim))?RHN_ERROR_MEMORY:RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_set_leeway(jwt_verifier_t * verifier, unsigned int leeway) {
+  if (verifier != NULL) {
+    r_jwt_cache_flush(verifier->cache);
+    verifier->leeway = leeway;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_set_typ(jwt_verifier_t * verifier, const char * typ) {
+  if (verifier != NULL) {
+    r_jwt_cache_flush(verifier->cache);
+    o_free(verifier->typ);
+    verifier->typ = o_strdup(typ);
+    return (typ == NULL || verifier->typ != NULL)?RHN_OK:RHN_ERROR_MEMORY;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_set_cty(jwt_verifier_t * verifier, const char * cty) {
+  if (verifier != NULL) {
+    r_jwt_cache_flush(verifier->cache);
+    o_free(verifier->cty);
+    verifier->cty = o_strdup(cty);
+    return (cty == NULL || verifier->cty != NULL)?RHN_OK:RHN_ERROR_MEMORY;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_set_cache(jwt_verifier_t * verifier, jwt_cache_t * cache) {
+  if (verifier != NULL) {
+    verifier->cache = cache;
+    r_jwt_cache_flush(cache);
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_set_jti_store(jwt_verifier_t * verifier, jti_store_t * jti_store) {
+  if (verifier != NULL) {
+    verifier->jti_store = jti_store;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+int r_jwt_verifier_set_arena(jwt_verifier_t * verifier, rhn_arena_t * arena) {
+  if (verifier != NULL) {
+    verifier->arena = arena;
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+static int _r_jwt_verifier_check_header(jwt_verifier_t * verifier, json_t * j_header, jwa_alg alg, rhn_jwt_verify_result_t * result) {
+  const char * kid;
+
+  if (alg <= R_JWA_ALG_NONE) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_PARAM, R_JWT_CHECK_PARSE, NULL);
+  }
+  if (!(verifier->algs & R_JWA_ALG_MASK(alg))) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_ALG, NULL);
+  }
+  if (verifier->typ != NULL && 0 != o_strcmp(verifier->typ, json_string_value(json_object_get(j_header, "typ")))) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_TYP, NULL);
+  }
+  if (verifier->cty != NULL && 0 != o_strcmp(verifier->cty, json_string_value(json_object_get(j_header, "cty")))) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_CTY, NULL);
+  }
+  if ((kid = json_string_value(json_object_get(j_header, "kid"))) != NULL) {
+    if (json_object_get(verifier->j_kid_index, kid) == NULL) {
+      return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_KEY, NULL);
+    }
+  } else if (!verifier->nb_keys) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_KEY, NULL);
+  }
+  return RHN_OK;
+}
+
+static int _r_jwt_verifier_check(jwt_verifier_t * verifier, jwt_t * jwt, const char * token, size_t token_len, rhn_jwt_verify_result_t * result) {
+  jwk_prepared_t * key;
+  json_t * j_header, * j_index, * j_value, * j_claim = NULL;
+  jwa_alg alg = R_JWA_ALG_UNKNOWN;
+  const char * kid;
+  time_t now;
+  size_t i;
+  int ret;
+
+  // The header is checked first, the claims are decoded only if the token can be accepted
+  if (r_jwt_token_typen(token, token_len) != R_JWT_TYPE_SIGN ||
+      (j_header = _r_jws_decode_header(token, token_len, &alg)) == NULL) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_PARAM, R_JWT_CHECK_PARSE, NULL);
+  }
+  if ((ret = _r_jwt_verifier_check_header(verifier, j_header, alg, result)) == RHN_OK) {
+    // The header decoded is used by the parse, so it's decoded only once
+    if (_r_jwt_advanced_parsen(jwt, token, token_len, j_header, R_PARSE_NONE, 0) != RHN_OK ||
+        jwt->type != R_JWT_TYPE_SIGN) {
+      ret = _r_jwt_verifier_fail(result, RHN_ERROR_PARAM, R_JWT_CHECK_PARSE, NULL);
+    }
+  }
+  json_decref(j_header);
+  if (ret != RHN_OK) {
+    return ret;
+  }
+
+  if ((kid = r_jwt_get_header_str_value(jwt, "kid")) != NULL) {
+    if ((j_index = json_object_get(verifier->j_kid_index, kid)) == NULL) {
+      return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_KEY, NULL);
+    }
+    key = verifier->keys[json_integer_value(j_index)];
+    ret = r_jwt_verify_signature_prepared(jwt, key);
+  } else if (verifier->nb_keys) {
+    ret = RHN_ERROR_INVALID;
+    for (i=0; i<verifier->nb_keys && ret == RHN_ERROR_INVALID; i++) {
+      ret = r_jwt_verify_signature_prepared(jwt, verifier->keys[i]);
+    }
+  } else {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_KEY, NULL);
+  }
+  if (ret != RHN_OK) {
+    return _r_jwt_verifier_fail(result, ret, R_JWT_CHECK_SIGNATURE, NULL);
+  }
+
+  if (json_object_size(verifier->j_issuers)) {
+    j_value = json_object_get(_r_jwt_get_claims(jwt), "iss");
+    if (!json_is_string(j_value) || json_object_get(verifier->j_issuers, json_string_value(j_value)) == NULL) {
+      return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_ISS, "iss");
+    }
+  }
+  if (json_object_size(verifier->j_audiences) && !_r_jwt_verifier_check_aud(verifier, json_object_get(_r_jwt_get_claims(jwt), "aud"))) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_AUD, "aud");
+  }
+  now = _r_jwt_verifier_now();
+  if (!_r_jwt_verifier_check_time(_r_jwt_get_claims(jwt), "exp", now, verifier->leeway)) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_EXP, "exp");
+  }
+  if (!_r_jwt_verifier_check_time(_r_jwt_get_claims(jwt), "nbf", now, verifier->leeway)) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_NBF, "nbf");
+  }
+  if (!_r_jwt_verifier_check_time(_r_jwt_get_claims(jwt), "iat", now, verifier->leeway)) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_IAT, "iat");
+  }
+  json_array_foreach(verifier->j_required, i, j_claim) {
+    if (json_object_get(_r_jwt_get_claims(jwt), json_string_value(j_claim)) == NULL) {
+      return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_REQUIRED, json_string_value(j_claim));
+    }
+  }
+  return _r_jwt_verifier_fail(result, RHN_OK, R_JWT_CHECK_NONE, NULL);
+}
+
+static const char * _r_jwt_verifier_claim_name(jwt_verifier_t * verifier, rhn_jwt_check failed, size_t claim_index) {
+  switch (failed) {
+    case R_JWT_CHECK_ISS:
+      return "iss";
+    case R_JWT_CHECK_AUD:
+      return "aud";
+    case R_JWT_CHECK_EXP:
+      return "exp";
+    case R_JWT_CHECK_NBF:
+      return "nbf";
+    case R_JWT_CHECK_IAT:
+      return "iat";
+    case R_JWT_CHECK_REQUIRED:
+      return json_string_value(json_array_get(verifier->j_required, claim_index));
+    case R_JWT_CHECK_JTI:
+      return "jti";
+    default:
+      return NULL;
+  }
+}
+
+static void _r_jwt_verifier_cache_result(jwt_verifier_t * verifier, const unsigned char * digest, time_t now, jwt_t * jwt, rhn_jwt_verify_result_t * result) {
+  json_t * j_claims = NULL, * j_claim = NULL, * j_exp;
+  size_t claim_index = 0, index = 0;
+  time_t expires_at;
+
+  if (result->status == RHN_OK) {
+    // A valid token stays valid until it expires
+    j_exp = json_object_get(_r_jwt_get_claims(jwt), "exp");
+    expires_at = json_is_integer(j_exp)?(time_t)json_integer_value(j_exp)+(time_t)verifier->leeway:0;
+    if ((j_claims = json_deep_copy(_r_jwt_get_claims(jwt))) == NULL) {
+      return;
+    }
+  } else if (verifier->cache->negative_ttl && (result->status == RHN_ERROR_PARAM || result->status == RHN_ERROR_INVALID)) {
+    expires_at = now+(time_t)verifier->cache->negative_ttl;
+    if (result->failed == R_JWT_CHECK_REQUIRED) {
+      json_array_foreach(verifier->j_required, index, j_claim) {
+        if (json_string_value(j_claim) == result->claim) {
+          claim_index = index;
+          break;
+        }
+      }
+    }
+  } else {
+    return;
+  }
+  _r_jwt_cache_put(verifier->cache, digest, result, claim_index, j_claims, expires_at);
+}
+
+static int _r_jwt_verifier_check_jti(jwt_verifier_t * verifier, rhn_jwt_verify_result_t * result) {
+  const char * jti = json_string_value(json_object_get(result->j_claims, "jti"));
+  json_t * j_exp = json_object_get(result->j_claims, "exp");
+  time_t exp = 0;
+  int ret;
+
+  if (o_strnullempty(jti)) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_INVALID, R_JWT_CHECK_JTI, "jti");
+  }
+  if (json_is_integer(j_exp) && json_integer_value(j_exp) > 0) {
+    exp = (time_t)json_integer_value(j_exp)+(time_t)verifier->leeway;
+  }
+  if ((ret = r_jti_store_add(verifier->jti_store, json_string_value(json_object_get(result->j_claims, "iss")), jti, exp)) != RHN_OK) {
+    return _r_jwt_verifier_fail(result, ret, R_JWT_CHECK_JTI, "jti");
+  }
+  return RHN_OK;
+}
+
+int r_jwt_verifier_verify(jwt_verifier_t * verifier, const char * token, size_t token_len, rhn_jwt_verify_result_t * result) {
+  rhn_jwt_verify_result_t local_result;
+  unsigned char digest[_R_JWT_CACHE_DIGEST_LEN];
+  size_t claim_index = 0;
+  time_t now = 0;
+  jwt_t * jwt = NULL;
+  int ret, hit = 0, need_claims;
+
+  // The claims are needed for the replay check even if the caller doesn't want them
+  need_claims = (result != NULL || (verifier != NULL && verifier->jti_store != NULL));
+  if (result == NULL) {
+    result = &local_result;
+  }
+  result->j_claims = NULL;
+  if (verifier == NULL || token == NULL || !token_len) {
+    return _r_jwt_verifier_fail(result, RHN_ERROR_PARAM, R_JWT_CHECK_PARSE, NULL);
+  }
+  if (verifier->cache != NULL) {
+    now = _r_jwt_verifier_now();
+    if (gnutls_hash_fast(GNUTLS_DIG_SHA256, token, token_len, digest)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_verify - Error gnutls_hash_fast");
+      return _r_jwt_verifier_fail(result, RHN_ERROR, R_JWT_CHECK_NONE, NULL);
+    }
+    hit = _r_jwt_cache_get(verifier->cache, digest, now, result, &claim_index, need_claims);
+  }
+  if (hit) {
+    result->claim = _r_jwt_verifier_claim_name(verifier, result->failed, claim_index);
+    ret = result->status;
+  } else {
+    if (verifier->arena != NULL) {
+      // The token is parsed and checked in the arena, only the claims are copied out of it
+      _r_arena_enter(verifier->arena);
+      ret = r_jwt_init(&jwt);
+    } else if (verifier->jwt != NULL) {
+      // The jwt_t is kept between calls and reset, so its buffers are reused
+      jwt = verifier->jwt;
+      ret = r_jwt_reset(jwt);
+    } else {
+      ret = r_jwt_init(&verifier->jwt);
+      jwt = verifier->jwt;
+    }
+    if (ret == RHN_OK) {
+      ret = _r_jwt_verifier_check(verifier, jwt, token, token_len, result);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_verify - Error r_jwt_init");
+      ret = _r_jwt_verifier_fail(result, RHN_ERROR_MEMORY, R_JWT_CHECK_NONE, NULL);
+    }
+    _r_arena_suspend(verifier->arena);
+    if (jwt != NULL) {
+      if (verifier->cache != NULL) {
+        _r_jwt_verifier_cache_result(verifier, digest, now, jwt, result);
+      }
+      if (ret == RHN_OK && need_claims) {
+        if (verifier->arena != NULL) {
+          if ((result->j_claims = json_deep_copy(_r_jwt_get_claims(jwt))) == NULL) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "r_jwt_verifier_verify - Error json_deep_copy");
+            ret = _r_jwt_verifier_fail(result, RHN_ERROR_MEMORY, R_JWT_CHECK_NONE, NULL);
+          }
+        } else {
+          // The claims are handed over to the result
+          result->j_claims = _r_jwt_get_claims(jwt);
+          jwt->j_claims = NULL;
+        }
+      }
+      if (verifier->arena != NULL) {
+        // Release what wasn't taken from the arena, e.g. GnuTLS objects
+        r_jwt_free(jwt);
+      }
+    }
+    _r_arena_leave(verifier->arena);
+  }
+  // The replay check is done after the cache, a cached valid token can be replayed too
+  if (ret == RHN_OK && verifier->jti_store != NULL) {
+    ret = _r_jwt_verifier_check_jti(verifier, result);
+  }
+  if (ret != RHN_OK || result == &local_result) {
+    json_decref(result->j_claims);
+    result->j_claims = NULL;
+  }
+  return ret;
+}
+
 int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
   const unsigned char * payload = NULL;
   size_t payload_len = 0, jwks_size, i;
@@ -1376,15 +2741,13 @@ int r_jwt_decrypt(jwt_t * jwt, jwk_t * privkey, int x5u_flags) {
     r_jwks_empty(jwt->jwe->jwks_pubkey);
     jwks_size = r_jwks_size(jwt->jwks_privkey_enc);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_enc, i);
+      jwk = r_jwks_peek_at(jwt->jwks_privkey_enc, i);
       r_jwe_add_keys(jwt->jwe, jwk, NULL);
-      r_jwk_free(jwk);
     }
     jwks_size = r_jwks_size(jwt->jwks_pubkey_enc);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_enc, i);
+      jwk = r_jwks_peek_at(jwt->jwks_pubkey_enc, i);
       r_jwe_add_keys(jwt->jwe, NULL, jwk);
-      r_jwk_free(jwk);
     }
     if ((res = r_jwe_decrypt(jwt->jwe, privkey, x5u_flags)) == RHN_OK) {
       if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
@@ -1429,28 +2792,24 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
     if (jwt->type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN && jwt->jwe != NULL) {
       jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
       for (i=0; i<jwks_size; i++) {
-        jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
+        jwk = r_jwks_peek_at(jwt->jwks_privkey_sign, i);
         r_jws_add_keys(jwt->jws, jwk, NULL);
-        r_jwk_free(jwk);
       }
       jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
       for (i=0; i<jwks_size; i++) {
-        jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
+        jwk = r_jwks_peek_at(jwt->jwks_pubkey_sign, i);
         r_jws_add_keys(jwt->jws, NULL, jwk);
-        r_jwk_free(jwk);
       }
       if ((res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags)) == RHN_OK) {
         jwks_size = r_jwks_size(jwt->jwks_privkey_enc);
         for (i=0; i<jwks_size; i++) {
-          jwk = r_jwks_get_at(jwt->jwks_privkey_enc, i);
+          jwk = r_jwks_peek_at(jwt->jwks_privkey_enc, i);
           r_jwe_add_keys(jwt->jwe, jwk, NULL);
-          r_jwk_free(jwk);
         }
         jwks_size = r_jwks_size(jwt->jwks_pubkey_enc);
         for (i=0; i<jwks_size; i++) {
-          jwk = r_jwks_get_at(jwt->jwks_pubkey_enc, i);
+          jwk = r_jwks_peek_at(jwt->jwks_pubkey_enc, i);
           r_jwe_add_keys(jwt->jwe, NULL, jwk);
-          r_jwk_free(jwk);
         }
         if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
           if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
@@ -1482,32 +2841,27 @@ int r_jwt_decrypt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int v
     } else if (jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
       jwks_size = r_jwks_size(jwt->jwks_privkey_enc);
       for (i=0; i<jwks_size; i++) {
-        jwk = r_jwks_get_at(jwt->jwks_privkey_enc, i);
+        jwk = r_jwks_peek_at(jwt->jwks_privkey_enc, i);
         r_jwe_add_keys(jwt->jwe, jwk, NULL);
-        r_jwk_free(jwk);
       }
       jwks_size = r_jwks_size(jwt->jwks_pubkey_enc);
       for (i=0; i<jwks_size; i++) {
-        jwk = r_jwks_get_at(jwt->jwks_pubkey_enc, i);
+        jwk = r_jwks_peek_at(jwt->jwks_pubkey_enc, i);
         r_jwe_add_keys(jwt->jwe, NULL, jwk);
-        r_jwk_free(jwk);
       }
       if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
         if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
-          r_jws_free(jwt->jws);
-          if ((r_jws_init(&jwt->jws)) == RHN_OK) {
+          if (_r_jwt_renew_jws(jwt) == RHN_OK) {
             if (r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags, verify_key_x5u_flags) == RHN_OK) {
               jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
               for (i=0; i<jwks_size; i++) {
-                jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
+                jwk = r_jwks_peek_at(jwt->jwks_privkey_sign, i);
                 r_jws_add_keys(jwt->jws, jwk, NULL);
-                r_jwk_free(jwk);
               }
               jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
               for (i=0; i<jwks_size; i++) {
-                jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
+                jwk = r_jwks_peek_at(jwt->jwks_pubkey_sign, i);
                 r_jws_add_keys(jwt->jws, NULL, jwk);
-                r_jwk_free(jwk);
               }
               json_decref(jwt->j_claims);
               jwt->j_claims = NULL;
@@ -1572,21 +2926,18 @@ int r_jwt_decrypt_nested(jwt_t * jwt, jwk_t * decrypt_key, int decrypt_key_x5u_f
   if (jwt != NULL && jwt->jwe != NULL && (jwt->type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN || jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT)) {
     jwks_size = r_jwks_size(jwt->jwks_privkey_enc);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_enc, i);
+      jwk = r_jwks_peek_at(jwt->jwks_privkey_enc, i);
       r_jwe_add_keys(jwt->jwe, jwk, NULL);
-      r_jwk_free(jwk);
     }
     jwks_size = r_jwks_size(jwt->jwks_pubkey_enc);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_enc, i);
+      jwk = r_jwks_peek_at(jwt->jwks_pubkey_enc, i);
       r_jwe_add_keys(jwt->jwe, NULL, jwk);
-      r_jwk_free(jwk);
     }
     if ((res = r_jwe_decrypt(jwt->jwe, decrypt_key, decrypt_key_x5u_flags)) == RHN_OK) {
       if ((payload = r_jwe_get_payload(jwt->jwe, &payload_len)) != NULL && payload_len > 0) {
         if (jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT) {
-          r_jws_free(jwt->jws);
-          if ((r_jws_init(&jwt->jws)) == RHN_OK) {
+          if (_r_jwt_renew_jws(jwt) == RHN_OK) {
             if ((res = r_jws_advanced_compact_parsen(jwt->jws, (const char *)payload, payload_len, jwt->parse_flags, decrypt_key_x5u_flags)) == RHN_OK) {
               if (r_jwt_add_sign_jwks(jwt, jwt->jws->jwks_privkey, jwt->jws->jwks_pubkey) == RHN_OK) {
                 if (r_jwt_set_sign_alg(jwt, r_jws_get_alg(jwt->jws)) == RHN_OK) {
@@ -1666,15 +3017,13 @@ int r_jwt_verify_signature_nested(jwt_t * jwt, jwk_t * verify_key, int verify_ke
   if (jwt != NULL && jwt->jws != NULL && (jwt->type == R_JWT_TYPE_NESTED_SIGN_THEN_ENCRYPT || jwt->type == R_JWT_TYPE_NESTED_ENCRYPT_THEN_SIGN)) {
     jwks_size = r_jwks_size(jwt->jwks_privkey_sign);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_privkey_sign, i);
+      jwk = r_jwks_peek_at(jwt->jwks_privkey_sign, i);
       r_jws_add_keys(jwt->jws, jwk, NULL);
-      r_jwk_free(jwk);
     }
     jwks_size = r_jwks_size(jwt->jwks_pubkey_sign);
     for (i=0; i<jwks_size; i++) {
-      jwk = r_jwks_get_at(jwt->jwks_pubkey_sign, i);
+      jwk = r_jwks_peek_at(jwt->jwks_pubkey_sign, i);
       r_jws_add_keys(jwt->jws, NULL, jwk);
-      r_jwk_free(jwk);
     }
     if ((res = r_jws_verify_signature(jwt->jws, verify_key, verify_key_x5u_flags)) == RHN_OK) {
       ret = RHN_OK;
@@ -1696,6 +3045,7 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
   int i_value;
   const char * str_key, * str_value;
   json_t * j_value, * j_expected_value;
+  jti_store_t * jti_store;
   va_list vl;
   time_t now, t_value;
 
@@ -1754,9 +3104,9 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
           break;
         case R_JWT_CLAIM_EXP:
           i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "exp"))) {
+          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(_r_jwt_get_claims(jwt), "exp"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "exp")) && json_integer_value(json_object_get(jwt->j_claims, "exp")) > 0) {
+          } else if (json_is_integer(json_object_get(_r_jwt_get_claims(jwt), "exp")) && json_integer_value(json_object_get(_r_jwt_get_claims(jwt), "exp")) > 0) {
             t_value = (time_t)r_jwt_get_claim_int_value(jwt, "exp");
             if (i_value == R_JWT_CLAIM_NOW) {
               if (t_value < now) {
@@ -1773,9 +3123,9 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
           break;
         case R_JWT_CLAIM_NBF:
           i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "nbf"))) {
+          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(_r_jwt_get_claims(jwt), "nbf"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "nbf")) && json_integer_value(json_object_get(jwt->j_claims, "nbf")) > 0) {
+          } else if (json_is_integer(json_object_get(_r_jwt_get_claims(jwt), "nbf")) && json_integer_value(json_object_get(_r_jwt_get_claims(jwt), "nbf")) > 0) {
             t_value = (time_t)r_jwt_get_claim_int_value(jwt, "nbf");
             if (i_value == R_JWT_CLAIM_NOW) {
               if (t_value > now) {
@@ -1792,9 +3142,9 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
           break;
         case R_JWT_CLAIM_IAT:
           i_value = va_arg(vl, int);
-          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(jwt->j_claims, "iat"))) {
+          if (i_value == R_JWT_CLAIM_PRESENT && !json_is_integer(json_object_get(_r_jwt_get_claims(jwt), "iat"))) {
             ret = RHN_ERROR_PARAM;
-          } else if (json_is_integer(json_object_get(jwt->j_claims, "iat")) && json_integer_value(json_object_get(jwt->j_claims, "iat")) > 0) {
+          } else if (json_is_integer(json_object_get(_r_jwt_get_claims(jwt), "iat")) && json_integer_value(json_object_get(_r_jwt_get_claims(jwt), "iat")) > 0) {
             t_value = (time_t)r_jwt_get_claim_int_value(jwt, "iat");
             if (i_value == R_JWT_CLAIM_NOW) {
               if (t_value > now) {
@@ -1860,6 +3210,12 @@ int r_jwt_validate_claims(jwt_t * jwt, ...) {
             }
           }
           break;
+        case R_JWT_CLAIM_JTI_STORE:
+          jti_store = va_arg(vl, jti_store_t *);
+          if (r_jti_store_add(jti_store, r_jwt_get_claim_str_value(jwt, "iss"), r_jwt_get_claim_str_value(jwt, "jti"), (time_t)r_jwt_get_claim_int_value(jwt, "exp")) != RHN_OK) {
+            ret = RHN_ERROR_PARAM;
+          }
+          break;
         default:
           ret = RHN_ERROR_PARAM;
           break;
@@ -2270,6 +3626,14 @@ int r_jwt_token_type(const char * token) {
   return r_jwt_token_typen(token, o_strlen(token));
 }
 
+int r_jwt_prescreen(const char * token, size_t token_len, uint64_t algs, jwks_t * jwks, const char * typ) {
+  if (r_jwt_token_typen(token, token_len) == R_JWT_TYPE_SIGN) {
+    return r_jws_prescreen(token, token_len, algs, jwks, typ);
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
 int r_jwt_token_typen(const char * token, size_t token_len) {
   size_t nb_dots = 0, i;
   int ret = R_JWT_TYPE_NONE;
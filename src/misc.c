@@ -22,16 +22,72 @@
  */
 
 #include <zlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <orcania.h>
 #include <yder.h>
 #include <rhonabwy.h>
 
 #define _R_BLOCK_SIZE 256
 
+static struct {
+  pthread_mutex_t lock;
+  rhn_fetcher_t   fetcher;
+  void          * user_data;
+} _r_fetcher = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL};
+
 #ifdef R_WITH_CURL
 #include <curl/curl.h>
-#include <string.h>
-#define _R_HEADER_CONTENT_TYPE "Content-Type"
+#include <time.h>
+#define _R_HEADER_CONTENT_TYPE  "Content-Type"
+#define _R_HEADER_ETAG          "ETag"
+#define _R_HEADER_LAST_MODIFIED "Last-Modified"
+#define _R_HEADER_CACHE_CONTROL "Cache-Control"
+#define _R_HEADER_EXPIRES       "Expires"
+
+#define _R_REMOTE_CACHE_MAX_ENTRIES 256
+
+struct _r_remote_cache_entry {
+  char                         * key;
+  char                         * content;
+  char                         * etag;
+  char                         * last_modified;
+  time_t                         fetched_at;
+  time_t                         expires_at;
+  struct _r_remote_cache_entry * next;
+};
+
+static struct {
+  pthread_mutex_t                lock;
+  int                            enabled;
+  unsigned int                   default_ttl;
+  unsigned int                   min_refresh_interval;
+  size_t                         nb_entries;
+  struct _r_remote_cache_entry * entries;
+} _r_remote_cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, NULL};
+
+/**
+ * Idle curl handles kept between two downloads, so their open connections
+ * can be reused, the DNS and TLS sessions cache are shared by all handles
+ */
+static struct {
+  pthread_mutex_t lock;
+  unsigned int    connect_timeout;
+  unsigned int    timeout;
+  size_t          max_response_size;
+  unsigned int    max_idle_handles;
+  CURL         ** idle;
+  size_t          nb_idle;
+  CURLSH        * share;
+  pthread_mutex_t share_lock[CURL_LOCK_DATA_LAST];
+  size_t          nb_requests;
+  size_t          nb_connections;
+} _r_http_pool = {PTHREAD_MUTEX_INITIALIZER, R_HTTP_DEFAULT_CONNECT_TIMEOUT, R_HTTP_DEFAULT_TIMEOUT, R_HTTP_DEFAULT_MAX_RESPONSE_SIZE, R_HTTP_DEFAULT_MAX_IDLE_HANDLES, NULL, 0, NULL, {PTHREAD_MUTEX_INITIALIZER}, 0, 0};
+
+static void _r_http_pool_close(void);
 #endif
 
 int r_global_init(void) {
@@ -57,7 +113,11 @@ int r_global_init(void) {
 }
 
 void r_global_close(void) {
+  r_global_set_fetcher(NULL, NULL);
+  _r_arena_global_close();
 #ifdef R_WITH_CURL
+  r_global_set_remote_cache(0, 0, 0);
+  _r_http_pool_close();
   curl_global_cleanup();
 #endif
 }
@@ -67,17 +127,38 @@ void r_global_close(void) {
 struct _r_response_str {
   char * ptr;
   size_t len;
+  size_t max_len;
 };
 
-struct _r_expected_content_type {
+struct _r_response_headers {
   const char * expected;
-  int found;
+  int          found;
+  char       * etag;
+  char       * last_modified;
+  long         max_age;
+  int          no_store;
+  int          no_cache;
+  time_t       expires;
 };
 
+static void _r_response_headers_reset(struct _r_response_headers * headers) {
+  o_free(headers->etag);
+  o_free(headers->last_modified);
+  headers->etag = NULL;
+  headers->last_modified = NULL;
+  headers->max_age = -1;
+  headers->no_store = 0;
+  headers->no_cache = 0;
+  headers->expires = 0;
+}
+
 static size_t write_response(char *ptr, size_t size, size_t nmemb, void * userdata) {
   struct _r_response_str * resp = (struct _r_response_str *)userdata;
   size_t len = (size*nmemb);
-  if ((resp->ptr = o_realloc(resp->ptr, (resp->len + len + 1))) != NULL) {
+  if (resp->max_len && resp->len + len > resp->max_len) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "write_response - Response larger than %zu bytes", resp->max_len);
+    return 0;
+  } else if ((resp->ptr = o_realloc(resp->ptr, (resp->len + len + 1))) != NULL) {
     memcpy(resp->ptr+resp->len, ptr, len);
     resp->len += len;
     resp->ptr[resp->len] = '\0';
@@ -87,34 +168,358 @@ static size_t write_response(char *ptr, size_t size, size_t nmemb, void * userda
   }
 }
 
+/**
+ * Returns a copy of the value of the header line if its name is header_name, NULL otherwise
+ */
+static char * get_header_value(const char * header, size_t header_len, const char * header_name) {
+  size_t name_len = o_strlen(header_name), start, end;
+
+  if (header_len > name_len && o_strncasecmp(header, header_name, name_len) == 0 && header[name_len] == ':') {
+    start = name_len+1;
+    end = header_len;
+    while (start < end && (header[start] == ' ' || header[start] == '\t')) {
+      start++;
+    }
+    while (end > start && (header[end-1] == '\r' || header[end-1] == '\n' || header[end-1] == ' ' || header[end-1] == '\t')) {
+      end--;
+    }
+    return o_strndup(header+start, end-start);
+  } else {
+    return NULL;
+  }
+}
+
+static void parse_cache_control(struct _r_response_headers * headers, const char * value) {
+  char ** directives = NULL, * directive;
+  size_t nb_directives, i;
+  long max_age;
+
+  nb_directives = split_string(value, ",", &directives);
+  for (i=0; i<nb_directives; i++) {
+    directive = directives[i];
+    while (*directive == ' ' || *directive == '\t') {
+      directive++;
+    }
+    if (o_strncasecmp(directive, "max-age=", o_strlen("max-age=")) == 0) {
+      max_age = strtol(directive+o_strlen("max-age="), NULL, 10);
+      headers->max_age = max_age>0?max_age:0;
+    } else if (o_strncasecmp(directive, "no-store", o_strlen("no-store")) == 0) {
+      headers->no_store = 1;
+    } else if (o_strncasecmp(directive, "no-cache", o_strlen("no-cache")) == 0) {
+      headers->no_cache = 1;
+    }
+  }
+  free_string_array(directives);
+}
+
 static size_t write_header(void * buffer, size_t size, size_t nitems, void * user_data) {
   const char * header = (const char *)buffer;
-  struct _r_expected_content_type * expected_content_type = (struct _r_expected_content_type *)user_data;
+  struct _r_response_headers * headers = (struct _r_response_headers *)user_data;
+  size_t header_len = size*nitems;
+  char * value;
 
-  if (o_strncasecmp(header, _R_HEADER_CONTENT_TYPE, o_strlen(_R_HEADER_CONTENT_TYPE)) == 0 &&
-     o_strstr(header+o_strlen(_R_HEADER_CONTENT_TYPE)+1, expected_content_type->expected)) {
-    expected_content_type->found = 1;
+  if (header_len > 5 && o_strncmp(header, "HTTP/", 5) == 0) {
+    // New response in a redirection chain, only the last one is relevant for the cache
+    _r_response_headers_reset(headers);
+  } else if (!o_strnullempty(headers->expected) && (value = get_header_value(header, header_len, _R_HEADER_CONTENT_TYPE)) != NULL) {
+    if (o_strstr(value, headers->expected)) {
+      headers->found = 1;
+    }
+    o_free(value);
+  } else if ((value = get_header_value(header, header_len, _R_HEADER_ETAG)) != NULL) {
+    o_free(headers->etag);
+    headers->etag = value;
+  } else if ((value = get_header_value(header, header_len, _R_HEADER_LAST_MODIFIED)) != NULL) {
+    o_free(headers->last_modified);
+    headers->last_modified = value;
+  } else if ((value = get_header_value(header, header_len, _R_HEADER_CACHE_CONTROL)) != NULL) {
+    parse_cache_control(headers, value);
+    o_free(value);
+  } else if ((value = get_header_value(header, header_len, _R_HEADER_EXPIRES)) != NULL) {
+    if ((headers->expires = curl_getdate(value, NULL)) < 0) {
+      // An invalid Expires value means the content is already expired
+      headers->expires = 1;
+    }
+    o_free(value);
   }
-  return nitems * size;
+  return header_len;
 }
-#endif
 
-char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type) {
-  char * to_return = NULL;
-#ifdef R_WITH_CURL
+static void _r_remote_cache_free_entry(struct _r_remote_cache_entry * entry) {
+  if (entry != NULL) {
+    o_free(entry->key);
+    o_free(entry->content);
+    o_free(entry->etag);
+    o_free(entry->last_modified);
+    o_free(entry);
+  }
+}
+
+static void _r_remote_cache_remove(const char * key) {
+  struct _r_remote_cache_entry ** cur = &_r_remote_cache.entries, * entry;
+
+  while (*cur != NULL) {
+    if (0 == o_strcmp((*cur)->key, key)) {
+      entry = *cur;
+      *cur = entry->next;
+      _r_remote_cache_free_entry(entry);
+      _r_remote_cache.nb_entries--;
+      break;
+    }
+    cur = &(*cur)->next;
+  }
+}
+
+static struct _r_remote_cache_entry * _r_remote_cache_find(const char * key) {
+  struct _r_remote_cache_entry * entry;
+
+  for (entry = _r_remote_cache.entries; entry != NULL; entry = entry->next) {
+    if (0 == o_strcmp(entry->key, key)) {
+      break;
+    }
+  }
+  return entry;
+}
+
+/**
+ * Computes the expiration date of a response given its cache headers
+ */
+static time_t _r_remote_cache_expiration(struct _r_response_headers * headers, time_t now) {
+  if (headers->no_cache) {
+    return now;
+  } else if (headers->max_age >= 0) {
+    return now + (time_t)headers->max_age;
+  } else if (headers->expires > 0) {
+    return headers->expires;
+  } else {
+    return now + (time_t)_r_remote_cache.default_ttl;
+  }
+}
+
+/**
+ * Looks for a cached content
+ * If the content is fresh, returns a copy of it
+ * Otherwise, sets etag and last_modified to copies of the stored validators if any
+ */
+static char * _r_remote_cache_lookup(const char * key, char ** etag, char ** last_modified) {
+  struct _r_remote_cache_entry * entry;
+  char * content = NULL;
+  time_t now = time(NULL);
+
+  if (!pthread_mutex_lock(&_r_remote_cache.lock)) {
+    if (_r_remote_cache.enabled && (entry = _r_remote_cache_find(key)) != NULL) {
+      if (now < entry->expires_at || now < entry->fetched_at + (time_t)_r_remote_cache.min_refresh_interval) {
+        content = o_strdup(entry->content);
+      } else {
+        *etag = o_strdup(entry->etag);
+        *last_modified = o_strdup(entry->last_modified);
+      }
+    }
+    pthread_mutex_unlock(&_r_remote_cache.lock);
+  }
+  return content;
+}
+
+/**
+ * Refreshes a cached content after a 304 Not Modified response
+ * Returns a copy of the content
+ */
+static char * _r_remote_cache_revalidate(const char * key, struct _r_response_headers * headers) {
+  struct _r_remote_cache_entry * entry;
+  char * content = NULL;
+  time_t now = time(NULL);
+
+  if (!pthread_mutex_lock(&_r_remote_cache.lock)) {
+    if ((entry = _r_remote_cache_find(key)) != NULL) {
+      content = o_strdup(entry->content);
+      entry->fetched_at = now;
+      entry->expires_at = _r_remote_cache_expiration(headers, now);
+      if (headers->etag != NULL) {
+        o_free(entry->etag);
+        entry->etag = o_strdup(headers->etag);
+      }
+      if (headers->last_modified != NULL) {
+        o_free(entry->last_modified);
+        entry->last_modified = o_strdup(headers->last_modified);
+      }
+    }
+    pthread_mutex_unlock(&_r_remote_cache.lock);
+  }
+  return content;
+}
+
+static void _r_remote_cache_store(const char * key, const char * content, struct _r_response_headers * headers) {
+  struct _r_remote_cache_entry * entry, * oldest, ** cur;
+  time_t now = time(NULL), expires_at = _r_remote_cache_expiration(headers, now);
+
+  if (!pthread_mutex_lock(&_r_remote_cache.lock)) {
+    if (_r_remote_cache.enabled) {
+      _r_remote_cache_remove(key);
+      // Store only contents that can be reused or revalidated
+      if (!headers->no_store && (expires_at > now || _r_remote_cache.min_refresh_interval || headers->etag != NULL || headers->last_modified != NULL)) {
+        if (_r_remote_cache.nb_entries >= _R_REMOTE_CACHE_MAX_ENTRIES) {
+          oldest = _r_remote_cache.entries;
+          for (entry = _r_remote_cache.entries; entry != NULL; entry = entry->next) {
+            if (entry->fetched_at < oldest->fetched_at) {
+              oldest = entry;
+            }
+          }
+          for (cur = &_r_remote_cache.entries; *cur != oldest; cur = &(*cur)->next);
+          *cur = oldest->next;
+          _r_remote_cache_free_entry(oldest);
+          _r_remote_cache.nb_entries--;
+        }
+        if ((entry = o_malloc(sizeof(struct _r_remote_cache_entry))) != NULL) {
+          entry->key = o_strdup(key);
+          entry->content = o_strdup(content);
+          entry->etag = o_strdup(headers->etag);
+          entry->last_modified = o_strdup(headers->last_modified);
+          entry->fetched_at = now;
+          entry->expires_at = expires_at;
+          entry->next = _r_remote_cache.entries;
+          _r_remote_cache.entries = entry;
+          _r_remote_cache.nb_entries++;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_remote_cache_store - Error allocating resources for entry");
+        }
+      }
+    }
+    pthread_mutex_unlock(&_r_remote_cache.lock);
+  }
+}
+
+static void _r_http_lock_share(CURL * handle, curl_lock_data data, curl_lock_access access, void * userptr) {
+  (void)handle;
+  (void)access;
+  (void)userptr;
+  pthread_mutex_lock(&_r_http_pool.share_lock[data]);
+}
+
+static void _r_http_unlock_share(CURL * handle, curl_lock_data data, void * userptr) {
+  (void)handle;
+  (void)userptr;
+  pthread_mutex_unlock(&_r_http_pool.share_lock[data]);
+}
+
+/**
+ * Closes the idle handles in excess, the pool lock must be held
+ */
+static void _r_http_pool_trim(size_t max_idle_handles) {
+  while (_r_http_pool.nb_idle > max_idle_handles) {
+    curl_easy_cleanup(_r_http_pool.idle[--_r_http_pool.nb_idle]);
+  }
+  if (!max_idle_handles) {
+    o_free(_r_http_pool.idle);
+    _r_http_pool.idle = NULL;
+  }
+}
+
+static void _r_http_pool_close(void) {
+  int i;
+
+  if (!pthread_mutex_lock(&_r_http_pool.lock)) {
+    _r_http_pool_trim(0);
+    if (_r_http_pool.share != NULL) {
+      curl_share_cleanup(_r_http_pool.share);
+      _r_http_pool.share = NULL;
+      for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&_r_http_pool.share_lock[i]);
+      }
+    }
+    pthread_mutex_unlock(&_r_http_pool.lock);
+  }
+}
+
+/**
+ * Takes an idle curl handle, or creates a new one using the share handle
+ * The request options are copied to timeouts and max_response_size
+ */
+static CURL * _r_http_handle_take(unsigned int * connect_timeout, unsigned int * timeout, size_t * max_response_size) {
+  CURL * curl = NULL;
+  int i;
+
+  if (!pthread_mutex_lock(&_r_http_pool.lock)) {
+    *connect_timeout = _r_http_pool.connect_timeout;
+    *timeout = _r_http_pool.timeout;
+    *max_response_size = _r_http_pool.max_response_size;
+    _r_http_pool.nb_requests++;
+    if (_r_http_pool.nb_idle) {
+      curl = _r_http_pool.idle[--_r_http_pool.nb_idle];
+    } else {
+      if (_r_http_pool.share == NULL && (_r_http_pool.share = curl_share_init()) != NULL) {
+        for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+          pthread_mutex_init(&_r_http_pool.share_lock[i], NULL);
+        }
+        if (curl_share_setopt(_r_http_pool.share, CURLSHOPT_LOCKFUNC, _r_http_lock_share) != CURLSHE_OK ||
+            curl_share_setopt(_r_http_pool.share, CURLSHOPT_UNLOCKFUNC, _r_http_unlock_share) != CURLSHE_OK ||
+            curl_share_setopt(_r_http_pool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+            curl_share_setopt(_r_http_pool.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_handle_take - Error curl_share_setopt");
+          curl_share_cleanup(_r_http_pool.share);
+          _r_http_pool.share = NULL;
+          for (i=0; i<CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&_r_http_pool.share_lock[i]);
+          }
+        }
+      }
+      if ((curl = curl_easy_init()) != NULL && _r_http_pool.share != NULL) {
+        if (curl_easy_setopt(curl, CURLOPT_SHARE, _r_http_pool.share) != CURLE_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_handle_take - Error setting CURLOPT_SHARE");
+        }
+      }
+    }
+    pthread_mutex_unlock(&_r_http_pool.lock);
+  }
+  return curl;
+}
+
+/**
+ * Puts back a curl handle in the idle handles, or closes it if the pool is full
+ * Its options are reset but its connections are kept
+ */
+static void _r_http_handle_release(CURL * curl) {
+  CURL ** idle;
+  long nb_connects = 0;
+
+  if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &nb_connects) != CURLE_OK) {
+    nb_connects = 0;
+  }
+  curl_easy_reset(curl);
+  if (!pthread_mutex_lock(&_r_http_pool.lock)) {
+    _r_http_pool.nb_connections += (size_t)nb_connects;
+    if (_r_http_pool.nb_idle < _r_http_pool.max_idle_handles) {
+      if (_r_http_pool.idle == NULL) {
+        if ((idle = o_malloc(_r_http_pool.max_idle_handles*sizeof(CURL *))) != NULL) {
+          _r_http_pool.idle = idle;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "_r_http_handle_release - Error allocating resources for idle");
+        }
+      }
+      if (_r_http_pool.idle != NULL) {
+        _r_http_pool.idle[_r_http_pool.nb_idle++] = curl;
+        curl = NULL;
+      }
+    }
+    pthread_mutex_unlock(&_r_http_pool.lock);
+  }
+  if (curl != NULL) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+/**
+ * Performs the http request and returns the response status, 0 on error
+ * If etag or last_modified are set, the request is conditional
+ */
+static long _r_http_fetch(const char * url, int x5u_flags, const char * etag, const char * last_modified, struct _r_response_str * resp, struct _r_response_headers * headers) {
   CURL *curl;
   struct curl_slist *list = NULL;
-  struct _r_response_str resp;
-  struct _r_expected_content_type ct;
+  char * header = NULL;
   long status = 0;
+  unsigned int connect_timeout = 0, timeout = 0;
 
-  curl = curl_easy_init();
+  curl = _r_http_handle_take(&connect_timeout, &timeout, &resp->max_len);
   if(curl != NULL) {
-    resp.ptr = NULL;
-    resp.len = 0;
-    ct.expected = expected_content_type;
-    ct.found = 0;
-
     do {
       if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK) {
         break;
@@ -122,18 +527,47 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
       if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response) != CURLE_OK) {
         break;
       }
-      if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp) != CURLE_OK) {
+      if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp) != CURLE_OK) {
         break;
       }
       if ((list = curl_slist_append(list, "User-Agent: Rhonabwy/" RHONABWY_VERSION_STR)) == NULL) {
         break;
       }
+      if (etag != NULL) {
+        header = msprintf("If-None-Match: %s", etag);
+        list = curl_slist_append(list, header);
+        o_free(header);
+        if (list == NULL) {
+          break;
+        }
+      }
+      if (last_modified != NULL) {
+        header = msprintf("If-Modified-Since: %s", last_modified);
+        list = curl_slist_append(list, header);
+        o_free(header);
+        if (list == NULL) {
+          break;
+        }
+      }
       if (curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list) != CURLE_OK) {
         break;
       }
       if (curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L) != CURLE_OK) {
         break;
       }
+      // Timeouts must not rely on signals, the downloads may run in any thread
+      if (curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) != CURLE_OK) {
+        break;
+      }
+      if (connect_timeout && curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)connect_timeout) != CURLE_OK) {
+        break;
+      }
+      if (timeout && curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout) != CURLE_OK) {
+        break;
+      }
+      if (resp->max_len && curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)resp->max_len) != CURLE_OK) {
+        break;
+      }
 #if CURL_AT_LEAST_VERSION(7,85,0)
       if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https") != CURLE_OK) {
         break;
@@ -162,40 +596,231 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
           break;
         }
       }
-      if (!o_strnullempty(expected_content_type)) {
-        if (curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK) {
-          break;
-        }
-        if (curl_easy_setopt(curl, CURLOPT_WRITEHEADER, &ct) != CURLE_OK) {
-          break;
-        }
+      if (curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK) {
+        break;
+      }
+      if (curl_easy_setopt(curl, CURLOPT_WRITEHEADER, headers) != CURLE_OK) {
+        break;
       }
       if (curl_easy_perform(curl) != CURLE_OK) {
         break;
       }
 
       if (curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK) {
+        status = 0;
         break;
       }
     } while (0);
 
-    curl_easy_cleanup(curl);
+    _r_http_handle_release(curl);
     curl_slist_free_all(list);
+  }
+  return status;
+}
+#endif
+
+int r_global_set_remote_cache(int enabled, unsigned int default_ttl, unsigned int min_refresh_interval) {
+#ifdef R_WITH_CURL
+  struct _r_remote_cache_entry * entry;
+  int ret;
+
+  if (!pthread_mutex_lock(&_r_remote_cache.lock)) {
+    _r_remote_cache.enabled = enabled;
+    _r_remote_cache.default_ttl = default_ttl;
+    _r_remote_cache.min_refresh_interval = min_refresh_interval;
+    if (!enabled) {
+      while ((entry = _r_remote_cache.entries) != NULL) {
+        _r_remote_cache.entries = entry->next;
+        _r_remote_cache_free_entry(entry);
+      }
+      _r_remote_cache.nb_entries = 0;
+    }
+    pthread_mutex_unlock(&_r_remote_cache.lock);
+    ret = RHN_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_global_set_remote_cache - Error pthread_mutex_lock");
+    ret = RHN_ERROR;
+  }
+  return ret;
+#else
+  (void)enabled;
+  (void)default_ttl;
+  (void)min_refresh_interval;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
 
-    if (status >= 200 && status < 300) {
-      if (o_strnullempty(expected_content_type)) {
-        to_return = resp.ptr;
+int r_global_set_http_options(unsigned int connect_timeout, unsigned int timeout, size_t max_response_size, unsigned int max_idle_handles) {
+#ifdef R_WITH_CURL
+  CURL ** idle;
+  int ret = RHN_OK;
+
+  if (!pthread_mutex_lock(&_r_http_pool.lock)) {
+    _r_http_pool_trim(max_idle_handles);
+    if (max_idle_handles && _r_http_pool.idle != NULL && max_idle_handles != _r_http_pool.max_idle_handles) {
+      if ((idle = o_realloc(_r_http_pool.idle, max_idle_handles*sizeof(CURL *))) != NULL) {
+        _r_http_pool.idle = idle;
       } else {
-        if (ct.found) {
-          to_return = resp.ptr;
-        } else {
-          o_free(resp.ptr);
-        }
+        y_log_message(Y_LOG_LEVEL_ERROR, "r_global_set_http_options - Error allocating resources for idle");
+        ret = RHN_ERROR_MEMORY;
+      }
+    }
+    if (ret == RHN_OK) {
+      _r_http_pool.connect_timeout = connect_timeout;
+      _r_http_pool.timeout = timeout;
+      _r_http_pool.max_response_size = max_response_size;
+      _r_http_pool.max_idle_handles = max_idle_handles;
+    }
+    pthread_mutex_unlock(&_r_http_pool.lock);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_global_set_http_options - Error pthread_mutex_lock");
+    ret = RHN_ERROR;
+  }
+  return ret;
+#else
+  (void)connect_timeout;
+  (void)timeout;
+  (void)max_response_size;
+  (void)max_idle_handles;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+int r_global_get_http_stats(size_t * nb_requests, size_t * nb_connections) {
+#ifdef R_WITH_CURL
+  int ret;
+
+  if (!pthread_mutex_lock(&_r_http_pool.lock)) {
+    if (nb_requests != NULL) {
+      *nb_requests = _r_http_pool.nb_requests;
+    }
+    if (nb_connections != NULL) {
+      *nb_connections = _r_http_pool.nb_connections;
+    }
+    pthread_mutex_unlock(&_r_http_pool.lock);
+    ret = RHN_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_global_get_http_stats - Error pthread_mutex_lock");
+    ret = RHN_ERROR;
+  }
+  return ret;
+#else
+  (void)nb_requests;
+  (void)nb_connections;
+  return RHN_ERROR_UNSUPPORTED;
+#endif
+}
+
+int r_global_set_fetcher(rhn_fetcher_t fetcher, void * user_data) {
+  int ret;
+
+  if (!pthread_mutex_lock(&_r_fetcher.lock)) {
+    _r_fetcher.fetcher = fetcher;
+    _r_fetcher.user_data = user_data;
+    pthread_mutex_unlock(&_r_fetcher.lock);
+    ret = RHN_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "r_global_set_fetcher - Error pthread_mutex_lock");
+    ret = RHN_ERROR;
+  }
+  return ret;
+}
+
+/**
+ * Returns 1 and sets content to the result of the fetcher if a fetcher is set,
+ * returns 0 otherwise
+ */
+static int _r_fetcher_get(const char * url, int x5u_flags, const char * expected_content_type, char ** content) {
+  rhn_fetcher_t fetcher = NULL;
+  void * user_data = NULL;
+
+  if (!pthread_mutex_lock(&_r_fetcher.lock)) {
+    fetcher = _r_fetcher.fetcher;
+    user_data = _r_fetcher.user_data;
+    pthread_mutex_unlock(&_r_fetcher.lock);
+  }
+  if (fetcher != NULL) {
+    *content = fetcher(url, x5u_flags, expected_content_type, user_data);
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+void r_global_flush_remote_cache(void) {
+#ifdef R_WITH_CURL
+  struct _r_remote_cache_entry * entry;
+
+  if (!pthread_mutex_lock(&_r_remote_cache.lock)) {
+    while ((entry = _r_remote_cache.entries) != NULL) {
+      _r_remote_cache.entries = entry->next;
+      _r_remote_cache_free_entry(entry);
+    }
+    _r_remote_cache.nb_entries = 0;
+    pthread_mutex_unlock(&_r_remote_cache.lock);
+  }
+#endif
+}
+
+static char * _r_curl_get_content(const char * url, int x5u_flags, const char * expected_content_type) {
+  char * to_return = NULL;
+#ifdef R_WITH_CURL
+  struct _r_response_str resp = {NULL, 0, 0};
+  struct _r_response_headers headers = {expected_content_type, 0, NULL, NULL, -1, 0, 0, 0};
+  char * key = NULL, * etag = NULL, * last_modified = NULL;
+  int enabled;
+  long status;
+
+  pthread_mutex_lock(&_r_remote_cache.lock);
+  enabled = _r_remote_cache.enabled;
+  pthread_mutex_unlock(&_r_remote_cache.lock);
+
+  if (enabled) {
+    key = msprintf("%d|%s|%s", x5u_flags, expected_content_type!=NULL?expected_content_type:"", url);
+    to_return = _r_remote_cache_lookup(key, &etag, &last_modified);
+  }
+
+  if (to_return == NULL) {
+    status = _r_http_fetch(url, x5u_flags, etag, last_modified, &resp, &headers);
+    if (status == 304 && enabled && (etag != NULL || last_modified != NULL)) {
+      to_return = _r_remote_cache_revalidate(key, &headers);
+      o_free(resp.ptr);
+    } else if (status >= 200 && status < 300 && (o_strnullempty(expected_content_type) || headers.found)) {
+      to_return = resp.ptr;
+      if (enabled) {
+        _r_remote_cache_store(key, to_return, &headers);
       }
     } else {
       o_free(resp.ptr);
     }
   }
+
+  _r_response_headers_reset(&headers);
+  o_free(key);
+  o_free(etag);
+  o_free(last_modified);
+#else
+  (void)url;
+  (void)x5u_flags;
+  (void)expected_content_type;
+#endif
+  return to_return;
+}
+
+static char * _r_curl_get_content_uncached(const char * url, int x5u_flags, const char * expected_content_type) {
+  char * to_return = NULL;
+#ifdef R_WITH_CURL
+  struct _r_response_str resp = {NULL, 0, 0};
+  struct _r_response_headers headers = {expected_content_type, 0, NULL, NULL, -1, 0, 0, 0};
+  long status;
+
+  status = _r_http_fetch(url, x5u_flags, NULL, NULL, &resp, &headers);
+  if (status >= 200 && status < 300 && (o_strnullempty(expected_content_type) || headers.found)) {
+    to_return = resp.ptr;
+  } else {
+    o_free(resp.ptr);
+  }
+  _r_response_headers_reset(&headers);
 #else
   (void)url;
   (void)x5u_flags;
@@ -204,6 +829,28 @@ char * _r_get_http_content(const char * url, int x5u_flags, const char * expecte
   return to_return;
 }
 
+char * _r_get_http_content(const char * url, int x5u_flags, const char * expected_content_type) {
+  char * to_return = NULL;
+
+  if (!_r_fetcher_get(url, x5u_flags, expected_content_type, &to_return)) {
+    to_return = _r_curl_get_content(url, x5u_flags, expected_content_type);
+  }
+  return to_return;
+}
+
+/**
+ * Same as _r_get_http_content but always downloads the content,
+ * the remote cache is neither read nor updated
+ */
+char * _r_get_http_content_uncached(const char * url, int x5u_flags, const char * expected_content_type) {
+  char * to_return = NULL;
+
+  if (!_r_fetcher_get(url, x5u_flags, expected_content_type, &to_return)) {
+    to_return = _r_curl_get_content_uncached(url, x5u_flags, expected_content_type);
+  }
+  return to_return;
+}
+
 int _r_json_set_str_value(json_t * j_json, const char * key, const char * str_value) {
   int ret;
 
@@ -253,42 +900,388 @@ int _r_json_set_json_t_value(json_t * j_json, const char * key, json_t * j_value
         ret = RHN_ERROR;
       }
     } else {
-      json_object_del(j_json, key);
-      ret = RHN_OK;
+      json_object_del(j_json, key);
+      ret = RHN_OK;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+const char * _r_json_get_str_value(json_t * j_json, const char * key) {
+  if (j_json != NULL && !o_strnullempty(key)) {
+    return json_string_value(json_object_get(j_json, key));
+  }
+  return NULL;
+}
+
+rhn_int_t _r_json_get_int_value(json_t * j_json, const char * key) {
+  if (j_json != NULL && !o_strnullempty(key)) {
+    return json_integer_value(json_object_get(j_json, key));
+  }
+  return 0;
+}
+
+json_t * _r_json_get_json_t_value(json_t * j_json, const char * key) {
+  json_t * j_value;
+
+  if (j_json != NULL && !o_strnullempty(key) && (j_value = json_object_get(j_json, key)) != NULL) {
+    return json_deep_copy(j_value);
+  }
+  return NULL;
+}
+
+json_t * _r_json_get_full_json_t(json_t * j_json) {
+  if (j_json != NULL) {
+    return json_deep_copy(j_json);
+  }
+  return NULL;
+}
+
+/**
+ * JSON scanner used to check or read a JSON text without building its tree
+ * The grammar accepted is the one of jansson's decoder: UTF-8 strings,
+ * no \u0000 escape, nested depth up to _R_JSON_MAX_DEPTH
+ * Each function returns the offset after the scanned element, 0 on error
+ */
+#define _R_JSON_MAX_DEPTH 2048
+
+static size_t _r_json_skip_ws(const char * json, size_t len, size_t i) {
+  while (i < len && (json[i] == ' ' || json[i] == '\t' || json[i] == '\n' || json[i] == '\r')) {
+    i++;
+  }
+  return i;
+}
+
+static int _r_json_hex4(const char * json, size_t len, size_t i, unsigned int * value) {
+  size_t k;
+  char c;
+
+  if (i+4 > len) {
+    return 0;
+  }
+  *value = 0;
+  for (k=0; k<4; k++) {
+    c = json[i+k];
+    if (c >= '0' && c <= '9') {
+      *value = (*value<<4) | (unsigned int)(c-'0');
+    } else if (c >= 'a' && c <= 'f') {
+      *value = (*value<<4) | (unsigned int)(c-'a'+10);
+    } else if (c >= 'A' && c <= 'F') {
+      *value = (*value<<4) | (unsigned int)(c-'A'+10);
+    } else {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static size_t _r_json_scan_utf8(const unsigned char * json, size_t len, size_t i) {
+  unsigned char c = json[i], lo = 0x80, hi = 0xBF;
+  size_t n, k;
+
+  if (c >= 0xC2 && c <= 0xDF) {
+    n = 1;
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    n = 2;
+    if (c == 0xE0) {
+      lo = 0xA0;
+    } else if (c == 0xED) {
+      // Surrogates aren't valid UTF-8
+      hi = 0x9F;
+    }
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 3;
+    if (c == 0xF0) {
+      lo = 0x90;
+    } else if (c == 0xF4) {
+      hi = 0x8F;
+    }
+  } else {
+    return 0;
+  }
+  if (i+n >= len || json[i+1] < lo || json[i+1] > hi) {
+    return 0;
+  }
+  for (k=2; k<=n; k++) {
+    if ((json[i+k]&0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  return i+n+1;
+}
+
+static size_t _r_json_scan_string(const char * json, size_t len, size_t i) {
+  unsigned int value, low;
+  unsigned char c;
+
+  if (i >= len || json[i] != '"') {
+    return 0;
+  }
+  i++;
+  while (i < len) {
+    c = (unsigned char)json[i];
+    if (c == '"') {
+      return i+1;
+    } else if (c < 0x20) {
+      return 0;
+    } else if (c == '\\') {
+      if (++i >= len) {
+        return 0;
+      }
+      switch (json[i]) {
+        case '"':
+        case '\\':
+        case '/':
+        case 'b':
+        case 'f':
+        case 'n':
+        case 'r':
+        case 't':
+          i++;
+          break;
+        case 'u':
+          if (!_r_json_hex4(json, len, i+1, &value) || !value || (value >= 0xDC00 && value <= 0xDFFF)) {
+            return 0;
+          }
+          i += 5;
+          if (value >= 0xD800 && value <= 0xDBFF) {
+            // A high surrogate must be followed by a low surrogate
+            if (i+2 > len || json[i] != '\\' || json[i+1] != 'u' || !_r_json_hex4(json, len, i+2, &low) || low < 0xDC00 || low > 0xDFFF) {
+              return 0;
+            }
+            i += 6;
+          }
+          break;
+        default:
+          return 0;
+      }
+    } else if (c < 0x80) {
+      i++;
+    } else if (!(i = _r_json_scan_utf8((const unsigned char *)json, len, i))) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static size_t _r_json_scan_digits(const char * json, size_t len, size_t i) {
+  if (i >= len || json[i] < '0' || json[i] > '9') {
+    return 0;
+  }
+  while (i < len && json[i] >= '0' && json[i] <= '9') {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * jansson rejects the integers out of the json_int_t range and the reals too large for a double
+ */
+static int _r_json_number_in_range(const char * json, size_t start, size_t end, int real) {
+  char stack_buf[64], * buf = stack_buf;
+  double value;
+  int ret;
+
+  if (end-start < sizeof(stack_buf)) {
+    memcpy(stack_buf, json+start, end-start);
+    stack_buf[end-start] = '\0';
+  } else if ((buf = o_strndup(json+start, end-start)) == NULL) {
+    return 0;
+  }
+  errno = 0;
+  if (real) {
+    value = strtod(buf, NULL);
+    ret = !((value == HUGE_VAL || value == -HUGE_VAL) && errno == ERANGE);
+  } else {
+    strtoll(buf, NULL, 10);
+    ret = errno != ERANGE;
+  }
+  if (buf != stack_buf) {
+    o_free(buf);
+  }
+  return ret;
+}
+
+static size_t _r_json_scan_number(const char * json, size_t len, size_t i) {
+  size_t start = i;
+  int real = 0;
+
+  if (i < len && json[i] == '-') {
+    i++;
+  }
+  if (i < len && json[i] == '0') {
+    i++;
+  } else if (i >= len || json[i] < '1' || !(i = _r_json_scan_digits(json, len, i))) {
+    return 0;
+  }
+  if (i < len && json[i] == '.') {
+    real = 1;
+    if (!(i = _r_json_scan_digits(json, len, i+1))) {
+      return 0;
+    }
+  }
+  if (i < len && (json[i] == 'e' || json[i] == 'E')) {
+    real = 1;
+    i++;
+    if (i < len && (json[i] == '+' || json[i] == '-')) {
+      i++;
+    }
+    if (!(i = _r_json_scan_digits(json, len, i))) {
+      return 0;
+    }
+  }
+  // Most numbers in claims are short integers, always in range
+  if ((real || i-start > 18) && !_r_json_number_in_range(json, start, i, real)) {
+    return 0;
+  }
+  return i;
+}
+
+static size_t _r_json_scan_value(const char * json, size_t len, size_t i, unsigned int depth);
+
+static size_t _r_json_scan_container(const char * json, size_t len, size_t i, unsigned int depth) {
+  char close = json[i]=='{'?'}':']';
+
+  i = _r_json_skip_ws(json, len, i+1);
+  if (i < len && json[i] == close) {
+    return i+1;
+  }
+  while (i < len) {
+    if (close == '}') {
+      if (!(i = _r_json_scan_string(json, len, i))) {
+        return 0;
+      }
+      i = _r_json_skip_ws(json, len, i);
+      if (i >= len || json[i] != ':') {
+        return 0;
+      }
+      i = _r_json_skip_ws(json, len, i+1);
+    }
+    if (!(i = _r_json_scan_value(json, len, i, depth))) {
+      return 0;
+    }
+    i = _r_json_skip_ws(json, len, i);
+    if (i < len && json[i] == ',') {
+      i = _r_json_skip_ws(json, len, i+1);
+    } else if (i < len && json[i] == close) {
+      return i+1;
+    } else {
+      return 0;
     }
-  } else {
-    ret = RHN_ERROR_PARAM;
   }
-  return ret;
+  return 0;
 }
 
-const char * _r_json_get_str_value(json_t * j_json, const char * key) {
-  if (j_json != NULL && !o_strnullempty(key)) {
-    return json_string_value(json_object_get(j_json, key));
+static size_t _r_json_scan_value(const char * json, size_t len, size_t i, unsigned int depth) {
+  if (i >= len) {
+    return 0;
+  }
+  switch (json[i]) {
+    case '"':
+      return _r_json_scan_string(json, len, i);
+    case '{':
+    case '[':
+      return depth<_R_JSON_MAX_DEPTH?_r_json_scan_container(json, len, i, depth+1):0;
+    case 't':
+      return (len-i >= 4 && 0 == memcmp(json+i, "true", 4))?i+4:0;
+    case 'f':
+      return (len-i >= 5 && 0 == memcmp(json+i, "false", 5))?i+5:0;
+    case 'n':
+      return (len-i >= 4 && 0 == memcmp(json+i, "null", 4))?i+4:0;
+    default:
+      return _r_json_scan_number(json, len, i);
   }
-  return NULL;
 }
 
-rhn_int_t _r_json_get_int_value(json_t * j_json, const char * key) {
-  if (j_json != NULL && !o_strnullempty(key)) {
-    return json_integer_value(json_object_get(j_json, key));
+int _r_json_validate(const char * json, size_t json_len) {
+  size_t i;
+
+  if (json == NULL || !json_len) {
+    return 0;
   }
-  return 0;
+  if (!(i = _r_json_scan_value(json, json_len, _r_json_skip_ws(json, json_len, 0), 0))) {
+    return 0;
+  }
+  return _r_json_skip_ws(json, json_len, i) == json_len;
 }
 
-json_t * _r_json_get_json_t_value(json_t * j_json, const char * key) {
-  json_t * j_value;
+/**
+ * Returns the index in names of the object key json[start..end[, -1 if not found
+ */
+static long _r_json_match_key(const char * json, size_t start, size_t end, const char * const * names, size_t nb_names) {
+  json_t * j_key = NULL;
+  const char * key = json+start+1;
+  size_t key_len = end-start-2, i;
+  long index = -1;
 
-  if (j_json != NULL && !o_strnullempty(key) && (j_value = json_object_get(j_json, key)) != NULL) {
-    return json_deep_copy(j_value);
+  if (memchr(key, '\\', key_len) != NULL) {
+    // The key is escaped, it's decoded to be compared
+    if ((j_key = json_loadb(json+start, end-start, JSON_DECODE_ANY, NULL)) == NULL) {
+      return -1;
+    }
+    key = json_string_value(j_key);
+    key_len = json_string_length(j_key);
   }
-  return NULL;
+  for (i=0; i<nb_names && index < 0; i++) {
+    if (names[i] != NULL && o_strlen(names[i]) == key_len && 0 == memcmp(names[i], key, key_len)) {
+      index = (long)i;
+    }
+  }
+  json_decref(j_key);
+  return index;
 }
 
-json_t * _r_json_get_full_json_t(json_t * j_json) {
-  if (j_json != NULL) {
-    return json_deep_copy(j_json);
+json_t * _r_json_extract_members(const char * json, size_t json_len, const char * const * names, size_t nb_names) {
+  json_t * j_result, * j_value;
+  size_t i, key_start, key_end, value_start;
+  long index;
+
+  if (json == NULL || !json_len || names == NULL) {
+    return NULL;
+  }
+  i = _r_json_skip_ws(json, json_len, 0);
+  if (i >= json_len || json[i] != '{' || (j_result = json_object()) == NULL) {
+    return NULL;
+  }
+  i = _r_json_skip_ws(json, json_len, i+1);
+  if (i < json_len && json[i] == '}') {
+    if (_r_json_skip_ws(json, json_len, i+1) == json_len) {
+      return j_result;
+    }
+    i = json_len;
+  }
+  // Only the values of the selected members are decoded, the others are skipped
+  while (i < json_len) {
+    key_start = i;
+    if (!(i = key_end = _r_json_scan_string(json, json_len, i))) {
+      break;
+    }
+    i = _r_json_skip_ws(json, json_len, i);
+    if (i >= json_len || json[i] != ':') {
+      break;
+    }
+    value_start = i = _r_json_skip_ws(json, json_len, i+1);
+    if (!(i = _r_json_scan_value(json, json_len, i, 1))) {
+      break;
+    }
+    if ((index = _r_json_match_key(json, key_start, key_end, names, nb_names)) >= 0) {
+      if ((j_value = json_loadb(json+value_start, i-value_start, JSON_DECODE_ANY, NULL)) == NULL ||
+          json_object_set_new(j_result, names[index], j_value)) {
+        break;
+      }
+    }
+    i = _r_json_skip_ws(json, json_len, i);
+    if (i < json_len && json[i] == ',') {
+      i = _r_json_skip_ws(json, json_len, i+1);
+    } else if (i < json_len && json[i] == '}' && _r_json_skip_ws(json, json_len, i+1) == json_len) {
+      return j_result;
+    } else {
+      break;
+    }
   }
+  json_decref(j_result);
   return NULL;
 }
 
@@ -436,6 +1429,334 @@ int _r_inflate_payload(const unsigned char * compressed, size_t compressed_len,
   return ret;
 }
 
+// Portable scalar base64url codec, bench/base64url.c measures its throughput
+static const unsigned char _r_base64url_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Value of each base64url character, 0xFF if the character is invalid
+static const unsigned char _r_base64url_values[256] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F,
+  0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+int _r_base64url_encode(const unsigned char * src, size_t len, unsigned char * out, size_t * out_len) {
+  size_t i = 0, j = 0;
+  uint32_t v;
+
+  if (src == NULL || !len || out_len == NULL) {
+    return 0;
+  }
+  if (out != NULL) {
+    for (; i+3 <= len; i+=3, j+=4) {
+      v = ((uint32_t)src[i]<<16) | ((uint32_t)src[i+1]<<8) | (uint32_t)src[i+2];
+      out[j]   = _r_base64url_alphabet[v>>18];
+      out[j+1] = _r_base64url_alphabet[(v>>12)&0x3F];
+      out[j+2] = _r_base64url_alphabet[(v>>6)&0x3F];
+      out[j+3] = _r_base64url_alphabet[v&0x3F];
+    }
+    if (len-i == 1) {
+      v = (uint32_t)src[i]<<16;
+      out[j]   = _r_base64url_alphabet[v>>18];
+      out[j+1] = _r_base64url_alphabet[(v>>12)&0x3F];
+    } else if (len-i == 2) {
+      v = ((uint32_t)src[i]<<16) | ((uint32_t)src[i+1]<<8);
+      out[j]   = _r_base64url_alphabet[v>>18];
+      out[j+1] = _r_base64url_alphabet[(v>>12)&0x3F];
+      out[j+2] = _r_base64url_alphabet[(v>>6)&0x3F];
+    }
+  }
+  *out_len = (len/3)*4 + (len%3?len%3+1:0);
+  return 1;
+}
+
+int _r_base64url_decode(const unsigned char * src, size_t len, unsigned char * out, size_t * out_len) {
+  size_t i = 0, j = 0;
+  uint32_t v;
+  unsigned char c0, c1, c2, c3;
+
+  if (src == NULL || !len || out_len == NULL) {
+    return 0;
+  }
+  // Padding isn't used in JOSE but is tolerated
+  if (!(len%4) && src[len-1] == '=') {
+    len--;
+    if (src[len-1] == '=') {
+      len--;
+    }
+  }
+  // A dangling character carries no complete byte, it is ignored like orcania does
+  if (len%4 == 1) {
+    if (_r_base64url_values[src[len-1]]&0x80) {
+      return 0;
+    }
+    if (!(--len)) {
+      return 0;
+    }
+  }
+  for (; i+4 <= len; i+=4, j+=3) {
+    c0 = _r_base64url_values[src[i]];
+    c1 = _r_base64url_values[src[i+1]];
+    c2 = _r_base64url_values[src[i+2]];
+    c3 = _r_base64url_values[src[i+3]];
+    if ((c0|c1|c2|c3)&0x80) {
+      return 0;
+    }
+    if (out != NULL) {
+      v = ((uint32_t)c0<<18) | ((uint32_t)c1<<12) | ((uint32_t)c2<<6) | (uint32_t)c3;
+      out[j]   = (unsigned char)(v>>16);
+      out[j+1] = (unsigned char)(v>>8);
+      out[j+2] = (unsigned char)v;
+    }
+  }
+  if (len-i >= 2) {
+    c0 = _r_base64url_values[src[i]];
+    c1 = _r_base64url_values[src[i+1]];
+    c2 = len-i==3?_r_base64url_values[src[i+2]]:0;
+    if ((c0|c1|c2)&0x80) {
+      return 0;
+    }
+    if (out != NULL) {
+      out[j] = (unsigned char)((c0<<2) | (c1>>4));
+      if (len-i == 3) {
+        out[j+1] = (unsigned char)((c1<<4) | (c2>>2));
+      }
+    }
+    j += len-i-1;
+  }
+  *out_len = j;
+  return 1;
+}
+
+int _r_base64url_encode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat) {
+  size_t out_len = 0;
+
+  if (dat != NULL && _r_base64url_encode(src, len, NULL, &out_len)) {
+    if ((dat->data = o_malloc(out_len+1)) != NULL) {
+      _r_base64url_encode(src, len, dat->data, &out_len);
+      dat->data[out_len] = '\0';
+      dat->size = out_len;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int _r_base64url_decode_alloc(const unsigned char * src, size_t len, struct _o_datum * dat) {
+  size_t out_len = 0;
+
+  if (dat != NULL && src != NULL && len) {
+    // Decode in a single pass in a buffer large enough for any valid input
+    if ((dat->data = o_malloc((len/4)*3+3)) != NULL) {
+      if (_r_base64url_decode(src, len, dat->data, &out_len)) {
+        dat->data[out_len] = '\0';
+        dat->size = out_len;
+        return 1;
+      }
+      o_free(dat->data);
+      dat->data = NULL;
+    }
+  }
+  return 0;
+}
+
+size_t _r_split_compact_token(const char * token, size_t token_len, size_t * offsets, size_t * lengths, size_t max_segments) {
+  size_t nb_segments = 0, start = 0, i;
+
+  if (token != NULL && offsets != NULL && lengths != NULL && max_segments) {
+    for (i=0; i<=token_len; i++) {
+      if (i == token_len || token[i] == '.') {
+        if (nb_segments == max_segments) {
+          return 0;
+        }
+        offsets[nb_segments] = start;
+        lengths[nb_segments] = i-start;
+        nb_segments++;
+        start = i+1;
+      }
+    }
+  }
+  return nb_segments;
+}
+
+void _r_spare_keep(unsigned char ** spare, unsigned char ** str) {
+  if (*str != NULL) {
+    if (*spare == NULL || o_strlen((const char *)*str) > o_strlen((const char *)*spare)) {
+      o_free(*spare);
+      *spare = *str;
+    } else {
+      o_free(*str);
+    }
+    *str = NULL;
+  }
+}
+
+unsigned char * _r_spare_strndup(unsigned char ** spare, const char * src, size_t len) {
+  unsigned char * str;
+
+  // The spare string length is a lower bound of its allocated size
+  if (*spare != NULL && o_strlen((const char *)*spare) >= len) {
+    str = *spare;
+    *spare = NULL;
+    memcpy(str, src, len);
+    str[len] = '\0';
+  } else {
+    str = (unsigned char *)o_strndup(src, len);
+  }
+  return str;
+}
+
+struct _r_batch {
+  jwks_t             * jwks;
+  json_t             * j_kid_index;
+  jwk_prepared_t    ** prepared;
+  size_t               nb_keys;
+  const char        ** tokens;
+  rhn_batch_result_t * results;
+  size_t               count;
+  size_t               next;
+  pthread_mutex_t      lock;
+  _r_batch_process     process;
+};
+
+static void * _r_batch_worker(void * arg) {
+  struct _r_batch * batch = (struct _r_batch *)arg;
+  size_t index;
+
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    index = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (index >= batch->count) {
+      break;
+    }
+    batch->process(batch, batch->tokens[index], &batch->results[index]);
+  }
+  return NULL;
+}
+
+jwk_prepared_t * _r_batch_get_key(struct _r_batch * batch, const char * kid) {
+  json_t * j_index;
+
+  if (kid != NULL) {
+    if ((j_index = json_object_get(batch->j_kid_index, kid)) == NULL) {
+      return NULL;
+    }
+    return batch->prepared[json_integer_value(j_index)];
+  } else if (batch->nb_keys == 1) {
+    return batch->prepared[0];
+  } else {
+    return NULL;
+  }
+}
+
+static void _r_batch_clean(struct _r_batch * batch) {
+  size_t i;
+
+  if (batch->prepared != NULL) {
+    for (i=0; i<batch->nb_keys; i++) {
+      r_jwk_prepared_free(batch->prepared[i]);
+    }
+    o_free(batch->prepared);
+  }
+  json_decref(batch->j_kid_index);
+}
+
+int _r_batch_run(jwks_t * jwks, int x5u_flags, const char ** tokens, size_t count, unsigned int nb_threads, rhn_batch_result_t * results, _r_batch_process process) {
+  struct _r_batch batch;
+  pthread_t * threads = NULL;
+  size_t i, nb_started = 0;
+  const char * kid;
+  long nb_cpus;
+  int ret = RHN_OK;
+
+  if (jwks == NULL || tokens == NULL || !count || results == NULL || process == NULL) {
+    return RHN_ERROR_PARAM;
+  }
+  for (i=0; i<count; i++) {
+    results[i].status = RHN_ERROR;
+    results[i].j_claims = NULL;
+    results[i].payload = NULL;
+    results[i].payload_len = 0;
+  }
+  memset(&batch, 0, sizeof(struct _r_batch));
+  batch.jwks = jwks;
+  batch.nb_keys = r_jwks_size(jwks);
+  batch.tokens = tokens;
+  batch.results = results;
+  batch.count = count;
+  batch.process = process;
+  // Keys are resolved by kid and prepared once per batch before the workers start,
+  // the workers only use them to verify signatures, so they share them
+  // The first key wins if a kid is duplicated
+  if ((batch.j_kid_index = json_object()) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_batch_run - Error allocating resources for j_kid_index");
+    return RHN_ERROR_MEMORY;
+  }
+  if ((batch.prepared = o_malloc((batch.nb_keys+1)*sizeof(jwk_prepared_t *))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_batch_run - Error allocating resources for prepared");
+    json_decref(batch.j_kid_index);
+    return RHN_ERROR_MEMORY;
+  }
+  memset(batch.prepared, 0, (batch.nb_keys+1)*sizeof(jwk_prepared_t *));
+  for (i=0; i<batch.nb_keys; i++) {
+    kid = r_jwk_get_property_str(r_jwks_peek_at(jwks, i), "kid");
+    if (kid != NULL && json_object_get(batch.j_kid_index, kid) != NULL) {
+      continue;
+    }
+    // A key that can't be prepared stays NULL, the tokens using it are invalid
+    batch.prepared[i] = r_jwk_prepare(r_jwks_peek_at(jwks, i), x5u_flags);
+    if (kid != NULL) {
+      json_object_set_new(batch.j_kid_index, kid, json_integer((json_int_t)i));
+    }
+  }
+  if (!nb_threads) {
+    nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nb_threads = nb_cpus>0?(unsigned int)nb_cpus:1;
+  }
+  if (nb_threads > count) {
+    nb_threads = (unsigned int)count;
+  }
+  if (pthread_mutex_init(&batch.lock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "_r_batch_run - Error pthread_mutex_init");
+    _r_batch_clean(&batch);
+    return RHN_ERROR;
+  }
+  // The calling thread is a worker too
+  if (nb_threads > 1 && (threads = o_malloc((nb_threads-1)*sizeof(pthread_t))) != NULL) {
+    for (i=0; i<nb_threads-1; i++) {
+      if (pthread_create(&threads[i], NULL, _r_batch_worker, &batch)) {
+        y_log_message(Y_LOG_LEVEL_WARNING, "_r_batch_run - Error pthread_create, continue with %zu threads", nb_started+1);
+        break;
+      }
+      nb_started++;
+    }
+  }
+  _r_batch_worker(&batch);
+  for (i=0; i<nb_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (batch.next < batch.count) {
+    ret = RHN_ERROR_MEMORY;
+  }
+  o_free(threads);
+  pthread_mutex_destroy(&batch.lock);
+  _r_batch_clean(&batch);
+  return ret;
+}
+
 jwa_alg r_str_to_jwa_alg(const char * alg) {
   if (0 == o_strcmp("none", alg)) {
     return R_JWA_ALG_NONE;
@@ -728,3 +2049,278 @@ char * r_library_info_json_str(void) {
 void r_free(void * data) {
   o_free(data);
 }
+
+void r_batch_results_clean(rhn_batch_result_t * results, size_t count) {
+  size_t i;
+
+  if (results != NULL) {
+    for (i=0; i<count; i++) {
+      json_decref(results[i].j_claims);
+      results[i].j_claims = NULL;
+      o_free(results[i].payload);
+      results[i].payload = NULL;
+      results[i].payload_len = 0;
+    }
+  }
+}
+
+#define _R_ARENA_DEFAULT_BLOCK_SIZE (64*1024)
+#define _R_ARENA_ALIGN              16
+
+struct _r_arena_block {
+  struct _r_arena_block * next;
+  size_t                  size;
+  size_t                  used;
+  unsigned char         * data;
+};
+
+struct _rhn_arena {
+  size_t                  block_size;
+  struct _r_arena_block * blocks;
+  struct _r_arena_block * current;
+  size_t                  nb_blocks;
+  size_t                  nb_allocs;
+  int                     active;
+  rhn_arena_t           * previous;
+};
+
+/**
+ * Each allocation is preceded by its size, so o_realloc can copy it
+ * The header keeps the allocations aligned
+ */
+typedef union {
+  size_t size;
+  unsigned char align[_R_ARENA_ALIGN];
+} _r_arena_header;
+
+static int _r_arena_installed = 0;
+static o_malloc_t _r_arena_next_malloc = NULL;
+static o_realloc_t _r_arena_next_realloc = NULL;
+static o_free_t _r_arena_next_free = NULL;
+static json_malloc_t _r_arena_next_json_malloc = NULL;
+static json_free_t _r_arena_next_json_free = NULL;
+static __thread rhn_arena_t * _r_arena_thread = NULL;
+
+static struct _r_arena_block * _r_arena_owner(rhn_arena_t * arena, const void * ptr) {
+  struct _r_arena_block * block;
+
+  for (block = arena->blocks; block != NULL; block = block->next) {
+    if ((const unsigned char *)ptr >= block->data && (const unsigned char *)ptr < block->data+block->size) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+static void * _r_arena_alloc(rhn_arena_t * arena, size_t size) {
+  struct _r_arena_block * block, * new_block;
+  size_t needed = sizeof(_r_arena_header)+((size+_R_ARENA_ALIGN-1)&~((size_t)_R_ARENA_ALIGN-1));
+  _r_arena_header * header;
+
+  // The blocks after the current one are empty, the first one large enough is used
+  for (block = arena->current; block != NULL && block->size-block->used < needed; block = block->next);
+  if (block == NULL) {
+    if ((new_block = _r_arena_next_malloc(sizeof(struct _r_arena_block))) == NULL) {
+      return NULL;
+    }
+    new_block->size = needed>arena->block_size?needed:arena->block_size;
+    new_block->used = 0;
+    if ((new_block->data = _r_arena_next_malloc(new_block->size)) == NULL) {
+      _r_arena_next_free(new_block);
+      return NULL;
+    }
+    if (arena->current != NULL) {
+      new_block->next = arena->current->next;
+      arena->current->next = new_block;
+    } else {
+      new_block->next = arena->blocks;
+      arena->blocks = new_block;
+    }
+    arena->nb_blocks++;
+    block = new_block;
+  }
+  if (block->size-block->used >= arena->block_size/8 || arena->current == NULL) {
+    arena->current = block;
+  }
+  header = (_r_arena_header *)(block->data+block->used);
+  header->size = size;
+  block->used += needed;
+  arena->nb_allocs++;
+  return header+1;
+}
+
+static void * _r_arena_malloc_fn(size_t size) {
+  rhn_arena_t * arena = _r_arena_thread;
+
+  if (arena != NULL && arena->active) {
+    return _r_arena_alloc(arena, size);
+  } else {
+    return _r_arena_next_malloc(size);
+  }
+}
+
+static void _r_arena_free_fn(void * ptr) {
+  rhn_arena_t * arena = _r_arena_thread;
+  struct _r_arena_block * block;
+  _r_arena_header * header;
+  size_t used;
+
+  if (arena != NULL && ptr != NULL && (block = _r_arena_owner(arena, ptr)) != NULL) {
+    // The memory is released with the arena, except the last allocation of a block
+    header = ((_r_arena_header *)ptr)-1;
+    used = (size_t)((unsigned char *)ptr-block->data)+((header->size+_R_ARENA_ALIGN-1)&~((size_t)_R_ARENA_ALIGN-1));
+    if (used == block->used) {
+      block->used = (size_t)((unsigned char *)header-block->data);
+    }
+  } else {
+    _r_arena_next_free(ptr);
+  }
+}
+
+static void * _r_arena_realloc_fn(void * ptr, size_t size) {
+  rhn_arena_t * arena = _r_arena_thread;
+  struct _r_arena_block * block;
+  _r_arena_header * header;
+  void * new_ptr;
+
+  if (arena != NULL && ptr != NULL && (block = _r_arena_owner(arena, ptr)) != NULL) {
+    header = ((_r_arena_header *)ptr)-1;
+    if ((new_ptr = _r_arena_malloc_fn(size)) != NULL) {
+      memcpy(new_ptr, ptr, header->size<size?header->size:size);
+      _r_arena_free_fn(ptr);
+    }
+    return new_ptr;
+  } else if (arena != NULL && arena->active && ptr == NULL) {
+    return _r_arena_alloc(arena, size);
+  } else {
+    return _r_arena_next_realloc(ptr, size);
+  }
+}
+
+/**
+ * jansson may use other allocation functions than orcania,
+ * the memory not taken from an arena goes back to them
+ */
+static void * _r_arena_json_malloc_fn(size_t size) {
+  rhn_arena_t * arena = _r_arena_thread;
+
+  if (arena != NULL && arena->active) {
+    return _r_arena_alloc(arena, size);
+  } else {
+    return _r_arena_next_json_malloc(size);
+  }
+}
+
+static void _r_arena_json_free_fn(void * ptr) {
+  rhn_arena_t * arena = _r_arena_thread;
+
+  if (arena != NULL && ptr != NULL && _r_arena_owner(arena, ptr) != NULL) {
+    _r_arena_free_fn(ptr);
+  } else {
+    _r_arena_next_json_free(ptr);
+  }
+}
+
+int r_global_enable_arena(void) {
+  if (!_r_arena_installed) {
+    o_get_alloc_funcs(&_r_arena_next_malloc, &_r_arena_next_realloc, &_r_arena_next_free);
+#if JANSSON_VERSION_HEX >= 0x020800
+    json_get_alloc_funcs(&_r_arena_next_json_malloc, &_r_arena_next_json_free);
+#else
+    // Without json_get_alloc_funcs, jansson uses the functions set by r_global_init
+    _r_arena_next_json_malloc = (json_malloc_t)_r_arena_next_malloc;
+    _r_arena_next_json_free = (json_free_t)_r_arena_next_free;
+#endif
+    o_set_alloc_funcs(_r_arena_malloc_fn, _r_arena_realloc_fn, _r_arena_free_fn);
+    json_set_alloc_funcs(_r_arena_json_malloc_fn, _r_arena_json_free_fn);
+    _r_arena_installed = 1;
+  }
+  return RHN_OK;
+}
+
+void _r_arena_global_close(void) {
+  if (_r_arena_installed) {
+    o_set_alloc_funcs(_r_arena_next_malloc, _r_arena_next_realloc, _r_arena_next_free);
+    json_set_alloc_funcs(_r_arena_next_json_malloc, _r_arena_next_json_free);
+    _r_arena_installed = 0;
+  }
+}
+
+int r_arena_init(rhn_arena_t ** arena, size_t block_size) {
+  int ret;
+
+  if (arena != NULL) {
+    if (!_r_arena_installed) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_arena_init - Arenas are disabled, call r_global_enable_arena first");
+      ret = RHN_ERROR_UNSUPPORTED;
+    } else if ((*arena = o_malloc(sizeof(rhn_arena_t))) != NULL) {
+      memset(*arena, 0, sizeof(rhn_arena_t));
+      (*arena)->block_size = block_size?block_size:_R_ARENA_DEFAULT_BLOCK_SIZE;
+      ret = RHN_OK;
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "r_arena_init - Error allocating resources for arena");
+      ret = RHN_ERROR_MEMORY;
+    }
+  } else {
+    ret = RHN_ERROR_PARAM;
+  }
+  return ret;
+}
+
+void r_arena_free(rhn_arena_t * arena) {
+  struct _r_arena_block * block;
+
+  if (arena != NULL) {
+    while ((block = arena->blocks) != NULL) {
+      arena->blocks = block->next;
+      gnutls_memset(block->data, 0, block->size);
+      _r_arena_next_free(block->data);
+      _r_arena_next_free(block);
+    }
+    o_free(arena);
+  }
+}
+
+int r_arena_get_stats(rhn_arena_t * arena, size_t * nb_allocs, size_t * nb_blocks) {
+  if (arena != NULL) {
+    if (nb_allocs != NULL) {
+      *nb_allocs = arena->nb_allocs;
+    }
+    if (nb_blocks != NULL) {
+      *nb_blocks = arena->nb_blocks;
+    }
+    return RHN_OK;
+  } else {
+    return RHN_ERROR_PARAM;
+  }
+}
+
+void _r_arena_enter(rhn_arena_t * arena) {
+  if (arena != NULL) {
+    arena->previous = _r_arena_thread;
+    arena->active = 1;
+    _r_arena_thread = arena;
+  }
+}
+
+void _r_arena_suspend(rhn_arena_t * arena) {
+  if (arena != NULL) {
+    arena->active = 0;
+  }
+}
+
+void _r_arena_leave(rhn_arena_t * arena) {
+  struct _r_arena_block * block;
+
+  if (arena != NULL) {
+    // The arena may have held keys or decrypted content
+    for (block = arena->blocks; block != NULL; block = block->next) {
+      gnutls_memset(block->data, 0, block->used);
+      block->used = 0;
+    }
+    arena->current = arena->blocks;
+    arena->active = 0;
+    _r_arena_thread = arena->previous;
+    arena->previous = NULL;
+  }
+}
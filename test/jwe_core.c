@@ -816,6 +816,58 @@ START_TEST(test_rhonabwy_copy)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_reset)
+{
+  jwe_t * jwe;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  const unsigned char * payload;
+  size_t payload_len = 0;
+  char * token;
+  int i;
+
+  ck_assert_int_eq(r_jwe_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys(jwe, NULL, jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_RSA1_5), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128CBC), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwe_serialize(jwe, NULL, 0)), NULL);
+
+  ck_assert_int_eq(r_jwe_reset(jwe), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwe->jwks_pubkey), 0);
+  ck_assert_int_eq(r_jwks_size(jwe->jwks_privkey), 0);
+  ck_assert_int_eq(json_object_size(jwe->j_header), 0);
+  ck_assert_int_eq(r_jwe_get_alg(jwe), R_JWA_ALG_UNKNOWN);
+  ck_assert_int_eq(r_jwe_get_enc(jwe), R_JWA_ENC_UNKNOWN);
+  ck_assert_ptr_eq(r_jwe_get_payload(jwe, &payload_len), NULL);
+  ck_assert_ptr_eq(jwe->key, NULL);
+  ck_assert_ptr_eq(jwe->iv, NULL);
+
+  for (i=0; i<3; i++) {
+    ck_assert_int_eq(r_jwe_parse(jwe, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_get_alg(jwe), R_JWA_ALG_RSA1_5);
+    ck_assert_int_eq(r_jwe_decrypt(jwe, jwk_privkey, 0), RHN_OK);
+    ck_assert_ptr_ne((payload = r_jwe_get_payload(jwe, &payload_len)), NULL);
+    ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+    ck_assert_int_eq(0, memcmp(payload, PAYLOAD, payload_len));
+    ck_assert_int_eq(r_jwe_reset(jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_parse(jwe, TOKEN, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_get_alg(jwe), R_JWA_ALG_A128KW);
+    ck_assert_int_eq(r_jwe_get_enc(jwe), R_JWA_ENC_A128CBC);
+    ck_assert_int_eq(r_jwe_reset(jwe), RHN_OK);
+  }
+
+  o_free(token);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_jwe_free(jwe);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_generate_cypher_key)
 {
   jwe_t * jwe;
@@ -1540,6 +1592,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
   tcase_add_test(tc_core, test_rhonabwy_copy);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
   tcase_add_test(tc_core, test_rhonabwy_generate_cypher_key);
   tcase_add_test(tc_core, test_rhonabwy_generate_iv);
   tcase_add_test(tc_core, test_rhonabwy_get_set_key_iv_aad);
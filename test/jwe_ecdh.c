@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <check.h>
 #include <yder.h>
@@ -1121,6 +1122,87 @@ START_TEST(test_rhonabwy_rfc_ok)
 }
 END_TEST
 
+static void test_encrypt_decrypt_pool(rhn_ecdh_pool_t * pool, const char * str_privkey, const char * str_pubkey, json_t ** j_epk) {
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  char * token = NULL;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, str_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, str_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys(jwe, NULL, jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwe_add_keys(jwe_decrypt, jwk_privkey, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_ecdh_pool(jwe, pool), RHN_OK);
+
+  ck_assert_int_eq(r_jwe_set_alg(jwe, R_JWA_ALG_ECDH_ES_A256KW), RHN_OK);
+  ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A256GCM), RHN_OK);
+  ck_assert_ptr_ne((token = r_jwe_serialize(jwe, NULL, 0)), NULL);
+
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt(jwe_decrypt, NULL, 0), RHN_OK);
+  ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+  ck_assert_ptr_ne((*j_epk = r_jwe_get_header_json_t_value(jwe_decrypt, "epk")), NULL);
+
+  o_free(token);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_jwe_free(jwe);
+  r_jwe_free(jwe_decrypt);
+}
+
+START_TEST(test_rhonabwy_ecdh_pool)
+{
+  rhn_ecdh_pool_t * pool = NULL;
+  size_t nb_available = 0, nb_hits = 0, nb_misses = 0;
+  json_t * j_epk_1 = NULL, * j_epk_2 = NULL;
+  int i;
+
+  ck_assert_int_eq(r_ecdh_pool_init(NULL, R_ECDH_POOL_ALL, 4), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_ecdh_pool_init(&pool, 0, 4), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_ecdh_pool_init(&pool, 0x10, 4), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_ecdh_pool_init(&pool, R_ECDH_POOL_ALL, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_ecdh_pool_get_stats(NULL, &nb_available, NULL, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_ecdh_pool_init(&pool, R_ECDH_POOL_P256|R_ECDH_POOL_X25519, 4), RHN_OK);
+
+  // Wait for the background thread to fill the pool
+  for (i=0; i<500; i++) {
+    ck_assert_int_eq(r_ecdh_pool_get_stats(pool, &nb_available, NULL, NULL), RHN_OK);
+    if (nb_available == 8) {
+      break;
+    }
+    usleep(10000);
+  }
+  ck_assert_int_eq(nb_available, 8);
+
+  test_encrypt_decrypt_pool(pool, jwk_privkey_ecdsa_str, jwk_pubkey_ecdsa_str, &j_epk_1);
+  test_encrypt_decrypt_pool(pool, jwk_privkey_ecdsa_str, jwk_pubkey_ecdsa_str, &j_epk_2);
+  ck_assert_int_eq(json_equal(j_epk_1, j_epk_2), 0);
+  json_decref(j_epk_1);
+  json_decref(j_epk_2);
+  test_encrypt_decrypt_pool(pool, jwk_privkey_x25519_str, jwk_pubkey_x25519_str, &j_epk_1);
+  test_encrypt_decrypt_pool(pool, jwk_privkey_x25519_str, jwk_pubkey_x25519_str, &j_epk_2);
+  ck_assert_int_eq(json_equal(j_epk_1, j_epk_2), 0);
+  json_decref(j_epk_1);
+  json_decref(j_epk_2);
+  ck_assert_int_eq(r_ecdh_pool_get_stats(pool, NULL, &nb_hits, &nb_misses), RHN_OK);
+  ck_assert_int_eq(nb_hits, 4);
+  ck_assert_int_eq(nb_misses, 0);
+
+  // P-384 isn't in the pool, the ephemeral key is generated on the fly
+  test_encrypt_decrypt_pool(pool, jwk_privkey_ecdsa_p384_str, jwk_pubkey_ecdsa_p384_str, &j_epk_1);
+  json_decref(j_epk_1);
+  ck_assert_int_eq(r_ecdh_pool_get_stats(pool, NULL, &nb_hits, &nb_misses), RHN_OK);
+  ck_assert_int_eq(nb_hits, 4);
+  ck_assert_int_eq(nb_misses, 1);
+
+  r_ecdh_pool_free(pool);
+}
+END_TEST
+
 #endif
 
 static Suite *rhonabwy_suite(void)
@@ -1152,6 +1234,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_check_apu);
   tcase_add_test(tc_core, test_rhonabwy_check_apv);
   tcase_add_test(tc_core, test_rhonabwy_rfc_ok);
+  tcase_add_test(tc_core, test_rhonabwy_ecdh_pool);
 #endif
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
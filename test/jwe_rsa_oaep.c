@@ -364,6 +364,60 @@ START_TEST(test_rhonabwy_encrypt_decrypt_rsa256_aesgcm_ok)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_encrypt_decrypt_prepared_ok)
+{
+  jwe_t * jwe, * jwe_decrypt;
+  jwk_t * jwk_privkey, * jwk_pubkey;
+  jwk_prepared_t * privkey, * pubkey, * privkey_2;
+  char * token = NULL;
+  int i;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_ptr_ne(NULL, privkey = r_jwk_prepare(jwk_privkey, 0));
+  ck_assert_ptr_ne(NULL, pubkey = r_jwk_prepare(jwk_pubkey, 0));
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str_2), RHN_OK);
+  ck_assert_ptr_ne(NULL, privkey_2 = r_jwk_prepare(jwk_privkey, 0));
+  r_jwk_free(jwk_privkey);
+
+  ck_assert_ptr_eq(r_jwe_serialize_prepared(NULL, pubkey), NULL);
+  ck_assert_int_eq(r_jwe_decrypt_prepared(NULL, privkey), RHN_ERROR_PARAM);
+
+  for (i=0; i<4; i++) {
+    ck_assert_int_eq(r_jwe_init(&jwe), RHN_OK);
+    ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_payload(jwe, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_alg(jwe, i%2?R_JWA_ALG_RSA_OAEP_256:R_JWA_ALG_RSA_OAEP), RHN_OK);
+    ck_assert_int_eq(r_jwe_set_enc(jwe, R_JWA_ENC_A128GCM), RHN_OK);
+    ck_assert_ptr_ne(NULL, token = r_jwe_serialize_prepared(jwe, i<2?pubkey:privkey));
+    ck_assert_int_eq(r_jwe_parse(jwe_decrypt, token, 0), RHN_OK);
+    ck_assert_int_eq(r_jwe_decrypt_prepared(jwe_decrypt, pubkey), RHN_ERROR_INVALID);
+    ck_assert_int_eq(r_jwe_decrypt_prepared(jwe_decrypt, privkey_2), RHN_ERROR_INVALID);
+    ck_assert_int_eq(r_jwe_decrypt_prepared(jwe_decrypt, privkey), RHN_OK);
+    ck_assert_int_eq(jwe_decrypt->payload_len, o_strlen(PAYLOAD));
+    ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+    o_free(token);
+    r_jwe_free(jwe);
+    r_jwe_free(jwe_decrypt);
+  }
+
+  ck_assert_int_eq(r_jwe_init(&jwe_decrypt), RHN_OK);
+  ck_assert_int_eq(r_jwe_parse(jwe_decrypt, TOKEN, 0), RHN_OK);
+  ck_assert_int_eq(r_jwe_decrypt_prepared(jwe_decrypt, privkey), RHN_OK);
+  ck_assert_int_eq(0, memcmp(jwe_decrypt->payload, PAYLOAD, jwe_decrypt->payload_len));
+  r_jwe_free(jwe_decrypt);
+
+  r_jwk_prepared_free(privkey);
+  r_jwk_prepared_free(pubkey);
+  r_jwk_prepared_free(privkey_2);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_flood_ok)
 {
   jwe_t * jwe, * jwe_decrypt;
@@ -712,6 +766,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_rsa1_aesgcm_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_rsa256_aescbc_ok);
   tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_rsa256_aesgcm_ok);
+  tcase_add_test(tc_core, test_rhonabwy_encrypt_decrypt_prepared_ok);
   tcase_add_test(tc_core, test_rhonabwy_flood_ok);
   tcase_add_test(tc_core, test_rhonabwy_check_key_length_rsa1);
   tcase_add_test(tc_core, test_rhonabwy_check_key_length_rsa256);
@@ -121,6 +121,7 @@ const char jwk_pubkey_rsa_x5u_str[] = "{\"kty\":\"RSA\",\"n\":\"0vx7agoebGcQSuuP
 
 const char jwk_pubkey_rsa_x5u_only_rsa_pub_7465[] = "{\"kty\":\"RSA\",\"alg\":\"RS256\",\"x5u\":\"https://localhost:7465/x5u_rsa_crt\"}";
 const char jwk_pubkey_rsa_x5u_only_ecdsa_pub_7465[] = "{\"kty\":\"EC\",\"alg\":\"RS256\",\"x5u\":\"https://localhost:7465/x5u_ecdsa_crt\"}";
+const char jwk_pubkey_rsa_x5u_only_invalid_7465[] = "{\"kty\":\"RSA\",\"alg\":\"RS256\",\"x5u\":\"https://localhost:7465/x5u_ecdsa_crt\"}";
 
 const char jwk_pubkey_rsa_x5u_only_rsa_pub_7466[] = "{\"kty\":\"RSA\",\"alg\":\"RS256\",\"x5u\":\"https://localhost:7466/x5u_rsa_crt\"}";
 const char jwk_pubkey_rsa_x5u_only_ecdsa_pub_7466[] = "{\"kty\":\"EC\",\"alg\":\"RS256\",\"x5u\":\"https://localhost:7466/x5u_ecdsa_crt\"}";
@@ -221,7 +222,10 @@ static char * get_file_content(const char * file_path) {
   return buffer;
 }
 
+static int nb_x5u_rsa_crt = 0;
+
 int callback_x5u_rsa_crt (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  nb_x5u_rsa_crt++;
   ulfius_set_string_body_response(response, 200, (const char *)rsa_crt);
   return U_CALLBACK_CONTINUE;
 }
@@ -691,6 +695,59 @@ START_TEST(test_rhonabwy_export_to_pem)
 }
 END_TEST
 
+#ifdef R_WITH_CURL
+START_TEST(test_rhonabwy_export_x5u_download_once)
+{
+  jwk_t * jwk;
+  jwk_prepared_t * prepared;
+  gnutls_pubkey_t pubkey = NULL;
+  gnutls_x509_crt_t crt = NULL;
+  struct _u_instance instance;
+  unsigned int bits = 0;
+  char * http_key, * http_cert;
+
+  ck_assert_ptr_ne(NULL, http_key = get_file_content(HTTPS_CERT_KEY));
+  ck_assert_ptr_ne(NULL, http_cert = get_file_content(HTTPS_CERT_PEM));
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7465, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/x5u_rsa_crt", NULL, 0, &callback_x5u_rsa_crt, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/x5u_ecdsa_crt", NULL, 0, &callback_x5u_ecdsa_crt, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_secure_framework(&instance, http_key, http_cert), U_OK);
+
+  nb_x5u_rsa_crt = 0;
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_x5u_only_rsa_pub_7465), RHN_OK);
+  ck_assert_ptr_ne((pubkey = r_jwk_export_to_gnutls_pubkey(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE)), NULL);
+  ck_assert_int_eq(nb_x5u_rsa_crt, 1);
+  gnutls_pubkey_deinit(pubkey);
+  ck_assert_ptr_ne((crt = r_jwk_export_to_gnutls_crt(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE)), NULL);
+  ck_assert_int_eq(nb_x5u_rsa_crt, 2);
+  gnutls_x509_crt_deinit(crt);
+  ck_assert_ptr_ne((prepared = r_jwk_prepare(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE)), NULL);
+  ck_assert_int_eq(nb_x5u_rsa_crt, 3);
+  ck_assert_int_eq(r_jwk_prepared_key_type(prepared, &bits), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  ck_assert_int_gt(bits, 0);
+  ck_assert_ptr_ne(_r_jwk_prepared_get_pubkey(prepared), NULL);
+  r_jwk_prepared_free(prepared);
+  ck_assert_int_eq(r_jwk_is_valid_x5u(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE), RHN_OK);
+  ck_assert_int_eq(nb_x5u_rsa_crt, 4);
+  r_jwk_free(jwk);
+
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_rsa_x5u_only_invalid_7465), RHN_OK);
+  ck_assert_ptr_eq(r_jwk_export_to_gnutls_pubkey(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE), NULL);
+  ck_assert_ptr_eq(r_jwk_export_to_gnutls_crt(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE), NULL);
+  ck_assert_ptr_eq(r_jwk_prepare(jwk, R_FLAG_IGNORE_SERVER_CERTIFICATE), NULL);
+  r_jwk_free(jwk);
+
+  o_free(http_key);
+  o_free(http_cert);
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+#endif
+
 START_TEST(test_rhonabwy_export_to_symmetric_key)
 {
   jwk_t * jwk;
@@ -727,6 +784,9 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_export_to_gnutls_crt);
   tcase_add_test(tc_core, test_rhonabwy_export_to_pem);
   tcase_add_test(tc_core, test_rhonabwy_export_to_symmetric_key);
+#ifdef R_WITH_CURL
+  tcase_add_test(tc_core, test_rhonabwy_export_x5u_download_once);
+#endif
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 
@@ -1,6 +1,7 @@
 /* Public domain, no copyright. Use at your own risk. */
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <check.h>
 #include <orcania.h>
@@ -241,6 +242,82 @@ int callback_x5u_ecdsa_crt (const struct _u_request * request, struct _u_respons
   return U_CALLBACK_CONTINUE;
 }
 
+static int nb_jwks_max_age = 0, nb_jwks_no_header = 0, nb_jwks_etag = 0, nb_jwks_etag_not_modified = 0;
+
+int callback_jwks_max_age (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  nb_jwks_max_age++;
+  u_map_put(response->map_header, "Cache-Control", "public, max-age=60");
+  return callback_jwks_ok(request, response, user_data);
+}
+
+int callback_jwks_no_header (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  nb_jwks_no_header++;
+  return callback_jwks_ok(request, response, user_data);
+}
+
+int callback_jwks_etag (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  nb_jwks_etag++;
+  u_map_put(response->map_header, "Cache-Control", "no-cache");
+  u_map_put(response->map_header, "ETag", "\"rhonabwy-jwks\"");
+  if (0 == o_strcmp(u_map_get_case(request->map_header, "If-None-Match"), "\"rhonabwy-jwks\"")) {
+    nb_jwks_etag_not_modified++;
+    response->status = 304;
+    return U_CALLBACK_CONTINUE;
+  } else {
+    return callback_jwks_ok(request, response, user_data);
+  }
+}
+
+static int nb_jwks_source = 0, jwks_source_phase = 0;
+
+int callback_jwks_source (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char * jwks_str;
+  json_t * j_jwks;
+
+  nb_jwks_source++;
+  if (jwks_source_phase == 0) {
+    return callback_jwks_ok(request, response, user_data);
+  } else if (jwks_source_phase == 1) {
+    jwks_str = msprintf("{\"keys\":[%s,%s]}", jwk_pubkey_ecdsa_str, jwk_privkey_ecdsa_str);
+    j_jwks = json_loads(jwks_str, JSON_DECODE_ANY, NULL);
+    ulfius_set_json_body_response(response, 200, j_jwks);
+    json_decref(j_jwks);
+    o_free(jwks_str);
+    return U_CALLBACK_CONTINUE;
+  } else {
+    return callback_jwks_error_content_no_jwks(request, response, user_data);
+  }
+}
+
+int callback_jwks_slow (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  usleep(1000000);
+  return callback_jwks_ok(request, response, user_data);
+}
+
+static int nb_fetcher = 0;
+
+static char * fetcher_in_memory(const char * url, int x5u_flags, const char * expected_content_type, void * user_data) {
+  nb_fetcher++;
+  if (0 == o_strcmp((const char *)user_data, "grut") && x5u_flags == R_FLAG_FOLLOW_REDIRECT) {
+    if (0 == o_strcmp(url, "https://keys.example.com/jwks") && 0 == o_strcmp(expected_content_type, "application/json")) {
+      return msprintf("{\"keys\":[%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str);
+    } else if (0 == o_strcmp(url, "https://keys.example.com/x5u")) {
+      return o_strdup((const char *)rsa_crt);
+    }
+  }
+  return NULL;
+}
+
+static int wait_for_jwks_source(int nb) {
+  int i;
+  for (i=0; i<500 && nb_jwks_source < nb; i++) {
+    usleep(10000);
+  }
+  // Let the source publish the downloaded content
+  usleep(100000);
+  return nb_jwks_source;
+}
+
 START_TEST(test_rhonabwy_init_jwks)
 {
   jwks_t * jwks;
@@ -597,6 +674,263 @@ START_TEST(test_rhonabwy_jwks_import_uri)
 }
 END_TEST
 
+#ifdef R_WITH_CURL
+START_TEST(test_rhonabwy_jwks_import_uri_cache)
+{
+  struct _u_instance instance;
+  jwks_t * jwks = NULL;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_max_age", NULL, 0, &callback_jwks_max_age, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_etag", NULL, 0, &callback_jwks_etag, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_no_header", NULL, 0, &callback_jwks_no_header, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  // Cache disabled
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 8);
+  ck_assert_int_eq(nb_jwks_max_age, 2);
+  r_jwks_free(jwks);
+
+  // Cache-Control max-age
+  ck_assert_int_eq(r_global_set_remote_cache(1, 0, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 8);
+  ck_assert_int_eq(nb_jwks_max_age, 3);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", R_FLAG_FOLLOW_REDIRECT), RHN_OK);
+  ck_assert_int_eq(nb_jwks_max_age, 4);
+  r_global_flush_remote_cache();
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_max_age", 0), RHN_OK);
+  ck_assert_int_eq(nb_jwks_max_age, 5);
+  r_jwks_free(jwks);
+
+  // No cache headers and no default ttl
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_no_header", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_no_header", 0), RHN_OK);
+  ck_assert_int_eq(nb_jwks_no_header, 2);
+  r_jwks_free(jwks);
+
+  // Revalidation with ETag
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 8);
+  ck_assert_int_eq(nb_jwks_etag, 2);
+  ck_assert_int_eq(nb_jwks_etag_not_modified, 1);
+  r_jwks_free(jwks);
+
+  // Minimum refresh interval
+  ck_assert_int_eq(r_global_set_remote_cache(1, 0, 60), RHN_OK);
+  r_global_flush_remote_cache();
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 8);
+  ck_assert_int_eq(nb_jwks_etag, 3);
+  ck_assert_int_eq(nb_jwks_etag_not_modified, 1);
+  r_jwks_free(jwks);
+
+  ck_assert_int_eq(r_global_set_remote_cache(0, 0, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_etag", 0), RHN_OK);
+  ck_assert_int_eq(nb_jwks_etag, 4);
+  ck_assert_int_eq(nb_jwks_etag_not_modified, 1);
+  r_jwks_free(jwks);
+
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+#endif
+
+#ifdef R_WITH_CURL
+START_TEST(test_rhonabwy_jwks_source)
+{
+  struct _u_instance instance;
+  jwks_source_t * source = NULL;
+  jwks_snapshot_t * snapshot, * snapshot_2;
+  jwk_t * jwk;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_source", NULL, 0, &callback_jwks_source, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ck_assert_int_eq(r_jwks_source_init(NULL, "http://localhost:7462/jwks_source", 0, 60, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_source_init(&source, NULL, 0, 60, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_source_init(&source, "http://localhost:7462/jwks_source", 0, 0, 0), RHN_ERROR_PARAM);
+  ck_assert_ptr_eq(r_jwks_source_acquire(NULL), NULL);
+  ck_assert_int_eq(r_jwks_source_request_refresh(NULL), RHN_ERROR_PARAM);
+
+  ck_assert_int_eq(r_jwks_source_init(&source, "http://localhost:7462/jwks_source", 0, 60, 0), RHN_OK);
+  ck_assert_int_eq(nb_jwks_source, 1);
+  ck_assert_ptr_ne(NULL, snapshot = r_jwks_source_acquire(source));
+  ck_assert_int_eq(r_jwks_size(r_jwks_snapshot_get_jwks(snapshot)), 4);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_source_get_by_kid(source, "2011-04-29"));
+  r_jwk_free(jwk);
+  ck_assert_int_eq(nb_jwks_source, 1);
+
+  // Unknown kid, the source is refreshed in background
+  jwks_source_phase = 1;
+  ck_assert_ptr_eq(NULL, r_jwks_source_get_by_kid(source, "grut"));
+  ck_assert_int_eq(wait_for_jwks_source(2), 2);
+  ck_assert_ptr_ne(NULL, jwk = r_jwks_source_get_by_kid(source, "grut"));
+  r_jwk_free(jwk);
+  // The previous snapshot is unchanged
+  ck_assert_int_eq(r_jwks_size(r_jwks_snapshot_get_jwks(snapshot)), 4);
+  r_jwks_snapshot_release(snapshot);
+  ck_assert_ptr_ne(NULL, snapshot = r_jwks_source_acquire(source));
+  ck_assert_int_eq(r_jwks_size(r_jwks_snapshot_get_jwks(snapshot)), 2);
+
+  // An invalid jwks doesn't replace the current snapshot
+  jwks_source_phase = 2;
+  ck_assert_int_eq(r_jwks_source_request_refresh(source), RHN_OK);
+  ck_assert_int_eq(wait_for_jwks_source(3), 3);
+  ck_assert_ptr_ne(NULL, snapshot_2 = r_jwks_source_acquire(source));
+  ck_assert_ptr_eq(snapshot, snapshot_2);
+  r_jwks_snapshot_release(snapshot_2);
+  r_jwks_source_free(source);
+  // A snapshot outlives its source
+  ck_assert_int_eq(r_jwks_size(r_jwks_snapshot_get_jwks(snapshot)), 2);
+  r_jwks_snapshot_release(snapshot);
+
+  // Early refresh is rate limited
+  jwks_source_phase = 0;
+  ck_assert_int_eq(r_jwks_source_init(&source, "http://localhost:7462/jwks_source", 0, 60, 60), RHN_OK);
+  ck_assert_int_eq(nb_jwks_source, 4);
+  ck_assert_int_eq(r_jwks_source_request_refresh(source), RHN_ERROR_INVALID);
+  ck_assert_ptr_eq(NULL, r_jwks_source_get_by_kid(source, "grut"));
+  ck_assert_ptr_eq(NULL, r_jwks_source_get_by_kid(source, "grut"));
+  ck_assert_int_eq(wait_for_jwks_source(5), 4);
+  r_jwks_source_free(source);
+
+  // Periodic refresh
+  ck_assert_int_eq(r_jwks_source_init(&source, "http://localhost:7462/jwks_source", 0, 1, 0), RHN_OK);
+  ck_assert_int_eq(nb_jwks_source, 5);
+  ck_assert_int_ge(wait_for_jwks_source(6), 6);
+  ck_assert_ptr_ne(NULL, snapshot = r_jwks_source_acquire(source));
+  ck_assert_int_eq(r_jwks_size(r_jwks_snapshot_get_jwks(snapshot)), 4);
+  r_jwks_snapshot_release(snapshot);
+  r_jwks_source_free(source);
+
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+
+  // Unreachable uri, the source has no key
+  ck_assert_int_eq(r_jwks_source_init(&source, "http://localhost:7462/jwks_source", 0, 60, 0), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_source_acquire(source), NULL);
+  ck_assert_ptr_eq(r_jwks_source_get_by_kid(source, "1"), NULL);
+  r_jwks_source_free(source);
+}
+END_TEST
+#endif
+
+#ifdef R_WITH_CURL
+START_TEST(test_rhonabwy_http_options)
+{
+  struct _u_instance instance, instance_https;
+  char * http_key, * http_cert;
+  jwks_t * jwks = NULL;
+  size_t nb_requests = 0, nb_connections = 0, nb_requests_start = 0, nb_connections_start = 0;
+
+  ck_assert_ptr_ne(NULL, http_key = get_file_content(HTTPS_CERT_KEY));
+  ck_assert_ptr_ne(NULL, http_cert = get_file_content(HTTPS_CERT_PEM));
+  ck_assert_int_eq(ulfius_init_instance(&instance, 7462, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_ok", NULL, 0, &callback_jwks_ok, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", "/jwks_slow", NULL, 0, &callback_jwks_slow, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+  ck_assert_int_eq(ulfius_init_instance(&instance_https, 7463, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance_https, "GET", "/jwks_ok", NULL, 0, &callback_jwks_ok, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_secure_framework(&instance_https, http_key, http_cert), U_OK);
+
+  // The connection is reused by the next downloads
+  ck_assert_int_eq(r_global_set_http_options(R_HTTP_DEFAULT_CONNECT_TIMEOUT, R_HTTP_DEFAULT_TIMEOUT, R_HTTP_DEFAULT_MAX_RESPONSE_SIZE, 1), RHN_OK);
+  ck_assert_int_eq(r_global_get_http_stats(&nb_requests_start, &nb_connections_start), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(r_global_get_http_stats(&nb_requests, &nb_connections), RHN_OK);
+  ck_assert_int_eq(nb_requests-nb_requests_start, 3);
+  ck_assert_int_eq(nb_connections-nb_connections_start, 1);
+
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "https://localhost:7463/jwks_ok", R_FLAG_IGNORE_SERVER_CERTIFICATE), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "https://localhost:7463/jwks_ok", R_FLAG_IGNORE_SERVER_CERTIFICATE), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(r_global_get_http_stats(&nb_requests, &nb_connections), RHN_OK);
+  ck_assert_int_eq(nb_requests-nb_requests_start, 5);
+  ck_assert_int_eq(nb_connections-nb_connections_start, 2);
+
+  // No idle handle, a new connection is opened for each download
+  ck_assert_int_eq(r_global_set_http_options(R_HTTP_DEFAULT_CONNECT_TIMEOUT, R_HTTP_DEFAULT_TIMEOUT, R_HTTP_DEFAULT_MAX_RESPONSE_SIZE, 0), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "https://localhost:7463/jwks_ok", R_FLAG_IGNORE_SERVER_CERTIFICATE), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "https://localhost:7463/jwks_ok", R_FLAG_IGNORE_SERVER_CERTIFICATE), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(r_global_get_http_stats(&nb_requests, &nb_connections), RHN_OK);
+  ck_assert_int_eq(nb_requests-nb_requests_start, 7);
+  ck_assert_int_eq(nb_connections-nb_connections_start, 4);
+
+  // Response too large
+  ck_assert_int_eq(r_global_set_http_options(R_HTTP_DEFAULT_CONNECT_TIMEOUT, R_HTTP_DEFAULT_TIMEOUT, 100, R_HTTP_DEFAULT_MAX_IDLE_HANDLES), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_ERROR);
+  ck_assert_int_eq(r_jwks_size(jwks), 0);
+  r_jwks_free(jwks);
+
+  // Request timeout
+  ck_assert_int_eq(r_global_set_http_options(R_HTTP_DEFAULT_CONNECT_TIMEOUT, 200, R_HTTP_DEFAULT_MAX_RESPONSE_SIZE, R_HTTP_DEFAULT_MAX_IDLE_HANDLES), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_slow", 0), RHN_ERROR);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks_ok", 0), RHN_OK);
+  r_jwks_free(jwks);
+
+  ck_assert_int_eq(r_global_set_http_options(R_HTTP_DEFAULT_CONNECT_TIMEOUT, R_HTTP_DEFAULT_TIMEOUT, R_HTTP_DEFAULT_MAX_RESPONSE_SIZE, R_HTTP_DEFAULT_MAX_IDLE_HANDLES), RHN_OK);
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+  ulfius_stop_framework(&instance_https);
+  ulfius_clean_instance(&instance_https);
+  o_free(http_key);
+  o_free(http_cert);
+}
+END_TEST
+#endif
+
+START_TEST(test_rhonabwy_fetcher)
+{
+  jwks_t * jwks = NULL;
+  jwk_t * jwk = NULL;
+
+  ck_assert_int_eq(r_global_set_fetcher(&fetcher_in_memory, "grut"), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "https://keys.example.com/jwks", R_FLAG_FOLLOW_REDIRECT), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jwks), 2);
+  ck_assert_int_eq(r_jwks_import_from_uri(jwks, "https://keys.example.com/error", R_FLAG_FOLLOW_REDIRECT), RHN_ERROR);
+  ck_assert_int_eq(r_jwks_size(jwks), 2);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_fetcher, 2);
+
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_x5u(jwk, R_FLAG_FOLLOW_REDIRECT, "https://keys.example.com/x5u"), RHN_OK);
+  ck_assert_int_eq(r_jwk_key_type(jwk, NULL, 0), R_KEY_TYPE_PUBLIC|R_KEY_TYPE_RSA);
+  r_jwk_free(jwk);
+  ck_assert_int_eq(nb_fetcher, 3);
+
+  // The default downloader is used again
+  ck_assert_int_eq(r_global_set_fetcher(NULL, NULL), RHN_OK);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_ne(r_jwks_import_from_uri(jwks, "http://localhost:7462/jwks", R_FLAG_FOLLOW_REDIRECT), RHN_OK);
+  r_jwks_free(jwks);
+  ck_assert_int_eq(nb_fetcher, 3);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwks_get_by_kid)
 {
   char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str);
@@ -620,6 +954,128 @@ START_TEST(test_rhonabwy_jwks_get_by_kid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_jwks_peek_at)
+{
+  char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str);
+  jwks_t * jwks;
+  jwk_t * jwk;
+
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  ck_assert_int_eq(r_jwks_import_from_json_str(jwks, jwks_str), RHN_OK);
+
+  ck_assert_ptr_eq(r_jwks_peek_at(NULL, 0), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_at(jwks, 4), NULL);
+  ck_assert_ptr_ne((jwk = r_jwks_peek_at(jwks, 1)), NULL);
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kid"), "2011-04-29");
+  ck_assert_ptr_eq(r_jwks_peek_at(jwks, 1), jwk);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "2011-04-29"), jwk);
+
+  r_jwks_free(jwks);
+  o_free(jwks_str);
+}
+END_TEST
+
+static void check_jwks_lookups(jwks_t * jwks) {
+  jwk_t * jwk;
+  char * thumbprint;
+
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "error"), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, NULL), NULL);
+  ck_assert_ptr_ne((jwk = r_jwks_peek_by_kid(jwks, "key-12")), NULL);
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kid"), "key-12");
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-12"), jwk);
+  ck_assert_ptr_ne((thumbprint = r_jwk_thumbprint(jwk, R_JWK_THUMB_SHA256, R_FLAG_IGNORE_REMOTE)), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_thumbprint(jwks, thumbprint), jwk);
+  ck_assert_ptr_eq(r_jwks_peek_by_thumbprint(jwks, "error"), NULL);
+  o_free(thumbprint);
+  ck_assert_ptr_ne((jwk = r_jwks_peek_by_alg(jwks, "oct", "HS256", NULL, 0)), NULL);
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kid"), "key-1");
+  ck_assert_ptr_ne((jwk = r_jwks_peek_by_alg(jwks, "oct", "HS256", NULL, 9)), NULL);
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kid"), "key-19");
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "oct", "HS256", NULL, 10), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "oct", "HS256", "sig", 0), NULL);
+}
+
+START_TEST(test_rhonabwy_jwks_index)
+{
+  jwks_t * jwks, * jwks_copy;
+  jwk_t * jwk, * jwk_ecdsa;
+  char * kid, * thumbprint, * str;
+  unsigned char key[16] = {0};
+  size_t i;
+
+  ck_assert_int_eq(r_jwks_build_index(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwks_init(&jwks), RHN_OK);
+  for (i=0; i<20; i++) {
+    key[0] = (unsigned char)i;
+    ck_assert_ptr_ne((jwk = r_jwk_quick_import(R_IMPORT_SYMKEY, key, sizeof(key))), NULL);
+    kid = msprintf("key-%zu", i);
+    ck_assert_int_eq(r_jwk_set_property_str(jwk, "kid", kid), RHN_OK);
+    ck_assert_int_eq(r_jwk_set_property_str(jwk, "alg", i%2?"HS256":"HS512"), RHN_OK);
+    ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk), RHN_OK);
+    o_free(kid);
+    r_jwk_free(jwk);
+  }
+
+  // Without index, the lookups scan the keys
+  check_jwks_lookups(jwks);
+  ck_assert_int_eq(r_jwk_set_property_str(r_jwks_peek_at(jwks, 3), "kid", "key-changed"), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-changed"), r_jwks_peek_at(jwks, 3));
+  ck_assert_int_eq(r_jwk_set_property_str(r_jwks_peek_at(jwks, 3), "kid", "key-3"), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-3"), r_jwks_peek_at(jwks, 3));
+
+  // Same results with the index
+  ck_assert_int_eq(r_jwks_build_index(jwks), RHN_OK);
+  check_jwks_lookups(jwks);
+
+  // The index must follow the changes in the jwks
+  ck_assert_int_eq(r_jwk_init(&jwk_ecdsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_ecdsa, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwks_append_jwk(jwks, jwk_ecdsa), RHN_OK);
+  ck_assert_ptr_ne((jwk = r_jwks_peek_by_kid(jwks, "1")), NULL);
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kty"), "EC");
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "EC", NULL, "enc", 0), jwk);
+  ck_assert_int_eq(r_jwks_remove_at(jwks, 0), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-0"), NULL);
+  ck_assert_ptr_ne((jwk = r_jwks_peek_by_kid(jwks, "key-12")), NULL);
+  ck_assert_str_eq(r_jwk_get_property_str(jwk, "kid"), "key-12");
+  ck_assert_int_eq(r_jwks_set_at(jwks, 0, jwk_ecdsa), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-1"), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "EC", NULL, "enc", 0), r_jwks_peek_by_kid(jwks, "1"));
+  ck_assert_ptr_ne(r_jwks_peek_by_alg(jwks, "EC", NULL, "enc", 1), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "oct", "HS256", NULL, 9), NULL);
+
+  // A key of an indexed set changed in place is found once the index is rebuilt
+  ck_assert_int_eq(r_jwk_set_property_str(r_jwks_peek_by_kid(jwks, "key-12"), "kid", "key-changed"), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-12"), NULL);
+  ck_assert_int_eq(r_jwks_build_index(jwks), RHN_OK);
+  ck_assert_ptr_ne(r_jwks_peek_by_kid(jwks, "key-changed"), NULL);
+
+  // A set changed without the r_jwks_* functions is scanned
+  ck_assert_int_eq(json_array_append_new(json_object_get(jwks, "keys"), json_pack("{ssssss}", "kty", "oct", "k", "AAAAAAAAAAAAAAAAAAAAAA", "kid", "key-direct")), 0);
+  ck_assert_ptr_ne((jwk = r_jwks_peek_by_kid(jwks, "key-direct")), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "oct", NULL, NULL, 0), jwk);
+  ck_assert_ptr_ne((thumbprint = r_jwk_thumbprint(jwk, R_JWK_THUMB_SHA256, R_FLAG_IGNORE_REMOTE)), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_thumbprint(jwks, thumbprint), jwk);
+  o_free(thumbprint);
+
+  // The index is never stored in the jwks
+  ck_assert_int_eq(json_object_size(jwks), 1);
+  ck_assert_ptr_ne((str = r_jwks_export_to_json_str(jwks, 0)), NULL);
+  ck_assert_ptr_ne((jwks_copy = r_jwks_copy(jwks)), NULL);
+  ck_assert_int_eq(r_jwks_equal(jwks, jwks_copy), 1);
+  ck_assert_ptr_ne(r_jwks_peek_by_kid(jwks_copy, "key-changed"), NULL);
+  ck_assert_int_eq(r_jwks_empty(jwks), RHN_OK);
+  ck_assert_ptr_eq(r_jwks_peek_by_kid(jwks, "key-changed"), NULL);
+  ck_assert_ptr_eq(r_jwks_peek_by_alg(jwks, "EC", NULL, "enc", 0), NULL);
+
+  o_free(str);
+  r_jwk_free(jwk_ecdsa);
+  r_jwks_free(jwks);
+  r_jwks_free(jwks_copy);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwks_equal)
 {
   char * jwks_str = msprintf("{\"keys\":[%s,%s,%s,%s]}", jwk_pubkey_ecdsa_str, jwk_pubkey_rsa_str, jwk_pubkey_rsa_x5u_str, jwk_pubkey_rsa_x5c_str),
@@ -953,7 +1409,15 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_jwks_export_pem);
   tcase_add_test(tc_core, test_rhonabwy_jwks_import);
   tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri);
+#ifdef R_WITH_CURL
+  tcase_add_test(tc_core, test_rhonabwy_jwks_import_uri_cache);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_source);
+  tcase_add_test(tc_core, test_rhonabwy_http_options);
+#endif
+  tcase_add_test(tc_core, test_rhonabwy_fetcher);
   tcase_add_test(tc_core, test_rhonabwy_jwks_get_by_kid);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_peek_at);
+  tcase_add_test(tc_core, test_rhonabwy_jwks_index);
   tcase_add_test(tc_core, test_rhonabwy_jwks_equal);
   tcase_add_test(tc_core, test_rhonabwy_jwks_empty);
   tcase_add_test(tc_core, test_rhonabwy_jwks_copy);
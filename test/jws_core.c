@@ -822,6 +822,86 @@ START_TEST(test_rhonabwy_token_serialize_unsecure)
   r_jwk_free(jwk_privkey);
 }
 END_TEST
+
+
+START_TEST(test_rhonabwy_prepared_key)
+{
+  jws_t * jws_sign, * jws_verify;
+  jwk_t * jwk_privkey, * jwk_pubkey, * jwk_key;
+  jwk_prepared_t * key_priv, * key_pub, * key_sym;
+  char * token = NULL;
+  unsigned int bits = 0;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_privkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_pubkey), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_privkey, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pubkey, jwk_pubkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key, jwk_key_symmetric_str), RHN_OK);
+
+  ck_assert_ptr_eq(r_jwk_prepare(NULL, 0), NULL);
+  ck_assert_ptr_ne((key_priv = r_jwk_prepare(jwk_privkey, 0)), NULL);
+  ck_assert_ptr_ne((key_pub = r_jwk_prepare(jwk_pubkey, 0)), NULL);
+  ck_assert_ptr_ne((key_sym = r_jwk_prepare(jwk_key, 0)), NULL);
+  ck_assert_int_eq(r_jwk_prepared_key_type(NULL, &bits), R_KEY_TYPE_NONE);
+  ck_assert_int_eq(r_jwk_prepared_key_type(key_priv, &bits), r_jwk_key_type(jwk_privkey, NULL, 0));
+  ck_assert_int_eq(bits, 2048);
+  ck_assert_int_eq(r_jwk_prepared_key_type(key_pub, NULL), R_KEY_TYPE_RSA|R_KEY_TYPE_PUBLIC);
+  ck_assert_int_eq(r_jwk_prepared_key_type(key_sym, NULL), R_KEY_TYPE_HMAC|R_KEY_TYPE_SYMMETRIC);
+
+  ck_assert_int_eq(r_jws_init(&jws_sign), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws_sign, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_ptr_eq(r_jws_serialize_prepared(jws_sign, NULL), NULL);
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_RS256), RHN_OK);
+  ck_assert_ptr_eq(r_jws_serialize_prepared(jws_sign, key_pub), NULL);
+  ck_assert_ptr_ne((token = r_jws_serialize_prepared(jws_sign, key_priv)), NULL);
+
+  ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_sym), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_pub), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_priv), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_verify, jwk_pubkey, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_pub), RHN_OK);
+  r_jws_free(jws_verify);
+  o_free(token);
+
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_HS256), RHN_OK);
+  ck_assert_ptr_ne((token = r_jws_serialize_prepared(jws_sign, key_sym)), NULL);
+  ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_pub), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_sym), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_verify, jwk_key, 0), RHN_OK);
+  r_jws_free(jws_verify);
+  o_free(token);
+
+  // The keyed HMAC state of each algorithm is kept in the prepared key
+  ck_assert_int_eq(r_jws_set_alg(jws_sign, R_JWA_ALG_HS512), RHN_OK);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws_sign, jwk_key, 0)), NULL);
+  ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_sym), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature_prepared(jws_verify, key_sym), RHN_OK);
+  r_jws_free(jws_verify);
+  o_free(token);
+  ck_assert_ptr_ne((token = r_jws_serialize_prepared(jws_sign, key_sym)), NULL);
+  ck_assert_int_eq(r_jws_init(&jws_verify), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_verify, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_verify, jwk_key, 0), RHN_OK);
+  r_jws_free(jws_verify);
+  o_free(token);
+
+  r_jws_free(jws_sign);
+  r_jwk_prepared_free(key_priv);
+  r_jwk_prepared_free(key_pub);
+  r_jwk_prepared_free(key_sym);
+  r_jwk_free(jwk_privkey);
+  r_jwk_free(jwk_pubkey);
+  r_jwk_free(jwk_key);
+}
+END_TEST
   
 START_TEST(test_rhonabwy_copy)
 {
@@ -978,6 +1058,66 @@ START_TEST(test_rhonabwy_zip_payload)
 END_TEST
 
 #if GNUTLS_VERSION_NUMBER >= 0x030600
+START_TEST(test_rhonabwy_reset)
+{
+  jws_t * jws, * jws_parsed;
+  jwk_t * jwk;
+  const unsigned char * payload;
+  size_t payload_len = 0;
+  char * token;
+  int i;
+  
+  ck_assert_int_eq(r_jws_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_privkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, TOKEN_WITH_JWK_IN_HEADER, 0), RHN_OK);
+  ck_assert_int_gt(r_jwks_size(jws->jwks_pubkey), 0);
+  ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+  
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_pubkey), 0);
+  ck_assert_int_eq(r_jwks_size(jws->jwks_privkey), 0);
+  ck_assert_int_eq(json_object_size(jws->j_header), 0);
+  ck_assert_int_eq(r_jws_get_alg(jws), R_JWA_ALG_UNKNOWN);
+  ck_assert_ptr_eq(r_jws_get_payload(jws, &payload_len), NULL);
+  ck_assert_int_eq(payload_len, 0);
+  
+  // The keys of the previous token header must not be used anymore
+  for (i=0; i<3; i++) {
+    ck_assert_int_eq(r_jws_parse(jws, HS256_TOKEN, 0), RHN_OK);
+    ck_assert_ptr_ne((payload = r_jws_get_payload(jws, &payload_len)), NULL);
+    ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+    ck_assert_int_eq(0, memcmp(payload, PAYLOAD, payload_len));
+    ck_assert_str_eq(r_jws_get_header_str_value(jws, "kid"), "1");
+    ck_assert_int_eq(r_jws_get_alg(jws), R_JWA_ALG_HS256);
+    ck_assert_int_ne(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+    ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+    ck_assert_int_eq(r_jws_parse(jws, TOKEN_WITH_JWK_IN_HEADER, 0), RHN_OK);
+    ck_assert_int_eq(r_jws_verify_signature(jws, NULL, 0), RHN_OK);
+    ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  }
+  
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)HUGE_PAYLOAD, o_strlen(HUGE_PAYLOAD)), RHN_OK);
+  ck_assert_int_eq(r_jws_set_alg(jws, R_JWA_ALG_ES256), RHN_OK);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws, jwk, 0)), NULL);
+  ck_assert_int_eq(r_jws_reset(jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_ptr_ne((payload = r_jws_get_payload(jws, &payload_len)), NULL);
+  ck_assert_int_eq(payload_len, o_strlen(HUGE_PAYLOAD));
+  ck_assert_int_eq(0, memcmp(payload, HUGE_PAYLOAD, payload_len));
+  ck_assert_int_eq(r_jws_init(&jws_parsed), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws_parsed, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws_parsed, jwk, 0), RHN_OK);
+  
+  o_free(token);
+  r_jws_free(jws_parsed);
+  r_jws_free(jws);
+  r_jwk_free(jwk);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwk_in_header)
 {
   jws_t * jws;
@@ -1378,7 +1518,9 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_token_unsecure);
   tcase_add_test(tc_core, test_rhonabwy_token_parse_unsecure);
   tcase_add_test(tc_core, test_rhonabwy_token_serialize_unsecure);
+  tcase_add_test(tc_core, test_rhonabwy_prepared_key);
   tcase_add_test(tc_core, test_rhonabwy_copy);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
   tcase_add_test(tc_core, test_rhonabwy_zip_payload);
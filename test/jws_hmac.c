@@ -16,6 +16,9 @@
 #define HS256_TOKEN_INVALID_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-5X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5o"
 #define HS256_TOKEN_INVALID_DOTS "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQVGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5o"
 #define HS256_TOKEN_EMPTY_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u."
+#define HS256_TOKEN_SHORT_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5"
+#define HS256_TOKEN_LONG_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5oA"
+#define HS256_TOKEN_NON_CANONICAL_SIGNATURE "eyJhbGciOiJIUzI1NiIsImtpZCI6IjEifQ.VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u.GKxWqRBFr-6X4HfflzGeGvKVsJ8v1-J39Ho2RslC-5p"
 
 const char jwk_key_symmetric_str[] = "{\"kty\":\"oct\",\"alg\":\"HS256\",\"k\":\"c2VjcmV0\",\"kid\":\"1\"}";
 const char jwk_key_symmetric_str_2[] = "{\"kty\":\"oct\",\"alg\":\"HS256\",\"k\":\"dGVyY2Vz\",\"kid\":\"2\"}";
@@ -161,6 +164,37 @@ START_TEST(test_rhonabwy_parse_token)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_parsen_token_buffer)
+{
+  jws_t * jws;
+  jwk_t * jwk_key_symmetric;
+  char * buffer = msprintf("%s.%s", HS256_TOKEN, HS256_TOKEN);
+  size_t payload_len = 0;
+  const unsigned char * payload = NULL;
+
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+
+  // The token is only a part of the buffer
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parsen(jws, buffer, o_strlen(HS256_TOKEN), 0), RHN_OK);
+  ck_assert_ptr_ne((payload = r_jws_get_payload(jws, &payload_len)), NULL);
+  ck_assert_int_eq(payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(0, o_strncmp(PAYLOAD, (const char *)payload, payload_len));
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  r_jws_free(jws);
+
+  // Too many segments
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, buffer, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jws_parsen(jws, buffer, o_strlen(HS256_TOKEN)+1, 0), RHN_ERROR_PARAM);
+  r_jws_free(jws);
+
+  o_free(buffer);
+  r_jwk_free(jwk_key_symmetric);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_verify_token_invalid)
 {
   jws_t * jws;
@@ -193,6 +227,25 @@ START_TEST(test_rhonabwy_verify_token_invalid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_token_invalid_signature_length)
+{
+  jws_t * jws;
+  jwk_t * jwk_key_symmetric;
+  const char * tokens[] = {HS256_TOKEN_SHORT_SIGNATURE, HS256_TOKEN_LONG_SIGNATURE, HS256_TOKEN_NON_CANONICAL_SIGNATURE};
+  size_t i;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  for (i=0; i<3; i++) {
+    ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+    ck_assert_int_eq(r_jws_parse(jws, tokens[i], 0), RHN_OK);
+    ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_ERROR_INVALID);
+    r_jws_free(jws);
+  }
+  r_jwk_free(jwk_key_symmetric);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_verify_token_invalid_key_type)
 {
   jws_t * jws;
@@ -243,6 +296,35 @@ START_TEST(test_rhonabwy_verify_token_valid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_token_set_payload)
+{
+  jws_t * jws;
+  jwk_t * jwk_key_symmetric;
+  const unsigned char * payload;
+  size_t payload_len = 0;
+  char * token;
+
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_key_symmetric), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_key_symmetric, jwk_key_symmetric_str), RHN_OK);
+  ck_assert_int_eq(r_jws_parse(jws, HS256_TOKEN, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)"new payload", o_strlen("new payload")), RHN_OK);
+  ck_assert_ptr_ne((payload = r_jws_get_payload(jws, &payload_len)), NULL);
+  ck_assert_int_eq(payload_len, o_strlen("new payload"));
+  ck_assert_int_eq(0, memcmp(payload, "new payload", payload_len));
+  // The signature of the received payload doesn't match the new payload
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_ERROR_INVALID);
+  ck_assert_ptr_ne((token = r_jws_serialize(jws, jwk_key_symmetric, 0)), NULL);
+  ck_assert_int_eq(r_jws_parse(jws, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk_key_symmetric, 0), RHN_OK);
+  ck_assert_ptr_ne((payload = r_jws_get_payload(jws, &payload_len)), NULL);
+  ck_assert_int_eq(0, memcmp(payload, "new payload", payload_len));
+  o_free(token);
+  r_jws_free(jws);
+  r_jwk_free(jwk_key_symmetric);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_verify_token_multiple_keys_valid)
 {
   jws_t * jws;
@@ -265,6 +347,47 @@ START_TEST(test_rhonabwy_verify_token_multiple_keys_valid)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_verify_batch)
+{
+  jws_t * jws;
+  jwk_t * jwk_privkey;
+  jwks_t * jwks_pubkey;
+  char * token_2, * token_no_kid;
+  const char * tokens[5] = {HS256_TOKEN, NULL, HS256_TOKEN_INVALID_SIGNATURE, HS256_TOKEN_INVALID_HEADER_B64, NULL};
+  rhn_batch_result_t results[5];
+
+  ck_assert_ptr_ne(NULL, jwks_pubkey = r_jwks_quick_import(R_IMPORT_JSON_STR, jwk_key_symmetric_str, R_IMPORT_JSON_STR, jwk_key_symmetric_str_2, R_IMPORT_NONE));
+  ck_assert_ptr_ne(NULL, jwk_privkey = r_jwk_quick_import(R_IMPORT_JSON_STR, jwk_key_symmetric_str_2));
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_set_payload(jws, (const unsigned char *)PAYLOAD, o_strlen(PAYLOAD)), RHN_OK);
+  ck_assert_ptr_ne(NULL, token_2 = r_jws_serialize(jws, jwk_privkey, 0));
+  ck_assert_int_eq(r_jwk_delete_property_str(jwk_privkey, "kid"), RHN_OK);
+  ck_assert_int_eq(r_jws_set_header_str_value(jws, "kid", NULL), RHN_OK);
+  ck_assert_ptr_ne(NULL, token_no_kid = r_jws_serialize(jws, jwk_privkey, 0));
+  tokens[1] = token_2;
+  tokens[4] = token_no_kid;
+
+  ck_assert_int_eq(r_jws_verify_batch(tokens, 5, jwks_pubkey, 0, 0, results), RHN_OK);
+  ck_assert_int_eq(results[0].status, RHN_OK);
+  ck_assert_int_eq(results[0].payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(0, memcmp(results[0].payload, PAYLOAD, o_strlen(PAYLOAD)));
+  ck_assert_int_eq(results[1].status, RHN_OK);
+  ck_assert_int_eq(results[1].payload_len, o_strlen(PAYLOAD));
+  ck_assert_int_eq(results[2].status, RHN_ERROR_INVALID);
+  ck_assert_ptr_eq(results[2].payload, NULL);
+  ck_assert_int_ne(results[3].status, RHN_OK);
+  // No kid and more than one key
+  ck_assert_int_eq(results[4].status, RHN_ERROR_INVALID);
+  r_batch_results_clean(results, 5);
+
+  r_jws_free(jws);
+  r_jwk_free(jwk_privkey);
+  r_jwks_free(jwks_pubkey);
+  o_free(token_2);
+  o_free(token_no_kid);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_set_alg_serialize_verify_ok)
 {
   jws_t * jws_sign, * jws_verify;
@@ -319,12 +442,16 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_serialize_with_key_ok);
   tcase_add_test(tc_core, test_rhonabwy_parse_token_invalid_content);
   tcase_add_test(tc_core, test_rhonabwy_parse_token);
+  tcase_add_test(tc_core, test_rhonabwy_parsen_token_buffer);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_signature_length);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_key_type);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_invalid_kid);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_valid);
+  tcase_add_test(tc_core, test_rhonabwy_verify_token_set_payload);
   tcase_add_test(tc_core, test_rhonabwy_verify_token_multiple_keys_valid);
   tcase_add_test(tc_core, test_rhonabwy_set_alg_serialize_verify_ok);
+  tcase_add_test(tc_core, test_rhonabwy_verify_batch);
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 
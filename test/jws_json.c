@@ -41,6 +41,7 @@ const char jwk_privkey_rsa_str[] = "{\"kty\":\"RSA\",\"n\":\"0vx7agoebGcQSuuPiLJ
 const char jwk_key_symmetric_str[] = "{\"kty\":\"oct\",\"alg\":\"HS256\",\"k\":\"c2VjcmV0Cg\",\"kid\":\""KID_3"\"}";
 
 #define JWS_FLATTENED "{\"payload\":\"VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u\",\"protected\":\"eyJhbGciOiJFUzI1NiJ9\",\"signature\":\"V0O2NqwDK3Ovq4ATITgR1GRFEQ8nj_SMvcuhIRWUZMJ2thkNm8jivmc0KzF-iE3aaqy_vyPEvS6544Z6LzCpJw\",\"header\":{\"kid\":\""KID_1"\"}}"
+#define JWS_FLATTENED_NO_HEADER "{\"payload\":\"VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u\",\"protected\":\"eyJhbGciOiJFUzI1NiJ9\",\"signature\":\"V0O2NqwDK3Ovq4ATITgR1GRFEQ8nj_SMvcuhIRWUZMJ2thkNm8jivmc0KzF-iE3aaqy_vyPEvS6544Z6LzCpJw\"}"
 #define JWS_FLATTENED_INVALID_JSON "error\"payload\":\"VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u\",\"protected\":\"eyJhbGciOiJFUzI1NiJ9\",\"signature\":\"V0O2NqwDK3Ovq4ATITgR1GRFEQ8nj_SMvcuhIRWUZMJ2thkNm8jivmc0KzF-iE3aaqy_vyPEvS6544Z6LzCpJw\",\"header\":{\"kid\":\""KID_1"\"}}"
 #define JWS_FLATTENED_MISSING_PAYLOAD "{\"protected\":\"eyJhbGciOiJFUzI1NiJ9\",\"signature\":\"V0O2NqwDK3Ovq4ATITgR1GRFEQ8nj_SMvcuhIRWUZMJ2thkNm8jivmc0KzF-iE3aaqy_vyPEvS6544Z6LzCpJw\",\"header\":{\"kid\":\""KID_1"\"}}"
 #define JWS_FLATTENED_MISSING_PROTECTED "{\"payload\":\"VGhlIHRydWUgc2lnbiBvZiBpbnRlbGxpZ2VuY2UgaXMgbm90IGtub3dsZWRnZSBidXQgaW1hZ2luYXRpb24u\",\"signature\":\"V0O2NqwDK3Ovq4ATITgR1GRFEQ8nj_SMvcuhIRWUZMJ2thkNm8jivmc0KzF-iE3aaqy_vyPEvS6544Z6LzCpJw\",\"header\":{\"kid\":\""KID_1"\"}}"
@@ -435,6 +436,24 @@ START_TEST(test_rhonabwy_json_flattened_verify_signature)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_json_flattened_no_header_verify_signature)
+{
+  jws_t * jws;
+  jwk_t * jwk;
+  
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk, jwk_pubkey_ecdsa_str), RHN_OK);
+
+  ck_assert_int_eq(r_jws_init(&jws), RHN_OK);
+  ck_assert_int_eq(r_jws_parse_json_str(jws, JWS_FLATTENED_NO_HEADER, 0), RHN_OK);
+  ck_assert_ptr_eq(NULL, r_jws_get_kid(jws));
+  ck_assert_int_eq(r_jws_verify_signature(jws, jwk, 0), RHN_OK);
+  
+  r_jwk_free(jwk);
+  r_jws_free(jws);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_json_flattened_invalid_signature)
 {
   jws_t * jws;
@@ -743,6 +762,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_parse_json_flattened_str);
   tcase_add_test(tc_core, test_rhonabwy_parse_json_flattened_json_t);
   tcase_add_test(tc_core, test_rhonabwy_json_flattened_verify_signature);
+  tcase_add_test(tc_core, test_rhonabwy_json_flattened_no_header_verify_signature);
   tcase_add_test(tc_core, test_rhonabwy_json_flattened_invalid_signature);
   tcase_add_test(tc_core, test_rhonabwy_parse_json_general_error);
   tcase_add_test(tc_core, test_rhonabwy_parse_json_general_str);
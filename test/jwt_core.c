@@ -1196,6 +1196,101 @@ START_TEST(test_rhonabwy_validate_claims)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_jti_store)
+{
+  jwt_t * jwt;
+  jti_store_t * store, * store_loaded;
+  time_t now = time(NULL);
+
+  ck_assert_int_eq(r_jti_store_init(NULL, 16, 60), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jti_store_init(&store, 0, 60), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jti_store_init(&store, 16, 0), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jti_store_init(&store, 16, 60), RHN_OK);
+
+  ck_assert_int_eq(r_jti_store_add(NULL, JWT_CLAIM_ISS, JWT_CLAIM_JTI, now+60), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jti_store_add(store, JWT_CLAIM_ISS, NULL, now+60), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jti_store_add(store, JWT_CLAIM_ISS, JWT_CLAIM_JTI, now+60), RHN_OK);
+  ck_assert_int_eq(r_jti_store_add(store, JWT_CLAIM_ISS, JWT_CLAIM_JTI, now+60), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jti_store_add(store, NULL, JWT_CLAIM_JTI, 0), RHN_OK);
+  ck_assert_int_eq(r_jti_store_add(store, NULL, JWT_CLAIM_JTI, 0), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jti_store_add(store, JWT_CLAIM_ISS, "expired", now-10), RHN_OK);
+  ck_assert_int_eq(r_jti_store_add(store, JWT_CLAIM_ISS, "expired", now-10), RHN_OK);
+  ck_assert_int_eq(r_jti_store_size(store), 2);
+
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_set_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_JTI, "jti-validate", R_JWT_CLAIM_EXP, now+60, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_JTI_STORE, store, R_JWT_CLAIM_NOP), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_ISS, JWT_CLAIM_ISS, R_JWT_CLAIM_JTI_STORE, store, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_JTI_STORE, NULL, R_JWT_CLAIM_NOP), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwt_set_claim_str_value(jwt, "iss", "https://other.tld"), RHN_OK);
+  ck_assert_int_eq(r_jwt_validate_claims(jwt, R_JWT_CLAIM_JTI_STORE, store, R_JWT_CLAIM_NOP), RHN_OK);
+  r_jwt_free(jwt);
+
+  ck_assert_int_eq(r_jti_store_save(store, NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jti_store_save(store, "jti_store.bin"), RHN_OK);
+  ck_assert_int_eq(r_jti_store_init(&store_loaded, 16, 60), RHN_OK);
+  ck_assert_int_eq(r_jti_store_load(store_loaded, "jti_store_missing.bin"), RHN_ERROR);
+  ck_assert_int_eq(r_jti_store_load(store_loaded, "jti_store.bin"), RHN_OK);
+  ck_assert_int_eq(r_jti_store_size(store_loaded), r_jti_store_size(store));
+  ck_assert_int_eq(r_jti_store_add(store_loaded, JWT_CLAIM_ISS, JWT_CLAIM_JTI, now+60), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jti_store_add(store_loaded, JWT_CLAIM_ISS, "jti-validate", now+60), RHN_ERROR_INVALID);
+  ck_assert_int_eq(r_jti_store_add(store_loaded, JWT_CLAIM_ISS, "new", now+60), RHN_OK);
+  remove("jti_store.bin");
+
+  r_jti_store_free(store);
+  r_jti_store_free(store_loaded);
+}
+END_TEST
+
+START_TEST(test_rhonabwy_reset)
+{
+  jwt_t * jwt;
+  jwk_t * jwk_pub, * jwk_priv_rsa;
+  jws_t * jws;
+  int i;
+  
+  ck_assert_int_eq(r_jwt_reset(NULL), RHN_ERROR_PARAM);
+  ck_assert_int_eq(r_jwk_init(&jwk_pub), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_pub, jwk_pubkey_ecdsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwk_init(&jwk_priv_rsa), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_json_str(jwk_priv_rsa, jwk_privkey_rsa_str), RHN_OK);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  
+  ck_assert_int_eq(r_jwt_advanced_parse(jwt, ADVANCED_TOKEN_SIGNED_WITH_ROOT_KEY, R_PARSE_HEADER_JWK, 0), RHN_OK);
+  ck_assert_int_gt(r_jwks_size(jwt->jwks_pubkey_sign), 0);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt, jwk_pub, 0), RHN_OK);
+  ck_assert_ptr_ne((jws = jwt->jws), NULL);
+  
+  ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_get_type(jwt), R_JWT_TYPE_NONE);
+  ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 0);
+  ck_assert_int_eq(json_object_size(jwt->j_header), 0);
+  ck_assert_int_eq(json_object_size(jwt->j_claims), 0);
+  ck_assert_int_eq(r_jwt_get_sign_alg(jwt), R_JWA_ALG_UNKNOWN);
+  
+  for (i=0; i<3; i++) {
+    // The inner jws_t is reused
+    ck_assert_int_eq(r_jwt_parse(jwt, TOKEN, 0), RHN_OK);
+    ck_assert_ptr_eq(jwt->jws, jws);
+    ck_assert_int_eq(r_jwt_get_type(jwt), R_JWT_TYPE_SIGN);
+    ck_assert_int_eq(r_jwks_size(jwt->jwks_pubkey_sign), 0);
+    ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "str"), CLAIM_STR);
+    ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "int"), CLAIM_INT);
+    ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+    
+    ck_assert_int_eq(r_jwt_parse(jwt, TOKEN_ENC, 0), RHN_OK);
+    ck_assert_int_eq(r_jwt_get_type(jwt), R_JWT_TYPE_ENCRYPT);
+    ck_assert_int_eq(r_jwt_decrypt(jwt, jwk_priv_rsa, 0), RHN_OK);
+    ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "str"), "plop");
+    ck_assert_int_eq(r_jwt_reset(jwt), RHN_OK);
+  }
+  
+  r_jwt_free(jwt);
+  r_jwk_free(jwk_pub);
+  r_jwk_free(jwk_priv_rsa);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_set_properties_error)
 {
   jwt_t * jwt;
@@ -1689,6 +1784,95 @@ START_TEST(test_rhonabwy_quick_parse)
 }
 END_TEST
 
+static char * serialize_payload(jwk_t * jwk, const char * payload) {
+  jws_t * jws = NULL;
+  char * token = NULL;
+
+  if (r_jws_init(&jws) == RHN_OK &&
+      r_jws_set_alg(jws, R_JWA_ALG_HS256) == RHN_OK &&
+      r_jws_set_payload(jws, (const unsigned char *)payload, o_strlen(payload)) == RHN_OK) {
+    token = r_jws_serialize(jws, jwk, 0);
+  }
+  r_jws_free(jws);
+  return token;
+}
+
+START_TEST(test_rhonabwy_lazy_claims)
+{
+  jwt_t * jwt;
+  jwk_t * jwk;
+  json_t * j_claims;
+  char * token;
+  const char * names[] = {"sub", "exp", "aud", "missing"};
+  const char * invalid[] = {"{\"sub\":\"user1\"", "{\"sub\":\"\\u0000\"}", "{\"sub\":\"\\ud800\"}", "{\"sub\":\"\\udc00\"}", "{\"sub\":01}",
+                            "{\"sub\":1.}", "{\"sub\":1,}", "{\"sub\":\"\xff\"}", "{\"sub\":\"\xed\xa0\x80\"}", "{\"sub\":tru}", "{\"sub\":1} x", "{sub:1}"};
+  size_t i;
+
+  ck_assert_int_eq(r_jwk_init(&jwk), RHN_OK);
+  ck_assert_int_eq(r_jwk_import_from_symmetric_key(jwk, (const unsigned char *)"0123456789abcdef0123456789abcdef", 32), RHN_OK);
+
+  ck_assert_ptr_ne(token = serialize_payload(jwk, "{\"sub\":\"user1\",\"exp\":42,\"obj\":{\"a\":[1,-2.5e3,true,false,null,{}]},\"k\\u00e9y\":\"v\xc3\xa9\\ud83d\\ude00\",\"\\u0061ud\":\"aud1\"}"), NULL);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(jwt->claims_pending, 1);
+  ck_assert_int_eq(r_jwt_verify_signature(jwt, jwk, 0), RHN_OK);
+  ck_assert_int_eq(jwt->claims_pending, 1);
+  ck_assert_ptr_eq(r_jwt_get_claims_json_t(jwt, NULL, 0), NULL);
+  ck_assert_ptr_ne(j_claims = r_jwt_get_claims_json_t(jwt, names, 4), NULL);
+  ck_assert_int_eq(json_object_size(j_claims), 3);
+  ck_assert_str_eq(json_string_value(json_object_get(j_claims, "sub")), "user1");
+  ck_assert_int_eq(json_integer_value(json_object_get(j_claims, "exp")), 42);
+  ck_assert_str_eq(json_string_value(json_object_get(j_claims, "aud")), "aud1");
+  json_decref(j_claims);
+  ck_assert_int_eq(jwt->claims_pending, 1);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "sub"), "user1");
+  ck_assert_int_eq(jwt->claims_pending, 0);
+  ck_assert_str_eq(r_jwt_get_claim_str_value(jwt, "k\xc3\xa9y"), "v\xc3\xa9\xf0\x9f\x98\x80");
+  ck_assert_ptr_ne(j_claims = r_jwt_get_claims_json_t(jwt, names, 4), NULL);
+  ck_assert_int_eq(json_object_size(j_claims), 3);
+  ck_assert_str_eq(json_string_value(json_object_get(j_claims, "aud")), "aud1");
+  json_decref(j_claims);
+  r_jwt_free(jwt);
+
+  // The pending claims are kept when the jwt is serialized again
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  o_free(token);
+  ck_assert_ptr_ne(token = r_jwt_serialize_signed(jwt, jwk, 0), NULL);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "exp"), 42);
+  r_jwt_free(jwt);
+
+  // The previous claims are kept if a new parse fails, whether they were read or still pending
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_int_eq(jwt->claims_pending, 1);
+  ck_assert_int_ne(r_jwt_parse(jwt, TOKEN_INVALID_HEADER, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "exp"), 42);
+  ck_assert_int_ne(r_jwt_parse(jwt, TOKEN_INVALID_HEADER, 0), RHN_OK);
+  ck_assert_int_eq(r_jwt_get_claim_int_value(jwt, "exp"), 42);
+  r_jwt_free(jwt);
+  o_free(token);
+
+  ck_assert_ptr_ne(token = serialize_payload(jwk, " [1, 2] "), NULL);
+  ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+  ck_assert_int_eq(r_jwt_parse(jwt, token, 0), RHN_OK);
+  ck_assert_ptr_eq(r_jwt_get_claims_json_t(jwt, names, 4), NULL);
+  r_jwt_free(jwt);
+  o_free(token);
+
+  for (i=0; i<sizeof(invalid)/sizeof(const char *); i++) {
+    ck_assert_ptr_ne(token = serialize_payload(jwk, invalid[i]), NULL);
+    ck_assert_int_eq(r_jwt_init(&jwt), RHN_OK);
+    ck_assert_int_ne(r_jwt_parse(jwt, token, 0), RHN_OK);
+    r_jwt_free(jwt);
+    o_free(token);
+  }
+
+  r_jwk_free(jwk);
+}
+END_TEST
+
 START_TEST(test_rhonabwy_jwk_in_header_invalid)
 {
   jwt_t * jwt, * jwt_parsed;
@@ -1779,14 +1963,17 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_add_enc_keys_by_content);
   tcase_add_test(tc_core, test_rhonabwy_set_claims);
   tcase_add_test(tc_core, test_rhonabwy_validate_claims);
+  tcase_add_test(tc_core, test_rhonabwy_jti_store);
   tcase_add_test(tc_core, test_rhonabwy_set_properties_error);
   tcase_add_test(tc_core, test_rhonabwy_set_properties);
   tcase_add_test(tc_core, test_rhonabwy_copy);
+  tcase_add_test(tc_core, test_rhonabwy_reset);
   tcase_add_test(tc_core, test_rhonabwy_set_enc_cypher_key_iv);
   tcase_add_test(tc_core, test_rhonabwy_token_type);
 #if GNUTLS_VERSION_NUMBER >= 0x030600 && defined(R_WITH_CURL)
   tcase_add_test(tc_core, test_rhonabwy_advanced_parse);
   tcase_add_test(tc_core, test_rhonabwy_quick_parse);
+  tcase_add_test(tc_core, test_rhonabwy_lazy_claims);
   tcase_add_test(tc_core, test_rhonabwy_jwk_in_header_invalid);
 #endif
   tcase_set_timeout(tc_core, 30);
@@ -302,6 +302,49 @@ START_TEST(test_rhonabwy_invalid_deflate_payload)
 }
 END_TEST
 
+START_TEST(test_rhonabwy_base64url)
+{
+  unsigned char data[259], out[400];
+  size_t i, len, out_len, o_len;
+  struct _o_datum dat = {0, NULL}, o_dat = {0, NULL};
+
+  for (i=0; i<sizeof(data); i++) {
+    data[i] = (unsigned char)(i*7);
+  }
+  for (len=1; len<=sizeof(data); len++) {
+    ck_assert_int_eq(_r_base64url_encode_alloc(data, len, &dat), 1);
+    ck_assert_int_eq(o_base64url_encode_alloc(data, len, &o_dat), 1);
+    ck_assert_int_eq(dat.size, o_dat.size);
+    ck_assert_int_eq(0, memcmp(dat.data, o_dat.data, dat.size));
+    ck_assert_int_eq(_r_base64url_decode(dat.data, dat.size, NULL, &out_len), 1);
+    ck_assert_int_eq(out_len, len);
+    ck_assert_int_eq(_r_base64url_decode(dat.data, dat.size, out, &out_len), 1);
+    ck_assert_int_eq(out_len, len);
+    ck_assert_int_eq(0, memcmp(out, data, len));
+    o_free(dat.data);
+    o_free(o_dat.data);
+  }
+
+  ck_assert_int_eq(_r_base64url_encode(data, 0, out, &out_len), 0);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"", 0, out, &out_len), 0);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"aGVs+G8", 7, out, &out_len), 0);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"aGVs/G8", 7, NULL, &out_len), 0);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"aGVs bG8", 8, out, &out_len), 0);
+  ck_assert_int_eq(_r_base64url_decode_alloc((const unsigned char *)"aGVs.bG8", 8, &dat), 0);
+  ck_assert_ptr_eq(dat.data, NULL);
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"aGVsbA==", 8, out, &out_len), 1);
+  ck_assert_int_eq(out_len, 4);
+  ck_assert_int_eq(0, memcmp(out, "hell", 4));
+  ck_assert_int_eq(_r_base64url_decode((const unsigned char *)"aGVsbG8", 7, out, &o_len), 1);
+  ck_assert_int_eq(o_len, 5);
+  ck_assert_int_eq(0, memcmp(out, "hello", 5));
+  ck_assert_int_eq(_r_base64url_decode_alloc((const unsigned char *)"aGVsbG8", 7, &dat), 1);
+  ck_assert_int_eq(dat.size, 5);
+  ck_assert_str_eq((const char *)dat.data, "hello");
+  o_free(dat.data);
+}
+END_TEST
+
 static Suite *rhonabwy_suite(void)
 {
   Suite *s;
@@ -315,6 +358,7 @@ static Suite *rhonabwy_suite(void)
   tcase_add_test(tc_core, test_rhonabwy_enc_conversion);
   tcase_add_test(tc_core, test_rhonabwy_inflate);
   tcase_add_test(tc_core, test_rhonabwy_invalid_deflate_payload);
+  tcase_add_test(tc_core, test_rhonabwy_base64url);
   tcase_set_timeout(tc_core, 30);
   suite_add_tcase(s, tc_core);
 